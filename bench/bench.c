@@ -0,0 +1,443 @@
+//Benchmark support: image generator, timed runner, baselines
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bench.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_BPS 512
+#define BENCH_RESERVED 32
+#define BENCH_NUM_FATS 2
+#define BENCH_EOC 0x0FFFFFFFu
+
+static uint32_t rng_state = 2463534242u;
+
+//xorshift32 step
+static uint32_t next_rand(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+uint32_t bench_rand(uint32_t n)
+{
+    return n ? next_rand(&rng_state) % n : 0;
+}
+
+double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void bench_image_defaults(BenchImageSpec *spec)
+{
+    spec->size_mb = 512;
+    spec->sectors_per_cluster = 8;
+    spec->dirs = 256;
+    spec->fanout = 8;
+    spec->files = 20000;
+    spec->min_file_bytes = 1024;
+    spec->max_file_bytes = 16 * 1024;
+    spec->frag_percent = 10;
+    spec->seed = 1;
+}
+
+bool bench_parse_spec(int argc, char **argv, int *argi, BenchImageSpec *spec)
+{
+    static const char *const options[] = { "--size", "--spc", "--dirs", "--fanout", "--files",
+                                           "--min", "--max", "--frag", "--seed" };
+    while(*argi < argc && strncmp(argv[*argi], "--", 2) == 0)
+    {
+        int which = -1;
+        for(int k = 0; k < (int)(sizeof options / sizeof options[0]); k++)
+        {
+            if(strcmp(argv[*argi], options[k]) == 0) which = k;
+        }
+        char *end = NULL;
+        unsigned long v = *argi + 1 < argc ? strtoul(argv[*argi + 1], &end, 10) : 0;
+        if(which < 0 || !end || *end != '\0' || v > 0xFFFFFFFFul)
+        {
+            fprintf(stderr, "bad option: %s\n", argv[*argi]);
+            return false;
+        }
+        switch(which)
+        {
+            case 0: spec->size_mb = (uint32_t)v; break;
+            case 1: spec->sectors_per_cluster = (uint8_t)(v && v <= 128 ? v : 1); break;
+            case 2: spec->dirs = (uint32_t)v; break;
+            case 3: spec->fanout = (uint32_t)v; break;
+            case 4: spec->files = (uint32_t)v; break;
+            case 5: spec->min_file_bytes = (uint32_t)v; break;
+            case 6: spec->max_file_bytes = (uint32_t)v; break;
+            case 7: spec->frag_percent = (uint32_t)(v > 100 ? 100 : v); break;
+            case 8: spec->seed = (uint32_t)v; break;
+        }
+        *argi += 2;
+    }
+    return true;
+}
+
+void bench_image_dir_name(uint32_t dir, char out[13])
+{
+    snprintf(out, 13, "D%07u", dir % 10000000u);
+}
+
+void bench_image_file_name(uint32_t file, char out[13])
+{
+    snprintf(out, 13, "F%07u.DAT", file % 10000000u);
+}
+
+void bench_image_dir_path(const BenchImageSpec *spec, uint32_t dir, char *out, size_t out_size)
+{
+    // collect the ancestors leaf first, then print them root first
+    uint32_t chain[64];
+    int depth = 0;
+    while(dir > 0 && depth < 64)
+    {
+        chain[depth++] = dir;
+        dir = (dir - 1) / spec->fanout;
+    }
+
+    size_t len = 0;
+    out[0] = '\0';
+    if(depth == 0) snprintf(out, out_size, "/");
+    for(int i = depth - 1; i >= 0 && len < out_size; i--)
+    {
+        char name[13];
+        bench_image_dir_name(chain[i], name);
+        len += (size_t)snprintf(out + len, out_size - len, "/%s", name);
+    }
+}
+
+void bench_image_path(const char *name, char *out, size_t out_size)
+{
+    const char *dir = getenv("BENCH_DIR");
+    snprintf(out, out_size, "%s/%s", dir && *dir ? dir : "/tmp", name);
+}
+
+// state of one image being generated
+typedef struct
+{
+    const BenchImageSpec *spec;
+    uint32_t *fat;
+    uint32_t clusters;          // data clusters
+    uint32_t cursor;            // next cluster to hand out
+    uint32_t rng;
+} ImageBuild;
+
+//Allocate a chain of `n` clusters, leaving random gaps; 0 when full
+static uint32_t alloc_chain(ImageBuild *b, uint32_t n)
+{
+    uint32_t first = 0, prev = 0;
+    for(uint32_t k = 0; k < n; k++)
+    {
+        if(b->cursor >= b->clusters + 2) return 0;
+        uint32_t c = b->cursor++;
+        if(prev) b->fat[prev] = c;
+        else first = c;
+        b->fat[c] = BENCH_EOC;
+        prev = c;
+        if(next_rand(&b->rng) % 100 < b->spec->frag_percent) b->cursor += 1 + next_rand(&b->rng) % 8;
+    }
+    return first;
+}
+
+static void put_entry(uint8_t *slot, const char *name83, uint8_t attr, uint32_t cluster, uint32_t size)
+{
+    memset(slot, 0, 32);
+    memcpy(slot, name83, 11);
+    slot[11] = attr;
+    slot[20] = (uint8_t)(cluster >> 16);
+    slot[21] = (uint8_t)(cluster >> 24);
+    slot[26] = (uint8_t)cluster;
+    slot[27] = (uint8_t)(cluster >> 8);
+    memcpy(slot + 28, &size, 4);
+}
+
+//"F0000001.DAT" -> "F0000001DAT" (space padded 8.3)
+static void pack_name(const char *name, char out[11])
+{
+    memset(out, ' ', 11);
+    const char *dot = strchr(name, '.');
+    size_t base = dot ? (size_t)(dot - name) : strlen(name);
+    memcpy(out, name, base > 8 ? 8 : base);
+    if(dot) memcpy(out + 8, dot + 1, strlen(dot + 1) > 3 ? 3 : strlen(dot + 1));
+}
+
+static bool write_at(int fd, const void *buf, size_t len, uint64_t off)
+{
+    const uint8_t *p = buf;
+    while(len > 0)
+    {
+        ssize_t n = pwrite(fd, p, len, (off_t)off);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return false;
+        p += n;
+        len -= (size_t)n;
+        off += (uint64_t)n;
+    }
+    return true;
+}
+
+bool bench_image_create(const char *path, const BenchImageSpec *spec)
+{
+    const uint32_t spc = spec->sectors_per_cluster ? spec->sectors_per_cluster : 1;
+    const uint32_t cs = spc * BENCH_BPS;
+    const uint32_t total = spec->size_mb * 2048u;
+    const uint32_t dirs = spec->dirs ? spec->dirs : 1;
+    const uint32_t fanout = spec->fanout ? spec->fanout : 1;
+
+    uint32_t estimate = (total - BENCH_RESERVED) / spc;
+    uint32_t fat_size = (uint32_t)(((uint64_t)estimate + 2) * 4 + BENCH_BPS - 1) / BENCH_BPS;
+    uint32_t first_data = BENCH_RESERVED + BENCH_NUM_FATS * fat_size;
+    if(total <= first_data + spc)
+    {
+        fprintf(stderr, "image of %u MiB is too small\n", spec->size_mb);
+        return false;
+    }
+
+    ImageBuild b = { spec, NULL, (total - first_data) / spc, 3, spec->seed ? spec->seed : 1 };
+    b.fat = calloc((size_t)fat_size * BENCH_BPS / 4, sizeof(uint32_t));
+    uint32_t *dir_first = calloc(dirs, sizeof(uint32_t));
+    uint32_t *dir_len = calloc(dirs, sizeof(uint32_t));
+    uint32_t *file_first = calloc(spec->files ? spec->files : 1, sizeof(uint32_t));
+    uint32_t *file_size = calloc(spec->files ? spec->files : 1, sizeof(uint32_t));
+    uint8_t *buf = NULL;
+    int fd = -1;
+    bool ok = false;
+    if(!b.fat || !dir_first || !dir_len || !file_first || !file_size) goto out;
+
+    b.fat[0] = 0x0FFFFFF8;
+    b.fat[1] = BENCH_EOC;
+
+    // directory chains first: dots, subdirectories and files of each
+    uint32_t max_dir_clusters = 1;
+    for(uint32_t d = 0; d < dirs; d++)
+    {
+        uint64_t children = 0;
+        for(uint64_t c = (uint64_t)d * fanout + 1; c <= (uint64_t)d * fanout + fanout && c < dirs; c++) children++;
+        uint64_t entries = (d ? 2 : 0) + children + spec->files / dirs + (d < spec->files % dirs);
+        dir_len[d] = (uint32_t)((entries * 32 + cs - 1) / cs);
+        if(dir_len[d] == 0) dir_len[d] = 1;
+        if(dir_len[d] > max_dir_clusters) max_dir_clusters = dir_len[d];
+
+        if(d == 0)
+        {
+            dir_first[0] = 2;
+            b.fat[2] = BENCH_EOC;
+            if(dir_len[0] > 1 && !(b.fat[2] = alloc_chain(&b, dir_len[0] - 1))) goto full;
+        }
+        else if(!(dir_first[d] = alloc_chain(&b, dir_len[d])))
+        {
+            goto full;
+        }
+    }
+
+    uint32_t span = spec->max_file_bytes > spec->min_file_bytes ? spec->max_file_bytes - spec->min_file_bytes : 0;
+    for(uint32_t f = 0; f < spec->files; f++)
+    {
+        file_size[f] = spec->min_file_bytes + (span ? next_rand(&b.rng) % (span + 1) : 0);
+        uint32_t n = (file_size[f] + cs - 1) / cs;
+        if(n && !(file_first[f] = alloc_chain(&b, n))) goto full;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || ftruncate(fd, (off_t)total * BENCH_BPS) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        goto out;
+    }
+
+    uint8_t boot[BENCH_BPS] = { 0xEB, 0x58, 0x90, 'M', 'S', 'W', 'I', 'N', '4', '.', '1' };
+    uint16_t bps = BENCH_BPS, rsv = BENCH_RESERVED, spt = 63, heads = 255, fsinfo = 1, backup = 6;
+    uint32_t root = 2;
+    memcpy(boot + 11, &bps, 2);
+    boot[13] = (uint8_t)spc;
+    memcpy(boot + 14, &rsv, 2);
+    boot[16] = BENCH_NUM_FATS;
+    boot[21] = 0xF8;
+    memcpy(boot + 24, &spt, 2);
+    memcpy(boot + 26, &heads, 2);
+    memcpy(boot + 32, &total, 4);
+    memcpy(boot + 36, &fat_size, 4);
+    memcpy(boot + 44, &root, 4);
+    memcpy(boot + 48, &fsinfo, 2);
+    memcpy(boot + 50, &backup, 2);
+    boot[64] = 0x80;
+    boot[66] = 0x29;
+    memcpy(boot + 71, "BENCH      FAT32   ", 19);
+    boot[510] = 0x55;
+    boot[511] = 0xAA;
+
+    uint32_t used = 0;
+    for(uint32_t c = 2; c < b.clusters + 2; c++) used += b.fat[c] != 0;
+    uint8_t info[BENCH_BPS] = { 0 };
+    uint32_t sig[3] = { 0x41615252, 0x61417272, 0xAA550000 };
+    uint32_t free_count = b.clusters - used;
+    uint32_t hint = b.cursor < b.clusters + 2 ? b.cursor : 2;
+    memcpy(info, &sig[0], 4);
+    memcpy(info + 484, &sig[1], 4);
+    memcpy(info + 488, &free_count, 4);
+    memcpy(info + 492, &hint, 4);
+    memcpy(info + 508, &sig[2], 4);
+
+    if(!write_at(fd, boot, sizeof boot, 0) || !write_at(fd, info, sizeof info, BENCH_BPS)
+       || !write_at(fd, boot, sizeof boot, (uint64_t)backup * BENCH_BPS)) goto io;
+    for(int k = 0; k < BENCH_NUM_FATS; k++)
+    {
+        uint64_t off = ((uint64_t)BENCH_RESERVED + (uint64_t)k * fat_size) * BENCH_BPS;
+        if(!write_at(fd, b.fat, (size_t)fat_size * BENCH_BPS, off)) goto io;
+    }
+
+    // directory contents, written cluster by cluster along each chain
+    buf = malloc((size_t)max_dir_clusters * cs);
+    if(!buf) goto out;
+    for(uint32_t d = 0; d < dirs; d++)
+    {
+        memset(buf, 0, (size_t)dir_len[d] * cs);
+        uint8_t *slot = buf;
+        char name[13], packed[11];
+        if(d)
+        {
+            uint32_t parent = (d - 1) / fanout;
+            put_entry(slot, ".          ", 0x10, dir_first[d], 0);
+            put_entry(slot + 32, "..         ", 0x10, parent ? dir_first[parent] : 0, 0);
+            slot += 64;
+        }
+        for(uint64_t c = (uint64_t)d * fanout + 1; c <= (uint64_t)d * fanout + fanout && c < dirs; c++)
+        {
+            bench_image_dir_name((uint32_t)c, name);
+            pack_name(name, packed);
+            put_entry(slot, packed, 0x10, dir_first[c], 0);
+            slot += 32;
+        }
+        for(uint32_t f = d; f < spec->files; f += dirs)
+        {
+            bench_image_file_name(f, name);
+            pack_name(name, packed);
+            put_entry(slot, packed, 0x20, file_first[f], file_size[f]);
+            slot += 32;
+        }
+
+        uint32_t c = dir_first[d];
+        for(uint32_t k = 0; k < dir_len[d]; k++, c = b.fat[c])
+        {
+            uint64_t off = ((uint64_t)first_data + (uint64_t)(c - 2) * spc) * BENCH_BPS;
+            if(!write_at(fd, buf + (size_t)k * cs, cs, off)) goto io;
+        }
+    }
+    ok = true;
+    goto out;
+
+full:
+    fprintf(stderr, "image of %u MiB is too small for this many files\n", spec->size_mb);
+    goto out;
+io:
+    fprintf(stderr, "%s: write failed: %s\n", path, strerror(errno));
+out:
+    if(fd >= 0 && close(fd) != 0) ok = false;
+    free(buf);
+    free(b.fat);
+    free(dir_first);
+    free(dir_len);
+    free(file_first);
+    free(file_size);
+    return ok;
+}
+
+/* Results go to a duplicate of the original stdout, so a benchmark may
+ * point descriptor 1 at /dev/null around code that prints. */
+static FILE *report(void)
+{
+    static FILE *out;
+    if(!out)
+    {
+        int fd = dup(STDOUT_FILENO);
+        out = fd >= 0 ? fdopen(fd, "w") : NULL;
+        if(!out) out = stdout;
+        setvbuf(out, NULL, _IOLBF, 0);
+    }
+    fflush(stdout);
+    return out;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+//Last throughput recorded for `name` in the baseline file, or 0
+static double baseline_for(const char *path, const char *name)
+{
+    FILE *f = fopen(path, "r");
+    if(!f) return 0;
+    char line[256], key[128];
+    double ops, found = 0;
+    while(fgets(line, sizeof line, f))
+    {
+        if(sscanf(line, "%127s %lf", key, &ops) == 2 && strcmp(key, name) == 0) found = ops;
+    }
+    fclose(f);
+    return found;
+}
+
+bool bench_run(const char *name, BenchOp op, void *ctx, size_t ops, size_t batch)
+{
+    if(batch == 0) batch = 1;
+    size_t samples = (ops + batch - 1) / batch;
+    double *lat = malloc(samples * sizeof(double));
+    if(!lat) return false;
+
+    size_t done = 0;
+    double start = bench_now();
+    for(size_t s = 0; s < samples; s++)
+    {
+        size_t n = ops - done < batch ? ops - done : batch;
+        double t0 = bench_now();
+        for(size_t k = 0; k < n; k++) op(ctx, done + k);
+        lat[s] = (bench_now() - t0) * 1e9 / (double)n;
+        done += n;
+    }
+    double elapsed = bench_now() - start;
+    double rate = elapsed > 0 ? (double)ops / elapsed : 0;
+
+    qsort(lat, samples, sizeof(double), compare_double);
+    FILE *out = report();
+    fprintf(out, "%-28s %12.0f ops/s   p50 %9.1f  p90 %9.1f  p99 %9.1f  max %9.1f ns", name, rate,
+           lat[samples / 2], lat[samples * 9 / 10], lat[samples * 99 / 100], lat[samples - 1]);
+    free(lat);
+
+    bool ok = true;
+    const char *base_path = getenv("BENCH_BASELINE");
+    double base = base_path ? baseline_for(base_path, name) : 0;
+    if(base > 0)
+    {
+        const char *tol_env = getenv("BENCH_TOLERANCE");
+        double tolerance = tol_env ? atof(tol_env) : 10.0;
+        double change = (rate - base) * 100.0 / base;
+        ok = change >= -tolerance;
+        fprintf(out, "   %+6.1f%%%s", change, ok ? "" : "  REGRESSION");
+    }
+    fprintf(out, "\n");
+
+    const char *save = getenv("BENCH_SAVE");
+    FILE *f = save ? fopen(save, "a") : NULL;
+    if(f)
+    {
+        fprintf(f, "%s %.0f\n", name, rate);
+        fclose(f);
+    }
+    return ok;
+}
@@ -0,0 +1,76 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Shared pieces of the benchmarks under bench/: a synthetic FAT32 image
+// generator, a timed runner that reports ops/sec and latency percentiles,
+// and a baseline file to compare runs against.
+//
+// Environment:
+//   BENCH_DIR       where images are generated (default /tmp)
+//   BENCH_SAVE      append each result to this file, as the next baseline
+//   BENCH_BASELINE  compare each result with this file; a throughput drop
+//                   beyond BENCH_TOLERANCE percent (default 10) is
+//                   reported as a regression and fails the run
+
+/* Shape of a generated image. Directories form a tree: directory 0 is
+ * the root and directory i > 0 is a child of (i - 1) / fanout. Files
+ * are dealt out over all directories round robin, so file j lives in
+ * directory j % dirs. Names are D%07u for directories and F%07u.DAT
+ * for files, all short (8.3) names. */
+typedef struct
+{
+    uint32_t size_mb;
+    uint8_t  sectors_per_cluster;
+    uint32_t dirs;              // including the root
+    uint32_t fanout;            // subdirectories per directory
+    uint32_t files;
+    uint32_t min_file_bytes;
+    uint32_t max_file_bytes;
+    uint32_t frag_percent;      // chance of a gap after each allocated cluster
+    uint32_t seed;
+} BenchImageSpec;
+
+/* Defaults: 512 MiB, 4 KiB clusters, 256 directories with fan-out 8,
+ * 20000 files of 1-16 KiB, 10% fragmentation. */
+void bench_image_defaults(BenchImageSpec *spec);
+
+/* Read generator options from argv[*argi] on: --size MB, --spc N,
+ * --dirs N, --fanout N, --files N, --min BYTES, --max BYTES, --frag PCT
+ * and --seed N. Stops at the first argument that is not an option and
+ * leaves *argi there. Returns false on an unknown option or bad value. */
+bool bench_parse_spec(int argc, char **argv, int *argi, BenchImageSpec *spec);
+
+/* Write the image described by `spec` to `path` (sparse; file data is
+ * left zero). Returns false with a message on stderr on failure. */
+bool bench_image_create(const char *path, const BenchImageSpec *spec);
+
+/* Path of directory `dir` from the root ("/" for the root), into `out`. */
+void bench_image_dir_path(const BenchImageSpec *spec, uint32_t dir, char *out, size_t out_size);
+
+/* Short name of directory `dir` or file `file`, into an 8.3 string. */
+void bench_image_dir_name(uint32_t dir, char out[13]);
+void bench_image_file_name(uint32_t file, char out[13]);
+
+/* Image path under BENCH_DIR for `name`, into `out`. */
+void bench_image_path(const char *name, char *out, size_t out_size);
+
+/* One operation of a benchmark; `i` counts from 0. */
+typedef void (*BenchOp)(void *ctx, size_t i);
+
+/* Run `op` `ops` times, timed in samples of `batch` operations (batch
+ * small ops so clock reads don't dominate), and print ops/sec and the
+ * p50/p90/p99/max latency per operation. Returns false if a baseline
+ * comparison found a regression. */
+bool bench_run(const char *name, BenchOp op, void *ctx, size_t ops, size_t batch);
+
+/* Random number in [0, n), from a fixed-seed generator. */
+uint32_t bench_rand(uint32_t n);
+
+/* Monotonic time in seconds. */
+double bench_now(void);
+
+#endif // BENCH_H
@@ -0,0 +1,112 @@
+//Directory scan kernels against the scalar path on a 64K-entry directory
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "dirscan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ENTRIES 65536
+#define ROUNDS 200
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+//Fill a directory: 8.3 files, some deleted slots and LFN runs, end marker last
+static void build(DirEntry *dir, size_t count)
+{
+    srand(18);
+    memset(dir, 0, count * sizeof(DirEntry));
+    for(size_t i = 0; i + 1 < count; i++)
+    {
+        char name[12];
+        snprintf(name, sizeof name, "F%07zuDAT", i);
+        memcpy(dir[i].DIR_Name, name, 11);
+        dir[i].DIR_Attr = 0x20;
+        int r = rand() % 10;
+        if(r == 0) dir[i].DIR_Name[0] = (char)0xE5;
+        else if(r == 1) dir[i].DIR_Attr = 0x0F;
+    }
+}
+
+//Best of ROUNDS, in nanoseconds per entry
+static double time_classify(const DirEntry *dir, size_t *named)
+{
+    double best = 1e9;
+    for(int r = 0; r < ROUNDS; r++)
+    {
+        double t0 = now();
+        size_t total = 0;
+        for(size_t b = 0; b < ENTRIES; b += 64)
+        {
+            DirScanMask m;
+            dir_scan_classify(dir + b, 64, &m);
+            total += (size_t)__builtin_popcountll(m.named);
+        }
+        double t = now() - t0;
+        if(t < best) best = t;
+        *named = total;
+    }
+    return best * 1e9 / ENTRIES;
+}
+
+static double time_find(const DirEntry *dir, const char key[11], size_t *at)
+{
+    double best = 1e9;
+    for(int r = 0; r < ROUNDS; r++)
+    {
+        double t0 = now();
+        *at = dir_scan_find(dir, ENTRIES, key);
+        double t = now() - t0;
+        if(t < best) best = t;
+    }
+    return best * 1e9 / ENTRIES;
+}
+
+int main(void)
+{
+    DirEntry *dir = malloc(ENTRIES * sizeof(DirEntry));
+    if(!dir) return 1;
+    build(dir, ENTRIES);
+
+    // the last live entry, so the search has to cover the whole directory
+    char last[11], missing[11];
+    size_t i = ENTRIES - 2;
+    while((uint8_t)dir[i].DIR_Name[0] == 0xE5 || dir[i].DIR_Attr == 0x0F) i--;
+    memcpy(last, dir[i].DIR_Name, 11);
+    memcpy(missing, "NOSUCH  TXT", 11);
+
+    const char *names[] = { "scalar", "sse2", "avx2" };
+    double base[3] = { 0, 0, 0 };
+    printf("%zu entries, best of %d rounds, ns/entry\n", (size_t)ENTRIES, ROUNDS);
+    printf("%-8s %10s %10s %10s\n", "kernel", "classify", "find-last", "find-miss");
+    for(int k = 0; k < 3; k++)
+    {
+        if(!dir_scan_use(names[k]))
+        {
+            printf("%-8s (not supported here)\n", names[k]);
+            continue;
+        }
+        size_t named, at_last, at_end;
+        double t[3];
+        t[0] = time_classify(dir, &named);
+        t[1] = time_find(dir, last, &at_last);
+        t[2] = time_find(dir, missing, &at_end);
+        if(at_last != i || at_end != ENTRIES - 1)
+        {
+            printf("%s: wrong answer\n", names[k]);
+            return 1;
+        }
+        if(k == 0) memcpy(base, t, sizeof base);
+        printf("%-8s %10.3f %10.3f %10.3f   (x%.1f, x%.1f, x%.1f vs scalar)\n", names[k], t[0], t[1], t[2],
+               base[0] / t[0], base[1] / t[1], base[2] / t[2]);
+    }
+    free(dir);
+    return 0;
+}
@@ -0,0 +1,194 @@
+//FAT core operations on a generated image: ops/sec and latency percentiles
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bench.h"
+#include "fat.h"
+#include "dir.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct
+{
+    fat32_volume *vol;
+    const BenchImageSpec *spec;
+    uint32_t *dir_cluster;      // first cluster of every generated directory
+    uint32_t *file_cluster;     // first cluster of a sample of files
+    uint32_t *file_index;       // which file each sample is
+    size_t samples;
+    uint8_t *buf;               // one cluster
+    int null_fd;
+    int stdout_fd;
+} Bench;
+
+static void op_get_entry_random(void *ctx, size_t i)
+{
+    Bench *b = ctx;
+    (void)i;
+    volatile uint32_t v = fat_get_entry(b->vol, 2 + bench_rand(b->vol->cluster_limit - 2));
+    (void)v;
+}
+
+static void op_get_entry_seq(void *ctx, size_t i)
+{
+    Bench *b = ctx;
+    volatile uint32_t v = fat_get_entry(b->vol, 2 + (uint32_t)(i % (b->vol->cluster_limit - 2)));
+    (void)v;
+}
+
+static void op_find_free(void *ctx, size_t i)
+{
+    Bench *b = ctx;
+    (void)i;
+    volatile uint32_t c = fat_find_free_cluster(b->vol);
+    (void)c;
+}
+
+static void op_get_chain(void *ctx, size_t i)
+{
+    Bench *b = ctx;
+    (void)i;
+    size_t count;
+    free(fat_get_chain(b->vol, b->file_cluster[bench_rand((uint32_t)b->samples)], &count));
+}
+
+static void op_find_hit(void *ctx, size_t i)
+{
+    Bench *b = ctx;
+    (void)i;
+    uint32_t file = b->file_index[bench_rand((uint32_t)b->samples)];
+    char name[13];
+    bench_image_file_name(file, name);
+    DirEntry e;
+    find_dir_entry(b->vol, b->dir_cluster[file % b->spec->dirs], name, &e, NULL);
+}
+
+static void op_find_miss(void *ctx, size_t i)
+{
+    Bench *b = ctx;
+    (void)i;
+    DirEntry e;
+    find_dir_entry(b->vol, b->dir_cluster[bench_rand(b->spec->dirs)], "NOSUCH.TXT", &e, NULL);
+}
+
+static void op_ls(void *ctx, size_t i)
+{
+    Bench *b = ctx;
+    (void)i;
+    fat32_ls(b->vol, b->dir_cluster[bench_rand(b->spec->dirs)]);
+}
+
+static void op_read_random(void *ctx, size_t i)
+{
+    Bench *b = ctx;
+    (void)i;
+    read_cluster_bytes(b->vol, 2 + bench_rand(b->vol->cluster_limit - 2), b->buf);
+}
+
+static void op_read_seq(void *ctx, size_t i)
+{
+    Bench *b = ctx;
+    read_cluster_bytes(b->vol, 2 + (uint32_t)(i % (b->vol->cluster_limit - 2)), b->buf);
+}
+
+//Send stdout to /dev/null while fat32_ls runs, and back
+static void quiet(Bench *b, bool on)
+{
+    fflush(stdout);
+    dup2(on ? b->null_fd : b->stdout_fd, STDOUT_FILENO);
+}
+
+int main(int argc, char **argv)
+{
+    BenchImageSpec spec;
+    bench_image_defaults(&spec);
+    int argi = 1;
+    if(!bench_parse_spec(argc, argv, &argi, &spec) || argi != argc)
+    {
+        fprintf(stderr, "usage: %s [image options, see mkimage]\n", argv[0]);
+        return 2;
+    }
+
+    char path[512];
+    bench_image_path("bench_fatcore.img", path, sizeof path);
+    double t0 = bench_now();
+    if(!bench_image_create(path, &spec)) return 1;
+    printf("generated %s in %.2f s: %u MiB, %u dirs, %u files, %u%% fragmentation\n", path, bench_now() - t0,
+           spec.size_mb, spec.dirs, spec.files, spec.frag_percent);
+
+    const char *io_env = getenv("BENCH_IO");
+    BlockDevType io = BDEV_PREAD;
+    if(io_env && strcmp(io_env, "mmap") == 0) io = BDEV_MMAP;
+    if(io_env && strcmp(io_env, "direct") == 0) io = BDEV_DIRECT;
+
+    Bench b;
+    memset(&b, 0, sizeof b);
+    b.spec = &spec;
+    b.vol = fat32_init(path, io, 0);
+    if(!b.vol) return 1;
+
+    // resolve every directory and a sample of files once, outside the timings
+    b.dir_cluster = calloc(spec.dirs ? spec.dirs : 1, sizeof(uint32_t));
+    b.samples = spec.files < 4096 ? spec.files : 4096;
+    b.file_cluster = calloc(b.samples ? b.samples : 1, sizeof(uint32_t));
+    b.file_index = calloc(b.samples ? b.samples : 1, sizeof(uint32_t));
+    b.buf = malloc(b.vol->cluster_size);
+    if(!b.dir_cluster || !b.file_cluster || !b.file_index || !b.buf) return 1;
+
+    for(uint32_t d = 0; d < spec.dirs; d++)
+    {
+        char dpath[1024];
+        DirEntry e;
+        bench_image_dir_path(&spec, d, dpath, sizeof dpath);
+        if(!dir_resolve(b.vol, b.vol->bpb.root_cluster, dpath, &e, NULL))
+        {
+            fprintf(stderr, "generated directory %s not found\n", dpath);
+            return 1;
+        }
+        b.dir_cluster[d] = first_cluster_from_entry(&e);
+        if(b.dir_cluster[d] < 2) b.dir_cluster[d] = b.vol->bpb.root_cluster;
+    }
+    for(size_t s = 0; s < b.samples; s++)
+    {
+        char name[13];
+        DirEntry e;
+        b.file_index[s] = (uint32_t)(s * (spec.files / b.samples));
+        bench_image_file_name(b.file_index[s], name);
+        if(!find_dir_entry(b.vol, b.dir_cluster[b.file_index[s] % spec.dirs], name, &e, NULL))
+        {
+            fprintf(stderr, "generated file %s not found\n", name);
+            return 1;
+        }
+        b.file_cluster[s] = first_cluster_from_entry(&e);
+    }
+
+    b.null_fd = open("/dev/null", O_WRONLY);
+    b.stdout_fd = dup(STDOUT_FILENO);
+
+    bool ok = true;
+    ok &= bench_run("fat_get_entry-random", op_get_entry_random, &b, 2000000, 256);
+    ok &= bench_run("fat_get_entry-seq", op_get_entry_seq, &b, 2000000, 256);
+    ok &= bench_run("fat_find_free_cluster", op_find_free, &b, 200000, 64);
+    if(b.samples) ok &= bench_run("fat_get_chain", op_get_chain, &b, 200000, 16);
+    if(b.samples) ok &= bench_run("find_dir_entry-hit", op_find_hit, &b, 200000, 16);
+    ok &= bench_run("find_dir_entry-miss", op_find_miss, &b, 200000, 16);
+
+    // fat32_ls prints every name; descriptor 1 goes to /dev/null meanwhile
+    quiet(&b, true);
+    ok &= bench_run("fat32_ls", op_ls, &b, 20000, 4);
+    quiet(&b, false);
+
+    ok &= bench_run("read_cluster-random", op_read_random, &b, 100000, 16);
+    ok &= bench_run("read_cluster-seq", op_read_seq, &b, 100000, 16);
+
+    fat32_close(b.vol);
+    if(!getenv("BENCH_KEEP")) unlink(path);
+    free(b.dir_cluster);
+    free(b.file_cluster);
+    free(b.file_index);
+    free(b.buf);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,88 @@
+//FAT statistics kernels against the scalar path on a 4M-cluster FAT
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "fatscan.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CLUSTERS (4u << 20)
+#define ROUNDS 20
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+//Half-full volume: files of 1-64 clusters, mostly contiguous, free gaps between
+static void build(uint32_t *fat, uint32_t limit)
+{
+    srand(19);
+    fat[0] = 0x0FFFFFF8;
+    fat[1] = 0x0FFFFFFF;
+    uint32_t c = 2;
+    while(c < limit)
+    {
+        uint32_t len = 1 + (uint32_t)(rand() % 64);
+        for(uint32_t i = 0; i < len && c < limit; i++, c++)
+            fat[c] = i + 1 == len ? 0x0FFFFFFF : (rand() % 16 ? c + 1 : 2 + (uint32_t)rand() % (limit - 2));
+        uint32_t gap = (uint32_t)(rand() % 64);
+        for(uint32_t i = 0; i < gap && c < limit; i++, c++) fat[c] = 0;
+    }
+}
+
+int main(void)
+{
+    uint32_t *fat = malloc(CLUSTERS * sizeof(uint32_t));
+    uint64_t *bits = malloc((CLUSTERS + 63) / 64 * sizeof(uint64_t));
+    if(!fat || !bits) return 1;
+    build(fat, CLUSTERS);
+
+    const char *names[] = { "scalar", "sse2", "avx2" };
+    double base[3] = { 0, 0, 0 };
+    FatStats ref;
+    printf("%u clusters, best of %d rounds, ms\n", CLUSTERS, ROUNDS);
+    printf("%-8s %10s %10s %10s\n", "kernel", "stats", "run-4096", "free-bits");
+    for(int k = 0; k < 3; k++)
+    {
+        if(!fat_scan_use(names[k]))
+        {
+            printf("%-8s (not supported here)\n", names[k]);
+            continue;
+        }
+        double t[3] = { 1e9, 1e9, 1e9 };
+        FatStats st;
+        uint32_t run = 0, count = 0;
+        for(int r = 0; r < ROUNDS; r++)
+        {
+            double t0 = now();
+            fat_scan_stats(fat, CLUSTERS, &st);
+            double t1 = now();
+            run = fat_scan_free_run(fat, 2, CLUSTERS, 4096);
+            double t2 = now();
+            count = fat_scan_free_bits(fat, CLUSTERS, bits);
+            double t3 = now();
+            if(t1 - t0 < t[0]) t[0] = t1 - t0;
+            if(t2 - t1 < t[1]) t[1] = t2 - t1;
+            if(t3 - t2 < t[2]) t[2] = t3 - t2;
+        }
+        if(k == 0) ref = st;
+        if(memcmp(&st, &ref, sizeof st) != 0 || count != st.free_clusters || run != 0)
+        {
+            printf("%s: wrong answer\n", names[k]);
+            return 1;
+        }
+        if(k == 0) memcpy(base, t, sizeof base);
+        printf("%-8s %10.3f %10.3f %10.3f   (x%.1f, x%.1f, x%.1f vs scalar)\n", names[k], t[0] * 1e3, t[1] * 1e3,
+               t[2] * 1e3, base[0] / t[0], base[1] / t[1], base[2] / t[2]);
+    }
+    printf("%llu free in %llu runs, %llu of %llu links jump\n", (unsigned long long)ref.free_clusters,
+           (unsigned long long)ref.free_runs, (unsigned long long)ref.breaks, (unsigned long long)ref.links);
+    free(fat);
+    free(bits);
+    return 0;
+}
@@ -0,0 +1,159 @@
+//Metadata journal: group commit against a commit per operation
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bench.h"
+#include "fat.h"
+#include "dir.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define THREADS 4
+
+typedef struct
+{
+    fat32_volume *vol;
+    const BenchImageSpec *spec;
+    uint32_t *dir_cluster;
+    bool sync_each;             // fat32_commit after every operation
+    uint32_t next;              // names handed out so far
+} Bench;
+
+//One metadata operation: create a file of one cluster in some directory
+static bool create_file(Bench *b, uint32_t n)
+{
+    char name[13];
+    DirEntry e;
+    memset(&e, 0, sizeof e);
+    snprintf(name, sizeof name, "J%07u.DAT", n % 10000000u);
+    format_name_83(name, e.DIR_Name);
+    e.DIR_Attr = 0x20;
+
+    fat_txn_begin(b->vol);
+    size_t count;
+    FatExtent *ext = fat_extend_chain_extents(b->vol, 0, 1, &count);
+    bool ok = ext != NULL;
+    if(ok)
+    {
+        e.DIR_FstClusHigh = (uint16_t)(ext[0].start >> 16);
+        e.DIR_FirstClusterLow = (uint16_t)(ext[0].start & 0xFFFF);
+        e.DIR_FileSize = b->vol->cluster_size;
+        ok = create_dir_entry(b->vol, b->dir_cluster[n % b->spec->dirs], &e);
+    }
+    free(ext);
+    fat_txn_end(b->vol);
+
+    if(ok && b->sync_each) ok = fat32_commit(b->vol);
+    return ok;
+}
+
+static void op_create(void *ctx, size_t i)
+{
+    Bench *b = ctx;
+    (void)i;
+    if(!create_file(b, __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)))
+    {
+        fprintf(stderr, "create failed\n");
+        exit(1);
+    }
+}
+
+typedef struct
+{
+    Bench *b;
+    size_t ops;
+} Worker;
+
+static void *worker_main(void *arg)
+{
+    Worker *w = arg;
+    for(size_t i = 0; i < w->ops; i++) op_create(w->b, i);
+    return NULL;
+}
+
+//THREADS clients each committing every operation: their commits share fsyncs
+static void run_threads(const char *name, Bench *b, size_t ops)
+{
+    pthread_t threads[THREADS];
+    Worker w = { b, ops / THREADS };
+    double t0 = bench_now();
+    for(int i = 0; i < THREADS; i++) pthread_create(&threads[i], NULL, worker_main, &w);
+    for(int i = 0; i < THREADS; i++) pthread_join(threads[i], NULL);
+    double t = bench_now() - t0;
+    printf("%-28s %12.0f ops/s   %d threads\n", name, (double)(w.ops * THREADS) / t, THREADS);
+}
+
+static fat32_volume *mount(const char *path, const BenchImageSpec *spec, unsigned flags, Bench *b)
+{
+    if(!bench_image_create(path, spec)) return NULL;
+    b->vol = fat32_init(path, BDEV_PREAD, flags);
+    if(!b->vol) return NULL;
+
+    for(uint32_t d = 0; d < spec->dirs; d++)
+    {
+        char dpath[1024];
+        DirEntry e;
+        bench_image_dir_path(spec, d, dpath, sizeof dpath);
+        if(!dir_resolve(b->vol, b->vol->bpb.root_cluster, dpath, &e, NULL)) return NULL;
+        b->dir_cluster[d] = first_cluster_from_entry(&e);
+        if(b->dir_cluster[d] < 2) b->dir_cluster[d] = b->vol->bpb.root_cluster;
+    }
+    return b->vol;
+}
+
+int main(int argc, char **argv)
+{
+    BenchImageSpec spec;
+    bench_image_defaults(&spec);
+    spec.size_mb = 256;
+    spec.dirs = 64;
+    spec.files = 0;
+    int argi = 1;
+    if(!bench_parse_spec(argc, argv, &argi, &spec) || argi != argc || spec.dirs == 0)
+    {
+        fprintf(stderr, "usage: %s [image options, see mkimage]\n", argv[0]);
+        return 2;
+    }
+
+    char path[512];
+    bench_image_path("bench_journal.img", path, sizeof path);
+    Bench b;
+    memset(&b, 0, sizeof b);
+    b.spec = &spec;
+    b.dir_cluster = calloc(spec.dirs, sizeof(uint32_t));
+    if(!b.dir_cluster) return 1;
+
+    static const struct
+    {
+        const char *name;
+        unsigned flags;
+        bool sync_each;
+        size_t ops;
+    } runs[] = {
+        { "create-no-journal", 0, false, 20000 },
+        { "create-journal-group", FAT_MOUNT_JOURNAL, false, 20000 },
+        { "create-journal-sync-each", FAT_MOUNT_JOURNAL, true, 2000 },
+    };
+
+    bool ok = true;
+    for(size_t r = 0; r < sizeof runs / sizeof runs[0]; r++)
+    {
+        if(!mount(path, &spec, runs[r].flags, &b)) return 1;
+        b.sync_each = runs[r].sync_each;
+        ok &= bench_run(runs[r].name, op_create, &b, runs[r].ops, 1);
+        fat32_close(b.vol);
+    }
+
+    // concurrent clients that each need their operation durable
+    if(!mount(path, &spec, FAT_MOUNT_JOURNAL, &b)) return 1;
+    b.sync_each = true;
+    run_threads("create-journal-sync-shared", &b, 2000);
+    fat32_close(b.vol);
+
+    if(!getenv("BENCH_KEEP")) unlink(path);
+    free(b.dir_cluster);
+    return ok ? 0 : 1;
+}
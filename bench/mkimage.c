@@ -0,0 +1,21 @@
+//Generate a synthetic FAT32 image for benchmarks and testing
+
+#include "bench.h"
+#include <stdio.h>
+
+int main(int argc, char **argv)
+{
+    BenchImageSpec spec;
+    bench_image_defaults(&spec);
+    int argi = 1;
+    if(!bench_parse_spec(argc, argv, &argi, &spec) || argi != argc - 1)
+    {
+        fprintf(stderr, "usage: %s [--size MB] [--spc N] [--dirs N] [--fanout N] [--files N]\n"
+                        "          [--min BYTES] [--max BYTES] [--frag PCT] [--seed N] IMAGE\n", argv[0]);
+        return 2;
+    }
+    if(!bench_image_create(argv[argi], &spec)) return 1;
+    printf("%s: %u MiB, %u directories (fan-out %u), %u files, %u%% fragmentation\n", argv[argi], spec.size_mb,
+           spec.dirs, spec.fanout, spec.files, spec.frag_percent);
+    return 0;
+}
@@ -0,0 +1,227 @@
+//Unix-socket server: requests from one and many clients against a mount per client
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bench.h"
+#include "fat.h"
+#include "dir.h"
+#include "server.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define CLIENTS 8
+
+typedef struct
+{
+    const BenchImageSpec *spec;
+    const char *img_path;
+    const char *sock_path;
+    uint8_t *buf;               // response payloads
+    int fd;                     // this client's connection
+    uint32_t tag;
+} Client;
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+    for(int i = 0; i < 4; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static bool full_io(int fd, void *buf, size_t len, bool sending)
+{
+    uint8_t *p = buf;
+    while(len > 0)
+    {
+        ssize_t n = sending ? send(fd, p, len, MSG_NOSIGNAL) : recv(fd, p, len, 0);
+        if(n <= 0) return false;
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static int client_connect(const char *sock_path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof addr.sun_path, "%s", sock_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof addr) != 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+//Send one request and wait for its response; returns the payload length or -1
+static long call(Client *c, uint16_t op, const void *payload, uint32_t len)
+{
+    uint8_t h[SRV_HEADER_SIZE];
+    put_u32(h, len);
+    h[4] = (uint8_t)op;
+    h[5] = (uint8_t)(op >> 8);
+    h[6] = h[7] = 0;
+    put_u32(h + 8, ++c->tag);
+    if(!full_io(c->fd, h, sizeof h, true) || !full_io(c->fd, (void *)payload, len, true)) return -1;
+
+    if(!full_io(c->fd, h, sizeof h, false)) return -1;
+    uint32_t got = get_u32(h);
+    if(got > SRV_MAX_PAYLOAD || !full_io(c->fd, c->buf, got, false)) return -1;
+    if(get_u32(h + 8) != c->tag || (h[6] | h[7] << 8) != SRV_OK) return -1;
+    return got;
+}
+
+//Path of file `file` of the image, into `out`; returns its length
+static size_t file_path(const BenchImageSpec *spec, uint32_t file, char *out, size_t out_size)
+{
+    char dir[1024], name[13];
+    bench_image_dir_path(spec, file % spec->dirs, dir, sizeof dir);
+    bench_image_file_name(file, name);
+    return (size_t)snprintf(out, out_size, "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, name);
+}
+
+static void fail(const char *what)
+{
+    fprintf(stderr, "%s failed\n", what);
+    exit(1);
+}
+
+static void op_stat(void *ctx, size_t i)
+{
+    Client *c = ctx;
+    (void)i;
+    char path[1100];
+    size_t len = file_path(c->spec, bench_rand(c->spec->files), path, sizeof path);
+    if(call(c, SRV_OP_STAT, path, (uint32_t)len) != 16) fail("stat");
+}
+
+static void op_read(void *ctx, size_t i)
+{
+    Client *c = ctx;
+    (void)i;
+    uint8_t req[12 + 1100];
+    memset(req, 0, 8);                  // offset 0
+    put_u32(req + 8, 4096);
+    size_t len = file_path(c->spec, bench_rand(c->spec->files), (char *)req + 12, sizeof req - 12);
+    if(call(c, SRV_OP_READ, req, (uint32_t)(12 + len)) < 0) fail("read");
+}
+
+//What every client pays without the server: its own mount of the image
+static void op_mount_stat(void *ctx, size_t i)
+{
+    Client *c = ctx;
+    (void)i;
+    char path[1100];
+    file_path(c->spec, bench_rand(c->spec->files), path, sizeof path);
+    fat32_volume *vol = fat32_init(c->img_path, BDEV_PREAD, 0);
+    DirEntry e;
+    if(!vol || !dir_resolve(vol, vol->bpb.root_cluster, path, &e, NULL)) fail("mount and stat");
+    fat32_close(vol);
+}
+
+typedef struct
+{
+    Client client;
+    size_t ops;
+} Worker;
+
+static void *client_main(void *arg)
+{
+    Worker *w = arg;
+    for(size_t i = 0; i < w->ops; i++) (i % 2 ? op_read : op_stat)(&w->client, i);
+    return NULL;
+}
+
+//CLIENTS connections at once, alternating stat and 4 KiB reads
+static void run_clients(const char *name, const Client *proto, size_t ops)
+{
+    pthread_t threads[CLIENTS];
+    Worker w[CLIENTS];
+    for(int i = 0; i < CLIENTS; i++)
+    {
+        w[i].client = *proto;
+        w[i].client.fd = client_connect(proto->sock_path);
+        w[i].client.buf = malloc(SRV_MAX_PAYLOAD);
+        w[i].ops = ops / CLIENTS;
+        if(w[i].client.fd < 0 || !w[i].client.buf) fail("connect");
+    }
+    double t0 = bench_now();
+    for(int i = 0; i < CLIENTS; i++) pthread_create(&threads[i], NULL, client_main, &w[i]);
+    for(int i = 0; i < CLIENTS; i++) pthread_join(threads[i], NULL);
+    double t = bench_now() - t0;
+    printf("%-28s %12.0f ops/s   %d clients\n", name, (double)(w[0].ops * CLIENTS) / t, CLIENTS);
+    for(int i = 0; i < CLIENTS; i++)
+    {
+        close(w[i].client.fd);
+        free(w[i].client.buf);
+    }
+}
+
+static void *serve_main(void *arg)
+{
+    server_run(arg);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    BenchImageSpec spec;
+    bench_image_defaults(&spec);
+    spec.size_mb = 256;
+    spec.files = 5000;
+    int argi = 1;
+    if(!bench_parse_spec(argc, argv, &argi, &spec) || argi != argc || spec.files == 0)
+    {
+        fprintf(stderr, "usage: %s [image options, see mkimage]\n", argv[0]);
+        return 2;
+    }
+
+    char img[512], sock[512];
+    bench_image_path("bench_server.img", img, sizeof img);
+    bench_image_path("bench_server.sock", sock, sizeof sock);
+    if(!bench_image_create(img, &spec)) return 1;
+    fat32_volume *vol = fat32_init(img, BDEV_PREAD, 0);
+    Server *srv = vol ? server_open(vol, sock, 0) : NULL;
+    if(!srv) return 1;
+    pthread_t loop;
+    pthread_create(&loop, NULL, serve_main, srv);
+
+    Client c = { &spec, img, sock, malloc(SRV_MAX_PAYLOAD), client_connect(sock), 0 };
+    if(c.fd < 0 || !c.buf) fail("connect");
+    bool ok = true;
+    ok &= bench_run("server-stat", op_stat, &c, 50000, 16);
+    ok &= bench_run("server-read-4k", op_read, &c, 50000, 16);
+
+    // fat32_init reports on stdout; bench_run prints to the original stdout
+    int stdout_fd = dup(STDOUT_FILENO), null_fd = open("/dev/null", O_WRONLY);
+    fflush(stdout);
+    dup2(null_fd, STDOUT_FILENO);
+    ok &= bench_run("mount-per-client-stat", op_mount_stat, &c, 200, 1);
+    fflush(stdout);
+    dup2(stdout_fd, STDOUT_FILENO);
+    close(null_fd);
+    close(stdout_fd);
+
+    run_clients("server-stat-read-shared", &c, 100000);
+    close(c.fd);
+    free(c.buf);
+
+    server_stop(srv);
+    pthread_join(loop, NULL);
+    server_close(srv);
+    fat32_close(vol);
+    if(!getenv("BENCH_KEEP")) unlink(img);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,173 @@
+//Bulk import/export: a host tree of small files and a few large ones
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bench.h"
+#include "fat.h"
+#include "dir.h"
+#include "transfer.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HOST_DIRS 8
+#define SMALL_FILES 500         // per directory, 1-16 KiB each
+#define LARGE_FILES 4           // in the top directory
+#define LARGE_BYTES (8u << 20)
+#define ROUNDS 3
+
+typedef struct
+{
+    fat32_volume *vol;
+    DirSession session;
+    char host[512];             // generated source tree
+    char out[512];              // export destinations live under here
+    uint64_t files, bytes;      // of the last round
+} Bench;
+
+static void fail(const char *what)
+{
+    fprintf(stderr, "%s failed\n", what);
+    exit(1);
+}
+
+static void write_file(const char *path, size_t size)
+{
+    static uint8_t buf[LARGE_BYTES];
+    for(size_t i = 0; i < size; i += 4) buf[i] = (uint8_t)bench_rand(256);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0 || write(fd, buf, size) != (ssize_t)size || close(fd) != 0) fail(path);
+}
+
+static void make_tree(const char *root)
+{
+    char path[1024];
+    if(mkdir(root, 0755) != 0) fail(root);
+    for(int i = 0; i < LARGE_FILES; i++)
+    {
+        snprintf(path, sizeof path, "%s/L%07d.BIN", root, i);
+        write_file(path, LARGE_BYTES);
+    }
+    for(int d = 0; d < HOST_DIRS; d++)
+    {
+        snprintf(path, sizeof path, "%s/D%07d", root, d);
+        if(mkdir(path, 0755) != 0) fail(path);
+        for(int f = 0; f < SMALL_FILES; f++)
+        {
+            snprintf(path, sizeof path, "%s/D%07d/F%07d.DAT", root, d, f);
+            write_file(path, 1024 + bench_rand(15 * 1024));
+        }
+    }
+}
+
+static void remove_tree(const char *root)
+{
+    DIR *d = opendir(root);
+    struct dirent *de;
+    char path[1024];
+    while(d && (de = readdir(d)) != NULL)
+    {
+        struct stat st;
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        snprintf(path, sizeof path, "%s/%s", root, de->d_name);
+        if(lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) remove_tree(path);
+        else unlink(path);
+    }
+    if(d) closedir(d);
+    rmdir(root);
+}
+
+static void record(Bench *b, const TransferStats *st)
+{
+    if(st->errors || st->skipped) fail("transfer");
+    b->files = st->files;
+    b->bytes = st->bytes;
+}
+
+//Copy the host tree into a new image directory T<i>
+static void op_import(void *ctx, size_t i)
+{
+    Bench *b = ctx;
+    char name[11], dir[16];
+    snprintf(dir, sizeof dir, "T%zu", i);
+    format_name_83(dir, name);
+    uint32_t cluster;
+    TransferStats st;
+    if(!create_directory(b->vol, b->vol->bpb.root_cluster, name, &cluster)) fail("mkdir");
+    if(!transfer_import(b->vol, &b->session, b->host, dir, &st)) fail("import");
+    record(b, &st);
+}
+
+//Copy image directory T0 out to a new host directory
+static void op_export(void *ctx, size_t i)
+{
+    Bench *b = ctx;
+    char dest[600];
+    snprintf(dest, sizeof dest, "%s/E%zu", b->out, i);
+    TransferStats st;
+    if(!transfer_export(b->vol, &b->session, "T0", dest, &st)) fail("export");
+    record(b, &st);
+}
+
+static bool run(const char *name, BenchOp op, Bench *b)
+{
+    double t0 = bench_now();
+    bool ok = bench_run(name, op, b, ROUNDS, 1);
+    double t = (bench_now() - t0) / ROUNDS;
+    printf("%-28s %12.0f files/s %8.1f MiB/s\n", name, (double)b->files / t, (double)b->bytes / t / (1 << 20));
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    BenchImageSpec spec;
+    bench_image_defaults(&spec);
+    spec.size_mb = 512;
+    spec.dirs = 1;
+    spec.files = 0;
+    spec.frag_percent = 0;
+    int argi = 1;
+    if(!bench_parse_spec(argc, argv, &argi, &spec) || argi != argc)
+    {
+        fprintf(stderr, "usage: %s [image options, see mkimage]\n", argv[0]);
+        return 2;
+    }
+
+    Bench b;
+    memset(&b, 0, sizeof b);
+    char img[512];
+    bench_image_path("bench_transfer.img", img, sizeof img);
+    bench_image_path("bench_transfer.src", b.host, sizeof b.host);
+    bench_image_path("bench_transfer.out", b.out, sizeof b.out);
+    remove_tree(b.host);
+    remove_tree(b.out);
+    make_tree(b.host);
+    if(mkdir(b.out, 0755) != 0) fail(b.out);
+    if(!bench_image_create(img, &spec)) return 1;
+
+    // fat32_init reports on stdout; bench_run prints to the original stdout
+    int stdout_fd = dup(STDOUT_FILENO), null_fd = open("/dev/null", O_WRONLY);
+    fflush(stdout);
+    dup2(null_fd, STDOUT_FILENO);
+    b.vol = fat32_init(img, BDEV_PREAD, 0);
+    fflush(stdout);
+    dup2(stdout_fd, STDOUT_FILENO);
+    close(null_fd);
+    close(stdout_fd);
+    if(!b.vol) return 1;
+    dir_session_init(b.vol, &b.session);
+
+    bool ok = true;
+    ok &= run("import-tree", op_import, &b);
+    ok &= run("export-tree", op_export, &b);
+
+    fat32_close(b.vol);
+    remove_tree(b.out);
+    remove_tree(b.host);
+    if(!getenv("BENCH_KEEP")) unlink(img);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,91 @@
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "perf.h"
+
+// Block device layer under the FAT code. Every access names its own byte
+// offset (pread/pwrite style), so there is no shared file cursor and the
+// backends can be used from several threads at once.
+
+// Backends, selected when the image is opened
+typedef enum
+{
+    BDEV_PREAD,     // pread/pwrite on a plain descriptor (default fallback)
+    BDEV_MMAP,      // whole image mapped MAP_SHARED; I/O is memcpy
+    BDEV_DIRECT     // O_DIRECT with aligned bounce buffers, bypasses page cache
+} BlockDevType;
+
+typedef struct BlockDev BlockDev;
+
+typedef struct
+{
+    bool (*read)(BlockDev *dev, uint64_t off, void *buf, size_t len);
+    bool (*write)(BlockDev *dev, uint64_t off, const void *buf, size_t len);
+    bool (*flush)(BlockDev *dev);
+    void (*close)(BlockDev *dev);
+    void (*prefetch)(BlockDev *dev, uint64_t off, size_t len);   // optional
+} BlockDevOps;
+
+struct BlockDev
+{
+    const BlockDevOps *ops;
+    BlockDevType type;      // backend actually in use (may differ from requested)
+    int fd;
+    uint64_t size;          // image size in bytes
+    uint8_t *map;           // base of the mapping for BDEV_MMAP, else NULL
+    size_t align;           // offset/length/buffer alignment for BDEV_DIRECT, else 1
+    void *priv;             // backend-private state
+};
+
+/* Open the image at `path` read/write with backend `type`. If mmap or
+ * O_DIRECT is not possible for this file, falls back to BDEV_PREAD; check
+ * `dev->type` for the backend that was chosen. Returns NULL if the file
+ * can't be opened at all. */
+BlockDev *bdev_open(const char *path, BlockDevType type);
+
+/* Read/write `len` bytes at byte offset `off`. Requests may have any
+ * alignment; BDEV_DIRECT handles unaligned edges internally. Return true
+ * only if the whole range was transferred. */
+static inline bool bdev_read(BlockDev *dev, uint64_t off, void *buf, size_t len)
+{
+    PERF_IO(false, off, len);
+    return dev->ops->read(dev, off, buf, len);
+}
+
+static inline bool bdev_write(BlockDev *dev, uint64_t off, const void *buf, size_t len)
+{
+    PERF_IO(true, off, len);
+    return dev->ops->write(dev, off, buf, len);
+}
+
+/* Make all completed writes durable (fsync / msync). */
+static inline bool bdev_flush(BlockDev *dev)
+{
+    return dev->ops->flush(dev);
+}
+
+/* Hint that `len` bytes at `off` will be read soon. Returns at once; the
+ * kernel starts reading into the page cache (posix_fadvise WILLNEED for
+ * pread, madvise WILLNEED for mmap). A no-op for O_DIRECT, which
+ * bypasses the page cache. */
+static inline void bdev_prefetch(BlockDev *dev, uint64_t off, size_t len)
+{
+    if(dev->ops->prefetch && len > 0) dev->ops->prefetch(dev, off, len);
+}
+
+/* Close the device and free it. Does not flush. */
+static inline void bdev_close(BlockDev *dev)
+{
+    if(dev) dev->ops->close(dev);
+}
+
+/* Zero `len` bytes at `off`. */
+bool bdev_zero(BlockDev *dev, uint64_t off, size_t len);
+
+/* Name of a backend, for messages. */
+const char *bdev_type_name(BlockDevType type);
+
+#endif // BLOCKDEV_H
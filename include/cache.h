@@ -0,0 +1,96 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Cluster buffer cache. A fixed number of cluster-sized slots keyed by
+// cluster number, with CLOCK eviction and write-back of dirty slots on
+// eviction, flush and shutdown. Directory and metadata cluster I/O goes
+// through here; the FAT itself is cached separately in fat.c. Each mounted
+// volume has its own cache (fat32_volume.cache).
+//
+// All functions except cache_init and cache_shutdown are thread-safe.
+// The cache protects its own bookkeeping only; callers that modify a
+// pinned buffer must hold the lock of the directory it belongs to.
+
+struct fat32_volume;
+
+typedef struct
+{
+    uint32_t cluster;   // cluster held by this slot
+    uint8_t *data;      // `cluster_size` bytes; valid while pinned
+    // internal
+    uint32_t refs;      // pin count; pinned slots are never evicted
+    bool dirty;
+    uint64_t lsn;       // journal transaction of the last change (journal.h)
+    bool referenced;    // CLOCK reference bit
+    bool valid;
+    bool loading;       // being read in with the cache lock dropped
+    bool reload;        // the image changed under a load; read again
+    int32_t hash_next;
+    uint8_t *storage;
+} ClusterBuf;
+
+typedef struct
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;    // dirty slots written to the image
+    size_t capacity;        // slots
+    size_t in_use;          // slots holding a cluster
+    size_t dirty;           // slots waiting for write-back
+} CacheStats;
+
+/* Create the cache of `vol`, sized to `bytes` worth of clusters (at least
+ * a few slots). Called by fat32_init once the geometry is known. */
+bool cache_init(struct fat32_volume *vol, size_t bytes);
+
+/* Write back all dirty slots and free the cache of `vol`. */
+void cache_shutdown(struct fat32_volume *vol);
+
+/* Return `cluster` pinned in the cache, reading it from the image on a
+ * miss. The read is done without the cache lock; other threads asking
+ * for the same cluster wait for it. Returns NULL on I/O error or if
+ * every slot is pinned. Release with `cache_put`. */
+ClusterBuf *cache_get(struct fat32_volume *vol, uint32_t cluster);
+
+/* Like `cache_get`, but for a freshly allocated cluster: no read is done,
+ * the data is zero-filled and the slot is marked dirty. */
+ClusterBuf *cache_get_zeroed(struct fat32_volume *vol, uint32_t cluster);
+
+/* Mark a pinned buffer as modified; it is written back later. */
+void cache_mark_dirty(struct fat32_volume *vol, ClusterBuf *buf);
+
+/* Unpin a buffer returned by `cache_get`/`cache_get_zeroed`. */
+void cache_put(struct fat32_volume *vol, ClusterBuf *buf);
+
+/* Drop `cluster` from the cache without writing it back. Used when the
+ * cluster is freed or its contents are rewritten around the cache. */
+void cache_invalidate(struct fat32_volume *vol, uint32_t cluster);
+
+/* Copy over `dst` the bytes of any dirty cached cluster that falls in
+ * the `len` bytes starting `offset` bytes into `first_cluster`, where the
+ * clusters from `first_cluster` on are physically contiguous. Lets
+ * callers that read the image directly see data not yet written back. */
+void cache_overlay_dirty(struct fat32_volume *vol, uint32_t first_cluster, uint64_t offset, size_t len, uint8_t *dst);
+
+/* Counterpart of `cache_overlay_dirty` for writes: copy `src` into any
+ * cached cluster in the same range, after the caller has written those
+ * bytes to the image directly, so the cache does not serve stale data. */
+void cache_update_range(struct fat32_volume *vol, uint32_t first_cluster, uint64_t offset, size_t len, const uint8_t *src);
+
+/* Write every dirty slot back to the image, adjacent clusters coalesced
+ * into single writes. On a journaled volume, slots changed by a
+ * transaction that is not durable yet stay dirty, as they do on
+ * eviction. Pinned slots may be changing under their directory lock, so
+ * they are skipped and stay dirty too. Returns true only if every
+ * durable dirty slot was written. */
+bool cache_flush(struct fat32_volume *vol);
+
+/* Copy the current counters into `*out`. */
+void cache_get_stats(struct fat32_volume *vol, CacheStats *out);
+
+#endif // CACHE_H
@@ -0,0 +1,63 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "fat.h"
+
+// Dentry cache for path resolution. Maps (parent directory cluster,
+// lookup name) to the directory entry and its byte offset, or to a
+// negative entry recording that the name does not exist. Names are keyed
+// by their case-folded form, so short and long names are cached alike;
+// the hash only picks the bucket, and every hit compares the full folded
+// name. write_dir_entry invalidates the entry it rewrites, and a name
+// newly written into a directory invalidates everything cached under it,
+// since it may answer lookups cached as missing. Entries are also dropped
+// when a directory is removed. Fixed size with CLOCK replacement;
+// each mounted volume has its own. Thread-safe; to keep a lookup and the
+// insert of its result atomic against writers, hold the parent's
+// directory lock (see fat.h) across both.
+
+typedef enum
+{
+    DCACHE_MISS,
+    DCACHE_HIT,
+    DCACHE_NEGATIVE     // cached "no such name"
+} DcacheResult;
+
+typedef struct
+{
+    uint64_t hash;      // hash_folded_name of `name`
+    uint16_t len;       // folded length in UTF-16 units
+    uint16_t name[255]; // the name as folded by fold_name_utf8
+} DcacheKey;
+
+/* Key of lookup name `name` (UTF-8). Returns false if it is not valid
+ * UTF-8 or too long for a FAT name. */
+bool dcache_key(const char *name, DcacheKey *key);
+
+/* Look up `key` in directory `parent`. On DCACHE_HIT copies the entry and
+ * its offset (either pointer may be NULL). */
+DcacheResult dcache_lookup(fat32_volume *vol, uint32_t parent, const DcacheKey *key, DirEntry *entry, uint64_t *entry_offset);
+
+/* Cache the result of a lookup. Pass `entry` NULL for a negative entry. */
+void dcache_insert(fat32_volume *vol, uint32_t parent, const DcacheKey *key, const DirEntry *entry, uint64_t entry_offset);
+
+/* Forget cached copies of the entry at `entry_offset` in directory `parent`. */
+void dcache_invalidate_entry(fat32_volume *vol, uint32_t parent, uint64_t entry_offset);
+
+/* A name appeared in directory `parent`: forget everything cached under
+ * it, in O(1). */
+void dcache_new_name(fat32_volume *vol, uint32_t parent);
+
+/* Forget everything cached under directory `parent`. Cheap when nothing
+ * was ever cached for it. */
+void dcache_drop_dir(fat32_volume *vol, uint32_t parent);
+
+/* Create the dentry cache of `vol` (fat32_init). */
+bool dcache_init(fat32_volume *vol);
+
+/* Free the dentry cache of `vol` (unmount). */
+void dcache_shutdown(fat32_volume *vol);
+
+#endif // DCACHE_H
@@ -4,13 +4,33 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include "fat.h"
 
-// functions added by isa
-void dir_init(uint32_t root);
-bool dir_cd(const char *name);
-void dir_ls(uint32_t start_cluster);                    // list current working directory
-uint32_t get_cwd_cluster(void);
-const char* get_cwd_path(void);
-void fat32_ls(uint32_t start_cluster); // list a FAT32 directory starting at cluster
+/* A client's working directory on one volume. Each client of a mounted
+ * image keeps its own (the interactive shell has one too). Not shared
+ * between threads. */
+typedef struct
+{
+    uint32_t cwd_cluster;       // first cluster of the working directory
+    char     cwd_path[256];     // normalized path, for prompts and lsof
+} DirSession;
+
+/* Start `session` at the root directory of `vol`. */
+void dir_session_init(fat32_volume *vol, DirSession *session);
+
+/* Change the working directory of `session` to `path` (see `dir_resolve`). */
+bool dir_session_cd(fat32_volume *vol, DirSession *session, const char *path);
+
+/* Resolve `path` to a directory entry. Absolute paths start at the root,
+ * others at `start_cluster`; "." and ".." components are followed and
+ * repeated or trailing slashes are ignored. Each component is looked up
+ * through the dentry cache (dcache.h) before falling back to
+ * `find_dir_entry`. For the root itself a directory entry with the root
+ * cluster is synthesized and `*entry_offset` is 0. Returns false if a
+ * component does not exist or a non-final component is not a directory.*/
+bool dir_resolve(fat32_volume *vol, uint32_t start_cluster, const char *path, DirEntry *out_entry, uint64_t *entry_offset);
+
+void dir_ls(fat32_volume *vol, const DirSession *session);     // list the session's working directory
+void fat32_ls(fat32_volume *vol, uint32_t start_cluster); // list a FAT32 directory starting at cluster
 
 #endif // DIR_H
\ No newline at end of file
@@ -0,0 +1,64 @@
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "fat.h"
+
+// Per-directory hash index of entry names. An index is built the first
+// time a directory is searched, in one pass over its entries, and then
+// maps each packed 11-byte short name, and each case-folded long name,
+// to the byte offset of its short entry and that entry's first cluster
+// and attributes, so later lookups in that
+// directory are O(1) instead of a scan of every entry, whatever kind of
+// name is asked for. Indexes are kept current by write_dir_entry and
+// dropped when the directory is removed; a change to LFN
+// slots drops the directory's index, to be rebuilt by the next lookup. A
+// bounded number of directories per volume is indexed at once; the least
+// recently used index is discarded to make room.
+//
+// Thread-safe. dir_index_lookup must be called with the directory locked
+// at least shared, dir_index_update with it locked exclusive (fat.h), so
+// an index is never built or changed while entries are being written.
+
+typedef enum
+{
+    DIR_INDEX_ABSENT = 0,       // index is complete and has no such name
+    DIR_INDEX_FOUND = 1,
+    DIR_INDEX_NONE = -1         // no index could be built; caller must scan
+} DirIndexResult;
+
+typedef struct
+{
+    uint64_t offset;            // absolute byte offset of the short entry
+    uint32_t first_cluster;     // as stored in the entry
+    uint8_t  attr;              // DIR_Attr
+} DirIndexHit;
+
+/* Look up a name in the directory starting at `dir_cluster`, building
+ * the index first if needed: `key` is the name packed as 8.3 (NULL if it
+ * does not pack) and `folded` its `folded_len` units as folded by
+ * fold_name_utf8. Like a scan, the first entry in directory order whose
+ * short name equals `key` or whose long name equals `folded` wins. On
+ * DIR_INDEX_FOUND the entry's offset, first cluster and attributes are
+ * stored in `*hit`.*/
+DirIndexResult dir_index_lookup(fat32_volume *vol, uint32_t dir_cluster, const char key[11],
+                                const uint16_t *folded, size_t folded_len, DirIndexHit *hit);
+
+/* Record that the entry at `entry_offset` in the directory starting at
+ * `dir_cluster` changed from `old_entry` to `new_entry`. `after_lfn` says
+ * the slot before it is an LFN fragment, or is not known not to be. No-op
+ * if that directory is not indexed. */
+void dir_index_update(fat32_volume *vol, uint32_t dir_cluster, uint64_t entry_offset,
+                      const DirEntry *old_entry, const DirEntry *new_entry, bool after_lfn);
+
+/* Forget the index of the directory starting at `dir_cluster`, if any. */
+void dir_index_drop(fat32_volume *vol, uint32_t dir_cluster);
+
+/* Create the (empty) index set of `vol` (fat32_init). */
+bool dir_index_init(fat32_volume *vol);
+
+/* Free every index of `vol` (unmount). */
+void dir_index_shutdown(fat32_volume *vol);
+
+#endif // DIRINDEX_H
@@ -0,0 +1,43 @@
+#ifndef DIRSCAN_H
+#define DIRSCAN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "fat.h"
+
+// Vector kernels for scanning raw directory entries. Instead of testing
+// each 32-byte entry byte by byte, several entries are loaded into one
+// register (the first and attribute words of 4 entries with SSE2, 8 with
+// AVX2) and classified, or compared against a packed 8.3 key, with one
+// instruction per test. The kernel is picked on first use from what the
+// CPU supports; a portable scalar kernel gives the same answers on every
+// machine and is what non-x86 builds use.
+
+// What dir_scan_classify found in up to 64 consecutive entries. Bit i
+// stands for entry i; no bits are set at or past the end marker.
+typedef struct
+{
+    uint64_t used;      // in use: neither free (0x00) nor deleted (0xE5)
+    uint64_t lfn;       // in use, and an LFN fragment
+    uint64_t named;     // in use, and a short entry that is not a volume label
+    size_t   end;       // index of the 0x00 end marker, or `count` if none
+} DirScanMask;
+
+/* Classify `count` (at most 64) entries starting at `entries`. */
+void dir_scan_classify(const DirEntry *entries, size_t count, DirScanMask *out);
+
+/* Return the index of the first of `count` entries that is either the
+ * 0x00 end marker or a named entry (as in DirScanMask) whose packed
+ * 11-byte name equals `key`; `count` if there is neither. The caller tells
+ * the two apart by the entry's first byte. */
+size_t dir_scan_find(const DirEntry *entries, size_t count, const char key[11]);
+
+/* Name of the kernel in use: "avx2", "sse2" or "scalar". */
+const char *dir_scan_kernel(void);
+
+/* Switch to the kernel called `name`, for benchmarks and comparisons.
+ * Returns false (and changes nothing) if this CPU or build lacks it. */
+bool dir_scan_use(const char *name);
+
+#endif // DIRSCAN_H
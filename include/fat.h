@@ -5,6 +5,9 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include "blockdev.h"
+#include "cache.h"
+#include "readahead.h"
 //Hello there!
 
 // BPB (BIOS Parameter Block) - fields read from the boot sector
@@ -52,70 +55,282 @@ typedef struct
 #pragma pack(pop)
 
 
-//GLobal State for Loaded FAT32 Image
-extern FILE *fat_img;
+// A run of physically contiguous clusters: start .. start + length - 1
+typedef struct
+{
+    uint32_t start;
+    uint32_t length;
+} FatExtent;
+
+// A cluster chain stored as runs of contiguous clusters, in chain order.
+// first_index[i] is the position within the chain of runs[i].start.
+typedef struct
+{
+    FatExtent *runs;
+    uint32_t  *first_index;
+    size_t     run_count;
+    size_t     cluster_count;
+} FatChain;
+
+
+// A mounted image. Everything the FAT32 layer knows about an image lives
+// here: the device, the geometry parsed from the boot sector, the cached
+// FAT and free-space map, the buffer and name caches and their locks.
+// Volumes share nothing, so any number can be mounted and used at once,
+// each from as many threads as needed. The public fields are set by
+// fat32_init and read-only afterwards.
+typedef struct fat32_volume
+{
+    BlockDev *dev;
+    BootInfo bpb;
+    uint32_t first_data_sector;
+    uint32_t first_fat_sector;
+    uint32_t cluster_size;      // bytes per cluster
+    uint32_t cluster_limit;     // one past the highest valid cluster
+
+    // internal, owned by fat.c, cache.c, dcache.c, dirindex.c and journal.c
+    struct FatState *fat;
+    struct ClusterCache *cache;
+    struct Dcache *dcache;
+    struct DirIndexSet *dirindex;
+    struct Journal *journal;    // NULL unless mounted with FAT_MOUNT_JOURNAL
+} fat32_volume;
+
+// fat32_init flags
+#define FAT_MOUNT_JOURNAL 0x1   // log metadata changes to IMAGE.journal (journal.h)
+
+
+// Cursor over the entries of a directory, following its cluster chain.
+// Yields every short entry (deleted slots are skipped) together with its
+// VFAT long name when a valid LFN sequence precedes it.
+typedef struct
+{
+    DirEntry entry;             // current short entry
+    uint64_t offset;            // image byte offset of `entry`
+    uint64_t first_offset;      // offset of its first LFN slot, or `offset` if none
+    uint16_t long_name[261];    // UTF-16 long name, NUL-terminated when long_len > 0
+    size_t   long_len;          // 0 when the entry has no (valid) long name
+    size_t   lfn_seen;          // LFN fragments passed so far, valid or not
+    bool     error;             // the walk stopped on an I/O error or a broken chain
 
-extern BootInfo bpb;    //initalizes bpb structure
+    // internal
+    fat32_volume *vol;
+    uint32_t cluster;
+    size_t   index;
+    size_t   walk_index;        // position of `cluster` in the chain
+    uint64_t block_used;        // in-use entries of the classified block (dirscan.h)
+    size_t   block_base;        // index of its first entry
+    size_t   block_len;         // entries in it, 0 until classified
+    bool     block_end;         // the block holds the end marker
+    ClusterBuf *buf;
+    ReadAhead ra;
+    uint32_t locked_dir;        // directory held shared until dir_iter_close
+    uint8_t  lfn_expect;
+    uint8_t  lfn_sum;
+    uint64_t lfn_offset;
+} DirIter;
 
-extern uint32_t first_data_sector;
-extern uint32_t first_fat_sector;
-extern uint32_t cluster_size;
 
 uint32_t first_cluster_from_entry(const DirEntry *entry);
 
 //Initialization & Shutdown
-/*returns a bool if properly initalized or not*/
-bool fat32_init(const char *img_path);
+/* Mount the image with block device backend `io` (BDEV_PREAD, BDEV_MMAP or
+ * BDEV_DIRECT; mmap and O_DIRECT fall back to pread when unavailable).
+ * `flags` is 0 or FAT_MOUNT_JOURNAL. A journal left next to the image by
+ * a crash is replayed first, whatever the flags. Returns the new volume,
+ * or NULL if the image could not be mounted. Every other function here
+ * takes the volume to operate on.*/
+fat32_volume *fat32_init(const char *img_path, BlockDevType io, unsigned flags);
+
+/* Flush and unmount `vol`, releasing everything it holds (caches, FAT,
+ * device). `vol` is freed; NULL is ignored. Descriptors open on it must
+ * be closed first (file_close_all).*/
+void fat32_close(fat32_volume *vol);
 
-/* Close the opened FAT image and release any resources held by the
- * FAT32 subsystem (close file handles, free caches, etc.). Safe to call
- * even if `fat32_init` previously failed.*/
-void fat32_close();
+/* Write any modified FAT sectors back to all `bpb.num_fats` copies on
+ * disk. The FAT is held in memory after `fat32_init`, so changes made
+ * through `fat_set_entry` only reach the image here or in `fat32_close`.
+ * With a journal this is a checkpoint: everything is committed, written
+ * to the image and synced, and the journal emptied. Not to be called
+ * inside a transaction. Returns true on success. */
+bool fat32_flush(fat32_volume *vol);
+
+/* Make every operation completed so far durable: one group commit of the
+ * journal, shared with any other thread committing at the same time, or
+ * `fat32_flush` on a volume without a journal. Not to be called inside
+ * a transaction. Returns true on success. */
+bool fat32_commit(fat32_volume *vol);
+
+/* Bracket an operation made of several metadata changes (say, allocating
+ * clusters and then updating the directory entry) so that the journal
+ * commits all of it or none of it. Brackets nest. The functions below
+ * that change metadata bracket themselves; callers only need this to
+ * group several of them. Take no directory lock before `fat_txn_begin`.
+ * No-ops without a journal. */
+void fat_txn_begin(fat32_volume *vol);
+void fat_txn_end(fat32_volume *vol);
 
 // Cluster <-> Byte offset functions
 /* Convert a cluster number to a byte offset within the image file.
  * The returned offset points to the first byte of the given cluster's
  * data area (i.e., start of that cluster in the image file). */
-uint32_t cluster_to_offset(uint32_t cluster);
+uint64_t cluster_to_offset(fat32_volume *vol, uint32_t cluster);
 
 /* Read the raw bytes of `cluster` into `buffer` which must be at least
- * `cluster_size` bytes long. Returns 0 on success, non-zero on error.
+ * `vol->cluster_size` bytes long. Returns 0 on success, non-zero on error.
  */
-int read_cluster_bytes(uint32_t cluster, uint8_t *buffer);
+int read_cluster_bytes(fat32_volume *vol, uint32_t cluster, uint8_t *buffer);
+
+/* Return a pointer to the `vol->cluster_size` bytes of `cluster` inside the
+ * mapped image, without copying. Writes through the pointer reach the
+ * image at the next `fat32_flush` (msync). Returns NULL when the image
+ * is not mapped (a backend other than BDEV_MMAP is in use) or `cluster` is invalid;
+ * callers then fall back to `read_cluster_bytes`.*/
+const uint8_t *fat_cluster_data(fat32_volume *vol, uint32_t cluster);
 
 
 // FAT table access
 /* Read the FAT entry for `cluster` and return its value.
  * The returned value is the next cluster in the chain, or a special
- * end-of-chain marker. Caller must ensure FAT is initialized.*/
-uint32_t fat_get_entry(uint32_t cluster);
+ * end-of-chain marker. Served from the in-memory FAT loaded at init;
+ * clusters outside the FAT read as end-of-chain.*/
+uint32_t fat_get_entry(fat32_volume *vol, uint32_t cluster);
+
+/* Copy the FAT entries of clusters [first, first + count) into `out`,
+ * under a single hold of the FAT lock; entries past the end of the FAT
+ * read as end-of-chain. For whole-table scans, which would otherwise pay
+ * for the lock on every `fat_get_entry`.*/
+void fat_get_entries(fat32_volume *vol, uint32_t first, size_t count, uint32_t *out);
 
 /* Write `value` into the FAT entry for `cluster`.
- * Use this to create/extend/truncate cluster chains. Returns nothing
- * but callers should ensure proper synchronization if needed.*/
-void fat_set_entry(uint32_t cluster, uint32_t value);
+ * Use this to create/extend/truncate cluster chains. Only the in-memory
+ * FAT is updated; the sector is marked dirty and written to every mirror
+ * by `fat32_flush`. Callers should ensure proper synchronization if needed.*/
+void fat_set_entry(fat32_volume *vol, uint32_t cluster, uint32_t value);
 
 // Cluster chain utilities
 /* Find a free cluster in the FAT and return its cluster number.
+ * Uses a free-cluster bitmap (built from the cached FAT on first use)
+ * and searches next-fit from the FSInfo next-free hint. The cluster is
+ * not reserved until the caller links it with `fat_set_entry`.
  * Returns 0 on failure (no free clusters) or the cluster index (>0).*/
-uint32_t fat_find_free_cluster();
+uint32_t fat_find_free_cluster(fat32_volume *vol);
+
+/* Return the number of free clusters on the volume. Seeded from FSInfo
+ * at init and kept current by `fat_set_entry`; returns 0xFFFFFFFF if
+ * FSInfo had no valid count and no allocation has happened yet. The
+ * count and next-free hint are written back to FSInfo by `fat32_flush`. */
+uint32_t fat_free_count(fat32_volume *vol);
+
+struct FatStats;
+
+/* Count free, used and bad clusters, measure the runs of free clusters
+ * and count fragment boundaries in one vectorized pass over the cached
+ * FAT (fatscan.h). Returns false if the FAT is not loaded. */
+bool fat_stats(fat32_volume *vol, struct FatStats *out);
+
+/* Return the first cluster of the lowest run of at least `need` free
+ * clusters, or 0 if there is none. Nothing is reserved. */
+uint32_t fat_find_free_run(fat32_volume *vol, uint32_t need);
 
 /* Build and return the cluster chain starting at `start_cluster`.
  * Allocates and returns an array of cluster numbers; the number of
  * entries is stored in `*count`. Caller is responsible for freeing
  * the returned array (if non-NULL).*/
-uint32_t *fat_get_chain(uint32_t start_cluster, size_t *count);
+uint32_t *fat_get_chain(fat32_volume *vol, uint32_t start_cluster, size_t *count);
+
+/* Build the chain starting at `start_cluster` as runs of contiguous
+ * clusters, in a single pass over the cached FAT. Fills `*chain`, which
+ * must be released with `fat_chain_free`. Returns false (with `*chain`
+ * empty) if the chain links to a free or out-of-range cluster or loops.*/
+bool fat_get_chain_extents(fat32_volume *vol, uint32_t start_cluster, FatChain *chain);
+
+/* Release the memory held by `chain` and reset it to empty. */
+void fat_chain_free(FatChain *chain);
+
+/* Return the index into `chain->runs` of the run holding the `index`-th
+ * cluster of the chain. O(log runs); `index` must be < cluster_count. */
+size_t fat_chain_find_run(const FatChain *chain, size_t index);
+
+/* Return the cluster number at position `index` of the chain, or 0 if
+ * `index` is past the end. O(log runs).*/
+uint32_t fat_chain_cluster_at(const FatChain *chain, size_t index);
+
+/* Translate byte `offset` within the data of `chain` into an absolute
+ * byte offset in the image, stored in `*disk_offset`. Returns false if
+ * the offset lies beyond the last cluster of the chain. O(log runs).*/
+bool fat_chain_offset(fat32_volume *vol, const FatChain *chain, uint64_t offset, uint64_t *disk_offset);
+
+/* Read `len` bytes starting at byte `offset` of the data of `chain` into
+ * `buf`. Each run of contiguous clusters is one device read straight
+ * into `buf`, so partial head and tail clusters cost no extra copy.
+ * Dirty clusters still in the buffer cache take precedence over the
+ * image. Returns false on I/O error or if the range passes the end of
+ * the chain.*/
+bool fat_chain_read(fat32_volume *vol, const FatChain *chain, uint64_t offset, size_t len, void *buf);
+
+/* Ask the device to start reading clusters [first, first + count) of
+ * `chain` (clamped to its length), one hint per contiguous run. */
+void fat_chain_prefetch(fat32_volume *vol, const FatChain *chain, size_t first, size_t count);
+
+/* Tell the read-ahead state `ra` of a directory walk that it has reached
+ * `cluster`, the `index`-th cluster of the directory. Prefetches further
+ * along the chain (followed through the in-memory FAT) when due. */
+void fat_dir_readahead(fat32_volume *vol, ReadAhead *ra, uint32_t cluster, size_t index);
+
+/* Write `len` bytes from `buf` at byte `offset` of the data of `chain`,
+ * one device write per run of contiguous clusters. Cached copies of the
+ * clusters are updated to match. Returns false on I/O error or if the
+ * range passes the end of the chain.*/
+bool fat_chain_write(fat32_volume *vol, const FatChain *chain, uint64_t offset, size_t len, const void *buf);
+
+/* Append `count` extents (as returned by `fat_extend_chain_extents`) to
+ * `chain`, merging with its last run when contiguous. Returns false if
+ * out of memory, leaving `chain` unchanged.*/
+bool fat_chain_append(FatChain *chain, const FatExtent *extents, size_t count);
+
+/* Read `len` bytes at byte `offset` of the file whose data starts at
+ * `start_cluster` (see `fat_chain_read`). Walks the chain once; callers
+ * reading the same file repeatedly should keep a FatChain instead.*/
+bool read_file_range(fat32_volume *vol, uint32_t start_cluster, uint64_t offset, size_t len, void *buf);
 
 /* Extend the chain that begins at `start_cluster` by allocating
  * `additional_clusters_needed` free clusters and linking them.
+ * Clusters are handed out in the largest contiguous runs available,
+ * continuing directly after the current tail when possible.
  * Returns true on success, false on failure (insufficient free clusters).*/
-bool fat_extend_chain(uint32_t start_cluster, size_t additional_clusters_needed);
+bool fat_extend_chain(fat32_volume *vol, uint32_t start_cluster, size_t additional_clusters_needed);
+
+/* Same as `fat_extend_chain`, but returns the newly linked clusters as
+ * extents in chain order; the number of extents is stored in
+ * `*extent_count`. Pass `start_cluster` 0 to allocate a new chain, whose
+ * first cluster is `extents[0].start`. The allocation is all-or-nothing.
+ * Caller frees the returned array; NULL on failure or if nothing was
+ * requested.*/
+FatExtent *fat_extend_chain_extents(fat32_volume *vol, uint32_t start_cluster, size_t additional_clusters_needed,
+                                    size_t *extent_count);
 
 /* Free (release) all clusters in the chain starting at `start_cluster`.
  * Marks each cluster in the chain as free in the FAT. Returns true on
  * success, false on failure.*/
-bool fat_free_chain(uint32_t start_cluster);
+bool fat_free_chain(fat32_volume *vol, uint32_t start_cluster);
+
 
+// Locking
+/* The FAT and free-space state of a volume are guarded by its own reader-writer
+ * lock, so the functions above may be called from any thread. Directory
+ * contents are guarded by per-directory reader-writer locks (striped by
+ * the directory's first cluster): the functions below take them, shared
+ * for lookups and iteration and exclusive for `write_dir_entry` and
+ * `create_dir_entry`. Callers that must see a directory unchanged across
+ * several calls (e.g. a lookup followed by caching its result) can hold
+ * the lock themselves; shared holds nest. Don't ask for an exclusive
+ * directory lock while holding any directory lock: locks are striped,
+ * so two directories may share one. Locks are per volume; separate
+ * volumes never contend. */
+void dir_lock_shared(fat32_volume *vol, uint32_t dir_cluster);
+void dir_lock_exclusive(fat32_volume *vol, uint32_t dir_cluster);
+void dir_unlock(fat32_volume *vol, uint32_t dir_cluster);
 
 // Directory reading/writing utilities
 /* Read directory entries from the directory starting at `cluster`.
@@ -125,26 +340,53 @@ bool fat_free_chain(uint32_t start_cluster);
  *  - max_entries: capacity of the `entries` buffer
  *  - out_count: pointer to size_t to receive the number of entries read
  * Returns true on success, false on error. */
-bool read_directory_cluster(uint32_t cluster, DirEntry *entries, size_t max_entries, size_t *out_count);
+bool read_directory_cluster(fat32_volume *vol, uint32_t cluster, DirEntry *entries, size_t max_entries, size_t *out_count);
 
 /* Search a directory for an entry matching `name` (8.3 format or plain
- * user input — implementation may call `format_name_83`). If found,
- * copy the DirEntry into `out_entry` and write the entry byte-offset
- * (relative to the start of the directory cluster area) into `entry_offset`.
+ * user input — converted once with `format_name_83`) or a VFAT long
+ * name (matched case-insensitively). If found,
+ * copy the DirEntry into `out_entry` and write the entry's absolute byte
+ * offset in the image into `entry_offset`. Uses the directory's hash
+ * index (see dirindex.h), building it on first use.
  * Returns true if found, false if not found or on error.*/
-bool find_dir_entry(uint32_t cluster, const char *name, DirEntry *out_entry, uint32_t *entry_offset);
+bool find_dir_entry(fat32_volume *vol, uint32_t cluster, const char *name, DirEntry *out_entry, uint64_t *entry_offset);
 
-/* Overwrite an existing directory entry at `entry_offset` (within the
- * given directory cluster) with the data from `entry`. Returns true on
- * success.*/
-bool write_dir_entry(uint32_t cluster, uint32_t entry_offset, const DirEntry *entry);
+/* Like `find_dir_entry`, but report only the entry's first cluster and
+ * DIR_Attr, which an indexed directory answers without reading the
+ * entry itself. Either pointer may be NULL. */
+bool find_dir_child(fat32_volume *vol, uint32_t cluster, const char *name, uint32_t *first_cluster, uint8_t *attr);
+
+/* Overwrite an existing directory entry at `entry_offset` (as returned
+ * by `find_dir_entry`) with the data from `entry`. `cluster` must be the
+ * first cluster of the directory holding the entry, so its name index
+ * can be updated. Returns true on success.*/
+bool write_dir_entry(fat32_volume *vol, uint32_t cluster, uint64_t entry_offset, const DirEntry *entry);
+
+/* Read the directory entry at image byte offset `entry_offset` (as
+ * returned by `find_dir_entry`) in the directory starting at `cluster`,
+ * through the buffer cache. Returns true on success.*/
+bool read_dir_entry(fat32_volume *vol, uint32_t cluster, uint64_t entry_offset, DirEntry *out_entry);
 
 /* Create a new directory entry `new_entry` inside the directory at
  * `cluster`. Finds a free slot and writes the entry. Returns true on success.*/
-bool create_dir_entry(uint32_t cluster, const DirEntry *new_entry);
+bool create_dir_entry(fat32_volume *vol, uint32_t cluster, const DirEntry *new_entry);
+
+/* Create the `count` entries `new_entries` inside the directory at
+ * `cluster`, in order, filling free slots in a single pass over the
+ * directory. Returns how many were created; fewer than `count` only on
+ * error (e.g. no space to grow the directory). */
+size_t create_dir_entries(fat32_volume *vol, uint32_t cluster, const DirEntry *new_entries, size_t count);
+
+/* Create an empty subdirectory with 8.3 name `name` (as packed by
+ * `format_name_83`) in the directory at `parent`: a zeroed cluster
+ * holding "." and "..", and its entry in `parent`, as one transaction.
+ * The caller checks that the name is free. Stores the new directory's
+ * cluster in `*cluster_out`. Returns true on success.*/
+bool create_directory(fat32_volume *vol, uint32_t parent, const char name[11], uint32_t *cluster_out);
 
 // Name handling helpers (8.3 filename support)
 /* Convert a user-supplied filename to the FAT 8.3 on-disk format.
+ * "." and ".." map to the literal dot entries.
  * Writes exactly 11 bytes into `out` (no NUL). Returns true on success
  * or false for invalid input.*/
 bool format_name_83(const char *input, char out[11]);
@@ -154,6 +396,39 @@ bool format_name_83(const char *input, char out[11]);
  * match.*/
 bool compare_name_83(const char entry_name[11], const char *input);
 
+/* Start iterating the directory whose first cluster is `dir_cluster`.
+ * The directory is locked shared until `dir_iter_close` (or until
+ * `dir_iter_next` returns false), so entries can't change under the
+ * iterator. Returns false on error; `dir_iter_close` is safe to call
+ * either way.*/
+bool dir_iter_open(fat32_volume *vol, DirIter *it, uint32_t dir_cluster);
+
+/* Advance to the next short entry. Returns false at the end of the
+ * directory (0x00 marker or end of chain) or on error, which sets
+ * `it->error`.*/
+bool dir_iter_next(DirIter *it);
+
+/* Release the cluster held by the iterator. */
+void dir_iter_close(DirIter *it);
+
+/* Checksum of an 11-byte short name, as stored in its LFN entries. */
+uint8_t lfn_checksum(const char short_name[11]);
+
+/* Decode UTF-8 `name` into at most `max` UTF-16 units in `out`, folded
+ * to upper case the way names are compared. Returns the unit count, 0 if
+ * `name` is not valid UTF-8 or too long. */
+size_t fold_name_utf8(const char *name, uint16_t *out, size_t max);
+
+/* Fold `len` UTF-16 units of `name` in place, as `fold_name_utf8`. */
+void fold_name_utf16(uint16_t *name, size_t len);
+
+/* 64-bit FNV-1a hash of a folded name, for name-keyed caches. */
+uint64_t hash_folded_name(const uint16_t *name, size_t len);
+
+/* Render a UTF-16 long name of `len` units as a NUL-terminated UTF-8
+ * string in `out` (truncated to `out_size`). */
+void format_long_name(const uint16_t *name, size_t len, char *out, size_t out_size);
+
 /* Return true if `entry` is the end-of-directory marker (first byte == 0x00).
  * According to FAT spec, a directory entry whose first name byte is 0x00
  * indicates there are no further entries in this directory.
@@ -0,0 +1,51 @@
+#ifndef FATSCAN_H
+#define FATSCAN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "fat.h"
+
+// Vector kernels over an in-memory FAT (an array of 32-bit entries). One
+// pass tests 8 entries per instruction with AVX2, 4 with SSE2, or one at
+// a time with the scalar fallback, and packs the free entries into a
+// bitmap 64 clusters to a word; runs of free clusters are then measured
+// with bit scans instead of entry by entry. The kernel is picked on first
+// use from what the CPU supports. These functions only read `table`; the
+// callers in fat.c hold the FAT lock around them.
+
+#define FAT_RUN_BUCKETS 29  // free-run histogram: bucket k counts runs of [2^k, 2^(k+1)) clusters
+
+typedef struct FatStats
+{
+    uint64_t free_clusters;
+    uint64_t used_clusters;     // anything not free, bad entries included
+    uint64_t bad_clusters;      // marked bad (0x0FFFFFF7)
+    uint64_t links;             // entries pointing at another cluster
+    uint64_t breaks;            // links to a cluster other than the next one: fragment boundaries
+    uint32_t first_free;        // 0 if the volume is full
+    FatExtent largest_run;      // longest run of free clusters
+    uint64_t free_runs;
+    uint64_t run_histogram[FAT_RUN_BUCKETS];
+} FatStats;
+
+/* Gather statistics over clusters [2, limit) of `table`. */
+void fat_scan_stats(const uint32_t *table, uint32_t limit, FatStats *out);
+
+/* Return the first cluster of the first run of at least `need` free
+ * clusters in [from, limit), or 0 if there is none. */
+uint32_t fat_scan_free_run(const uint32_t *table, uint32_t from, uint32_t limit, uint32_t need);
+
+/* Set bit c of `bits` (word c / 64) for every free cluster c in [2, limit)
+ * and clear every other bit; `bits` holds (limit + 63) / 64 words.
+ * Returns the number of free clusters. */
+uint32_t fat_scan_free_bits(const uint32_t *table, uint32_t limit, uint64_t *bits);
+
+/* Name of the kernel in use: "avx2", "sse2" or "scalar". */
+const char *fat_scan_kernel(void);
+
+/* Switch to the kernel called `name`, for benchmarks and comparisons.
+ * Returns false (and changes nothing) if this CPU or build lacks it. */
+bool fat_scan_use(const char *name);
+
+#endif // FATSCAN_H
@@ -0,0 +1,107 @@
+#ifndef FILE_H
+#define FILE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "fat.h"
+#include "dir.h"
+
+#define MAX_NUM_FILES 10 //maximum number of open files
+
+// open modes (bit flags)
+#define FILE_MODE_READ  0x1
+#define FILE_MODE_WRITE 0x2
+
+typedef enum
+{
+    FILE_OK = 0,
+    FILE_ERR_NOT_FOUND = -1,
+    FILE_ERR_IS_DIR = -2,
+    FILE_ERR_ALREADY_OPEN = -3,
+    FILE_ERR_TABLE_FULL = -4,
+    FILE_ERR_BAD_MODE = -5,
+    FILE_ERR_NOT_OPEN = -6,
+    FILE_ERR_IO = -7,
+    FILE_ERR_RANGE = -8,
+    FILE_ERR_NO_SPACE = -9,
+    FILE_ERR_TOO_BIG = -10
+} FileError;
+
+// One slot of the open-file table. The file's cluster chain is read
+// once at open and kept as extents, so positioning is a binary search
+// over runs and sequential access only steps the cursor.
+typedef struct
+{
+    bool     in_use;
+    fat32_volume *vol;          // volume the file lives on
+    char     name[256];         // name as given to open
+    char     path[256];         // working directory at open time
+    int      mode;              // FILE_MODE_* bits
+    uint32_t dir_cluster;       // directory holding the entry
+    uint64_t entry_offset;      // image byte offset of the entry
+    uint32_t start_cluster;     // 0 for an empty file
+    uint32_t size;
+    FatChain chain;
+    uint64_t offset;            // current position
+
+    // cursor: the chain run and cluster index holding `offset`
+    size_t   cur_run;
+    size_t   cur_index;
+
+    ReadAhead ra;               // sequential-read detection for this descriptor
+} OpenFile;
+
+/* Parse an open mode string ("-r", "-w", "-rw" or "-wr") into
+ * FILE_MODE_* bits. Returns 0 for anything else. */
+int file_parse_mode(const char *flags);
+
+/* Open the regular file at `path` on `vol`, resolved from the working
+ * directory of `session`, with `mode`. Returns the descriptor (>= 0) or
+ * a negative FileError. The table is shared by all volumes, sessions and
+ * threads; every function here is thread-safe, and calls on different
+ * descriptors run in parallel. */
+int file_open_at(fat32_volume *vol, const DirSession *session, const char *path, int mode);
+
+/* Close descriptor `fd`. Returns FILE_OK or FILE_ERR_NOT_OPEN. */
+int file_close(int fd);
+
+/* Close every descriptor open on `vol`, before unmounting it. */
+void file_close_all(fat32_volume *vol);
+
+/* Return the descriptor of the open file named `name` (as given to
+ * open), or FILE_ERR_NOT_OPEN. */
+int file_find(const char *name);
+
+/* Return the table slot of `fd`, or NULL if it is not open. Not
+ * synchronized; for inspection while no other thread uses `fd`. */
+const OpenFile *file_get(int fd);
+
+/* Move the position of `fd` to `offset`, which may not exceed the file
+ * size. O(log runs). Returns FILE_OK or a negative FileError. */
+int file_lseek(int fd, uint64_t offset);
+
+/* Read up to `len` bytes at the current position of `fd` into `buf` and
+ * advance the position. Returns the number of bytes read (0 at end of
+ * file) or a negative FileError. */
+long file_read(int fd, void *buf, size_t len);
+
+/* Write `len` bytes from `buf` at the current position of `fd` and
+ * advance the position, growing the file as needed. All clusters the
+ * write needs are allocated in one call before any data is written,
+ * the data goes out in one device write per contiguous run, and the
+ * directory entry (size, first cluster) is updated once at the end.
+ * Returns `len` or a negative FileError; on error the file is unchanged
+ * apart from bytes already overwritten within its old size. */
+long file_write(int fd, const void *buf, size_t len);
+
+/* Write at the end of the file, whatever the current position. */
+long file_append(int fd, const void *buf, size_t len);
+
+/* Print the open-file table. */
+void file_lsof(void);
+
+/* Message for a FileError. */
+const char *file_strerror(int err);
+
+#endif // FILE_H
@@ -0,0 +1,51 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "fat.h"
+
+// Whole-volume consistency check. Every directory reachable from the
+// root is walked and every chain it references is followed through the
+// FAT and claimed in a shared cluster-ownership bitmap, which is what
+// finds broken chains, cross-linked clusters (claimed twice) and, in a
+// second pass over the FAT, lost clusters (allocated but never claimed).
+// The FAT copies on disk are compared sector by sector.
+//
+// Directories are tasks for a pool of worker threads: each worker keeps
+// its own deque of subdirectories found so far and steals from the
+// others when it runs dry, so wide and deep trees both keep every core
+// busy. The volume should not be modified while a check runs.
+
+typedef struct
+{
+    uint32_t directories;       // reachable directories, root excluded
+    uint32_t files;
+    uint64_t used_clusters;     // clusters claimed by reachable chains
+    uint32_t bad_chains;        // chains that hit a free, bad or out-of-range cluster, or loop
+    uint32_t cross_linked;      // clusters claimed by more than one chain
+    uint32_t size_mismatches;   // file size disagrees with its chain length
+    uint32_t lost_clusters;     // allocated in the FAT but not reachable
+    uint32_t free_clusters;     // free entries counted in the FAT
+    uint32_t free_reported;     // fat_free_count() at the start, 0xFFFFFFFF if unknown
+    uint32_t mirror_mismatches; // sectors of a FAT mirror that differ from the first FAT
+    uint32_t io_errors;
+    unsigned threads;
+    double   seconds;
+} FsckReport;
+
+/* Called for every entry found by the walk (deleted slots, LFN fragments,
+ * volume labels and the dot entries are skipped), from any worker thread
+ * and concurrently; `dir_cluster` is the directory holding it. */
+typedef void (*FsckVisit)(fat32_volume *vol, uint32_t dir_cluster, const DirEntry *entry, void *ctx);
+
+/* Check `vol` with `threads` workers (0 = one per online CPU). `visit`
+ * may be NULL; with a callback the check doubles as a parallel scan of
+ * every entry on the volume. Fills `*report` and returns true if no
+ * problem was found. */
+bool fsck_run(fat32_volume *vol, unsigned threads, FsckVisit visit, void *ctx, FsckReport *report);
+
+/* Print `report` as a human-readable summary. */
+void fsck_print(const FsckReport *report);
+
+#endif // FSCK_H
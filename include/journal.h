@@ -0,0 +1,104 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Write-ahead journal for metadata, kept in a sidecar file next to the
+// image (IMAGE.journal). FAT entry changes, directory entry writes and
+// directory cluster zeroing are logged as redo records when they are made
+// in memory; the buffer cache and the cached FAT then hold the changed
+// blocks until the records describing them are durable in the journal.
+//
+// Operations run as handles (fat_txn_begin/fat_txn_end in fat.h) and all
+// handles between two commits form one transaction, so a transaction only
+// ever holds whole operations. A commit waits for the handles in flight,
+// closes the running transaction, lets new handles start on the next one
+// and writes the closed one with a single write and fdatasync. Commits
+// happen when a transaction grows past a size limit, every
+// JOURNAL_COMMIT_MS from a background thread, or on request; callers that
+// ask while another commit is writing wait for it and share its fsync.
+//
+// A checkpoint (fat32_flush) writes all committed state to the image,
+// syncs it and empties the journal; the commit thread checkpoints once
+// the journal file passes JOURNAL_CHECKPOINT_BYTES. fat32_init replays
+// the complete transactions of a journal left by a crash before anything
+// else reads the volume.
+//
+// Lock order: the journal mutex is innermost; nothing else is taken while
+// holding it. A handle must not be started while holding a directory
+// lock or the FAT lock, because a commit waiting for handles would then
+// wait for that lock's owner.
+
+struct fat32_volume;
+
+#define JOURNAL_COMMIT_MS 500               // longest a completed operation waits for its commit
+#define JOURNAL_COMMIT_BYTES (1u << 20)     // commit once a transaction's records pass this
+#define JOURNAL_CHECKPOINT_BYTES (16u << 20) // checkpoint once the journal file passes this
+
+/* Called by `journal_replay` for every logged FAT entry change. */
+typedef void (*JournalFatFn)(struct fat32_volume *vol, uint32_t cluster, uint32_t value);
+
+/* Replay the sidecar journal of the image at `img_path`, if there is one:
+ * FAT changes go to `fat_fn` (the caller writes the FAT out afterwards),
+ * data and zeroing records go straight to the image. Stops at the first
+ * incomplete or damaged transaction. Returns the number of transactions
+ * applied, 0 if there was no journal, or -1 on error. */
+int journal_replay(struct fat32_volume *vol, const char *img_path, JournalFatFn fat_fn);
+
+/* Delete the sidecar journal of `img_path`, once it has been replayed
+ * and the image synced. */
+void journal_remove(const char *img_path);
+
+/* Start journaling `vol` to a new, empty sidecar journal and the commit
+ * thread. A transaction is also committed once it has dirtied
+ * `max_blocks` clusters, so the buffer cache always has clean slots.
+ * Returns false if the journal can't be created. */
+bool journal_open(struct fat32_volume *vol, const char *img_path, size_t max_blocks);
+
+/* Stop the commit thread and close the journal. When `clean` (a
+ * checkpoint just succeeded) the sidecar file is deleted. */
+void journal_close(struct fat32_volume *vol, bool clean);
+
+/* Start and end a handle: the changes made in between land in a single
+ * transaction. Nests within one thread. No-ops without a journal. Ending
+ * the outermost handle wakes the commit thread when the transaction is
+ * due, and commits on the spot if that thread is falling behind. */
+void journal_begin(struct fat32_volume *vol);
+void journal_end(struct fat32_volume *vol);
+
+/* Log a change made inside a handle: FAT entry `cluster` set to `value`,
+ * `len` bytes of new data at image offset `off`, or `len` zero bytes at
+ * `off`. FAT changes that continue the previous one (the next cluster
+ * linked onward, or set to the same value) extend its record. */
+void journal_log_fat(struct fat32_volume *vol, uint32_t cluster, uint32_t value);
+void journal_log_data(struct fat32_volume *vol, uint64_t off, const void *data, size_t len);
+void journal_log_zero(struct fat32_volume *vol, uint64_t off, size_t len);
+
+/* Note that file data was written to the image directly; the next commit
+ * syncs the image first, so committed metadata never points at data
+ * that is not on disk. */
+void journal_note_data(struct fat32_volume *vol);
+
+/* Sequence number of the running transaction: the one changes made now
+ * belong to. 0 without a journal. */
+uint64_t journal_running_seq(struct fat32_volume *vol);
+
+/* True if transaction `seq` is durable, so blocks it changed may be
+ * written to the image. Always true for 0 and without a journal. */
+bool journal_durable(struct fat32_volume *vol, uint64_t seq);
+
+/* Commit the running transaction and wait until it is durable. Must not
+ * be called inside a handle. Returns false on I/O error. */
+bool journal_commit(struct fat32_volume *vol);
+
+/* Checkpoint bracket. `journal_checkpoint_begin` waits for the handles in
+ * flight, holds off new ones and commits everything; the caller then
+ * writes the FAT and cache to the image and syncs it, and
+ * `journal_checkpoint_end` empties the journal if `ok` and lets handles
+ * start again. */
+void journal_checkpoint_begin(struct fat32_volume *vol);
+void journal_checkpoint_end(struct fat32_volume *vol, bool ok);
+
+#endif // JOURNAL_H
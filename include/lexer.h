@@ -3,13 +3,47 @@
 #include <stdlib.h>
 #include <stdbool.h>
 
+/* Shell input, read from a file descriptor in large blocks. Lines are
+ * handed out in place, NUL-terminated inside the buffer, and stay valid
+ * until the next call to reader_next. */
 typedef struct {
-    char ** items;
+    int fd;
+    char *buf;
+    size_t cap;     // buffer size, not counting the byte kept for a final NUL
+    size_t start;   // first byte not yet handed out
+    size_t end;     // end of the bytes read so far
+    bool eof;
+} LineReader;
+
+void reader_init(LineReader *r, int fd);
+/* Next line without its newline, or NULL at end of input or on a read
+ * error. `len` (if not NULL) receives its length. */
+char *reader_next(LineReader *r, size_t *len);
+/* True if reader_next can return without reading: a whole line, or the
+ * end of input, is already buffered. */
+bool reader_ready(const LineReader *r);
+void reader_free(LineReader *r);
+
+/* Bump allocator for the scratch memory of one command; arena_reset
+ * releases everything at once and keeps the largest block for reuse. */
+typedef struct ArenaBlock ArenaBlock;
+typedef struct {
+    ArenaBlock *head;
+} Arena;
+
+void *arena_alloc(Arena *a, size_t n);
+void arena_reset(Arena *a);
+void arena_free(Arena *a);
+
+typedef struct {
+    char ** items;  // NULL terminated
     size_t size;
+    char *end;      // end of the line the items point into
 } tokenlist;
 
-char * get_input(void);
-tokenlist * get_tokens(char *input);
-tokenlist * new_tokenlist(void);
-void add_token(tokenlist *tokens, char *item);
-void free_tokens(tokenlist *tokens);
+/* Split `input` on spaces in place: separators become NULs and the items
+ * point into `input`. The list itself comes from `arena`. */
+tokenlist * get_tokens(Arena *arena, char *input, size_t len);
+/* Undo the splitting from item `i` to the end of the line and return the
+ * raw text starting at item `i`. */
+char * token_rest(tokenlist *tokens, size_t i);
@@ -0,0 +1,102 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Performance counters for the FAT core. Built in when FAT_PERF is
+// defined (the Makefile does so unless PERF=0); otherwise the PERF_*
+// macros expand to nothing and perf.c is empty, so instrumented code
+// costs nothing.
+//
+// Every thread counts into its own block, found through a thread-local
+// pointer, so counting takes no lock and shares no cache line; a
+// snapshot adds the blocks up. The counters are process-wide: with
+// several volumes mounted they hold the sum over all of them.
+
+typedef enum
+{
+    PERF_FAT_GET,       // FAT entries read through fat_get_entry/fat_get_entries
+    PERF_FAT_SET,       // FAT entries changed
+    PERF_READS,         // block device reads; each is followed by its byte count
+    PERF_READ_BYTES,
+    PERF_WRITES,        // block device writes
+    PERF_WRITE_BYTES,
+    PERF_SEEKS,         // I/O not starting where the thread's previous one ended
+    PERF_DIR_SCANNED,   // directory entries examined by find_dir_entry
+    PERF_FREE_PROBED,   // clusters passed over by fat_find_free_cluster
+    PERF_COUNTERS
+} PerfCounter;
+
+#define PERF_HIST_BUCKETS 32    // bucket k: [2^k, 2^(k+1)) microseconds; bucket 0 includes less
+
+/* Wall-time histogram, for callers that time operations themselves. Not
+ * thread-safe. */
+typedef struct
+{
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[PERF_HIST_BUCKETS];
+} PerfHist;
+
+#ifdef FAT_PERF
+
+typedef struct PerfThread
+{
+    uint64_t count[PERF_COUNTERS];
+    uint64_t next_off;          // where a sequential I/O would start
+    struct PerfThread *next;    // internal
+    struct PerfThread *prev;
+} PerfThread;
+
+extern __thread PerfThread *perf_self;
+
+/* Give the calling thread its counter block. NULL if out of memory. */
+PerfThread *perf_thread_register(void);
+
+static inline void perf_add(PerfCounter c, uint64_t n)
+{
+    PerfThread *t = perf_self ? perf_self : perf_thread_register();
+    if(t) __atomic_store_n(&t->count[c], t->count[c] + n, __ATOMIC_RELAXED);
+}
+
+/* One block device transfer of `len` bytes at `off`. */
+static inline void perf_io(bool write, uint64_t off, size_t len)
+{
+    PerfThread *t = perf_self ? perf_self : perf_thread_register();
+    if(!t) return;
+    PerfCounter ops = write ? PERF_WRITES : PERF_READS;
+    __atomic_store_n(&t->count[ops], t->count[ops] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&t->count[ops + 1], t->count[ops + 1] + len, __ATOMIC_RELAXED);
+    if(off != t->next_off)
+        __atomic_store_n(&t->count[PERF_SEEKS], t->count[PERF_SEEKS] + 1, __ATOMIC_RELAXED);
+    t->next_off = off + len;
+}
+
+#define PERF_ADD(counter, n) perf_add((counter), (n))
+#define PERF_IO(write, off, len) perf_io((write), (off), (len))
+
+/* Sum of every thread's counters since the last `perf_reset`. */
+void perf_snapshot(uint64_t out[PERF_COUNTERS]);
+
+/* Start counting again from zero. */
+void perf_reset(void);
+
+/* Name of a counter, as printed by the shell and used as its JSON key. */
+const char *perf_counter_name(PerfCounter c);
+
+/* Monotonic clock in nanoseconds, for timing into a PerfHist. */
+uint64_t perf_now_ns(void);
+
+void perf_hist_add(PerfHist *h, uint64_t ns);
+
+#else
+
+#define PERF_ADD(counter, n) ((void)0)
+#define PERF_IO(write, off, len) ((void)0)
+
+#endif // FAT_PERF
+
+#endif // PERF_H
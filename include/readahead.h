@@ -0,0 +1,37 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Read-ahead policy for a stream of cluster accesses (an open file or a
+// directory walk). Positions are cluster indexes within the stream, not
+// cluster numbers; the caller maps them onto its chain and issues the
+// prefetch (see fat_chain_prefetch and fat_dir_readahead in fat.h).
+//
+// An access that starts where the previous one ended (or in the same
+// cluster) is sequential and arms a window of RA_MIN_WINDOW clusters.
+// Whenever less than half a window is left prefetched ahead of the
+// stream, the next window is issued, doubled if every access since the
+// last one was sequential. A seek halves the window and a few seeks in a
+// row switch read-ahead off until the stream turns sequential again.
+
+typedef struct
+{
+    uint64_t next;      // index a sequential access would start at
+    uint64_t issued;    // clusters before this index have been prefetched
+    uint32_t window;    // current depth in clusters; 0 = off
+    uint32_t hits;      // sequential accesses since the last window
+    uint32_t misses;    // seeks since the last window
+} ReadAhead;
+
+/* Start a new stream with read-ahead off. */
+void ra_reset(ReadAhead *ra);
+
+/* Record an access to clusters [first, first + count) of the stream,
+ * whose clusters are `cluster_size` bytes (this caps the window). If a
+ * prefetch is due, stores its first index in `*from` and returns the
+ * number of clusters to prefetch; otherwise returns 0. */
+size_t ra_access(ReadAhead *ra, uint64_t first, size_t count, uint32_t cluster_size, uint64_t *from);
+
+#endif // READAHEAD_H
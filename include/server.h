@@ -0,0 +1,92 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "fat.h"
+
+// Local server: one process keeps a volume mounted, its FAT and caches
+// warm, and serves clients over a Unix domain stream socket.
+//
+// One thread runs an epoll loop that does all socket I/O. Once a client
+// has sent at least one whole request, the loop stops reading from it and
+// queues it for the worker pool; a worker runs every whole request
+// buffered for that client, in order, and hands the responses back to the
+// loop to send. Until they are sent nothing more is read from the client,
+// so a client that does not read its responses only stalls itself.
+// Each client has its own working directory, starting at the root.
+//
+// Wire format, all integers little-endian. Every request and response is
+// a 12-byte header followed by `len` payload bytes:
+//
+//     u32 len      payload bytes after the header
+//     u16 op       SRV_OP_*; a response repeats its request's op
+//     u16 status   0 in requests; SRV_OK or an error in responses
+//     u32 tag      chosen by the client, repeated in the response
+//
+// Request payloads, paths relative to the client's working directory
+// unless they start with '/':
+//
+//     SRV_OP_LS     path (empty for the working directory)
+//     SRV_OP_CD     path (empty for the root)
+//     SRV_OP_STAT   path
+//     SRV_OP_READ   u64 offset, u32 length, path
+//     SRV_OP_WRITE  u64 offset, u32 path_len, path, data
+//
+// Response payloads, when the status is SRV_OK:
+//
+//     SRV_OP_LS     per entry: u32 size, u8 attr, u8 0, u16 name_len, name
+//     SRV_OP_CD     the new working directory
+//     SRV_OP_STAT   u32 size, u32 first_cluster, u8 attr, u8 0,
+//                   u16 write_date, u16 write_time, u16 0
+//     SRV_OP_READ   the data; shorter than asked at end of file
+//     SRV_OP_WRITE  u32 bytes written
+//
+// An error response has no payload and status SRV_ERR_BAD_REQUEST,
+// SRV_ERR_NOT_DIR, or the negated FileError (file.h) of the failed
+// operation. A write to a file that is open elsewhere fails with
+// -FILE_ERR_ALREADY_OPEN. A header with a `len` above SRV_MAX_PAYLOAD
+// closes the connection.
+
+#define SRV_HEADER_SIZE 12
+#define SRV_MAX_PAYLOAD (4u << 20)
+
+enum
+{
+    SRV_OP_LS = 1,
+    SRV_OP_CD = 2,
+    SRV_OP_STAT = 3,
+    SRV_OP_READ = 4,
+    SRV_OP_WRITE = 5
+};
+
+enum
+{
+    SRV_OK = 0,
+    SRV_ERR_BAD_REQUEST = 100,  // unknown op or malformed payload
+    SRV_ERR_NOT_DIR = 101       // ls or cd on something that is not a directory
+};
+
+typedef struct Server Server;
+
+/* Listen on a new socket at `socket_path` (an existing socket file there
+ * is replaced) and start `workers` worker threads, or one per CPU if 0.
+ * A worker holds at most one descriptor of the open-file table at a
+ * time, so there are never more than MAX_NUM_FILES (file.h) workers.
+ * Returns NULL on error. */
+Server *server_open(fat32_volume *vol, const char *socket_path, unsigned workers);
+
+/* Serve clients until `server_stop`. Returns false if the event loop
+ * failed. */
+bool server_run(Server *srv);
+
+/* Make `server_run` return. Safe to call from any thread and from a
+ * signal handler. */
+void server_stop(Server *srv);
+
+/* Let the workers finish the requests they are running and stop them,
+ * disconnect every client without sending anything more, remove the
+ * socket file and free `srv`. The volume stays mounted. */
+void server_close(Server *srv);
+
+#endif // SERVER_H
@@ -0,0 +1,60 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "fat.h"
+#include "dir.h"
+
+// Bulk copy between a host directory tree and a directory of a mounted
+// image, for the shell's import and export commands.
+//
+// The copy runs as a pipeline. The calling thread walks the source tree,
+// creates the directories and, for import, allocates each file's
+// clusters up front as contiguous extents (fat_extend_chain_extents).
+// It cuts every file into chunks of up to TRANSFER_CHUNK bytes and
+// queues them on a ring of TRANSFER_SLOTS buffers. TRANSFER_READERS
+// threads fill the buffers from the source. One writer thread drains
+// them in walk order, so the device sees the freshly allocated clusters
+// written front to back, and closes each host file after its last chunk.
+// A finisher thread then completes the file: for import it creates the
+// directory entry. All stages overlap, and the ring bounds the memory and
+// the host descriptors in flight.
+//
+// Import: regular files and directories only; symlinks and special files
+// are skipped. Names must fit 8.3, since only short entries can be
+// created; others are skipped, as are names already present in the image
+// directory (existing directories are merged into). Files of 4 GiB and
+// more do not fit FAT32 and are skipped.
+// Export: host files are created or truncated and preallocated to size.
+//
+// A crash during an import can leave clusters allocated to no entry;
+// fsck reports them.
+
+#define TRANSFER_CHUNK (1u << 20)   // largest piece of a file in one buffer
+#define TRANSFER_SLOTS 32           // buffers in flight
+#define TRANSFER_READERS 4
+
+typedef struct
+{
+    uint64_t files;
+    uint64_t dirs;          // directories created
+    uint64_t bytes;
+    uint64_t skipped;       // entries not copied, each reported on stderr
+    uint64_t errors;        // files whose copy failed, each reported on stderr
+    double seconds;
+} TransferStats;
+
+/* Copy the contents of host directory `host_dir` into image directory
+ * `img_dir` (resolved from `session`). Returns false if either directory
+ * can't be opened; per-file problems are counted in `*stats`. */
+bool transfer_import(fat32_volume *vol, const DirSession *session, const char *host_dir, const char *img_dir,
+                     TransferStats *stats);
+
+/* Copy the contents of image directory `img_dir` (resolved from
+ * `session`) into host directory `host_dir`, which is created if
+ * missing. */
+bool transfer_export(fat32_volume *vol, const DirSession *session, const char *img_dir, const char *host_dir,
+                     TransferStats *stats);
+
+#endif // TRANSFER_H
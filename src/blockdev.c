@@ -0,0 +1,335 @@
+//Block device backends: pread/pwrite, mmap, O_DIRECT
+
+#define _GNU_SOURCE         // O_DIRECT, pread/pwrite with -std=c99
+
+#include "blockdev.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DIRECT_ALIGN 4096   // safe for 512e and 4Kn devices and common filesystems
+
+//Loop over short transfers and EINTR
+static bool full_pread(int fd, uint64_t off, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    while(len > 0)
+    {
+        ssize_t n = pread(fd, p, len, (off_t)off);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return false;
+        p += n;
+        off += (uint64_t)n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool full_pwrite(int fd, uint64_t off, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    while(len > 0)
+    {
+        ssize_t n = pwrite(fd, p, len, (off_t)off);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return false;
+        p += n;
+        off += (uint64_t)n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool in_range(BlockDev *dev, uint64_t off, size_t len)
+{
+    return off <= dev->size && len <= dev->size - off;
+}
+
+
+// ---- pread/pwrite ----
+
+static bool pread_read(BlockDev *dev, uint64_t off, void *buf, size_t len)
+{
+    return in_range(dev, off, len) && full_pread(dev->fd, off, buf, len);
+}
+
+static bool pread_write(BlockDev *dev, uint64_t off, const void *buf, size_t len)
+{
+    return in_range(dev, off, len) && full_pwrite(dev->fd, off, buf, len);
+}
+
+static bool fd_flush(BlockDev *dev)
+{
+    return fsync(dev->fd) == 0;
+}
+
+static void fd_close(BlockDev *dev)
+{
+    close(dev->fd);
+    free(dev);
+}
+
+static void fd_prefetch(BlockDev *dev, uint64_t off, size_t len)
+{
+    if(in_range(dev, off, len)) posix_fadvise(dev->fd, (off_t)off, (off_t)len, POSIX_FADV_WILLNEED);
+}
+
+static const BlockDevOps pread_ops = { pread_read, pread_write, fd_flush, fd_close, fd_prefetch };
+
+
+// ---- mmap ----
+
+static bool mmap_read(BlockDev *dev, uint64_t off, void *buf, size_t len)
+{
+    if(!in_range(dev, off, len)) return false;
+    memcpy(buf, dev->map + off, len);
+    return true;
+}
+
+static bool mmap_write(BlockDev *dev, uint64_t off, const void *buf, size_t len)
+{
+    if(!in_range(dev, off, len)) return false;
+    memcpy(dev->map + off, buf, len);
+    return true;
+}
+
+static bool mmap_flush(BlockDev *dev)
+{
+    return msync(dev->map, (size_t)dev->size, MS_SYNC) == 0;
+}
+
+static void mmap_close(BlockDev *dev)
+{
+    munmap(dev->map, (size_t)dev->size);
+    fd_close(dev);
+}
+
+static void mmap_prefetch(BlockDev *dev, uint64_t off, size_t len)
+{
+    if(!in_range(dev, off, len)) return;
+
+    // madvise wants a page-aligned start
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = off - off % page;
+    madvise(dev->map + start, (size_t)(off + len - start), MADV_WILLNEED);
+}
+
+static const BlockDevOps mmap_ops = { mmap_read, mmap_write, mmap_flush, mmap_close, mmap_prefetch };
+
+
+// ---- O_DIRECT ----
+
+/* Requests that are already aligned go straight to pread/pwrite. Anything
+ * else is widened to whole aligned blocks through a bounce buffer; partial
+ * block writes are read-modify-write. Every write holds `rmw_lock`: whole
+ * block writes shared, read-modify-writes exclusive, so no write can land
+ * between an edge block's read and its write-back and be undone by it. */
+typedef struct
+{
+    pthread_rwlock_t rmw_lock;
+} DirectState;
+
+static bool is_aligned(BlockDev *dev, uint64_t off, const void *buf, size_t len)
+{
+    return off % dev->align == 0 && len % dev->align == 0 && (uintptr_t)buf % dev->align == 0;
+}
+
+static bool direct_read(BlockDev *dev, uint64_t off, void *buf, size_t len)
+{
+    if(!in_range(dev, off, len)) return false;
+    if(len == 0) return true;
+    if(is_aligned(dev, off, buf, len)) return full_pread(dev->fd, off, buf, len);
+
+    uint64_t start = off - off % dev->align;
+    uint64_t end = (off + len + dev->align - 1) / dev->align * dev->align;
+    void *bounce;
+    if(posix_memalign(&bounce, dev->align, (size_t)(end - start)) != 0) return false;
+
+    bool ok = full_pread(dev->fd, start, bounce, (size_t)(end - start));
+    if(ok) memcpy(buf, (uint8_t *)bounce + (off - start), len);
+
+    free(bounce);
+    return ok;
+}
+
+static bool direct_write(BlockDev *dev, uint64_t off, const void *buf, size_t len)
+{
+    if(!in_range(dev, off, len)) return false;
+    if(len == 0) return true;
+
+    DirectState *st = dev->priv;
+    if(is_aligned(dev, off, buf, len))
+    {
+        pthread_rwlock_rdlock(&st->rmw_lock);
+        bool ok = full_pwrite(dev->fd, off, buf, len);
+        pthread_rwlock_unlock(&st->rmw_lock);
+        return ok;
+    }
+
+    uint64_t start = off - off % dev->align;
+    uint64_t end = (off + len + dev->align - 1) / dev->align * dev->align;
+    size_t span = (size_t)(end - start);
+    void *bounce;
+    if(posix_memalign(&bounce, dev->align, span) != 0) return false;
+
+    bool ok = true;
+    bool partial = (off != start) || (off + len != end);
+
+    if(partial) pthread_rwlock_wrlock(&st->rmw_lock);
+    else pthread_rwlock_rdlock(&st->rmw_lock);     // whole blocks, only the buffer is unaligned
+
+    // only the edge blocks carry bytes we must preserve
+    if(off != start)
+        ok = full_pread(dev->fd, start, bounce, dev->align);
+    if(ok && off + len != end && !(end - dev->align == start && off != start))
+        ok = full_pread(dev->fd, end - dev->align, (uint8_t *)bounce + span - dev->align, dev->align);
+
+    if(ok)
+    {
+        memcpy((uint8_t *)bounce + (off - start), buf, len);
+        ok = full_pwrite(dev->fd, start, bounce, span);
+    }
+
+    pthread_rwlock_unlock(&st->rmw_lock);
+
+    free(bounce);
+    return ok;
+}
+
+static void direct_close(BlockDev *dev)
+{
+    DirectState *st = dev->priv;
+    pthread_rwlock_destroy(&st->rmw_lock);
+    free(st);
+    fd_close(dev);
+}
+
+static const BlockDevOps direct_ops = { direct_read, direct_write, fd_flush, direct_close, NULL };
+
+
+// ---- open ----
+
+static bool open_mmap(BlockDev *dev)
+{
+    void *p = mmap(NULL, (size_t)dev->size, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+    if(p == MAP_FAILED) return false;
+
+    dev->map = p;
+    dev->ops = &mmap_ops;
+    return true;
+}
+
+static bool open_direct(BlockDev *dev, const char *path)
+{
+    // the tail block of an unaligned image could only be written by extending it
+    if(dev->size % DIRECT_ALIGN != 0) return false;
+
+    int fd = open(path, O_RDWR | O_DIRECT);
+    if(fd < 0) return false;
+
+    DirectState *st = malloc(sizeof *st);
+    if(!st)
+    {
+        close(fd);
+        return false;
+    }
+    pthread_rwlock_init(&st->rmw_lock, NULL);
+
+    // probe: some filesystems accept the flag but fail the first read
+    void *probe;
+    bool ok = posix_memalign(&probe, DIRECT_ALIGN, DIRECT_ALIGN) == 0;
+    if(ok)
+    {
+        ok = full_pread(fd, 0, probe, DIRECT_ALIGN);
+        free(probe);
+    }
+    if(!ok)
+    {
+        pthread_rwlock_destroy(&st->rmw_lock);
+        free(st);
+        close(fd);
+        return false;
+    }
+
+    close(dev->fd);
+    dev->fd = fd;
+    dev->priv = st;
+    dev->align = DIRECT_ALIGN;
+    dev->ops = &direct_ops;
+    return true;
+}
+
+BlockDev *bdev_open(const char *path, BlockDevType type)
+{
+    int fd = open(path, O_RDWR);
+    if(fd < 0) return NULL;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size <= 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    BlockDev *dev = calloc(1, sizeof *dev);
+    if(!dev)
+    {
+        close(fd);
+        return NULL;
+    }
+    dev->fd = fd;
+    dev->size = (uint64_t)st.st_size;
+    dev->align = 1;
+    dev->type = BDEV_PREAD;
+    dev->ops = &pread_ops;
+
+    if(type == BDEV_MMAP && open_mmap(dev))
+        dev->type = BDEV_MMAP;
+    else if(type == BDEV_DIRECT && open_direct(dev, path))
+        dev->type = BDEV_DIRECT;
+
+    return dev;
+}
+
+bool bdev_zero(BlockDev *dev, uint64_t off, size_t len)
+{
+    if(dev->map)
+    {
+        if(!in_range(dev, off, len)) return false;
+        memset(dev->map + off, 0, len);
+        return true;
+    }
+
+    size_t chunk = len < 65536 ? len : 65536;
+    void *zero;
+    if(posix_memalign(&zero, dev->align > 1 ? dev->align : sizeof(void *), chunk ? chunk : 1) != 0)
+        return false;
+    memset(zero, 0, chunk);
+
+    bool ok = true;
+    while(ok && len > 0)
+    {
+        size_t n = len < chunk ? len : chunk;
+        ok = bdev_write(dev, off, zero, n);
+        off += n;
+        len -= n;
+    }
+
+    free(zero);
+    return ok;
+}
+
+const char *bdev_type_name(BlockDevType type)
+{
+    switch(type)
+    {
+        case BDEV_MMAP:   return "mmap";
+        case BDEV_DIRECT: return "O_DIRECT";
+        default:          return "pread";
+    }
+}
@@ -0,0 +1,477 @@
+//Cluster buffer cache with CLOCK eviction and dirty write-back
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "cache.h"
+#include "fat.h"
+#include "journal.h"
+#include <pthread.h>
+#include <string.h>
+
+#define CACHE_MIN_SLOTS 16
+#define CACHE_FLUSH_BATCH (1u << 20)    // max bytes coalesced into one write
+
+/* Per-volume cache state (fat32_volume.cache). One mutex covers the
+ * table, the hash and the counters; it is dropped while a miss reads its
+ * cluster, and `loaded` is signalled when that read ends. Buffer contents
+ * are not covered: a pinned slot is never evicted, and its bytes are
+ * guarded by the lock of the directory it belongs to. */
+typedef struct ClusterCache
+{
+    ClusterBuf *slots;
+    size_t slot_count;
+    int32_t *buckets;           // hash heads, -1 terminated chains
+    size_t bucket_count;
+    size_t clock_hand;
+    CacheStats stats;
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+
+    /* Slots of a mapped image point into the mapping, unless the volume
+     * is journaled: the kernel may write mapped pages back at any time,
+     * and journaled blocks must wait for their commit. */
+    bool in_place;
+} ClusterCache;
+
+static size_t hash_cluster(const ClusterCache *cache, uint32_t cluster)
+{
+    return (size_t)(cluster * 2654435761u) & (cache->bucket_count - 1);
+}
+
+static ClusterBuf *lookup(ClusterCache *cache, uint32_t cluster)
+{
+    for(int32_t i = cache->buckets[hash_cluster(cache, cluster)]; i >= 0; i = cache->slots[i].hash_next)
+    {
+        if(cache->slots[i].cluster == cluster) return &cache->slots[i];
+    }
+    return NULL;
+}
+
+static void unhash(ClusterCache *cache, ClusterBuf *b)
+{
+    int32_t idx = (int32_t)(b - cache->slots);
+    int32_t *link = &cache->buckets[hash_cluster(cache, b->cluster)];
+    while(*link >= 0)
+    {
+        if(*link == idx)
+        {
+            *link = b->hash_next;
+            break;
+        }
+        link = &cache->slots[*link].hash_next;
+    }
+    b->valid = false;
+    b->hash_next = -1;
+    cache->stats.in_use--;
+}
+
+//Write one dirty slot back to the image
+static bool write_back(fat32_volume *vol, ClusterBuf *b)
+{
+    ClusterCache *cache = vol->cache;
+    if(!b->dirty) return true;
+    if(!bdev_write(vol->dev, cluster_to_offset(vol, b->cluster), b->data, vol->cluster_size)) return false;
+
+    b->dirty = false;
+    cache->stats.dirty--;
+    cache->stats.writebacks++;
+    return true;
+}
+
+bool cache_init(fat32_volume *vol, size_t bytes)
+{
+    cache_shutdown(vol);
+    if(vol->cluster_size == 0) return false;
+
+    ClusterCache *cache = calloc(1, sizeof *cache);
+    if(!cache) return false;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->loaded, NULL);
+    vol->cache = cache;
+
+    cache->in_place = vol->dev->map && !vol->journal;
+    cache->slot_count = bytes / vol->cluster_size;
+    if(cache->slot_count < CACHE_MIN_SLOTS) cache->slot_count = CACHE_MIN_SLOTS;
+
+    cache->bucket_count = 1;
+    while(cache->bucket_count < cache->slot_count * 2) cache->bucket_count <<= 1;
+
+    cache->slots = calloc(cache->slot_count, sizeof(ClusterBuf));
+    cache->buckets = malloc(cache->bucket_count * sizeof(int32_t));
+    if(!cache->slots || !cache->buckets)
+    {
+        cache_shutdown(vol);
+        return false;
+    }
+
+    for(size_t i = 0; i < cache->bucket_count; i++) cache->buckets[i] = -1;
+    for(size_t i = 0; i < cache->slot_count; i++) cache->slots[i].hash_next = -1;
+
+    cache->stats.capacity = cache->slot_count;
+    return true;
+}
+
+void cache_shutdown(fat32_volume *vol)
+{
+    ClusterCache *cache = vol->cache;
+    if(!cache) return;
+
+    if(cache->slots)
+    {
+        cache_flush(vol);
+        for(size_t i = 0; i < cache->slot_count; i++) free(cache->slots[i].storage);
+    }
+    free(cache->slots);
+    free(cache->buckets);
+    pthread_cond_destroy(&cache->loaded);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+    vol->cache = NULL;
+}
+
+//Find a slot to reuse: CLOCK sweep over unpinned slots
+static ClusterBuf *take_slot(fat32_volume *vol)
+{
+    ClusterCache *cache = vol->cache;
+    // two full sweeps: the first may only clear reference bits
+    for(size_t n = 0; n < cache->slot_count * 2; n++)
+    {
+        ClusterBuf *b = &cache->slots[cache->clock_hand];
+        cache->clock_hand = (cache->clock_hand + 1) % cache->slot_count;
+
+        if(b->refs > 0) continue;
+        if(!b->valid) return b;
+        if(b->dirty && !journal_durable(vol, b->lsn)) continue;   // its transaction is not on disk yet
+        if(b->referenced)
+        {
+            b->referenced = false;
+            continue;
+        }
+
+        if(!write_back(vol, b)) continue;    // keep data we could not save
+        unhash(cache, b);
+        cache->stats.evictions++;
+        return b;
+    }
+    return NULL;
+}
+
+//Bind `b` to `cluster` and link it into the hash
+static bool install(fat32_volume *vol, ClusterBuf *b, uint32_t cluster)
+{
+    ClusterCache *cache = vol->cache;
+    if(cache->in_place)
+    {
+        // mapped image: the mapping is the buffer, nothing to copy or write back
+        b->data = (uint8_t *)fat_cluster_data(vol, cluster);
+        if(!b->data) return false;
+    }
+    else
+    {
+        if(!b->storage)
+        {
+            b->storage = malloc(vol->cluster_size);
+            if(!b->storage) return false;
+        }
+        b->data = b->storage;
+    }
+
+    size_t h = hash_cluster(cache, cluster);
+    b->cluster = cluster;
+    b->valid = true;
+    b->dirty = false;
+    b->loading = false;
+    b->reload = false;
+    b->referenced = true;
+    b->refs = 1;
+    b->hash_next = cache->buckets[h];
+    cache->buckets[h] = (int32_t)(b - cache->slots);
+    cache->stats.in_use++;
+    return true;
+}
+
+static void mark_dirty(fat32_volume *vol, ClusterBuf *b)
+{
+    ClusterCache *cache = vol->cache;
+    if(cache->in_place) return;
+    b->lsn = journal_running_seq(vol);
+    if(b->dirty) return;
+    b->dirty = true;
+    cache->stats.dirty++;
+}
+
+//Look up or load `cluster` with the cache lock held; a load drops it for the read
+static ClusterBuf *get_locked(fat32_volume *vol, uint32_t cluster, bool zeroed)
+{
+    ClusterCache *cache = vol->cache;
+    ClusterBuf *b;
+    while((b = lookup(cache, cluster)) && b->loading)
+    {
+        // look again afterwards: a failed read leaves the cluster uncached
+        pthread_cond_wait(&cache->loaded, &cache->lock);
+    }
+    if(b)
+    {
+        cache->stats.hits++;
+        b->refs++;
+        b->referenced = true;
+        if(zeroed)
+        {
+            memset(b->data, 0, vol->cluster_size);
+            mark_dirty(vol, b);
+        }
+        return b;
+    }
+
+    cache->stats.misses++;
+    b = take_slot(vol);
+    if(!b || !install(vol, b, cluster)) return NULL;
+
+    if(zeroed)
+    {
+        memset(b->data, 0, vol->cluster_size);
+        mark_dirty(vol, b);
+        return b;
+    }
+    if(cache->in_place) return b;
+
+    // pinned and marked loading, the slot is neither evicted nor handed
+    // out while the lock is dropped for the read
+    b->loading = true;
+    bool ok;
+    do
+    {
+        b->reload = false;
+        pthread_mutex_unlock(&cache->lock);
+        ok = bdev_read(vol->dev, cluster_to_offset(vol, cluster), b->data, vol->cluster_size);
+        pthread_mutex_lock(&cache->lock);
+    } while(ok && b->reload);
+    b->loading = false;
+    pthread_cond_broadcast(&cache->loaded);
+
+    if(!ok)
+    {
+        b->refs = 0;
+        unhash(cache, b);
+        return NULL;
+    }
+    return b;
+}
+
+static ClusterBuf *get(fat32_volume *vol, uint32_t cluster, bool zeroed)
+{
+    ClusterCache *cache = vol->cache;
+    if(!cache || !vol->dev || cluster < 2) return NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    ClusterBuf *b = get_locked(vol, cluster, zeroed);
+    pthread_mutex_unlock(&cache->lock);
+    return b;
+}
+
+ClusterBuf *cache_get(fat32_volume *vol, uint32_t cluster)
+{
+    return get(vol, cluster, false);
+}
+
+ClusterBuf *cache_get_zeroed(fat32_volume *vol, uint32_t cluster)
+{
+    return get(vol, cluster, true);
+}
+
+void cache_mark_dirty(fat32_volume *vol, ClusterBuf *b)
+{
+    ClusterCache *cache = vol->cache;
+    if(!b) return;
+    pthread_mutex_lock(&cache->lock);
+    mark_dirty(vol, b);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_put(fat32_volume *vol, ClusterBuf *b)
+{
+    ClusterCache *cache = vol->cache;
+    if(!b) return;
+    pthread_mutex_lock(&cache->lock);
+    if(b->refs > 0) b->refs--;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_invalidate(fat32_volume *vol, uint32_t cluster)
+{
+    ClusterCache *cache = vol->cache;
+    if(!cache) return;
+
+    pthread_mutex_lock(&cache->lock);
+    ClusterBuf *b = lookup(cache, cluster);
+    if(b && b->loading)
+    {
+        b->reload = true;   // its read may predate the change
+    }
+    else if(b && b->refs == 0)
+    {
+        if(b->dirty)
+        {
+            b->dirty = false;
+            cache->stats.dirty--;
+        }
+        unhash(cache, b);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_overlay_dirty(fat32_volume *vol, uint32_t first_cluster, uint64_t offset, size_t len, uint8_t *dst)
+{
+    ClusterCache *cache = vol->cache;
+    if(!cache || len == 0) return;
+
+    pthread_mutex_lock(&cache->lock);
+    if(cache->stats.dirty == 0)
+    {
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+
+    uint64_t end = offset + len;
+    uint32_t last = first_cluster + (uint32_t)((end - 1) / vol->cluster_size);
+    for(uint32_t c = first_cluster + (uint32_t)(offset / vol->cluster_size); c <= last; c++)
+    {
+        ClusterBuf *b = lookup(cache, c);
+        if(!b || !b->dirty) continue;
+
+        // overlap of this cluster with [offset, end), relative to first_cluster
+        uint64_t lo = (uint64_t)(c - first_cluster) * vol->cluster_size;
+        uint64_t hi = lo + vol->cluster_size;
+        if(lo < offset) lo = offset;
+        if(hi > end) hi = end;
+        memcpy(dst + (lo - offset), b->data + (lo % vol->cluster_size), (size_t)(hi - lo));
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_update_range(fat32_volume *vol, uint32_t first_cluster, uint64_t offset, size_t len, const uint8_t *src)
+{
+    ClusterCache *cache = vol->cache;
+    // a mapped image has no copies to refresh
+    if(!cache || len == 0 || cache->in_place) return;
+
+    pthread_mutex_lock(&cache->lock);
+    uint64_t end = offset + len;
+    uint32_t last = first_cluster + (uint32_t)((end - 1) / vol->cluster_size);
+    for(uint32_t c = first_cluster + (uint32_t)(offset / vol->cluster_size); c <= last; c++)
+    {
+        ClusterBuf *b = lookup(cache, c);
+        if(!b) continue;
+        if(b->loading)
+        {
+            b->reload = true;   // its read may predate the caller's write
+            continue;
+        }
+
+        uint64_t lo = (uint64_t)(c - first_cluster) * vol->cluster_size;
+        uint64_t hi = lo + vol->cluster_size;
+        if(lo < offset) lo = offset;
+        if(hi > end) hi = end;
+        memcpy(b->data + (lo % vol->cluster_size), src + (lo - offset), (size_t)(hi - lo));
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static int compare_slot_cluster(const void *a, const void *b)
+{
+    uint32_t ca = (*(ClusterBuf *const *)a)->cluster;
+    uint32_t cb = (*(ClusterBuf *const *)b)->cluster;
+    return (ca > cb) - (ca < cb);
+}
+
+static bool flush_locked(fat32_volume *vol)
+{
+    ClusterCache *cache = vol->cache;
+    if(cache->stats.dirty == 0) return true;
+
+    ClusterBuf **dirty = malloc(cache->stats.dirty * sizeof(ClusterBuf *));
+    if(!dirty) return false;
+
+    // a pinned slot's bytes may be mid-change under its directory lock,
+    // which is not ours to take; it stays dirty for a later flush
+    bool ok = true;
+    size_t n = 0;
+    for(size_t i = 0; i < cache->slot_count; i++)
+    {
+        const ClusterBuf *b = &cache->slots[i];
+        if(!b->valid || !b->dirty || !journal_durable(vol, b->lsn)) continue;
+        if(b->refs > 0) ok = false;
+        else dirty[n++] = &cache->slots[i];
+    }
+    qsort(dirty, n, sizeof(ClusterBuf *), compare_slot_cluster);
+
+    // stage runs of adjacent clusters so each run is one write
+    size_t max_run = CACHE_FLUSH_BATCH / vol->cluster_size;
+    if(max_run < 1) max_run = 1;
+    uint8_t *stage = max_run > 1 ? malloc(max_run * vol->cluster_size) : NULL;
+
+    size_t i = 0;
+    while(i < n)
+    {
+        size_t run = 1;
+        while(stage && i + run < n && run < max_run
+              && dirty[i + run]->cluster == dirty[i]->cluster + run)
+        {
+            run++;
+        }
+
+        if(run == 1)
+        {
+            if(!write_back(vol, dirty[i])) ok = false;
+        }
+        else
+        {
+            for(size_t k = 0; k < run; k++)
+                memcpy(stage + k * vol->cluster_size, dirty[i + k]->data, vol->cluster_size);
+
+            if(bdev_write(vol->dev, cluster_to_offset(vol, dirty[i]->cluster), stage, run * vol->cluster_size))
+            {
+                for(size_t k = 0; k < run; k++)
+                {
+                    dirty[i + k]->dirty = false;
+                    cache->stats.dirty--;
+                    cache->stats.writebacks++;
+                }
+            }
+            else
+            {
+                ok = false;
+            }
+        }
+        i += run;
+    }
+
+    free(stage);
+    free(dirty);
+    return ok;
+}
+
+bool cache_flush(fat32_volume *vol)
+{
+    ClusterCache *cache = vol->cache;
+    if(!cache) return true;
+
+    pthread_mutex_lock(&cache->lock);
+    bool ok = flush_locked(vol);
+    pthread_mutex_unlock(&cache->lock);
+    return ok;
+}
+
+void cache_get_stats(fat32_volume *vol, CacheStats *out)
+{
+    ClusterCache *cache = vol->cache;
+    if(!out) return;
+    if(!cache)
+    {
+        memset(out, 0, sizeof *out);
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    *out = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
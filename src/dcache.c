@@ -0,0 +1,270 @@
+//Dentry cache: (parent cluster, folded name) -> directory entry
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "dcache.h"
+#include <pthread.h>
+#include <string.h>
+
+#define DCACHE_SLOTS 4096
+#define DCACHE_BUCKETS 8192             // power of two
+#define DCACHE_PARENT_FILTER 65536      // bits; power of two
+#define DCACHE_GENERATIONS 4096         // power of two
+
+typedef struct
+{
+    uint32_t parent;        // 0 = unused slot
+    uint64_t hash;          // DcacheKey
+    uint16_t len;
+    uint16_t *name;         // folded name, owned; `name_cap` units allocated
+    uint16_t name_cap;
+    bool     negative;
+    bool     referenced;    // CLOCK bit
+    uint32_t generation;    // of the parent when cached
+    int32_t  hash_next;
+    int32_t  offset_next;   // positive entries are also chained by offset
+    uint64_t offset;
+    DirEntry entry;
+} Dentry;
+
+/* Per-volume dentry cache (fat32_volume.dcache). */
+typedef struct Dcache
+{
+    Dentry slots[DCACHE_SLOTS];
+    int32_t buckets[DCACHE_BUCKETS];
+    int32_t offset_buckets[DCACHE_BUCKETS];
+    size_t clock_hand;
+    pthread_mutex_t lock;
+
+    /* Bit set for every parent that has ever had an entry cached. Lets
+     * dcache_drop_dir skip the slot sweep for directories that never had
+     * anything cached. */
+    uint8_t parent_filter[DCACHE_PARENT_FILTER / 8];
+
+    /* Entries are valid while their parent's generation is unchanged;
+     * parents that share a counter only cost each other some misses. */
+    uint32_t generations[DCACHE_GENERATIONS];
+} Dcache;
+
+bool dcache_key(const char *name, DcacheKey *key)
+{
+    size_t len = fold_name_utf8(name, key->name, 255);
+    if(len == 0) return false;
+    key->hash = hash_folded_name(key->name, len);
+    key->len = (uint16_t)len;
+    return true;
+}
+
+static size_t hash_key(uint32_t parent, uint64_t hash)
+{
+    uint64_t h = hash + parent * 0x9E3779B97F4A7C15ull;
+    return (size_t)(h ^ (h >> 29)) & (DCACHE_BUCKETS - 1);
+}
+
+static size_t hash_offset(uint64_t offset)
+{
+    return (size_t)((offset >> 5) * 2654435761u) & (DCACHE_BUCKETS - 1);
+}
+
+static size_t filter_bit(uint32_t parent)
+{
+    return (parent * 2654435761u) & (DCACHE_PARENT_FILTER - 1);
+}
+
+static uint32_t *generation(Dcache *dc, uint32_t parent)
+{
+    return &dc->generations[(parent * 2654435761u) >> 20 & (DCACHE_GENERATIONS - 1)];
+}
+
+static Dentry *find(Dcache *dc, uint32_t parent, const DcacheKey *key)
+{
+    for(int32_t i = dc->buckets[hash_key(parent, key->hash)]; i >= 0; i = dc->slots[i].hash_next)
+    {
+        Dentry *d = &dc->slots[i];
+        if(d->parent == parent && d->hash == key->hash && d->len == key->len
+           && memcmp(d->name, key->name, key->len * sizeof(uint16_t)) == 0) return d;
+    }
+    return NULL;
+}
+
+static void unlink_slot(Dcache *dc, Dentry *d)
+{
+    int32_t idx = (int32_t)(d - dc->slots);
+    int32_t *link = &dc->buckets[hash_key(d->parent, d->hash)];
+    while(*link >= 0)
+    {
+        if(*link == idx)
+        {
+            *link = d->hash_next;
+            break;
+        }
+        link = &dc->slots[*link].hash_next;
+    }
+    if(!d->negative)
+    {
+        link = &dc->offset_buckets[hash_offset(d->offset)];
+        while(*link >= 0)
+        {
+            if(*link == idx)
+            {
+                *link = d->offset_next;
+                break;
+            }
+            link = &dc->slots[*link].offset_next;
+        }
+    }
+    d->parent = 0;
+    d->hash_next = -1;
+    d->offset_next = -1;
+}
+
+DcacheResult dcache_lookup(fat32_volume *vol, uint32_t parent, const DcacheKey *key, DirEntry *entry, uint64_t *entry_offset)
+{
+    Dcache *dc = vol->dcache;
+    DcacheResult result = DCACHE_MISS;
+
+    pthread_mutex_lock(&dc->lock);
+    Dentry *d = find(dc, parent, key);
+    if(d && d->generation != *generation(dc, parent))
+    {
+        unlink_slot(dc, d);     // a name was added to the directory since
+        d = NULL;
+    }
+    if(d)
+    {
+        d->referenced = true;
+        result = d->negative ? DCACHE_NEGATIVE : DCACHE_HIT;
+        if(!d->negative)
+        {
+            if(entry) *entry = d->entry;
+            if(entry_offset) *entry_offset = d->offset;
+        }
+    }
+    pthread_mutex_unlock(&dc->lock);
+    return result;
+}
+
+void dcache_insert(fat32_volume *vol, uint32_t parent, const DcacheKey *key, const DirEntry *entry, uint64_t entry_offset)
+{
+    Dcache *dc = vol->dcache;
+    if(parent == 0) return;
+
+    pthread_mutex_lock(&dc->lock);
+    Dentry *d = find(dc, parent, key);
+    if(d)
+    {
+        unlink_slot(dc, d);     // relinked below, in case its offset changed
+    }
+    else
+    {
+        // CLOCK: give recently used slots a second chance
+        while(1)
+        {
+            d = &dc->slots[dc->clock_hand];
+            dc->clock_hand = (dc->clock_hand + 1) % DCACHE_SLOTS;
+            if(d->parent == 0) break;
+            if(!d->referenced) break;
+            d->referenced = false;
+        }
+        if(d->parent != 0) unlink_slot(dc, d);
+    }
+
+    // keep the slot's name buffer unless it is too small
+    if(d->name_cap < key->len)
+    {
+        uint16_t *grown = realloc(d->name, key->len * sizeof(uint16_t));
+        if(!grown)
+        {
+            pthread_mutex_unlock(&dc->lock);
+            return;     // not cached; the next lookup scans
+        }
+        d->name = grown;
+        d->name_cap = key->len;
+    }
+    memcpy(d->name, key->name, key->len * sizeof(uint16_t));
+
+    int32_t idx = (int32_t)(d - dc->slots);
+    size_t h = hash_key(parent, key->hash);
+    d->parent = parent;
+    d->hash = key->hash;
+    d->len = key->len;
+    d->hash_next = dc->buckets[h];
+    dc->buckets[h] = idx;
+
+    size_t bit = filter_bit(parent);
+    dc->parent_filter[bit / 8] |= (uint8_t)(1u << (bit % 8));
+
+    d->referenced = true;
+    d->generation = *generation(dc, parent);
+    d->negative = (entry == NULL);
+    d->offset = entry_offset;
+    if(entry)
+    {
+        d->entry = *entry;
+        size_t o = hash_offset(entry_offset);
+        d->offset_next = dc->offset_buckets[o];
+        dc->offset_buckets[o] = idx;
+    }
+    pthread_mutex_unlock(&dc->lock);
+}
+
+void dcache_invalidate_entry(fat32_volume *vol, uint32_t parent, uint64_t entry_offset)
+{
+    Dcache *dc = vol->dcache;
+    pthread_mutex_lock(&dc->lock);
+    int32_t i = dc->offset_buckets[hash_offset(entry_offset)];
+    while(i >= 0)
+    {
+        Dentry *d = &dc->slots[i];
+        i = d->offset_next;
+        if(d->parent == parent && d->offset == entry_offset) unlink_slot(dc, d);     // one per name that reached it
+    }
+    pthread_mutex_unlock(&dc->lock);
+}
+
+void dcache_new_name(fat32_volume *vol, uint32_t parent)
+{
+    Dcache *dc = vol->dcache;
+    pthread_mutex_lock(&dc->lock);
+    (*generation(dc, parent))++;
+    pthread_mutex_unlock(&dc->lock);
+}
+
+void dcache_drop_dir(fat32_volume *vol, uint32_t parent)
+{
+    Dcache *dc = vol->dcache;
+    size_t bit = filter_bit(parent);
+
+    pthread_mutex_lock(&dc->lock);
+    if(dc->parent_filter[bit / 8] & (1u << (bit % 8)))
+    {
+        for(size_t i = 0; i < DCACHE_SLOTS; i++)
+        {
+            if(dc->slots[i].parent == parent) unlink_slot(dc, &dc->slots[i]);
+        }
+    }
+    pthread_mutex_unlock(&dc->lock);
+}
+
+bool dcache_init(fat32_volume *vol)
+{
+    Dcache *dc = calloc(1, sizeof *dc);
+    if(!dc) return false;
+
+    for(size_t i = 0; i < DCACHE_BUCKETS; i++) dc->buckets[i] = dc->offset_buckets[i] = -1;
+    for(size_t i = 0; i < DCACHE_SLOTS; i++) dc->slots[i].hash_next = dc->slots[i].offset_next = -1;
+    pthread_mutex_init(&dc->lock, NULL);
+    vol->dcache = dc;
+    return true;
+}
+
+void dcache_shutdown(fat32_volume *vol)
+{
+    Dcache *dc = vol->dcache;
+    if(!dc) return;
+
+    for(size_t i = 0; i < DCACHE_SLOTS; i++) free(dc->slots[i].name);
+    pthread_mutex_destroy(&dc->lock);
+    free(dc);
+    vol->dcache = NULL;
+}
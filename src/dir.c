@@ -7,83 +7,235 @@
 -checking if directory is empty*/
 #include "dir.h"
 #include "fat.h"
+#include "dcache.h"
+#include <stdio.h>
 #include <string.h>
 
-uint32_t cwd_cluster;  // the first cluster of the current working directory, so we know where we are
-static char cwd_path[256];     //string path for shell prompt
-
-void dir_init(uint32_t root) {
-    cwd_cluster = root;        //usually root_cluster from fat32_init()
-    strcpy(cwd_path, "/");
+void dir_session_init(fat32_volume *vol, DirSession *session) {
+    session->cwd_cluster = vol->bpb.root_cluster;
+    strcpy(session->cwd_path, "/");
 }
 
-//helpers
-uint32_t get_cwd_cluster(void) { return cwd_cluster; }
-const char* get_cwd_path(void) { return cwd_path; }
+//Directory-entry view of the root, which has no entry of its own
+static void root_entry(fat32_volume *vol, DirEntry *e)
+{
+    memset(e, 0, sizeof *e);
+    memset(e->DIR_Name, ' ', 11);
+    e->DIR_Name[0] = '/';
+    e->DIR_Attr = 0x10;
+    e->DIR_FstClusHigh = (uint16_t)(vol->bpb.root_cluster >> 16);
+    e->DIR_FirstClusterLow = (uint16_t)(vol->bpb.root_cluster & 0xFFFF);
+}
 
-bool dir_cd(const char *name) {
-    DirEntry e;
-    if (find_dir_entry(cwd_cluster, name, &e, NULL) && (e.DIR_Attr & 0x10)) {
-        cwd_cluster = first_cluster_from_entry(&e); //update cwd_path string for prompt
-        strcat(cwd_path, name);
-        return true;
+//Look up one component in `parent`, through the dentry cache
+static bool lookup_component(fat32_volume *vol, uint32_t parent, const char *name, DirEntry *out, uint64_t *off)
+{
+    // short and long names share the cache, keyed by their folded form
+    DcacheKey key;
+    if (!dcache_key(name, &key))
+        return find_dir_entry(vol, parent, name, out, off);
+
+    switch (dcache_lookup(vol, parent, &key, out, off)) {
+        case DCACHE_HIT:      return true;
+        case DCACHE_NEGATIVE: return false;
+        case DCACHE_MISS:     break;
     }
-    return false;
+
+    // hold the directory so a writer can't invalidate before we insert
+    dir_lock_shared(vol, parent);
+    bool found = find_dir_entry(vol, parent, name, out, off);
+    dcache_insert(vol, parent, &key, found ? out : NULL, found ? *off : 0);
+    dir_unlock(vol, parent);
+    return found;
 }
 
-void fat32_ls(uint32_t start_cluster)
+bool dir_resolve(fat32_volume *vol, uint32_t start_cluster, const char *path, DirEntry *out_entry, uint64_t *entry_offset)
 {
-    if (start_cluster < 2) 
-        start_cluster = bpb.root_cluster; // safety: use root cluster from global BootInfo `bpb`
+    if (!path)
+        return false;
 
-    const size_t entries_per_cluster = cluster_size / 32;
-    if (entries_per_cluster == 0) 
-        return;
+    DirEntry e;
+    uint64_t off = 0;
+    uint32_t cur = (path[0] == '/' || start_cluster < 2) ? vol->bpb.root_cluster : start_cluster;
+    bool at_root = (cur == vol->bpb.root_cluster);
+    if (at_root)
+        root_entry(vol, &e);
+    else {
+        memset(&e, 0, sizeof e);
+        e.DIR_Attr = 0x10;
+        e.DIR_FstClusHigh = (uint16_t)(cur >> 16);
+        e.DIR_FirstClusterLow = (uint16_t)(cur & 0xFFFF);
+    }
 
-    uint8_t *cluster_buf = malloc(cluster_size);
-    if (!cluster_buf) 
-        return;
+    const char *p = path;
+    char comp[256];
+    while (*p) {
+        while (*p == '/') p++;
+        if (!*p) break;
+
+        size_t len = strcspn(p, "/");
+        if (len >= sizeof comp)
+            return false;
+        memcpy(comp, p, len);
+        comp[len] = '\0';
+        p += len;
+
+        if (!(e.DIR_Attr & 0x10))
+            return false;   // walking through a file
+        if (strcmp(comp, ".") == 0)
+            continue;
+        if (strcmp(comp, "..") == 0 && at_root)
+            continue;       // the root is its own parent
+
+        if (!lookup_component(vol, cur, comp, &e, &off))
+            return false;
+
+        cur = first_cluster_from_entry(&e);
+        if (cur == 0 && (e.DIR_Attr & 0x10))
+            cur = vol->bpb.root_cluster;     // ".." entries use 0 for the root
+        at_root = (cur == vol->bpb.root_cluster) && (e.DIR_Attr & 0x10);
+        if (at_root) {
+            root_entry(vol, &e);
+            off = 0;
+        }
+    }
 
-    uint32_t cluster = start_cluster;
-    bool is_root = (start_cluster == bpb.root_cluster);
+    if (out_entry) *out_entry = e;
+    if (entry_offset) *entry_offset = off;
+    return true;
+}
 
-    while (1) {
-        //read cluster bytes
-        if (read_cluster_bytes(cluster, cluster_buf) != 0) 
-            break;
+//On-disk name of the entry at `entry_offset` in `dir`: its long name if it has one
+static bool entry_name(fat32_volume *vol, uint32_t dir, uint64_t entry_offset, char *out, size_t out_size)
+{
+    DirIter it;
+    bool found = false;
+    if (dir_iter_open(vol, &it, dir)) {
+        while (!found && dir_iter_next(&it)) {
+            if (it.offset != entry_offset)
+                continue;
+            if (it.long_len > 0)
+                format_long_name(it.long_name, it.long_len, out, out_size);
+            else
+                format_short_name(it.entry.DIR_Name, out, out_size);
+            found = true;
+        }
+    }
+    dir_iter_close(&it);
+    return found;
+}
 
-        //iterate directory entries in this cluster
-        for (size_t i = 0; i < entries_per_cluster; ++i) {
-            DirEntry *e = (DirEntry *)(cluster_buf + i * 32);
+//Apply `path` to the cwd shown to the user, folding "." and ".." components
+//and spelling the others as they are stored on disk
+static bool update_cwd_path(fat32_volume *vol, DirSession *session, const char *path)
+{
+    char next[sizeof session->cwd_path];
+    size_t len;
+    uint32_t cur;
+
+    if (path[0] == '/') {
+        len = 0;
+        cur = vol->bpb.root_cluster;
+    } else {
+        len = strlen(session->cwd_path);
+        if (len == 1) len = 0;      // "/" -> build on an empty prefix
+        memcpy(next, session->cwd_path, len);
+        cur = session->cwd_cluster;
+    }
 
-            if (is_end_of_dir(e)) { // 0x00 -> no more entries in this dir
-                free(cluster_buf);
-                return;
-            }
+    const char *p = path;
+    char comp[256];
+    while (*p) {
+        while (*p == '/') p++;
+        if (!*p) break;
+        size_t clen = strcspn(p, "/");
+        if (clen >= sizeof comp)
+            return false;
+        memcpy(comp, p, clen);
+        comp[clen] = '\0';
+        p += clen;
+
+        if (strcmp(comp, ".") == 0)
+            continue;
+
+        DirEntry e;
+        uint64_t off;
+        if (!dir_resolve(vol, cur, comp, &e, &off))
+            return false;
+        uint32_t child = first_cluster_from_entry(&e);
+        if (child == 0)
+            child = vol->bpb.root_cluster;     // ".." entries use 0 for the root
+
+        if (strcmp(comp, "..") == 0) {
+            while (len > 0 && next[len - 1] != '/') len--;
+            if (len > 0) len--;     // drop the separator too
+        } else {
+            char name[256];
+            if (!entry_name(vol, cur, off, name, sizeof name))
+                snprintf(name, sizeof name, "%s", comp);    // show it as typed
+            size_t nlen = strlen(name);
+            if (len + 1 + nlen >= sizeof next)
+                return false;
+            next[len++] = '/';
+            memcpy(next + len, name, nlen);
+            len += nlen;
+        }
+        cur = child;
+    }
 
-            // Format the short 8.3 name
-            char namebuf[64];
-            format_short_name(e->DIR_Name, namebuf, sizeof namebuf);
+    if (len == 0)
+        next[len++] = '/';
+    next[len] = '\0';
+    strcpy(session->cwd_path, next);
+    return true;
+}
 
-            //indicate directory vs file
-            bool is_dir = (e->DIR_Attr & 0x10) != 0;
+bool dir_session_cd(fat32_volume *vol, DirSession *session, const char *path) {
+    DirEntry e;
+    if (!path || !dir_resolve(vol, session->cwd_cluster, path, &e, NULL) || !(e.DIR_Attr & 0x10))
+        return false;
+
+    uint32_t target = first_cluster_from_entry(&e);
+    if (!update_cwd_path(vol, session, path))
+        return false;   // too deep to show in the prompt
+    session->cwd_cluster = target;
+    return true;
+}
 
-            if (is_dir) 
-                printf("%s/\t", namebuf);
-            else         
-                printf("%s\t", namebuf);
-        }
+void fat32_ls(fat32_volume *vol, uint32_t start_cluster)
+{
+    if (start_cluster < 2) 
+        start_cluster = vol->bpb.root_cluster; // safety: use the volume's root cluster
 
-        //follow cluster chain
-        uint32_t next = fat_get_entry(cluster) & 0x0FFFFFFF; // mask to 28 bits for FAT32
-        if (next >= 0x0FFFFFF8 || next == 0x0) 
-            break; // EOC or invalid
-        cluster = next;
+    DirIter it;
+    if (!dir_iter_open(vol, &it, start_cluster)) {
+        dir_iter_close(&it);
+        return;
     }
 
-    free(cluster_buf);
+    //one pass over the entries; LFN parts are assembled by the iterator
+    while (dir_iter_next(&it)) {
+        if (it.entry.DIR_Attr & 0x08)
+            continue;   // volume label
+
+        // Prefer the long name, else format the short 8.3 name
+        char namebuf[1024];
+        if (it.long_len > 0)
+            format_long_name(it.long_name, it.long_len, namebuf, sizeof namebuf);
+        else
+            format_short_name(it.entry.DIR_Name, namebuf, sizeof namebuf);
+
+        //indicate directory vs file
+        bool is_dir = (it.entry.DIR_Attr & 0x10) != 0;
+
+        if (is_dir) 
+            printf("%s/\t", namebuf);
+        else         
+            printf("%s\t", namebuf);
+    }
+    dir_iter_close(&it);
 }
 
-void dir_ls(uint32_t start_cluster) {
-    fat32_ls(cwd_cluster);  // ls uses cwd_cluster internally
+void dir_ls(fat32_volume *vol, const DirSession *session) {
+    fat32_ls(vol, session->cwd_cluster);
 }
\ No newline at end of file
@@ -0,0 +1,414 @@
+//Hashed name index for directories
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "dirindex.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DIR_INDEX_MAX_DIRS 64
+#define DIR_INDEX_MIN_SLOTS 64
+
+// slot states
+#define SLOT_EMPTY 0
+#define SLOT_USED  1
+#define SLOT_DEAD  2    // tombstone left by a removal
+
+typedef struct
+{
+    char     name[11];
+    uint8_t  state;
+    bool     has_long;      // the entry also has a long name in `long_slots`
+    DirIndexHit hit;
+} IndexSlot;
+
+typedef struct
+{
+    uint64_t  hash;         // hash_folded_name of `name`
+    uint16_t *name;         // case-folded long name, owned
+    uint16_t  len;
+    uint8_t   state;
+    DirIndexHit hit;        // the short entry the name belongs to
+} LongSlot;
+
+typedef struct
+{
+    uint32_t dir_cluster;   // 0 = unused
+    uint64_t last_use;
+    IndexSlot *slots;
+    size_t capacity;        // power of two
+    size_t used;
+    size_t dead;
+    LongSlot *long_slots;
+    size_t long_capacity;   // power of two
+    size_t long_used;
+    bool has_lfn;           // directory holds LFN fragments, valid or not
+    bool has_dups;          // some name is held by more than one entry
+} DirIndex;
+
+/* Per-volume set of indexes (fat32_volume.dirindex). */
+typedef struct DirIndexSet
+{
+    DirIndex indexes[DIR_INDEX_MAX_DIRS];
+    uint64_t use_clock;
+    pthread_mutex_t lock;       // never held across I/O
+} DirIndexSet;
+
+//FNV-1a over the packed 8.3 name
+static size_t hash_name(const char name[11])
+{
+    uint32_t h = 2166136261u;
+    for(int i = 0; i < 11; i++)
+    {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void index_free(DirIndex *ix)
+{
+    for(size_t i = 0; i < ix->long_capacity; i++) free(ix->long_slots[i].name);
+    free(ix->long_slots);
+    free(ix->slots);
+    memset(ix, 0, sizeof *ix);
+}
+
+//Slot holding `name`, or NULL
+static IndexSlot *probe_find(DirIndex *ix, const char name[11])
+{
+    size_t mask = ix->capacity - 1;
+    for(size_t i = hash_name(name) & mask, n = 0; n < ix->capacity; i = (i + 1) & mask, n++)
+    {
+        IndexSlot *s = &ix->slots[i];
+        if(s->state == SLOT_EMPTY) return NULL;
+        if(s->state == SLOT_USED && memcmp(s->name, name, 11) == 0) return s;
+    }
+    return NULL;
+}
+
+static bool rehash(DirIndex *ix, size_t capacity)
+{
+    IndexSlot *fresh = calloc(capacity, sizeof(IndexSlot));
+    if(!fresh) return false;
+
+    IndexSlot *old = ix->slots;
+    size_t old_cap = ix->capacity;
+    ix->slots = fresh;
+    ix->capacity = capacity;
+    ix->used = 0;
+    ix->dead = 0;
+
+    for(size_t i = 0; i < old_cap; i++)
+    {
+        if(old[i].state != SLOT_USED) continue;
+        size_t mask = capacity - 1;
+        size_t j = hash_name(old[i].name) & mask;
+        while(fresh[j].state != SLOT_EMPTY) j = (j + 1) & mask;
+        fresh[j] = old[i];
+        ix->used++;
+    }
+    free(old);
+    return true;
+}
+
+static DirIndexHit make_hit(const DirEntry *e, uint64_t offset)
+{
+    DirIndexHit hit = { offset, first_cluster_from_entry(e), e->DIR_Attr };
+    return hit;
+}
+
+//Add entry `e` at `offset` under its short name; if the name is already held, the earlier entry keeps it
+static IndexSlot *insert(DirIndex *ix, const DirEntry *e, uint64_t offset)
+{
+    const char *name = e->DIR_Name;
+    // keep the load factor (live + tombstones) under 1/2
+    if((ix->used + ix->dead + 1) * 2 > ix->capacity)
+    {
+        // grow if mostly live entries, otherwise just sweep the tombstones
+        size_t cap = ix->capacity;
+        if((ix->used + 1) * 4 > cap) cap *= 2;
+        if(!rehash(ix, cap)) return NULL;
+    }
+
+    IndexSlot *s = probe_find(ix, name);
+    if(s)
+    {
+        ix->has_dups = true;
+        if(s->hit.offset > offset)
+        {
+            s->hit = make_hit(e, offset);
+            s->has_long = false;
+        }
+        return s;
+    }
+
+    size_t mask = ix->capacity - 1;
+    size_t i = hash_name(name) & mask;
+    while(ix->slots[i].state == SLOT_USED) i = (i + 1) & mask;
+    s = &ix->slots[i];
+    if(s->state == SLOT_DEAD) ix->dead--;
+    ix->used++;
+    memcpy(s->name, name, 11);
+    s->state = SLOT_USED;
+    s->has_long = false;
+    s->hit = make_hit(e, offset);
+    return s;
+}
+
+//Slot holding folded long name `name`, or NULL
+static LongSlot *long_find(DirIndex *ix, uint64_t hash, const uint16_t *name, size_t len)
+{
+    if(ix->long_capacity == 0) return NULL;
+    size_t mask = ix->long_capacity - 1;
+    for(size_t i = (size_t)hash & mask; ix->long_slots[i].state != SLOT_EMPTY; i = (i + 1) & mask)
+    {
+        LongSlot *s = &ix->long_slots[i];
+        if(s->hash == hash && s->len == len && memcmp(s->name, name, len * sizeof(uint16_t)) == 0) return s;
+    }
+    return NULL;
+}
+
+//Add folded long name `name` of entry `e` at `offset`; the table only grows, as long names change by rebuilding
+static bool long_insert(DirIndex *ix, const uint16_t *name, size_t len, const DirEntry *e, uint64_t offset)
+{
+    uint64_t hash = hash_folded_name(name, len);
+    if(long_find(ix, hash, name, len))
+    {
+        ix->has_dups = true;    // met in directory order, so the earlier entry keeps it
+        return true;
+    }
+
+    if((ix->long_used + 1) * 2 > ix->long_capacity)
+    {
+        size_t cap = ix->long_capacity ? ix->long_capacity * 2 : DIR_INDEX_MIN_SLOTS;
+        LongSlot *fresh = calloc(cap, sizeof(LongSlot));
+        if(!fresh) return false;
+        for(size_t i = 0; i < ix->long_capacity; i++)
+        {
+            if(ix->long_slots[i].state != SLOT_USED) continue;
+            size_t j = (size_t)ix->long_slots[i].hash & (cap - 1);
+            while(fresh[j].state != SLOT_EMPTY) j = (j + 1) & (cap - 1);
+            fresh[j] = ix->long_slots[i];
+        }
+        free(ix->long_slots);
+        ix->long_slots = fresh;
+        ix->long_capacity = cap;
+    }
+
+    uint16_t *copy = malloc(len * sizeof(uint16_t));
+    if(!copy) return false;
+    memcpy(copy, name, len * sizeof(uint16_t));
+
+    size_t mask = ix->long_capacity - 1;
+    size_t i = (size_t)hash & mask;
+    while(ix->long_slots[i].state != SLOT_EMPTY) i = (i + 1) & mask;
+    LongSlot *s = &ix->long_slots[i];
+    s->hash = hash;
+    s->name = copy;
+    s->len = (uint16_t)len;
+    s->state = SLOT_USED;
+    s->hit = make_hit(e, offset);
+    ix->long_used++;
+    return true;
+}
+
+//Entries that can be looked up by name
+static bool indexable(const DirEntry *e)
+{
+    uint8_t first = (uint8_t)e->DIR_Name[0];
+    if(first == 0x00 || first == 0xE5) return false;
+    if((e->DIR_Attr & 0x3F) == 0x0F) return false;     // LFN fragment
+    if(e->DIR_Attr & 0x08) return false;                // volume label
+    return true;
+}
+
+static bool is_lfn(const DirEntry *e)
+{
+    return e && (e->DIR_Attr & 0x3F) == 0x0F;
+}
+
+//Scan the whole directory once and fill `ix` with its short and long names
+static bool build(fat32_volume *vol, DirIndex *ix, uint32_t dir_cluster)
+{
+    ix->capacity = DIR_INDEX_MIN_SLOTS;
+    ix->slots = calloc(ix->capacity, sizeof(IndexSlot));
+    if(!ix->slots) return false;
+
+    DirIter it;
+    bool ok = dir_iter_open(vol, &it, dir_cluster);
+    while(ok && dir_iter_next(&it))
+    {
+        if(!indexable(&it.entry)) continue;
+        IndexSlot *s = insert(ix, &it.entry, it.offset);
+        ok = s != NULL;
+        if(ok && it.long_len > 0)
+        {
+            fold_name_utf16(it.long_name, it.long_len);
+            ok = long_insert(ix, it.long_name, it.long_len, &it.entry, it.offset);
+            if(s->hit.offset == it.offset) s->has_long = true;
+        }
+    }
+    ok = ok && !it.error;
+    ix->has_lfn = it.lfn_seen > 0;
+    dir_iter_close(&it);
+    return ok;
+}
+
+static DirIndex *find_index(DirIndexSet *set, uint32_t dir_cluster)
+{
+    for(int i = 0; i < DIR_INDEX_MAX_DIRS; i++)
+    {
+        if(set->indexes[i].dir_cluster == dir_cluster) return &set->indexes[i];
+    }
+    return NULL;
+}
+
+DirIndexResult dir_index_lookup(fat32_volume *vol, uint32_t dir_cluster, const char key[11],
+                                const uint16_t *folded, size_t folded_len, DirIndexHit *hit)
+{
+    DirIndexSet *set = vol->dirindex;
+    if(dir_cluster < 2) return DIR_INDEX_NONE;
+
+    pthread_mutex_lock(&set->lock);
+    DirIndex *ix = find_index(set, dir_cluster);
+    if(!ix)
+    {
+        // scan without the lock; the caller's shared directory lock keeps
+        // writers out of this directory until the index is installed
+        pthread_mutex_unlock(&set->lock);
+        DirIndex fresh;
+        memset(&fresh, 0, sizeof fresh);
+        if(!build(vol, &fresh, dir_cluster))
+        {
+            index_free(&fresh);
+            return DIR_INDEX_NONE;
+        }
+        fresh.dir_cluster = dir_cluster;
+
+        pthread_mutex_lock(&set->lock);
+        ix = find_index(set, dir_cluster);
+        if(ix)
+        {
+            index_free(&fresh);     // another reader built it meanwhile
+        }
+        else
+        {
+            // take a free slot, or evict the least recently used index
+            ix = &set->indexes[0];
+            for(int i = 0; i < DIR_INDEX_MAX_DIRS; i++)
+            {
+                if(set->indexes[i].dir_cluster == 0)
+                {
+                    ix = &set->indexes[i];
+                    break;
+                }
+                if(set->indexes[i].last_use < ix->last_use) ix = &set->indexes[i];
+            }
+            index_free(ix);
+            *ix = fresh;
+        }
+    }
+    ix->last_use = ++set->use_clock;
+
+    // a scan stops at the first entry matching either name
+    const IndexSlot *s = key ? probe_find(ix, key) : NULL;
+    const LongSlot *l = folded_len > 0 ? long_find(ix, hash_folded_name(folded, folded_len), folded, folded_len) : NULL;
+    DirIndexResult result = DIR_INDEX_ABSENT;
+    if(s || l)
+    {
+        *hit = s && (!l || s->hit.offset < l->hit.offset) ? s->hit : l->hit;
+        result = DIR_INDEX_FOUND;
+    }
+    pthread_mutex_unlock(&set->lock);
+    return result;
+}
+
+void dir_index_update(fat32_volume *vol, uint32_t dir_cluster, uint64_t entry_offset,
+                      const DirEntry *old_entry, const DirEntry *new_entry, bool after_lfn)
+{
+    DirIndexSet *set = vol->dirindex;
+    pthread_mutex_lock(&set->lock);
+    DirIndex *ix = find_index(set, dir_cluster);
+    if(ix)
+    {
+        bool old_named = old_entry && indexable(old_entry);
+        bool new_named = new_entry && indexable(new_entry);
+        bool renamed = !old_named || !new_named || memcmp(old_entry->DIR_Name, new_entry->DIR_Name, 11) != 0;
+        IndexSlot *s = old_named ? probe_find(ix, old_entry->DIR_Name) : NULL;
+        bool held = s && s->hit.offset == entry_offset;
+
+        /* Rebuild instead of patching when the change can move a long name:
+         * LFN slots written, a long-named entry renamed or removed (its
+         * checksum no longer matches), or a name written where it may
+         * complete fragments before it. A removed duplicate may also
+         * uncover a later entry of the same name. */
+        bool rebuild = is_lfn(old_entry) || is_lfn(new_entry);
+        if(renamed && old_named && (!held || s->has_long || ix->has_dups)) rebuild = true;
+        if(renamed && new_named && after_lfn && ix->has_lfn) rebuild = true;
+
+        if(rebuild)
+        {
+            index_free(ix);     // the next lookup scans the directory again
+        }
+        else if(renamed)
+        {
+            if(held)
+            {
+                s->state = SLOT_DEAD;
+                ix->used--;
+                ix->dead++;
+            }
+            if(new_named && !insert(ix, new_entry, entry_offset))
+                index_free(ix);     // out of memory: fall back to scanning
+        }
+        else if(first_cluster_from_entry(old_entry) != first_cluster_from_entry(new_entry)
+                || old_entry->DIR_Attr != new_entry->DIR_Attr)
+        {
+            // same name, new first cluster or attributes (sizes and times aren't indexed)
+            DirIndexHit fresh = make_hit(new_entry, entry_offset);
+            if(held) s->hit = fresh;
+            if(!held || s->has_long)
+            {
+                // its long name, if any, is somewhere in the long table
+                for(size_t i = 0; i < ix->long_capacity; i++)
+                {
+                    LongSlot *l = &ix->long_slots[i];
+                    if(l->state == SLOT_USED && l->hit.offset == entry_offset) l->hit = fresh;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&set->lock);
+}
+
+void dir_index_drop(fat32_volume *vol, uint32_t dir_cluster)
+{
+    DirIndexSet *set = vol->dirindex;
+    pthread_mutex_lock(&set->lock);
+    DirIndex *ix = find_index(set, dir_cluster);
+    if(ix) index_free(ix);
+    pthread_mutex_unlock(&set->lock);
+}
+
+bool dir_index_init(fat32_volume *vol)
+{
+    DirIndexSet *set = calloc(1, sizeof *set);
+    if(!set) return false;
+
+    pthread_mutex_init(&set->lock, NULL);
+    vol->dirindex = set;
+    return true;
+}
+
+void dir_index_shutdown(fat32_volume *vol)
+{
+    DirIndexSet *set = vol->dirindex;
+    if(!set) return;
+
+    for(int i = 0; i < DIR_INDEX_MAX_DIRS; i++) index_free(&set->indexes[i]);
+    pthread_mutex_destroy(&set->lock);
+    free(set);
+    vol->dirindex = NULL;
+}
@@ -0,0 +1,344 @@
+//Directory entry scan kernels: scalar, SSE2 and AVX2, chosen at run time
+
+#include "dirscan.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIR_SCAN_X86 1
+#endif
+
+// Per-entry predicates as bit masks, before the end marker is applied
+typedef struct
+{
+    uint64_t zero;      // first byte 0x00
+    uint64_t deleted;   // first byte 0xE5
+    uint64_t lfn;       // (attr & 0x3F) == 0x0F
+    uint64_t plain;     // (attr & 0x08) == 0: neither label nor LFN
+} RawMasks;
+
+typedef struct
+{
+    const char *name;
+    bool (*supported)(void);
+    void (*classify)(const uint8_t *p, size_t count, RawMasks *raw);
+    size_t (*find)(const uint8_t *p, size_t count, const char key[11]);
+} ScanKernel;
+
+static inline uint32_t load32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+//Scalar classification of entries [from, count)
+static void classify_scalar_from(const uint8_t *p, size_t from, size_t count, RawMasks *raw)
+{
+    for(size_t i = from; i < count; i++)
+    {
+        const uint8_t *e = p + i * sizeof(DirEntry);
+        uint64_t bit = (uint64_t)1 << i;
+        if(e[0] == 0x00) raw->zero |= bit;
+        if(e[0] == 0xE5) raw->deleted |= bit;
+        if((e[11] & 0x3F) == 0x0F) raw->lfn |= bit;
+        if(!(e[11] & 0x08)) raw->plain |= bit;
+    }
+}
+
+static void classify_scalar(const uint8_t *p, size_t count, RawMasks *raw)
+{
+    classify_scalar_from(p, 0, count, raw);
+}
+
+//Scalar search of entries [from, count)
+static size_t find_scalar_from(const uint8_t *p, size_t from, size_t count, const char key[11])
+{
+    for(size_t i = from; i < count; i++)
+    {
+        const uint8_t *e = p + i * sizeof(DirEntry);
+        if(e[0] == 0x00) return i;
+        if(e[0] != 0xE5 && !(e[11] & 0x08) && memcmp(e, key, 11) == 0) return i;
+    }
+    return count;
+}
+
+static size_t find_scalar(const uint8_t *p, size_t count, const char key[11])
+{
+    return find_scalar_from(p, 0, count, key);
+}
+
+static bool always(void)
+{
+    return true;
+}
+
+#ifdef DIR_SCAN_X86
+
+/* Both vector kernels look at three little-endian words per entry:
+ * bytes 0-3 and 4-7 of the name, and bytes 8-11 (the extension and the
+ * attribute byte). An entry matches the key when all three words equal
+ * the key's, with the attribute byte masked down to its 0x08 bit, which
+ * is set for both volume labels and LFN fragments. */
+#define KEY_WORD2_MASK 0x08FFFFFFu
+
+/* Load the first 12 bytes of 4 consecutive entries as three vectors
+ * holding word 0, 1 and 2 of each entry: a 4x4 transpose of the rows. */
+__attribute__((target("sse2")))
+static inline void load4(const uint8_t *p, __m128i w[3])
+{
+    const size_t s = sizeof(DirEntry);
+    __m128i a = _mm_loadu_si128((const __m128i *)(const void *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(const void *)(p + s));
+    __m128i c = _mm_loadu_si128((const __m128i *)(const void *)(p + 2 * s));
+    __m128i d = _mm_loadu_si128((const __m128i *)(const void *)(p + 3 * s));
+    __m128i ab_lo = _mm_unpacklo_epi32(a, b);   // a0 b0 a1 b1
+    __m128i cd_lo = _mm_unpacklo_epi32(c, d);
+    w[0] = _mm_unpacklo_epi64(ab_lo, cd_lo);    // a0 b0 c0 d0
+    w[1] = _mm_unpackhi_epi64(ab_lo, cd_lo);
+    w[2] = _mm_unpacklo_epi64(_mm_unpackhi_epi32(a, b), _mm_unpackhi_epi32(c, d));
+}
+
+__attribute__((target("sse2")))
+static inline int mask4(__m128i v)
+{
+    return _mm_movemask_ps(_mm_castsi128_ps(v));
+}
+
+__attribute__((target("sse2")))
+static void classify_sse2(const uint8_t *p, size_t count, RawMasks *raw)
+{
+    const __m128i low_byte = _mm_set1_epi32(0xFF);
+    const __m128i e5 = _mm_set1_epi32(0xE5);
+    const __m128i lfn_bits = _mm_set1_epi32(0x3F);
+    const __m128i lfn_attr = _mm_set1_epi32(0x0F);
+    const __m128i label_bit = _mm_set1_epi32(0x08);
+    const __m128i zero = _mm_setzero_si128();
+
+    uint64_t zeros = 0, deleted = 0, lfn = 0, plain = 0;
+    size_t i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        __m128i w[3];
+        load4(p + i * sizeof(DirEntry), w);
+        __m128i first = _mm_and_si128(w[0], low_byte);
+        __m128i attr = _mm_srli_epi32(w[2], 24);
+
+        zeros |= (uint64_t)mask4(_mm_cmpeq_epi32(first, zero)) << i;
+        deleted |= (uint64_t)mask4(_mm_cmpeq_epi32(first, e5)) << i;
+        lfn |= (uint64_t)mask4(_mm_cmpeq_epi32(_mm_and_si128(attr, lfn_bits), lfn_attr)) << i;
+        plain |= (uint64_t)mask4(_mm_cmpeq_epi32(_mm_and_si128(attr, label_bit), zero)) << i;
+    }
+    raw->zero |= zeros;
+    raw->deleted |= deleted;
+    raw->lfn |= lfn;
+    raw->plain |= plain;
+    classify_scalar_from(p, i, count, raw);
+}
+
+__attribute__((target("sse2")))
+static size_t find_sse2(const uint8_t *p, size_t count, const char key[11])
+{
+    const uint8_t *k = (const uint8_t *)key;
+    const __m128i key0 = _mm_set1_epi32((int)load32(k));
+    const __m128i key1 = _mm_set1_epi32((int)load32(k + 4));
+    const __m128i key2 = _mm_set1_epi32((int)(k[8] | (uint32_t)k[9] << 8 | (uint32_t)k[10] << 16));
+    const __m128i key2_mask = _mm_set1_epi32((int)KEY_WORD2_MASK);
+    const __m128i low_byte = _mm_set1_epi32(0xFF);
+    const __m128i e5 = _mm_set1_epi32(0xE5);
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        __m128i w[3];
+        load4(p + i * sizeof(DirEntry), w);
+        __m128i first = _mm_and_si128(w[0], low_byte);
+
+        __m128i hit = _mm_and_si128(_mm_cmpeq_epi32(w[0], key0), _mm_cmpeq_epi32(w[1], key1));
+        hit = _mm_and_si128(hit, _mm_cmpeq_epi32(_mm_and_si128(w[2], key2_mask), key2));
+        hit = _mm_andnot_si128(_mm_cmpeq_epi32(first, e5), hit);    // a key may begin with 0xE5
+
+        int stop = mask4(_mm_or_si128(hit, _mm_cmpeq_epi32(first, zero)));
+        if(stop) return i + (size_t)__builtin_ctz((unsigned)stop);
+    }
+    return find_scalar_from(p, i, count, key);
+}
+
+static bool has_sse2(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+/* The same transpose for 8 entries: each 256-bit row holds entry i in
+ * its low lane and entry i+4 in its high lane, and the in-lane unpacks
+ * leave the words of entries 0-7 in order. */
+__attribute__((target("avx2")))
+static inline __m256i row2(const uint8_t *p)
+{
+    __m128i lo = _mm_loadu_si128((const __m128i *)(const void *)p);
+    __m128i hi = _mm_loadu_si128((const __m128i *)(const void *)(p + 4 * sizeof(DirEntry)));
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+__attribute__((target("avx2")))
+static inline void load8(const uint8_t *p, __m256i w[3])
+{
+    const size_t s = sizeof(DirEntry);
+    __m256i a = row2(p), b = row2(p + s), c = row2(p + 2 * s), d = row2(p + 3 * s);
+    __m256i ab_lo = _mm256_unpacklo_epi32(a, b);
+    __m256i cd_lo = _mm256_unpacklo_epi32(c, d);
+    w[0] = _mm256_unpacklo_epi64(ab_lo, cd_lo);
+    w[1] = _mm256_unpackhi_epi64(ab_lo, cd_lo);
+    w[2] = _mm256_unpacklo_epi64(_mm256_unpackhi_epi32(a, b), _mm256_unpackhi_epi32(c, d));
+}
+
+__attribute__((target("avx2")))
+static inline int mask8(__m256i v)
+{
+    return _mm256_movemask_ps(_mm256_castsi256_ps(v));
+}
+
+__attribute__((target("avx2")))
+static void classify_avx2(const uint8_t *p, size_t count, RawMasks *raw)
+{
+    const __m256i low_byte = _mm256_set1_epi32(0xFF);
+    const __m256i e5 = _mm256_set1_epi32(0xE5);
+    const __m256i lfn_bits = _mm256_set1_epi32(0x3F);
+    const __m256i lfn_attr = _mm256_set1_epi32(0x0F);
+    const __m256i label_bit = _mm256_set1_epi32(0x08);
+    const __m256i zero = _mm256_setzero_si256();
+
+    // masks are gathered in registers, not through `raw`
+    uint64_t zeros = 0, deleted = 0, lfn = 0, plain = 0;
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        __m256i w[3];
+        load8(p + i * sizeof(DirEntry), w);
+        __m256i first = _mm256_and_si256(w[0], low_byte);
+        __m256i attr = _mm256_srli_epi32(w[2], 24);
+
+        zeros |= (uint64_t)mask8(_mm256_cmpeq_epi32(first, zero)) << i;
+        deleted |= (uint64_t)mask8(_mm256_cmpeq_epi32(first, e5)) << i;
+        lfn |= (uint64_t)mask8(_mm256_cmpeq_epi32(_mm256_and_si256(attr, lfn_bits), lfn_attr)) << i;
+        plain |= (uint64_t)mask8(_mm256_cmpeq_epi32(_mm256_and_si256(attr, label_bit), zero)) << i;
+    }
+    _mm256_zeroupper();     // the scalar tail and the caller run SSE code
+    raw->zero |= zeros;
+    raw->deleted |= deleted;
+    raw->lfn |= lfn;
+    raw->plain |= plain;
+    classify_scalar_from(p, i, count, raw);
+}
+
+__attribute__((target("avx2")))
+static size_t find_avx2(const uint8_t *p, size_t count, const char key[11])
+{
+    const uint8_t *k = (const uint8_t *)key;
+    const __m256i key0 = _mm256_set1_epi32((int)load32(k));
+    const __m256i key1 = _mm256_set1_epi32((int)load32(k + 4));
+    const __m256i key2 = _mm256_set1_epi32((int)(k[8] | (uint32_t)k[9] << 8 | (uint32_t)k[10] << 16));
+    const __m256i key2_mask = _mm256_set1_epi32((int)KEY_WORD2_MASK);
+    const __m256i low_byte = _mm256_set1_epi32(0xFF);
+    const __m256i e5 = _mm256_set1_epi32(0xE5);
+    const __m256i zero = _mm256_setzero_si256();
+
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        __m256i w[3];
+        load8(p + i * sizeof(DirEntry), w);
+        __m256i first = _mm256_and_si256(w[0], low_byte);
+
+        __m256i hit = _mm256_and_si256(_mm256_cmpeq_epi32(w[0], key0), _mm256_cmpeq_epi32(w[1], key1));
+        hit = _mm256_and_si256(hit, _mm256_cmpeq_epi32(_mm256_and_si256(w[2], key2_mask), key2));
+        hit = _mm256_andnot_si256(_mm256_cmpeq_epi32(first, e5), hit);
+
+        int stop = mask8(_mm256_or_si256(hit, _mm256_cmpeq_epi32(first, zero)));
+        if(stop)
+        {
+            _mm256_zeroupper();
+            return i + (size_t)__builtin_ctz((unsigned)stop);
+        }
+    }
+    _mm256_zeroupper();
+    return find_scalar_from(p, i, count, key);
+}
+
+static bool has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif // DIR_SCAN_X86
+
+// best first
+static const ScanKernel kernels[] = {
+#ifdef DIR_SCAN_X86
+    { "avx2", has_avx2, classify_avx2, find_avx2 },
+    { "sse2", has_sse2, classify_sse2, find_sse2 },
+#endif
+    { "scalar", always, classify_scalar, find_scalar },
+};
+
+#define KERNEL_COUNT (sizeof kernels / sizeof kernels[0])
+
+static const ScanKernel *active;    // NULL until first use
+
+static const ScanKernel *kernel(void)
+{
+    const ScanKernel *k = __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+    if(k) return k;
+
+    // racing first callers all pick the same kernel
+    for(size_t i = 0; i < KERNEL_COUNT; i++)
+    {
+        if(kernels[i].supported())
+        {
+            k = &kernels[i];
+            break;
+        }
+    }
+    __atomic_store_n(&active, k, __ATOMIC_RELEASE);
+    return k;
+}
+
+void dir_scan_classify(const DirEntry *entries, size_t count, DirScanMask *out)
+{
+    if(count > 64) count = 64;
+    RawMasks raw = { 0, 0, 0, 0 };
+    kernel()->classify((const uint8_t *)entries, count, &raw);
+
+    size_t end = raw.zero ? (size_t)__builtin_ctzll(raw.zero) : count;
+    if(end > count) end = count;
+    uint64_t before_end = end >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << end) - 1;
+
+    out->used = ~raw.deleted & before_end;  // nothing before the end marker is 0x00
+    out->lfn = out->used & raw.lfn;
+    out->named = out->used & raw.plain;
+    out->end = end;
+}
+
+size_t dir_scan_find(const DirEntry *entries, size_t count, const char key[11])
+{
+    return kernel()->find((const uint8_t *)entries, count, key);
+}
+
+const char *dir_scan_kernel(void)
+{
+    return kernel()->name;
+}
+
+bool dir_scan_use(const char *name)
+{
+    for(size_t i = 0; i < KERNEL_COUNT; i++)
+    {
+        if(strcmp(kernels[i].name, name) == 0 && kernels[i].supported())
+        {
+            __atomic_store_n(&active, &kernels[i], __ATOMIC_RELEASE);
+            return true;
+        }
+    }
+    return false;
+}
@@ -5,16 +5,60 @@
 
 //Boot sector parsing (for part 1)
 
+#define _POSIX_C_SOURCE 200809L    // pthread rwlocks with -std=c99
+
 #include "fat.h"
 #include "dir.h"
+#include "cache.h"
+#include "dirindex.h"
+#include "dirscan.h"
+#include "fatscan.h"
+#include "dcache.h"
+#include "journal.h"
+#include "perf.h"
 #include <ctype.h>
+#include <pthread.h>
 #include <string.h>
 
-uint32_t first_data_sector = 0;
-uint32_t first_fat_sector = 0;
-uint32_t cluster_size = 0;
-FILE *fat_img = NULL;
-BootInfo bpb; /* definition of the global BPB expected by other modules */
+#define FAT_CACHE_BYTES (8u << 20)     // cluster buffer cache size, per volume
+
+#define FSINFO_LEAD_SIG   0x41615252
+#define FSINFO_STRUCT_SIG 0x61417272
+#define FSINFO_TRAIL_SIG  0xAA550000
+#define FSINFO_UNKNOWN    0xFFFFFFFF
+
+#define DIR_LOCK_STRIPES 64
+
+/* Per-volume FAT state (fat32_volume.fat). */
+struct FatState
+{
+    /* In-memory copy of the first FAT. Loaded once by fat32_init and served
+     * to fat_get_entry/fat_set_entry; modified sectors are tracked in
+     * `dirty` and written back to every FAT mirror by fat32_flush. */
+    uint32_t *table;
+    uint32_t entry_count;
+    uint8_t *dirty;             // one flag per FAT sector
+    uint32_t dirty_count;
+
+    /* Free-space state. `free_map` has one bit per cluster (1 = free) and
+     * is built from the cached FAT the first time an allocation needs it.
+     * The free count and next-free hint are seeded from the FSInfo sector
+     * so a mount that never allocates does not have to scan the FAT. */
+    uint64_t *free_map;
+    uint32_t free_clusters;
+    uint32_t next_free_hint;
+    uint16_t fsinfo_sector;     // 0 when the volume has no usable FSInfo
+    bool fsinfo_dirty;
+
+    /* Locking. `lock` guards the FAT cache and all free-space state above:
+     * lookups and chain walks hold it shared, anything that changes an
+     * entry holds it exclusive. Directory contents are guarded by
+     * `dir_locks`, striped by the directory's first cluster. A directory
+     * lock may be held while taking `lock`, never the reverse; the cluster
+     * cache, dentry cache and name index locks are innermost. */
+    pthread_rwlock_t lock;
+    pthread_rwlock_t dir_locks[DIR_LOCK_STRIPES];
+};
 
 // Convert a user-supplied filename to FAT 8.3 format (11 bytes, space-padded)
 bool format_name_83(const char *input, char out[11])
@@ -24,6 +68,12 @@ bool format_name_83(const char *input, char out[11])
     /* initialize with spaces */
     for (int i = 0; i < 11; i++) out[i] = ' ';
 
+    /* the "." and ".." directory entries are stored literally */
+    if (strcmp(input, ".") == 0 || strcmp(input, "..") == 0) {
+        memcpy(out, input, strlen(input));
+        return true;
+    }
+
     const char *dot = strchr(input, '.');
     size_t namelen = dot ? (size_t)(dot - input) : strlen(input);
     const char *ext = dot ? dot + 1 : NULL;
@@ -102,278 +152,1836 @@ void format_short_name(const char entry_name[11], char *out, size_t out_size)//c
 }
 
 
-//Load FAT image and parse BPB
-bool fat32_init(const char *img_path)
+//Pointer to a cluster inside the mapped image, NULL if not mapped
+const uint8_t *fat_cluster_data(fat32_volume *vol, uint32_t cluster)
 {
-    printf("Initializing FAT32 image: %s\n", img_path);
-    fat_img = fopen(img_path, "rb+");   //uses fopen, MAKE SURE TO CLOSE!
-    if(!fat_img)
+    if(!vol->dev || !vol->dev->map || cluster < 2 || cluster >= vol->cluster_limit) return NULL;
+
+    uint64_t off = cluster_to_offset(vol, cluster);
+    if(off > vol->dev->size || vol->cluster_size > vol->dev->size - off) return NULL;
+    return vol->dev->map + off;
+}
+
+//Cluster holding image byte offset `off` (data area only)
+static uint32_t offset_to_cluster(fat32_volume *vol, uint64_t off)
+{
+    uint64_t sector = off / vol->bpb.bytes_per_sector;
+    if(sector < vol->first_data_sector) return 0;
+    return (uint32_t)((sector - vol->first_data_sector) / vol->bpb.sectors_per_cluster) + 2;
+}
+
+//Read the whole first FAT into memory in one pass
+static bool fat_load_table(fat32_volume *vol)
+{
+    size_t fat_bytes = (size_t)vol->bpb.fat_size * vol->bpb.bytes_per_sector;
+    if(fat_bytes == 0 || vol->bpb.bytes_per_sector < 4) return false;
+
+    vol->fat->table = malloc(fat_bytes);
+    vol->fat->dirty = calloc(vol->bpb.fat_size, 1);
+    if(!vol->fat->table || !vol->fat->dirty)
     {
-        printf("File not found: %s\n", img_path);
+        free(vol->fat->table);
+        free(vol->fat->dirty);
+        vol->fat->table = NULL;
+        vol->fat->dirty = NULL;
         return false;
     }
 
-    printf("Parsing BPB...\n");
-    fseek(fat_img, 11, SEEK_SET);
-    fread(&bpb.bytes_per_sector, 2, 1, fat_img);
-    fread(&bpb.sectors_per_cluster, 1, 1, fat_img);
-    fread(&bpb.reserved_sectors, 2, 1, fat_img);
-    fread(&bpb.num_fats, 1, 1, fat_img);
+    if(!bdev_read(vol->dev, (uint64_t)vol->first_fat_sector * vol->bpb.bytes_per_sector, vol->fat->table, fat_bytes))
+    {
+        free(vol->fat->table);
+        free(vol->fat->dirty);
+        vol->fat->table = NULL;
+        vol->fat->dirty = NULL;
+        return false;
+    }
 
-    fseek(fat_img, 36, SEEK_SET);
-    fread(&bpb.fat_size, 4, 1, fat_img);
-    fread(&bpb.root_cluster, 4, 1, fat_img);
+    vol->fat->entry_count = (uint32_t)(fat_bytes / 4);
+    vol->fat->dirty_count = 0;
+    return true;
+}
 
-    fseek(fat_img, 32, SEEK_SET);
-    fread(&bpb.total_sectors, 4, 1, fat_img);
+//Read the FSInfo free count and next-free hint, if the sector is valid
+static void fsinfo_load(fat32_volume *vol)
+{
+    struct FatState *fs = vol->fat;
+    fs->free_clusters = FSINFO_UNKNOWN;
+    fs->next_free_hint = 2;
+    fs->fsinfo_dirty = false;
 
-    first_fat_sector = bpb.reserved_sectors;
-    first_data_sector = bpb.reserved_sectors + bpb.num_fats * bpb.fat_size;
+    if(fs->fsinfo_sector == 0 || fs->fsinfo_sector == 0xFFFF || fs->fsinfo_sector >= vol->bpb.reserved_sectors)
+    {
+        fs->fsinfo_sector = 0;
+        return;
+    }
 
-    cluster_size = bpb.bytes_per_sector * bpb.sectors_per_cluster;
+    uint8_t sec[512];
+    if(!bdev_read(vol->dev, (uint64_t)fs->fsinfo_sector * vol->bpb.bytes_per_sector, sec, sizeof sec))
+    {
+        fs->fsinfo_sector = 0;
+        return;
+    }
 
-    dir_init(bpb.root_cluster); //initialize cwd to root
+    uint32_t lead, strc, trail, count, hint;
+    memcpy(&lead, sec, 4);
+    memcpy(&strc, sec + 484, 4);
+    memcpy(&count, sec + 488, 4);
+    memcpy(&hint, sec + 492, 4);
+    memcpy(&trail, sec + 508, 4);
+    if(lead != FSINFO_LEAD_SIG || strc != FSINFO_STRUCT_SIG || trail != FSINFO_TRAIL_SIG)
+    {
+        fs->fsinfo_sector = 0;
+        return;
+    }
 
-    return true;
+    // both fields are only hints; discard values that can't be right
+    if(count != FSINFO_UNKNOWN && count <= vol->cluster_limit - 2) fs->free_clusters = count;
+    if(hint >= 2 && hint < vol->cluster_limit) fs->next_free_hint = hint;
 }
 
-//Convert Cluster -> Byte Offset
-uint32_t cluster_to_offset(uint32_t cluster)
+//Write the current free count and next-free hint back to FSInfo
+static bool fsinfo_store(fat32_volume *vol)
 {
-    return(first_data_sector + (cluster - 2) * bpb.sectors_per_cluster)
-            * bpb.bytes_per_sector;
+    struct FatState *fs = vol->fat;
+    if(!fs->fsinfo_dirty || fs->fsinfo_sector == 0) return true;
+
+    uint32_t fields[2] = { fs->free_clusters, fs->next_free_hint };
+    bool ok = bdev_write(vol->dev, (uint64_t)fs->fsinfo_sector * vol->bpb.bytes_per_sector + 488, fields, sizeof fields);
+
+    if(ok) fs->fsinfo_dirty = false;
+    return ok;
 }
 
-//Get FAT Entry
-uint32_t fat_get_entry(uint32_t cluster)
+//Build the free-cluster bitmap from the cached FAT
+static bool free_map_build(fat32_volume *vol)
 {
-    uint32_t fat_offset = first_fat_sector * bpb.bytes_per_sector + cluster * 4;
+    if(vol->fat->free_map) return true;
+    if(!vol->fat->table || vol->cluster_limit <= 2) return false;
 
-    fseek(fat_img, fat_offset, SEEK_SET);
+    vol->fat->free_map = calloc((vol->cluster_limit + 63) / 64, sizeof(uint64_t));
+    if(!vol->fat->free_map) return false;
 
-    uint32_t value;
-    fread(&value, 4, 1, fat_img);
+    uint32_t count = fat_scan_free_bits(vol->fat->table, vol->cluster_limit, vol->fat->free_map);
 
-    return value & 0x0FFFFFFF;
+    if(count != vol->fat->free_clusters)
+    {
+        vol->fat->free_clusters = count;
+        vol->fat->fsinfo_dirty = true;
+    }
+    return true;
 }
 
-//Set FAT Entry
-void fat_set_entry(uint32_t cluster, uint32_t value)
+//Return the first free cluster in [from, to), or 0 if there is none
+static uint32_t free_map_scan(fat32_volume *vol, uint32_t from, uint32_t to)
 {
-    uint32_t fat_offset = first_fat_sector * bpb.bytes_per_sector + cluster * 4;
+    if(from >= to) return 0;
 
-    fseek(fat_img, fat_offset, SEEK_SET);
-    fwrite(&value, 4, 1, fat_img);
+    uint32_t w = from / 64;
+    uint32_t last = (to - 1) / 64;
+    uint64_t bits = vol->fat->free_map[w] & (~(uint64_t)0 << (from % 64));
 
-    for(int i = 1; i < bpb.num_fats; i++)
+    while(1)
     {
-        uint32_t mirror_offset = (first_fat_sector + i * bpb.fat_size)
-                                    * bpb.bytes_per_sector + cluster * 4;
-        fseek(fat_img, mirror_offset, SEEK_SET);
-        fwrite(&value, 4, 1, fat_img);
+        if(bits)
+        {
+            uint32_t c = w * 64 + (uint32_t)__builtin_ctzll(bits);
+            return c < to ? c : 0;
+        }
+        if(++w > last) return 0;
+        bits = vol->fat->free_map[w];
     }
 }
 
-//Find Free CLuster
-uint32_t fat_find_free_cluster()
+//Return the first allocated cluster in [from, to), or `to` if all are free
+static uint32_t free_map_scan_used(fat32_volume *vol, uint32_t from, uint32_t to)
 {
-    uint32_t total_clusters = (bpb.total_sectors - first_data_sector) / bpb.sectors_per_cluster;
+    if(from >= to) return to;
 
-    for(uint32_t c = 2; c < total_clusters; c++)
+    uint32_t w = from / 64;
+    uint32_t last = (to - 1) / 64;
+    uint64_t bits = ~vol->fat->free_map[w] & (~(uint64_t)0 << (from % 64));
+
+    while(1)
     {
-        if(fat_get_entry(c) == 0)
+        if(bits)
         {
-            return c;
+            uint32_t c = w * 64 + (uint32_t)__builtin_ctzll(bits);
+            return c < to ? c : to;
         }
+        if(++w > last) return to;
+        bits = ~vol->fat->free_map[w];
     }
-
-    return 0;
-
 }
 
-//Build CLuster Chain
-uint32_t *fat_get_chain(uint32_t start, size_t *count_out)
+/* Pick the free run to allocate from next. Runs are visited next-fit from
+ * the hint; the first run holding all of `need` wins, otherwise the largest
+ * run seen is returned so the request is split into as few pieces as
+ * possible. Returns false if the volume has no free cluster at all. */
+static bool free_map_pick_run(fat32_volume *vol, uint32_t need, FatExtent *out)
 {
-    size_t capacity = 16;
-    uint32_t *chain = malloc(sizeof(uint32_t) * capacity);
-    size_t count = 0;
+    FatExtent best = {0, 0};
 
-    uint32_t cur = start;
-    while(cur < 0x0FFFFFF8)
+    for(int pass = 0; pass < 2; pass++)
     {
-        if(count >= capacity)
+        uint32_t c = pass == 0 ? vol->fat->next_free_hint : 2;
+        uint32_t end = pass == 0 ? vol->cluster_limit : vol->fat->next_free_hint;
+
+        while((c = free_map_scan(vol, c, end)) != 0)
         {
-            capacity *= 2;
-            chain = realloc(chain, sizeof(uint32_t) * capacity);
+            // runs are allowed to cross the hint; measure to the real end
+            uint32_t run_end = free_map_scan_used(vol, c, vol->cluster_limit);
+            uint32_t len = run_end - c;
+
+            if(len >= need)
+            {
+                out->start = c;
+                out->length = need;
+                return true;
+            }
+            if(len > best.length)
+            {
+                best.start = c;
+                best.length = len;
+            }
+            if(run_end >= end) break;
+            c = run_end;
         }
-        chain[count++] = cur;
-        cur = fat_get_entry(cur);
     }
 
-    *count_out = count;
-    return chain;
+    *out = best;
+    return best.length > 0;
 }
 
-//Free Cluster Chain
-bool fat_free_chain(uint32_t start)
+//FAT entry change from the journal, before anything else uses the table
+static void replay_fat_entry(fat32_volume *vol, uint32_t cluster, uint32_t value)
 {
-    uint32_t cur = start;
-    while(cur < 0x0FFFFFF8)
+    vol->fat->table[cluster] = (vol->fat->table[cluster] & 0xF0000000) | (value & 0x0FFFFFFF);
+
+    uint32_t sector = cluster / (vol->bpb.bytes_per_sector / 4);
+    if(!vol->fat->dirty[sector])
     {
-        uint32_t next = fat_get_entry(cur);
-        fat_set_entry(cur, 0);
-        cur = next;
+        vol->fat->dirty[sector] = 1;
+        vol->fat->dirty_count++;
+    }
+}
+
+static bool write_table_locked(fat32_volume *vol);
+static void volume_release(fat32_volume *vol, bool flush);
+
+//Replay a journal left by a crash, then start a fresh one if asked to
+static bool journal_mount(fat32_volume *vol, const char *img_path, unsigned flags)
+{
+    int replayed = journal_replay(vol, img_path, replay_fat_entry);
+    if(replayed < 0)
+    {
+        printf("Failed to replay journal\n");
+        return false;
+    }
+    if(replayed > 0)
+    {
+        if(!write_table_locked(vol) || !bdev_flush(vol->dev))
+        {
+            printf("Failed to write replayed journal to the image\n");
+            return false;
+        }
+        printf("Replayed %d journal transactions\n", replayed);
+
+        // FSInfo predates the replayed changes; count again on first use
+        vol->fat->free_clusters = FSINFO_UNKNOWN;
+        vol->fat->fsinfo_dirty = true;
+    }
+
+    if(!(flags & FAT_MOUNT_JOURNAL))
+    {
+        journal_remove(img_path);
+        return true;
+    }
+    // a transaction may dirty a quarter of the buffer cache before it commits
+    size_t slots = FAT_CACHE_BYTES / vol->cluster_size;
+    if(!journal_open(vol, img_path, slots / 4))
+    {
+        printf("Failed to create journal\n");
+        return false;
     }
     return true;
 }
 
-//Read All Directory Entries in a CLuster
-bool read_directory_cluster(uint32_t cluster, DirEntry *entries, size_t max, size_t *count_out)
+//Load FAT image and parse BPB
+fat32_volume *fat32_init(const char *img_path, BlockDevType io, unsigned flags)
 {
-    uint32_t offset = cluster_to_offset(cluster);
-    size_t bytes = cluster_size;
+    printf("Initializing FAT32 image: %s\n", img_path);
+    fat32_volume *vol = calloc(1, sizeof *vol);
+    if(!vol || !(vol->fat = calloc(1, sizeof *vol->fat)))
+    {
+        printf("Out of memory\n");
+        free(vol);
+        return NULL;
+    }
+    pthread_rwlock_init(&vol->fat->lock, NULL);
+    for(int i = 0; i < DIR_LOCK_STRIPES; i++) pthread_rwlock_init(&vol->fat->dir_locks[i], NULL);
+    vol->fat->free_clusters = FSINFO_UNKNOWN;
+    vol->fat->next_free_hint = 2;
+
+    vol->dev = bdev_open(img_path, io);  //MAKE SURE TO CLOSE!
+    if(!vol->dev)
+    {
+        printf("File not found: %s\n", img_path);
+        volume_release(vol, false);
+        return NULL;
+    }
+    if(vol->dev->type != io)
+    {
+        printf("%s not available, using %s\n", bdev_type_name(io), bdev_type_name(vol->dev->type));
+    }
+
+    printf("Parsing BPB...\n");
+    uint8_t boot[512];
+    if(!bdev_read(vol->dev, 0, boot, sizeof boot))
+    {
+        printf("Failed to read boot sector\n");
+        volume_release(vol, false);
+        return NULL;
+    }
+    memcpy(&vol->bpb.bytes_per_sector, boot + 11, 2);
+    memcpy(&vol->bpb.sectors_per_cluster, boot + 13, 1);
+    memcpy(&vol->bpb.reserved_sectors, boot + 14, 2);
+    memcpy(&vol->bpb.num_fats, boot + 16, 1);
+    memcpy(&vol->bpb.total_sectors, boot + 32, 4);
+    memcpy(&vol->bpb.fat_size, boot + 36, 4);
+    memcpy(&vol->bpb.root_cluster, boot + 44, 4);  // skip BPB_ExtFlags and BPB_FSVer
+    memcpy(&vol->fat->fsinfo_sector, boot + 48, 2);
+
+    vol->first_fat_sector = vol->bpb.reserved_sectors;
+    vol->first_data_sector = vol->bpb.reserved_sectors + vol->bpb.num_fats * vol->bpb.fat_size;
+
+    vol->cluster_size = vol->bpb.bytes_per_sector * vol->bpb.sectors_per_cluster;
+
+    if(vol->cluster_size == 0 || vol->bpb.num_fats == 0 || vol->bpb.total_sectors <= vol->first_data_sector)
+    {
+        printf("Not a FAT32 image: %s\n", img_path);
+        volume_release(vol, false);
+        return NULL;
+    }
+
+    if(!fat_load_table(vol))
+    {
+        printf("Failed to load FAT\n");
+        volume_release(vol, false);
+        return NULL;
+    }
 
-    fseek(fat_img, offset, SEEK_SET);
+    uint32_t data_clusters = (vol->bpb.total_sectors - vol->first_data_sector) / vol->bpb.sectors_per_cluster;
+    vol->cluster_limit = data_clusters + 2;
+    if(vol->cluster_limit > vol->fat->entry_count) vol->cluster_limit = vol->fat->entry_count;
 
-    size_t read = fread(entries, sizeof(DirEntry), bytes / 32, fat_img);
-    *count_out = read;
+    fsinfo_load(vol);
 
-    return (read > 0);
+    // before the caches: the buffer cache works differently under a journal
+    if(!journal_mount(vol, img_path, flags))
+    {
+        volume_release(vol, false);
+        return NULL;
+    }
+
+    if(!cache_init(vol, FAT_CACHE_BYTES) || !dcache_init(vol) || !dir_index_init(vol))
+    {
+        printf("Failed to allocate caches\n");
+        volume_release(vol, false);
+        return NULL;
+    }
+
+    return vol;
 }
 
-/* Read raw bytes of a cluster into `buffer`.
- * Returns 0 on success, non-zero on failure.
- */
-int read_cluster_bytes(uint32_t cluster, uint8_t *buffer)
+//Convert Cluster -> Byte Offset
+uint64_t cluster_to_offset(fat32_volume *vol, uint32_t cluster)
 {
-    if (!buffer || !fat_img || cluster < 2) return -1;
+    return((uint64_t)vol->first_data_sector + (uint64_t)(cluster - 2) * vol->bpb.sectors_per_cluster)
+            * vol->bpb.bytes_per_sector;
+}
 
-    uint32_t offset = cluster_to_offset(cluster);
-    if (fseek(fat_img, offset, SEEK_SET) != 0) return -1;
+static pthread_rwlock_t *dir_lock_for(fat32_volume *vol, uint32_t dir_cluster)
+{
+    return &vol->fat->dir_locks[(dir_cluster * 2654435761u) >> 26];
+}
 
-    size_t to_read = (size_t)cluster_size;
-    size_t got = fread(buffer, 1, to_read, fat_img);
-    if (got != to_read) return -1;
+void dir_lock_shared(fat32_volume *vol, uint32_t dir_cluster)
+{
+    pthread_rwlock_rdlock(dir_lock_for(vol, dir_cluster));
+}
 
-    return 0;
+void dir_lock_exclusive(fat32_volume *vol, uint32_t dir_cluster)
+{
+    pthread_rwlock_wrlock(dir_lock_for(vol, dir_cluster));
 }
 
-uint32_t first_cluster_from_entry(const DirEntry *entry)
+void dir_unlock(fat32_volume *vol, uint32_t dir_cluster)
 {
-    uint32_t high = entry->DIR_FstClusHigh;
-    uint32_t low  = entry->DIR_FirstClusterLow;
+    pthread_rwlock_unlock(dir_lock_for(vol, dir_cluster));
+}
 
-    return (high << 16) | low;
+//FAT entry access with the FAT lock already held
+static uint32_t entry_get(fat32_volume *vol, uint32_t cluster)
+{
+    if(!vol->fat->table || cluster >= vol->fat->entry_count)
+    {
+        return 0x0FFFFFFF;  // out of range reads as end-of-chain
+    }
+    return vol->fat->table[cluster] & 0x0FFFFFFF;
 }
 
-//Find Specific Directory Entry
-bool find_dir_entry(uint32_t cluster, const char *name, DirEntry *out_entry, uint32_t *entry_offset)
+static void entry_set(fat32_volume *vol, uint32_t cluster, uint32_t value)
 {
-    DirEntry entries[256];
-    size_t count;
+    if(!vol->fat->table || cluster >= vol->fat->entry_count)
+    {
+        return;
+    }
 
-    size_t entries_per_cluster = cluster_size / 32;
+    value &= 0x0FFFFFFF;
+    uint32_t old = vol->fat->table[cluster] & 0x0FFFFFFF;
 
-    while(1)
+    // the top 4 bits are reserved and must be preserved
+    vol->fat->table[cluster] = (vol->fat->table[cluster] & 0xF0000000) | value;
+    journal_log_fat(vol, cluster, value);
+    PERF_ADD(PERF_FAT_SET, 1);
+
+    // keep free-space accounting in step with the table
+    if(cluster >= 2 && cluster < vol->cluster_limit && (old == 0) != (value == 0))
+    {
+        uint64_t bit = (uint64_t)1 << (cluster % 64);
+        if(value == 0)
+        {
+            if(vol->fat->free_map) vol->fat->free_map[cluster / 64] |= bit;
+            if(vol->fat->free_clusters != FSINFO_UNKNOWN) vol->fat->free_clusters++;
+        }
+        else
+        {
+            if(vol->fat->free_map) vol->fat->free_map[cluster / 64] &= ~bit;
+            if(vol->fat->free_clusters != FSINFO_UNKNOWN) vol->fat->free_clusters--;
+            if(cluster == vol->fat->next_free_hint)
+                vol->fat->next_free_hint = (cluster + 1 < vol->cluster_limit) ? cluster + 1 : 2;
+        }
+        vol->fat->fsinfo_dirty = true;
+    }
+
+    uint32_t sector = cluster / (vol->bpb.bytes_per_sector / 4);
+    if(!vol->fat->dirty[sector])
+    {
+        vol->fat->dirty[sector] = 1;
+        vol->fat->dirty_count++;
+    }
+}
+
+//Get FAT Entry
+uint32_t fat_get_entry(fat32_volume *vol, uint32_t cluster)
+{
+    pthread_rwlock_rdlock(&vol->fat->lock);
+    uint32_t value = entry_get(vol, cluster);
+    pthread_rwlock_unlock(&vol->fat->lock);
+    PERF_ADD(PERF_FAT_GET, 1);
+    return value;
+}
+
+//Copy a range of FAT entries under one hold of the lock
+void fat_get_entries(fat32_volume *vol, uint32_t first, size_t count, uint32_t *out)
+{
+    pthread_rwlock_rdlock(&vol->fat->lock);
+    for(size_t i = 0; i < count; i++) out[i] = entry_get(vol, first + (uint32_t)i);
+    pthread_rwlock_unlock(&vol->fat->lock);
+    PERF_ADD(PERF_FAT_GET, count);
+}
+
+//Set FAT Entry
+void fat_set_entry(fat32_volume *vol, uint32_t cluster, uint32_t value)
+{
+    journal_begin(vol);
+    pthread_rwlock_wrlock(&vol->fat->lock);
+    entry_set(vol, cluster, value);
+    pthread_rwlock_unlock(&vol->fat->lock);
+    journal_end(vol);
+}
+
+//Write dirty FAT sectors back to every FAT copy, with the FAT lock held
+static bool write_table_locked(fat32_volume *vol)
+{
+    bool ok = true;
+    uint32_t still_dirty = 0;
+    uint32_t s = 0;
+    while(s < vol->bpb.fat_size)
     {
-        read_directory_cluster(cluster, entries, 256, &count);
+        if(!vol->fat->dirty[s])
+        {
+            s++;
+            continue;
+        }
 
-        for(size_t i = 0; i < entries_per_cluster; i++)
+        // coalesce adjacent dirty sectors into a single write per mirror
+        uint32_t run = s;
+        while(run < vol->bpb.fat_size && vol->fat->dirty[run])
         {
-            if(entries[i].DIR_Name[0] == 0x00)
-            {
-                return false;
-            }
-            if(entries[i].DIR_Name[0] == 0xE5)
-            {
-                continue;
-            }
-            if(entries[i].DIR_Name[0] == 0x0F)
-            {
-                continue;
-            }
+            run++;
+        }
 
-            if(compare_name_83(entries[i].DIR_Name, name))
-            {
-                if(out_entry) *out_entry = entries[i];
+        const uint8_t *src = (const uint8_t *)vol->fat->table + (size_t)s * vol->bpb.bytes_per_sector;
+        size_t len = (size_t)(run - s) * vol->bpb.bytes_per_sector;
 
-                if(entry_offset)
-                {
-                    *entry_offset = cluster_to_offset(cluster) + i * 32;
-                }
-                return true;
+        bool written = true;
+        for(int i = 0; i < vol->bpb.num_fats; i++)
+        {
+            uint64_t off = ((uint64_t)vol->first_fat_sector + (uint64_t)i * vol->bpb.fat_size + s)
+                           * vol->bpb.bytes_per_sector;
+            if(!bdev_write(vol->dev, off, src, len))
+            {
+                written = false;
             }
         }
 
-        uint32_t next = fat_get_entry(cluster);
-        if(next >= 0x0FFFFFF8)
+        // a run stays dirty until every mirror has it, so the next flush retries
+        if(written)
         {
-            return false;
+            memset(vol->fat->dirty + s, 0, run - s);
         }
-        cluster = next;
+        else
+        {
+            still_dirty += run - s;
+            ok = false;
+        }
+        s = run;
     }
+
+    vol->fat->dirty_count = still_dirty;
+    return ok;
 }
 
-//Write Directory Entry at Offset
-bool write_dir_entry(uint32_t cluster, uint32_t entry_offset, const DirEntry *entry)
+//Write dirty FAT sectors back to every FAT copy
+bool fat32_flush(fat32_volume *vol)
 {
-    fseek(fat_img, entry_offset, SEEK_SET);
-    fwrite(entry, sizeof(DirEntry), 1, fat_img);
-    return true;
+    if(!vol->dev || !vol->fat->table) return false;
+
+    // with a journal, commit everything first and keep operations out until the image matches
+    journal_checkpoint_begin(vol);
+
+    bool ok = cache_flush(vol);
+
+    pthread_rwlock_wrlock(&vol->fat->lock);
+    if(!fsinfo_store(vol)) ok = false;
+    if(!write_table_locked(vol)) ok = false;
+    pthread_rwlock_unlock(&vol->fat->lock);
+
+    if(!bdev_flush(vol->dev)) ok = false;
+
+    journal_checkpoint_end(vol, ok);
+    return ok;
 }
 
-//Create Directory Entry (FInd free slot)
-bool create_dir_entry(uint32_t cluster, const DirEntry * new_entry)
+//Group commit of the journal, or a full flush without one
+bool fat32_commit(fat32_volume *vol)
 {
-    DirEntry entries[256];
-    size_t count;
+    return vol->journal ? journal_commit(vol) : fat32_flush(vol);
+}
 
-    while(1)
+void fat_txn_begin(fat32_volume *vol)
+{
+    journal_begin(vol);
+}
+
+void fat_txn_end(fat32_volume *vol)
+{
+    journal_end(vol);
+}
+
+//Find Free CLuster
+static uint32_t find_free_locked(fat32_volume *vol)
+{
+    if(!free_map_build(vol)) return 0;
+    if(vol->fat->free_clusters == 0) return 0;
+
+    // next-fit: search from the hint to the end, then wrap around
+    uint32_t hint = vol->fat->next_free_hint;
+    uint32_t c = free_map_scan(vol, hint, vol->cluster_limit);
+    PERF_ADD(PERF_FREE_PROBED, (c ? c : vol->cluster_limit) - hint);
+    if(!c)
     {
-        read_directory_cluster(cluster, entries, 256, &count);
+        c = free_map_scan(vol, 2, hint);
+        PERF_ADD(PERF_FREE_PROBED, (c ? c : hint) - 2);
+    }
+    if(!c) return 0;
 
-        for(size_t i = 0; i < count; i++)
-        {
-            if(entries[i].DIR_Name[0] == 0x00 ||entries[i].DIR_Name[0] == 0xE5)
-            {
-                uint32_t off = cluster_to_offset(cluster) + i * 32;
-                //Might need to move this out of the if statement.
-                return write_dir_entry(cluster, off, new_entry);
-            }
+    if(c != vol->fat->next_free_hint)
+    {
+        vol->fat->next_free_hint = c;
+        vol->fat->fsinfo_dirty = true;
+    }
+    return c;
+}
 
+uint32_t fat_find_free_cluster(fat32_volume *vol)
+{
+    pthread_rwlock_wrlock(&vol->fat->lock);   // may build the free map
+    uint32_t c = find_free_locked(vol);
+    pthread_rwlock_unlock(&vol->fat->lock);
+    return c;
+}
 
-        }
+//Number of free clusters, or 0xFFFFFFFF if not known yet
+uint32_t fat_free_count(fat32_volume *vol)
+{
+    pthread_rwlock_rdlock(&vol->fat->lock);
+    uint32_t n = vol->fat->free_clusters;
+    pthread_rwlock_unlock(&vol->fat->lock);
+    return n;
+}
 
-        uint32_t next = fat_get_entry(cluster);
-        if(next >= 0x0FFFFFF8)
+//Free-space and fragmentation statistics from the cached FAT
+bool fat_stats(fat32_volume *vol, FatStats *out)
+{
+    pthread_rwlock_rdlock(&vol->fat->lock);
+    bool ok = vol->fat->table != NULL;
+    if(ok) fat_scan_stats(vol->fat->table, vol->cluster_limit, out);
+    pthread_rwlock_unlock(&vol->fat->lock);
+    return ok;
+}
+
+//First run of `need` free clusters, or 0
+uint32_t fat_find_free_run(fat32_volume *vol, uint32_t need)
+{
+    pthread_rwlock_rdlock(&vol->fat->lock);
+    uint32_t c = vol->fat->table ? fat_scan_free_run(vol->fat->table, 2, vol->cluster_limit, need) : 0;
+    pthread_rwlock_unlock(&vol->fat->lock);
+    return c;
+}
+
+static bool free_chain_locked(fat32_volume *vol, uint32_t start, FatExtent **freed, size_t *freed_count);
+
+//Extend a chain using the largest contiguous free runs available
+static FatExtent *extend_locked(fat32_volume *vol, uint32_t start, size_t additional, size_t *extent_count)
+{
+    if(extent_count) *extent_count = 0;
+    if(additional == 0 || !free_map_build(vol)) return NULL;
+    if(vol->fat->free_clusters == FSINFO_UNKNOWN || additional > vol->fat->free_clusters) return NULL;
+
+    // find the tail; a chain longer than the volume must contain a loop
+    uint32_t tail = 0;
+    if(start != 0)
+    {
+        if(start < 2 || start >= vol->cluster_limit) return NULL;
+
+        tail = start;
+        uint32_t steps = 0;
+        uint32_t next;
+        while((next = entry_get(vol, tail)) >= 2 && next < 0x0FFFFFF8)
         {
-            uint32_t newc = fat_find_free_cluster();
-            if(!newc)
-            {
-                return false;
-            }
+            if(next >= vol->cluster_limit || ++steps >= vol->cluster_limit) return NULL;
+            tail = next;
+        }
+    }
+
+    size_t capacity = 4;
+    size_t count = 0;
+    FatExtent *extents = malloc(sizeof(FatExtent) * capacity);
+    if(!extents) return NULL;
 
-            fat_set_entry(cluster, newc);
-            fat_set_entry(newc, 0x0FFFFFFF);
+    size_t remaining = additional;
+    while(remaining > 0)
+    {
+        FatExtent run;
+        uint32_t need = remaining > UINT32_MAX ? UINT32_MAX : (uint32_t)remaining;
 
-            uint32_t off = cluster_to_offset(newc);
-            uint8_t zero[4096] = {0};
-            fseek(fat_img, off, SEEK_SET);
-            fwrite(zero, 1, cluster_size, fat_img);
+        // growing in place keeps the existing chain contiguous
+        if(tail && tail + 1 < vol->cluster_limit && (vol->fat->free_map[(tail + 1) / 64] >> ((tail + 1) % 64)) & 1)
+        {
+            run.start = tail + 1;
+            run.length = free_map_scan_used(vol, tail + 1, vol->cluster_limit) - run.start;
+            if(run.length > need) run.length = need;
+        }
+        else if(!free_map_pick_run(vol, need, &run))
+        {
+            break;  // free count was stale; keep what was linked so far
+        }
 
-            cluster = newc;
+        // link the run in, so the next search sees it as allocated
+        if(tail) entry_set(vol, tail, run.start);
+        for(uint32_t i = 0; i + 1 < run.length; i++)
+        {
+            entry_set(vol, run.start + i, run.start + i + 1);
+        }
+        entry_set(vol, run.start + run.length - 1, 0x0FFFFFFF);
+        tail = run.start + run.length - 1;
+
+        if(count > 0 && extents[count - 1].start + extents[count - 1].length == run.start)
+        {
+            extents[count - 1].length += run.length;
         }
         else
         {
-            cluster = next;
+            if(count >= capacity)
+            {
+                capacity *= 2;
+                FatExtent *grown = realloc(extents, sizeof(FatExtent) * capacity);
+                if(!grown) break;
+                extents = grown;
+            }
+            extents[count++] = run;
         }
+        remaining -= run.length;
     }
-}
-void fat32_close()  //Close FAT image, check if correct,
-{
-    if(fat_img)
-    {
-        fclose(fat_img);
-        fat_img = NULL;
+
+    vol->fat->next_free_hint = (tail + 1 < vol->cluster_limit) ? tail + 1 : 2;
+    vol->fat->fsinfo_dirty = true;
+
+    if(remaining > 0)
+    {
+        // undo a partial allocation so the caller sees all-or-nothing
+        if(start == 0 && count > 0)
+        {
+            free_chain_locked(vol, extents[0].start, NULL, NULL);
+        }
+        else if(start != 0)
+        {
+            uint32_t first_new = count > 0 ? extents[0].start : 0;
+            if(first_new)
+            {
+                uint32_t prev = start;
+                while(entry_get(vol, prev) != first_new) prev = entry_get(vol, prev);
+                entry_set(vol, prev, 0x0FFFFFFF);
+                free_chain_locked(vol, first_new, NULL, NULL);
+            }
+        }
+        free(extents);
+        return NULL;
+    }
+
+    if(extent_count) *extent_count = count;
+    return extents;
+}
+
+FatExtent *fat_extend_chain_extents(fat32_volume *vol, uint32_t start, size_t additional, size_t *extent_count)
+{
+    journal_begin(vol);
+    pthread_rwlock_wrlock(&vol->fat->lock);
+    FatExtent *extents = extend_locked(vol, start, additional, extent_count);
+    pthread_rwlock_unlock(&vol->fat->lock);
+    journal_end(vol);
+    return extents;
+}
+
+//Extend Cluster Chain
+bool fat_extend_chain(fat32_volume *vol, uint32_t start, size_t additional)
+{
+    if(additional == 0) return true;
+
+    size_t count;
+    FatExtent *extents = fat_extend_chain_extents(vol, start, additional, &count);
+    if(!extents) return false;
+
+    free(extents);
+    return true;
+}
+
+//Build CLuster Chain
+uint32_t *fat_get_chain(fat32_volume *vol, uint32_t start, size_t *count_out)
+{
+    size_t capacity = 16;
+    uint32_t *chain = malloc(sizeof(uint32_t) * capacity);
+    size_t count = 0;
+
+    pthread_rwlock_rdlock(&vol->fat->lock);
+    uint32_t cur = start;
+    while(cur >= 2 && cur < 0x0FFFFFF8 && count < vol->cluster_limit)
+    {
+        if(count >= capacity)
+        {
+            capacity *= 2;
+            chain = realloc(chain, sizeof(uint32_t) * capacity);
+        }
+        chain[count++] = cur;
+        cur = entry_get(vol, cur);
+    }
+
+    pthread_rwlock_unlock(&vol->fat->lock);
+
+    *count_out = count;
+    return chain;
+}
+
+//Build Cluster Chain as runs of contiguous clusters
+static bool chain_extents_locked(fat32_volume *vol, uint32_t start, FatChain *chain)
+{
+    if(!chain) return false;
+    chain->runs = NULL;
+    chain->first_index = NULL;
+    chain->run_count = 0;
+    chain->cluster_count = 0;
+    if(start < 2 || start >= vol->cluster_limit) return false;
+
+    size_t capacity = 4;
+    chain->runs = malloc(sizeof(FatExtent) * capacity);
+    chain->first_index = malloc(sizeof(uint32_t) * capacity);
+    if(!chain->runs || !chain->first_index)
+    {
+        fat_chain_free(chain);
+        return false;
+    }
+
+    // one pass over the cached FAT; a new run starts whenever next != cur + 1
+    uint32_t cur = start;
+    size_t count = 0;
+    while(1)
+    {
+        if(count >= vol->cluster_limit)
+        {
+            fat_chain_free(chain);  // longer than the volume: the chain loops
+            return false;
+        }
+
+        size_t r = chain->run_count;
+        if(r > 0 && chain->runs[r - 1].start + chain->runs[r - 1].length == cur)
+        {
+            chain->runs[r - 1].length++;
+        }
+        else
+        {
+            if(r >= capacity)
+            {
+                capacity *= 2;
+                FatExtent *runs = realloc(chain->runs, sizeof(FatExtent) * capacity);
+                uint32_t *idx = runs ? realloc(chain->first_index, sizeof(uint32_t) * capacity) : NULL;
+                if(runs) chain->runs = runs;
+                if(!idx)
+                {
+                    fat_chain_free(chain);
+                    return false;
+                }
+                chain->first_index = idx;
+            }
+            chain->runs[r].start = cur;
+            chain->runs[r].length = 1;
+            chain->first_index[r] = (uint32_t)count;
+            chain->run_count++;
+        }
+        count++;
+
+        uint32_t next = entry_get(vol, cur);
+        if(next >= 0x0FFFFFF8) break;
+        if(next < 2 || next >= vol->cluster_limit)
+        {
+            fat_chain_free(chain);  // free or out-of-range link
+            return false;
+        }
+        cur = next;
+    }
+
+    chain->cluster_count = count;
+    return true;
+}
+
+bool fat_get_chain_extents(fat32_volume *vol, uint32_t start, FatChain *chain)
+{
+    pthread_rwlock_rdlock(&vol->fat->lock);
+    bool ok = chain_extents_locked(vol, start, chain);
+    pthread_rwlock_unlock(&vol->fat->lock);
+    return ok;
+}
+
+//Release the arrays held by a FatChain
+void fat_chain_free(FatChain *chain)
+{
+    if(!chain) return;
+    free(chain->runs);
+    free(chain->first_index);
+    chain->runs = NULL;
+    chain->first_index = NULL;
+    chain->run_count = 0;
+    chain->cluster_count = 0;
+}
+
+//Binary search for the run holding the `index`-th cluster of the chain
+size_t fat_chain_find_run(const FatChain *chain, size_t index)
+{
+    size_t lo = 0;
+    size_t hi = chain->run_count;
+    while(hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if(chain->first_index[mid] <= index) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+//Cluster number at position `index` of the chain
+uint32_t fat_chain_cluster_at(const FatChain *chain, size_t index)
+{
+    if(!chain || index >= chain->cluster_count) return 0;
+
+    size_t r = fat_chain_find_run(chain, index);
+    return chain->runs[r].start + (uint32_t)(index - chain->first_index[r]);
+}
+
+//Translate a byte offset within the chain to a byte offset in the image
+bool fat_chain_offset(fat32_volume *vol, const FatChain *chain, uint64_t offset, uint64_t *disk_offset)
+{
+    if(!chain || vol->cluster_size == 0) return false;
+
+    uint32_t cluster = fat_chain_cluster_at(chain, (size_t)(offset / vol->cluster_size));
+    if(cluster == 0) return false;
+
+    if(disk_offset) *disk_offset = cluster_to_offset(vol, cluster) + offset % vol->cluster_size;
+    return true;
+}
+
+//Read a byte range of a chain, one device read per contiguous run
+bool fat_chain_read(fat32_volume *vol, const FatChain *chain, uint64_t offset, size_t len, void *buf)
+{
+    if(!chain || !buf || !vol->dev || vol->cluster_size == 0) return false;
+    if(len == 0) return true;
+    if(offset + len > (uint64_t)chain->cluster_count * vol->cluster_size) return false;
+
+    uint8_t *out = buf;
+    size_t r = fat_chain_find_run(chain, (size_t)(offset / vol->cluster_size));
+    uint64_t in_run = offset - (uint64_t)chain->first_index[r] * vol->cluster_size;
+    while(len > 0)
+    {
+        const FatExtent *run = &chain->runs[r++];
+        uint64_t avail = (uint64_t)run->length * vol->cluster_size - in_run;
+        size_t n = avail < len ? (size_t)avail : len;
+
+        if(!bdev_read(vol->dev, cluster_to_offset(vol, run->start) + in_run, out, n)) return false;
+        cache_overlay_dirty(vol, run->start, in_run, n, out);
+
+        out += n;
+        len -= n;
+        in_run = 0;
+    }
+    return true;
+}
+
+//Prefetch hint for part of a chain, one per contiguous run
+void fat_chain_prefetch(fat32_volume *vol, const FatChain *chain, size_t first, size_t count)
+{
+    if(!chain || !vol->dev || first >= chain->cluster_count) return;
+    if(count > chain->cluster_count - first) count = chain->cluster_count - first;
+
+    size_t r = fat_chain_find_run(chain, first);
+    uint32_t skip = (uint32_t)(first - chain->first_index[r]);
+    while(count > 0 && r < chain->run_count)
+    {
+        const FatExtent *run = &chain->runs[r++];
+        uint32_t n = run->length - skip;
+        if(n > count) n = (uint32_t)count;
+
+        bdev_prefetch(vol->dev, cluster_to_offset(vol, run->start + skip), (size_t)n * vol->cluster_size);
+        count -= n;
+        skip = 0;
+    }
+}
+
+void fat_dir_readahead(fat32_volume *vol, ReadAhead *ra, uint32_t cluster, size_t index)
+{
+    uint64_t from;
+    size_t count = ra_access(ra, index, 1, vol->cluster_size, &from);
+    if(count == 0 || !vol->dev) return;
+
+    // walk the in-memory FAT to the first cluster to prefetch
+    pthread_rwlock_rdlock(&vol->fat->lock);
+    for(uint64_t i = index; i < from; i++)
+    {
+        cluster = entry_get(vol, cluster);
+        if(cluster < 2 || cluster >= vol->cluster_limit)
+        {
+            pthread_rwlock_unlock(&vol->fat->lock);
+            return;
+        }
+    }
+
+    // hint contiguous stretches as single ranges
+    uint32_t run_start = cluster;
+    uint32_t run_len = 0;
+    while(count-- > 0)
+    {
+        if(run_len > 0 && cluster != run_start + run_len)
+        {
+            bdev_prefetch(vol->dev, cluster_to_offset(vol, run_start), (size_t)run_len * vol->cluster_size);
+            run_start = cluster;
+            run_len = 0;
+        }
+        run_len++;
+
+        uint32_t next = entry_get(vol, cluster);
+        if(next < 2 || next >= vol->cluster_limit) break;
+        cluster = next;
+    }
+    pthread_rwlock_unlock(&vol->fat->lock);
+    bdev_prefetch(vol->dev, cluster_to_offset(vol, run_start), (size_t)run_len * vol->cluster_size);
+}
+
+//Write a byte range of a chain, one device write per contiguous run
+bool fat_chain_write(fat32_volume *vol, const FatChain *chain, uint64_t offset, size_t len, const void *buf)
+{
+    if(!chain || !buf || !vol->dev || vol->cluster_size == 0) return false;
+    if(len == 0) return true;
+    if(offset + len > (uint64_t)chain->cluster_count * vol->cluster_size) return false;
+
+    const uint8_t *in = buf;
+    size_t r = fat_chain_find_run(chain, (size_t)(offset / vol->cluster_size));
+    uint64_t in_run = offset - (uint64_t)chain->first_index[r] * vol->cluster_size;
+    while(len > 0)
+    {
+        const FatExtent *run = &chain->runs[r++];
+        uint64_t avail = (uint64_t)run->length * vol->cluster_size - in_run;
+        size_t n = avail < len ? (size_t)avail : len;
+
+        if(!bdev_write(vol->dev, cluster_to_offset(vol, run->start) + in_run, in, n)) return false;
+        cache_update_range(vol, run->start, in_run, n, in);
+        journal_note_data(vol);
+
+        in += n;
+        len -= n;
+        in_run = 0;
+    }
+    return true;
+}
+
+//Add newly linked extents to the end of a FatChain
+bool fat_chain_append(FatChain *chain, const FatExtent *extents, size_t count)
+{
+    if(!chain) return false;
+
+    size_t capacity = chain->run_count + count + 1;
+    FatExtent *runs = realloc(chain->runs, sizeof(FatExtent) * capacity);
+    if(!runs) return false;
+    chain->runs = runs;
+    uint32_t *idx = realloc(chain->first_index, sizeof(uint32_t) * capacity);
+    if(!idx) return false;
+    chain->first_index = idx;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        size_t r = chain->run_count;
+        if(r > 0 && chain->runs[r - 1].start + chain->runs[r - 1].length == extents[i].start)
+        {
+            chain->runs[r - 1].length += extents[i].length;
+        }
+        else
+        {
+            chain->runs[r] = extents[i];
+            chain->first_index[r] = (uint32_t)chain->cluster_count;
+            chain->run_count++;
+        }
+        chain->cluster_count += extents[i].length;
+    }
+    return true;
+}
+
+bool read_file_range(fat32_volume *vol, uint32_t start_cluster, uint64_t offset, size_t len, void *buf)
+{
+    if(len == 0) return true;
+
+    FatChain chain;
+    if(!fat_get_chain_extents(vol, start_cluster, &chain)) return false;
+    bool ok = fat_chain_read(vol, &chain, offset, len, buf);
+    fat_chain_free(&chain);
+    return ok;
+}
+
+//Free Cluster Chain, collecting the freed clusters as runs in `*freed` if asked
+static bool free_chain_locked(fat32_volume *vol, uint32_t start, FatExtent **freed, size_t *freed_count)
+{
+    size_t cap = 0;
+    uint32_t cur = start;
+    while(cur >= 2 && cur < vol->cluster_limit)
+    {
+        uint32_t next = entry_get(vol, cur);
+        if(next == 0) break;    // already free: chain is damaged or looped
+        entry_set(vol, cur, 0);
+
+        if(freed)
+        {
+            FatExtent *last = *freed_count ? &(*freed)[*freed_count - 1] : NULL;
+            if(last && last->start + last->length == cur)
+            {
+                last->length++;
+            }
+            else
+            {
+                if(*freed_count == cap)
+                {
+                    cap = cap ? cap * 2 : 16;
+                    FatExtent *grown = realloc(*freed, cap * sizeof(FatExtent));
+                    if(!grown)
+                    {
+                        cache_invalidate(vol, cur);     // can't defer this one
+                        cur = next;
+                        continue;
+                    }
+                    *freed = grown;
+                }
+                (*freed)[(*freed_count)++] = (FatExtent){ cur, 1 };
+            }
+        }
+        cur = next;
+    }
+    return true;
+}
+
+bool fat_free_chain(fat32_volume *vol, uint32_t start)
+{
+    FatExtent *freed = NULL;
+    size_t freed_count = 0;
+
+    journal_begin(vol);
+    pthread_rwlock_wrlock(&vol->fat->lock);
+    bool ok = free_chain_locked(vol, start, &freed, &freed_count);
+    pthread_rwlock_unlock(&vol->fat->lock);
+
+    // cached contents of the freed clusters are dead; drop them under the
+    // read lock, which keeps the allocator from handing them out meanwhile
+    pthread_rwlock_rdlock(&vol->fat->lock);
+    for(size_t i = 0; i < freed_count; i++)
+    {
+        for(uint32_t c = freed[i].start; c < freed[i].start + freed[i].length; c++)
+        {
+            if(entry_get(vol, c) == 0) cache_invalidate(vol, c);
+        }
+    }
+    pthread_rwlock_unlock(&vol->fat->lock);
+    free(freed);
+
+    journal_end(vol);
+    return ok;
+}
+
+//Read All Directory Entries in a CLuster
+bool read_directory_cluster(fat32_volume *vol, uint32_t cluster, DirEntry *entries, size_t max, size_t *count_out)
+{
+    size_t count = vol->cluster_size / sizeof(DirEntry);
+    if(count > max) count = max;
+
+    *count_out = 0;
+    ClusterBuf *buf = cache_get(vol, cluster);
+    if(!buf)
+    {
+        return false;
+    }
+    memcpy(entries, buf->data, count * sizeof(DirEntry));
+    cache_put(vol, buf);
+
+    *count_out = count;
+    return (count > 0);
+}
+
+/* Read raw bytes of a cluster into `buffer`.
+ * Returns 0 on success, non-zero on failure.
+ */
+int read_cluster_bytes(fat32_volume *vol, uint32_t cluster, uint8_t *buffer)
+{
+    if (!buffer || !vol->dev || cluster < 2) return -1;
+
+    ClusterBuf *buf = cache_get(vol, cluster);
+    if (!buf) return -1;
+
+    memcpy(buffer, buf->data, (size_t)vol->cluster_size);
+    cache_put(vol, buf);
+
+    return 0;
+}
+
+uint32_t first_cluster_from_entry(const DirEntry *entry)
+{
+    uint32_t high = entry->DIR_FstClusHigh;
+    uint32_t low  = entry->DIR_FirstClusterLow;
+
+    return (high << 16) | low;
+}
+
+// Byte offsets of the 13 UTF-16 characters inside an LFN entry
+static const uint8_t lfn_char_offsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+
+//Checksum of a short name, stored in each of its LFN entries
+uint8_t lfn_checksum(const char short_name[11])
+{
+    uint8_t sum = 0;
+    for(int i = 0; i < 11; i++)
+    {
+        sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + (uint8_t)short_name[i]);
+    }
+    return sum;
+}
+
+bool dir_iter_open(fat32_volume *vol, DirIter *it, uint32_t dir_cluster)
+{
+    memset(it, 0, sizeof *it);
+    it->vol = vol;
+    if(dir_cluster < 2 || dir_cluster >= vol->cluster_limit) return false;
+
+    dir_lock_shared(vol, dir_cluster);
+    it->locked_dir = dir_cluster;
+    it->cluster = dir_cluster;
+    fat_dir_readahead(vol, &it->ra, dir_cluster, 0);
+    it->buf = cache_get(vol, dir_cluster);
+    return it->buf != NULL;
+}
+
+void dir_iter_close(DirIter *it)
+{
+    fat32_volume *vol = it->vol;
+    if(it->buf) cache_put(vol, it->buf);
+    it->buf = NULL;
+    if(it->locked_dir) dir_unlock(vol, it->locked_dir);
+    it->locked_dir = 0;
+}
+
+/* Single pass over the raw entries. LFN fragments are written straight
+ * into `long_name` at their final position as they are met (they are
+ * stored last-part-first), and the sequence is accepted only if every
+ * part arrived in order and the checksum matches the short entry. */
+bool dir_iter_next(DirIter *it)
+{
+    fat32_volume *vol = it->vol;
+    size_t per_cluster = vol->cluster_size / sizeof(DirEntry);
+
+    while(it->buf)
+    {
+        if(it->index >= per_cluster)
+        {
+            uint32_t next = fat_get_entry(vol, it->cluster);
+            if(next < 2 || next >= vol->cluster_limit || it->walk_index >= vol->cluster_limit)
+            {
+                // end of chain, or a free, out-of-range or looping link
+                it->error = next < 0x0FFFFFF8 || it->walk_index >= vol->cluster_limit;
+                dir_iter_close(it);
+                return false;
+            }
+            cache_put(vol, it->buf);
+            it->buf = NULL;
+
+            it->cluster = next;
+            it->index = 0;
+            it->block_len = 0;
+            fat_dir_readahead(vol, &it->ra, next, ++it->walk_index);
+            it->buf = cache_get(vol, next);
+            if(!it->buf) it->error = true;
+            continue;
+        }
+
+        if(it->index >= it->block_base + it->block_len)
+        {
+            // classify the next 64 entries at once so free and deleted runs are skipped
+            size_t n = per_cluster - it->index < 64 ? per_cluster - it->index : 64;
+            DirScanMask m;
+            dir_scan_classify((const DirEntry *)it->buf->data + it->index, n, &m);
+            it->block_used = m.used;
+            it->block_base = it->index;
+            it->block_len = n;
+            it->block_end = m.end < n;
+        }
+        uint64_t ahead = it->block_used >> (it->index - it->block_base);
+        if(ahead == 0)
+        {
+            if(it->block_end)
+            {
+                dir_iter_close(it);
+                return false;
+            }
+            it->lfn_expect = 0;     // only deleted slots left in the block
+            it->index = it->block_base + it->block_len;
+            continue;
+        }
+        if(!(ahead & 1))
+        {
+            it->lfn_expect = 0;
+            it->index += (size_t)__builtin_ctzll(ahead);
+        }
+
+        const uint8_t *raw = it->buf->data + it->index * sizeof(DirEntry);
+        uint64_t raw_off = cluster_to_offset(vol, it->cluster) + it->index * sizeof(DirEntry);
+        it->index++;
+
+        if(raw[0] == 0x00)
+        {
+            dir_iter_close(it);
+            return false;
+        }
+        if(raw[0] == 0xE5)
+        {
+            it->lfn_expect = 0;
+            continue;
+        }
+
+        if((raw[11] & 0x3F) == 0x0F)
+        {
+            it->lfn_seen++;
+            uint8_t seq = raw[0] & 0x1F;
+            if(seq == 0 || seq > 20)
+            {
+                it->lfn_expect = 0;     // 20 parts = 260 chars is the VFAT maximum
+                continue;
+            }
+            if(raw[0] & 0x40)
+            {
+                // last logical part comes first and fixes the length
+                it->lfn_sum = raw[13];
+                it->lfn_offset = raw_off;
+                it->long_len = (size_t)seq * 13;
+            }
+            else if(seq != it->lfn_expect - 1 || raw[13] != it->lfn_sum)
+            {
+                it->lfn_expect = 0;     // orphaned or out-of-order fragment
+                continue;
+            }
+            it->lfn_expect = seq;
+
+            uint16_t *dst = it->long_name + (size_t)(seq - 1) * 13;
+            for(int k = 0; k < 13; k++)
+            {
+                uint16_t ch = (uint16_t)(raw[lfn_char_offsets[k]] | (raw[lfn_char_offsets[k] + 1] << 8));
+                if(ch == 0x0000 && (raw[0] & 0x40))
+                {
+                    it->long_len = (size_t)(seq - 1) * 13 + (size_t)k;
+                    break;
+                }
+                dst[k] = ch;
+            }
+            continue;
+        }
+
+        memcpy(&it->entry, raw, sizeof(DirEntry));
+        it->offset = raw_off;
+        if(it->lfn_expect == 1 && lfn_checksum(it->entry.DIR_Name) == it->lfn_sum)
+        {
+            it->long_name[it->long_len] = 0;
+            it->first_offset = it->lfn_offset;
+        }
+        else
+        {
+            it->long_len = 0;
+            it->first_offset = raw_off;
+        }
+        it->lfn_expect = 0;
+        return true;
+    }
+    return false;
+}
+
+//Decode UTF-8 into UTF-16; returns the unit count, 0 if invalid or too long
+static size_t utf8_to_utf16(const char *in, uint16_t *out, size_t max)
+{
+    const uint8_t *p = (const uint8_t *)in;
+    size_t n = 0;
+    while(*p)
+    {
+        uint32_t cp;
+        int extra;
+        if(*p < 0x80)               { cp = *p; extra = 0; }
+        else if((*p & 0xE0) == 0xC0) { cp = *p & 0x1F; extra = 1; }
+        else if((*p & 0xF0) == 0xE0) { cp = *p & 0x0F; extra = 2; }
+        else if((*p & 0xF8) == 0xF0) { cp = *p & 0x07; extra = 3; }
+        else return 0;
+        p++;
+        for(int i = 0; i < extra; i++, p++)
+        {
+            if((*p & 0xC0) != 0x80) return 0;
+            cp = (cp << 6) | (*p & 0x3F);
+        }
+
+        if(cp >= 0x10000)
+        {
+            if(n + 2 > max) return 0;
+            cp -= 0x10000;
+            out[n++] = (uint16_t)(0xD800 | (cp >> 10));
+            out[n++] = (uint16_t)(0xDC00 | (cp & 0x3FF));
+        }
+        else
+        {
+            if(n + 1 > max) return 0;
+            out[n++] = (uint16_t)cp;
+        }
+    }
+    return n;
+}
+
+//Upper-case fold for ASCII and Latin-1, enough for FAT name matching
+static uint16_t fold_utf16(uint16_t c)
+{
+    if(c >= 'a' && c <= 'z') return (uint16_t)(c - 32);
+    if(c >= 0xE0 && c <= 0xFE && c != 0xF7) return (uint16_t)(c - 32);
+    return c;
+}
+
+size_t fold_name_utf8(const char *name, uint16_t *out, size_t max)
+{
+    size_t len = utf8_to_utf16(name, out, max);
+    fold_name_utf16(out, len);
+    return len;
+}
+
+void fold_name_utf16(uint16_t *name, size_t len)
+{
+    for(size_t i = 0; i < len; i++) name[i] = fold_utf16(name[i]);
+}
+
+uint64_t hash_folded_name(const uint16_t *name, size_t len)
+{
+    uint64_t h = 14695981039346656037ull;
+    for(size_t i = 0; i < len; i++)
+    {
+        h ^= name[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static bool long_name_equals(const uint16_t *name, size_t len, const uint16_t *folded_query, size_t qlen)
+{
+    if(len != qlen) return false;
+    for(size_t i = 0; i < len; i++)
+    {
+        if(fold_utf16(name[i]) != folded_query[i]) return false;
+    }
+    return true;
+}
+
+//Render a UTF-16 long name as UTF-8
+void format_long_name(const uint16_t *name, size_t len, char *out, size_t out_size)
+{
+    if(!out || out_size == 0) return;
+
+    size_t o = 0;
+    for(size_t i = 0; i < len; i++)
+    {
+        uint32_t cp = name[i];
+        if(cp >= 0xD800 && cp <= 0xDBFF && i + 1 < len && name[i + 1] >= 0xDC00 && name[i + 1] <= 0xDFFF)
+        {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (name[i + 1] - 0xDC00);
+            i++;
+        }
+
+        char enc[4];
+        size_t n;
+        if(cp < 0x80)         { enc[0] = (char)cp; n = 1; }
+        else if(cp < 0x800)   { enc[0] = (char)(0xC0 | (cp >> 6)); enc[1] = (char)(0x80 | (cp & 0x3F)); n = 2; }
+        else if(cp < 0x10000) { enc[0] = (char)(0xE0 | (cp >> 12)); enc[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+                                enc[2] = (char)(0x80 | (cp & 0x3F)); n = 3; }
+        else                  { enc[0] = (char)(0xF0 | (cp >> 18)); enc[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+                                enc[2] = (char)(0x80 | ((cp >> 6) & 0x3F)); enc[3] = (char)(0x80 | (cp & 0x3F)); n = 4; }
+
+        if(o + n >= out_size) break;
+        memcpy(out + o, enc, n);
+        o += n;
+    }
+    out[o] = '\0';
+}
+
+/* Short-name search without an index: the vector kernel jumps straight
+ * to the first matching entry (or the end marker) of each cluster. Only
+ * valid while no long name has been passed, since a long name earlier in
+ * the directory wins; `*decided` is cleared if one turns up first. */
+static bool find_short_entry(fat32_volume *vol, uint32_t cluster, const char key[11], DirEntry *out_entry,
+                             uint64_t *entry_offset, bool *decided)
+{
+    size_t per_cluster = vol->cluster_size / sizeof(DirEntry);
+    size_t hops = 0;
+    *decided = false;
+
+    while(cluster >= 2 && cluster < vol->cluster_limit && hops++ < vol->cluster_limit)
+    {
+        ClusterBuf *buf = cache_get(vol, cluster);
+        if(!buf)
+        {
+            return false;
+        }
+        const DirEntry *entries = (const DirEntry *)buf->data;
+        size_t hit = dir_scan_find(entries, per_cluster, key);
+        PERF_ADD(PERF_DIR_SCANNED, hit < per_cluster ? hit + 1 : per_cluster);
+
+        for(size_t block = 0; block < hit; block += 64)
+        {
+            DirScanMask m;
+            dir_scan_classify(entries + block, hit - block < 64 ? hit - block : 64, &m);
+            if(m.lfn)
+            {
+                cache_put(vol, buf);
+                return false;   // undecided: long names must be compared too
+            }
+        }
+
+        if(hit < per_cluster)
+        {
+            bool found = (uint8_t)entries[hit].DIR_Name[0] != 0x00;
+            if(found)
+            {
+                if(out_entry) *out_entry = entries[hit];
+                if(entry_offset) *entry_offset = cluster_to_offset(vol, cluster) + hit * sizeof(DirEntry);
+            }
+            cache_put(vol, buf);
+            *decided = true;
+            return found;
+        }
+        cache_put(vol, buf);
+
+        uint32_t next = fat_get_entry(vol, cluster);
+        if(next >= 0x0FFFFFF8)
+        {
+            *decided = true;
+            return false;
+        }
+        cluster = next;
+    }
+    return false;
+}
+
+//Find Specific Directory Entry; `ref` gets its offset, first cluster and attributes
+static bool find_entry(fat32_volume *vol, uint32_t cluster, const char *name, DirEntry *out_entry, DirIndexHit *ref)
+{
+    if(!name || !*name)
+    {
+        return false;
+    }
+
+    char key[11];
+    bool short_ok = format_name_83(name, key);
+
+    // fold the query once; entries are compared without any allocation
+    uint16_t query[256];
+    size_t qlen = fold_name_utf8(name, query, 255);
+    if(qlen == 0 && !short_ok)
+    {
+        return false;
+    }
+
+    // hashed lookup on the short and the long name; the directory is scanned once to build the index
+    switch(dir_index_lookup(vol, cluster, short_ok ? key : NULL, query, qlen, ref))
+    {
+        case DIR_INDEX_ABSENT:
+            return false;
+        case DIR_INDEX_FOUND:
+        {
+            if(!out_entry)
+            {
+                return true;    // the index holds all the caller wants
+            }
+            uint32_t holder = offset_to_cluster(vol, ref->offset);
+            ClusterBuf *buf = cache_get(vol, holder);
+            if(!buf)
+            {
+                return false;
+            }
+            memcpy(out_entry, buf->data + (ref->offset - cluster_to_offset(vol, holder)), sizeof(DirEntry));
+            cache_put(vol, buf);
+            return true;
+        }
+        case DIR_INDEX_NONE:
+            break;
+    }
+
+    DirEntry found_entry;
+    if(!out_entry) out_entry = &found_entry;
+    if(short_ok)
+    {
+        bool decided;
+        bool found = find_short_entry(vol, cluster, key, out_entry, &ref->offset, &decided);
+        if(decided)
+        {
+            ref->first_cluster = first_cluster_from_entry(out_entry);
+            ref->attr = out_entry->DIR_Attr;
+            return found;
+        }
+    }
+
+    DirIter it;
+    bool found = false;
+    if(dir_iter_open(vol, &it, cluster))
+    {
+        while(dir_iter_next(&it))
+        {
+            PERF_ADD(PERF_DIR_SCANNED, 1);
+            if((it.entry.DIR_Attr & 0x08))
+            {
+                continue;   // volume label
+            }
+            if((short_ok && memcmp(it.entry.DIR_Name, key, 11) == 0)
+               || (it.long_len > 0 && long_name_equals(it.long_name, it.long_len, query, qlen)))
+            {
+                *out_entry = it.entry;
+                ref->offset = it.offset;
+                ref->first_cluster = first_cluster_from_entry(&it.entry);
+                ref->attr = it.entry.DIR_Attr;
+                found = true;
+                break;
+            }
+        }
+        dir_iter_close(&it);
+    }
+
+    return found;
+}
+
+bool find_dir_entry(fat32_volume *vol, uint32_t cluster, const char *name, DirEntry *out_entry, uint64_t *entry_offset)
+{
+    DirIndexHit ref;
+    dir_lock_shared(vol, cluster);
+    bool found = find_entry(vol, cluster, name, out_entry, &ref);
+    dir_unlock(vol, cluster);
+    if(found && entry_offset) *entry_offset = ref.offset;
+    return found;
+}
+
+bool find_dir_child(fat32_volume *vol, uint32_t cluster, const char *name, uint32_t *first_cluster, uint8_t *attr)
+{
+    DirIndexHit ref;
+    dir_lock_shared(vol, cluster);
+    bool found = find_entry(vol, cluster, name, NULL, &ref);
+    dir_unlock(vol, cluster);
+    if(found && first_cluster) *first_cluster = ref.first_cluster;
+    if(found && attr) *attr = ref.attr;
+    return found;
+}
+
+//Read Directory Entry at Offset
+bool read_dir_entry(fat32_volume *vol, uint32_t cluster, uint64_t entry_offset, DirEntry *out_entry)
+{
+    uint32_t holder = offset_to_cluster(vol, entry_offset);
+    dir_lock_shared(vol, cluster);
+    ClusterBuf *buf = cache_get(vol, holder);
+    if(!buf)
+    {
+        dir_unlock(vol, cluster);
+        return false;
+    }
+
+    memcpy(out_entry, buf->data + (entry_offset - cluster_to_offset(vol, holder)), sizeof(DirEntry));
+    cache_put(vol, buf);
+    dir_unlock(vol, cluster);
+    return true;
+}
+
+//Entries a name lookup can return
+static bool entry_named(const DirEntry *e)
+{
+    uint8_t first = (uint8_t)e->DIR_Name[0];
+    return first != 0x00 && first != 0xE5 && (e->DIR_Attr & 0x3F) != 0x0F && !(e->DIR_Attr & 0x08);
+}
+
+//Write Directory Entry at Offset, with the directory locked exclusive
+
+static bool write_entry_locked(fat32_volume *vol, uint32_t cluster, uint64_t entry_offset, const DirEntry *entry)
+{
+    uint32_t holder = offset_to_cluster(vol, entry_offset);
+    ClusterBuf *buf = cache_get(vol, holder);
+    if(!buf)
+    {
+        return false;
+    }
+
+    size_t index = (size_t)(entry_offset - cluster_to_offset(vol, holder)) / sizeof(DirEntry);
+    DirEntry *slot = (DirEntry *)buf->data + index;
+    DirEntry old;
+    memcpy(&old, slot, sizeof(DirEntry));
+    memcpy(slot, entry, sizeof(DirEntry));
+    journal_log_data(vol, entry_offset, entry, sizeof(DirEntry));
+
+    // a short entry completes the long name whose fragments precede it;
+    // at the start of a cluster the previous slot is not at hand
+    bool after_lfn = index == 0 || ((slot[-1].DIR_Attr & 0x3F) == 0x0F
+                                    && (uint8_t)slot[-1].DIR_Name[0] != 0xE5 && (uint8_t)slot[-1].DIR_Name[0] != 0x00);
+    cache_mark_dirty(vol, buf);
+    cache_put(vol, buf);
+
+    dir_index_update(vol, cluster, entry_offset, &old, entry, after_lfn);
+    if((entry->DIR_Attr & 0x3F) == 0x0F || (old.DIR_Attr & 0x3F) == 0x0F)
+    {
+        dcache_drop_dir(vol, cluster);   // a long name can answer any lookup
+    }
+    else
+    {
+        dcache_invalidate_entry(vol, cluster, entry_offset);
+        if(entry_named(entry) && (!entry_named(&old) || memcmp(old.DIR_Name, entry->DIR_Name, 11) != 0))
+        {
+            dcache_new_name(vol, cluster);  // may answer lookups cached as missing
+        }
+    }
+    return true;
+}
+
+bool write_dir_entry(fat32_volume *vol, uint32_t cluster, uint64_t entry_offset, const DirEntry *entry)
+{
+    journal_begin(vol);
+    dir_lock_exclusive(vol, cluster);
+    bool ok = write_entry_locked(vol, cluster, entry_offset, entry);
+    dir_unlock(vol, cluster);
+    journal_end(vol);
+    return ok;
+}
+
+//Create Directory Entry (FInd free slot)
+bool create_dir_entry(fat32_volume *vol, uint32_t cluster, const DirEntry * new_entry)
+{
+    return create_dir_entries(vol, cluster, new_entry, 1) == 1;
+}
+
+//Create Directory Entries (fill free slots in one pass over the directory)
+size_t create_dir_entries(fat32_volume *vol, uint32_t cluster, const DirEntry *new_entries, size_t count)
+{
+    uint32_t dir_cluster = cluster;
+    size_t entries_per_cluster = vol->cluster_size / 32;
+    size_t done = 0;
+
+    journal_begin(vol);
+    dir_lock_exclusive(vol, dir_cluster);
+    while(done < count && cluster >= 2 && cluster < vol->cluster_limit)
+    {
+        ClusterBuf *buf = cache_get(vol, cluster);
+        if(!buf)
+        {
+            break;
+        }
+        const DirEntry *entries = (const DirEntry *)buf->data;
+
+        // free or deleted slots, 64 entries at a time
+        bool failed = false;
+        for(size_t block = 0; block < entries_per_cluster && done < count && !failed; block += 64)
+        {
+            size_t n = entries_per_cluster - block < 64 ? entries_per_cluster - block : 64;
+            DirScanMask m;
+            dir_scan_classify(entries + block, n, &m);
+            uint64_t free_slots = n < 64 ? ~m.used & ((1ull << n) - 1) : ~m.used;
+            while(free_slots && done < count)
+            {
+                uint64_t off = cluster_to_offset(vol, cluster) + (block + (size_t)__builtin_ctzll(free_slots)) * 32;
+                free_slots &= free_slots - 1;
+                if(!write_entry_locked(vol, dir_cluster, off, &new_entries[done]))
+                {
+                    failed = true;
+                    break;
+                }
+                done++;
+            }
+        }
+        cache_put(vol, buf);
+        if(failed || done == count)
+        {
+            break;
+        }
+
+        uint32_t next = fat_get_entry(vol, cluster);
+        if(next >= 0x0FFFFFF8)
+        {
+            // find and link the new cluster in one step, safe against other allocators
+            if(!fat_extend_chain(vol, cluster, 1))
+            {
+                break;
+            }
+            uint32_t newc = fat_get_entry(vol, cluster);
+
+            ClusterBuf *fresh = cache_get_zeroed(vol, newc);
+            if(!fresh)
+            {
+                break;
+            }
+            journal_log_zero(vol, cluster_to_offset(vol, newc), vol->cluster_size);
+            cache_put(vol, fresh);
+
+            cluster = newc;
+        }
+        else
+        {
+            cluster = next;
+        }
     }
-}
\ No newline at end of file
+    dir_unlock(vol, dir_cluster);
+    journal_end(vol);
+
+    return done;
+}
+
+//Create Directory (new cluster with "." and "..", then its entry)
+bool create_directory(fat32_volume *vol, uint32_t parent, const char name[11], uint32_t *cluster_out)
+{
+    journal_begin(vol);
+    size_t count;
+    FatExtent *ext = fat_extend_chain_extents(vol, 0, 1, &count);
+    uint32_t cluster = ext ? ext[0].start : 0;
+    free(ext);
+    bool ok = cluster != 0;
+
+    if(ok)
+    {
+        ClusterBuf *fresh = cache_get_zeroed(vol, cluster);
+        ok = fresh != NULL;
+        if(ok)
+        {
+            journal_log_zero(vol, cluster_to_offset(vol, cluster), vol->cluster_size);
+            cache_put(vol, fresh);
+        }
+    }
+
+    DirEntry e;
+    memset(&e, 0, sizeof e);
+    e.DIR_Attr = 0x10;
+    uint64_t off = ok ? cluster_to_offset(vol, cluster) : 0;
+    if(ok)
+    {
+        memcpy(e.DIR_Name, ".          ", 11);
+        e.DIR_FstClusHigh = (uint16_t)(cluster >> 16);
+        e.DIR_FirstClusterLow = (uint16_t)(cluster & 0xFFFF);
+        ok = write_dir_entry(vol, cluster, off, &e);
+    }
+    if(ok)
+    {
+        // ".." of a directory in the root points at cluster 0
+        uint32_t up = parent == vol->bpb.root_cluster ? 0 : parent;
+        memcpy(e.DIR_Name, "..         ", 11);
+        e.DIR_FstClusHigh = (uint16_t)(up >> 16);
+        e.DIR_FirstClusterLow = (uint16_t)(up & 0xFFFF);
+        ok = write_dir_entry(vol, cluster, off + sizeof(DirEntry), &e);
+    }
+    if(ok)
+    {
+        memcpy(e.DIR_Name, name, 11);
+        e.DIR_FstClusHigh = (uint16_t)(cluster >> 16);
+        e.DIR_FirstClusterLow = (uint16_t)(cluster & 0xFFFF);
+        ok = create_dir_entry(vol, parent, &e);
+    }
+
+    if(!ok && cluster)
+    {
+        fat_free_chain(vol, cluster);
+        dir_index_drop(vol, cluster);   // the only place a directory goes away
+        dcache_drop_dir(vol, cluster);
+    }
+    else if(ok && cluster_out)
+    {
+        *cluster_out = cluster;
+    }
+    journal_end(vol);
+    return ok;
+}
+
+//Release a volume; `flush` writes its dirty state back first
+static void volume_release(fat32_volume *vol, bool flush)
+{
+    if(!vol) return;
+
+    if(vol->dev)
+    {
+        bool clean = flush && vol->fat->table && fat32_flush(vol);
+        journal_close(vol, clean);
+        dir_index_shutdown(vol);
+        dcache_shutdown(vol);
+        cache_shutdown(vol);
+        bdev_close(vol->dev);
+    }
+
+    free(vol->fat->table);
+    free(vol->fat->dirty);
+    free(vol->fat->free_map);
+    pthread_rwlock_destroy(&vol->fat->lock);
+    for(int i = 0; i < DIR_LOCK_STRIPES; i++) pthread_rwlock_destroy(&vol->fat->dir_locks[i]);
+    free(vol->fat);
+    free(vol);
+}
+
+void fat32_close(fat32_volume *vol)  //Close FAT image, check if correct,
+{
+    volume_release(vol, true);
+}
@@ -0,0 +1,355 @@
+//FAT statistics kernels: scalar, SSE2 and AVX2, chosen at run time
+
+#include "fatscan.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAT_SCAN_X86 1
+#endif
+
+#define FAT_SCAN_CHUNK 4096         // entries packed per kernel call (a multiple of 64)
+#define FAT_ENTRY_MASK 0x0FFFFFFFu
+#define FAT_ENTRY_BAD  0x0FFFFFF7u
+
+// Per-entry link tests gathered alongside the free bitmap
+typedef struct
+{
+    uint64_t links;
+    uint64_t breaks;
+    uint64_t bad;
+} LinkCounts;
+
+/* A kernel packs `count` entries, standing for clusters `first`.., into
+ * (count + 63) / 64 words of `bits`, and adds to `counts` unless NULL. */
+typedef struct
+{
+    const char *name;
+    bool (*supported)(void);
+    void (*pack)(const uint32_t *e, size_t count, uint32_t first, uint32_t limit, uint64_t *bits, LinkCounts *counts);
+} ScanKernel;
+
+//Scalar packing of entries [from, count), into bits already cleared
+static void pack_scalar_from(const uint32_t *e, size_t from, size_t count, uint32_t first, uint32_t limit,
+                             uint64_t *bits, LinkCounts *counts)
+{
+    for(size_t i = from; i < count; i++)
+    {
+        uint32_t v = e[i] & FAT_ENTRY_MASK;
+        if(v == 0)
+        {
+            bits[i / 64] |= (uint64_t)1 << (i % 64);
+        }
+        else if(counts)
+        {
+            if(v == FAT_ENTRY_BAD) counts->bad++;
+            if(v >= 2 && v < limit)
+            {
+                counts->links++;
+                if(v != first + (uint32_t)i + 1) counts->breaks++;
+            }
+        }
+    }
+}
+
+static void pack_scalar(const uint32_t *e, size_t count, uint32_t first, uint32_t limit, uint64_t *bits, LinkCounts *counts)
+{
+    memset(bits, 0, (count + 63) / 64 * sizeof(uint64_t));
+    pack_scalar_from(e, 0, count, first, limit, bits, counts);
+}
+
+static bool always(void)
+{
+    return true;
+}
+
+#ifdef FAT_SCAN_X86
+
+/* Entries and cluster numbers stay below 2^28, so the signed 32-bit
+ * compares the vector units offer give the unsigned answers. A link is
+ * an entry in [2, limit); it breaks the run unless it equals its own
+ * cluster number + 1. */
+
+__attribute__((target("sse2")))
+static void pack_sse2(const uint32_t *e, size_t count, uint32_t first, uint32_t limit, uint64_t *bits, LinkCounts *counts)
+{
+    const __m128i mask = _mm_set1_epi32((int)FAT_ENTRY_MASK);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i four = _mm_set1_epi32(4);
+    const __m128i lim = _mm_set1_epi32((int)limit);
+    const __m128i bad = _mm_set1_epi32((int)FAT_ENTRY_BAD);
+    __m128i next = _mm_add_epi32(_mm_set1_epi32((int)first + 1), _mm_setr_epi32(0, 1, 2, 3));
+
+    // per-lane counters: a true compare is -1, so subtracting it counts
+    __m128i links = zero, breaks = zero, bads = zero;
+    size_t i = 0;
+    for(; i + 64 <= count; i += 64)
+    {
+        uint64_t word = 0;
+        for(int j = 0; j < 64; j += 4)
+        {
+            __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(const void *)(e + i + j)), mask);
+            word |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero))) << j;
+            if(counts)
+            {
+                __m128i link = _mm_and_si128(_mm_cmpgt_epi32(v, one), _mm_cmpgt_epi32(lim, v));
+                links = _mm_sub_epi32(links, link);
+                breaks = _mm_sub_epi32(breaks, _mm_andnot_si128(_mm_cmpeq_epi32(v, next), link));
+                bads = _mm_sub_epi32(bads, _mm_cmpeq_epi32(v, bad));
+                next = _mm_add_epi32(next, four);
+            }
+        }
+        bits[i / 64] = word;
+    }
+    if(counts)
+    {
+        uint32_t lane[3][4];
+        _mm_storeu_si128((__m128i *)(void *)lane[0], links);
+        _mm_storeu_si128((__m128i *)(void *)lane[1], breaks);
+        _mm_storeu_si128((__m128i *)(void *)lane[2], bads);
+        for(int l = 0; l < 4; l++)
+        {
+            counts->links += lane[0][l];
+            counts->breaks += lane[1][l];
+            counts->bad += lane[2][l];
+        }
+    }
+    if(i < count)
+    {
+        bits[i / 64] = 0;
+        pack_scalar_from(e, i, count, first, limit, bits, counts);
+    }
+}
+
+static bool has_sse2(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("avx2")))
+static void pack_avx2(const uint32_t *e, size_t count, uint32_t first, uint32_t limit, uint64_t *bits, LinkCounts *counts)
+{
+    const __m256i mask = _mm256_set1_epi32((int)FAT_ENTRY_MASK);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i eight = _mm256_set1_epi32(8);
+    const __m256i lim = _mm256_set1_epi32((int)limit);
+    const __m256i bad = _mm256_set1_epi32((int)FAT_ENTRY_BAD);
+    __m256i next = _mm256_add_epi32(_mm256_set1_epi32((int)first + 1), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+
+    __m256i links = zero, breaks = zero, bads = zero;
+    size_t i = 0;
+    for(; i + 64 <= count; i += 64)
+    {
+        uint64_t word = 0;
+        for(int j = 0; j < 64; j += 8)
+        {
+            __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(const void *)(e + i + j)), mask);
+            word |= (uint64_t)(uint8_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero))) << j;
+            if(counts)
+            {
+                __m256i link = _mm256_and_si256(_mm256_cmpgt_epi32(v, one), _mm256_cmpgt_epi32(lim, v));
+                links = _mm256_sub_epi32(links, link);
+                breaks = _mm256_sub_epi32(breaks, _mm256_andnot_si256(_mm256_cmpeq_epi32(v, next), link));
+                bads = _mm256_sub_epi32(bads, _mm256_cmpeq_epi32(v, bad));
+                next = _mm256_add_epi32(next, eight);
+            }
+        }
+        bits[i / 64] = word;
+    }
+    uint32_t lane[3][8];
+    _mm256_storeu_si256((__m256i *)(void *)lane[0], links);
+    _mm256_storeu_si256((__m256i *)(void *)lane[1], breaks);
+    _mm256_storeu_si256((__m256i *)(void *)lane[2], bads);
+    _mm256_zeroupper();     // the scalar tail and the caller run SSE code
+    if(counts)
+    {
+        for(int l = 0; l < 8; l++)
+        {
+            counts->links += lane[0][l];
+            counts->breaks += lane[1][l];
+            counts->bad += lane[2][l];
+        }
+    }
+    if(i < count)
+    {
+        bits[i / 64] = 0;
+        pack_scalar_from(e, i, count, first, limit, bits, counts);
+    }
+}
+
+static bool has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif // FAT_SCAN_X86
+
+// best first
+static const ScanKernel kernels[] = {
+#ifdef FAT_SCAN_X86
+    { "avx2", has_avx2, pack_avx2 },
+    { "sse2", has_sse2, pack_sse2 },
+#endif
+    { "scalar", always, pack_scalar },
+};
+
+#define KERNEL_COUNT (sizeof kernels / sizeof kernels[0])
+
+static const ScanKernel *active;    // NULL until first use
+
+static const ScanKernel *kernel(void)
+{
+    const ScanKernel *k = __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+    if(k) return k;
+
+    // racing first callers all pick the same kernel
+    for(size_t i = 0; i < KERNEL_COUNT; i++)
+    {
+        if(kernels[i].supported())
+        {
+            k = &kernels[i];
+            break;
+        }
+    }
+    __atomic_store_n(&active, k, __ATOMIC_RELEASE);
+    return k;
+}
+
+//Index of the first set (or, with `invert`, clear) bit at or after `from`, or `nbits`
+static size_t next_bit(const uint64_t *bits, size_t nbits, size_t from, bool invert)
+{
+    if(from >= nbits) return nbits;
+    size_t w = from / 64;
+    uint64_t x = (invert ? ~bits[w] : bits[w]) & (~(uint64_t)0 << (from % 64));
+    while(1)
+    {
+        if(x)
+        {
+            size_t p = w * 64 + (size_t)__builtin_ctzll(x);
+            return p < nbits ? p : nbits;
+        }
+        if(++w * 64 >= nbits) return nbits;
+        x = invert ? ~bits[w] : bits[w];
+    }
+}
+
+static void close_run(FatStats *st, FatExtent *run)
+{
+    if(st)
+    {
+        int bucket = 63 - __builtin_clzll(run->length);
+        st->free_runs++;
+        st->run_histogram[bucket < FAT_RUN_BUCKETS ? bucket : FAT_RUN_BUCKETS - 1]++;
+        if(run->length > st->largest_run.length) st->largest_run = *run;
+    }
+    run->length = 0;
+}
+
+/* Follow free runs through `nbits` bits standing for clusters `base`..,
+ * continuing the open `run` from the previous chunk. Closed runs are
+ * recorded in `st` (if not NULL). With `need` set, returns the start of
+ * the first run to reach `need` clusters as soon as it does, else 0. */
+static uint32_t walk_runs(const uint64_t *bits, size_t nbits, uint32_t base, FatExtent *run, FatStats *st, uint32_t need)
+{
+    size_t pos = 0;
+    while(pos < nbits)
+    {
+        if(run->length == 0)
+        {
+            pos = next_bit(bits, nbits, pos, false);
+            if(pos == nbits) break;
+            run->start = base + (uint32_t)pos;
+        }
+        size_t used = next_bit(bits, nbits, pos, true);
+        run->length += (uint32_t)(used - pos);
+        pos = used;
+        if(need && run->length >= need) return run->start;
+        if(pos < nbits) close_run(st, run);
+    }
+    return 0;
+}
+
+void fat_scan_stats(const uint32_t *table, uint32_t limit, FatStats *out)
+{
+    memset(out, 0, sizeof *out);
+    const ScanKernel *k = kernel();
+    uint64_t bits[FAT_SCAN_CHUNK / 64];
+    LinkCounts counts = { 0, 0, 0 };
+    FatExtent run = { 0, 0 };
+
+    for(uint32_t c = 2; c < limit; )
+    {
+        size_t n = limit - c < FAT_SCAN_CHUNK ? limit - c : FAT_SCAN_CHUNK;
+        k->pack(table + c, n, c, limit, bits, &counts);
+        for(size_t w = 0; w < (n + 63) / 64; w++) out->free_clusters += (uint64_t)__builtin_popcountll(bits[w]);
+        if(!out->first_free)
+        {
+            size_t f = next_bit(bits, n, 0, false);
+            if(f < n) out->first_free = c + (uint32_t)f;
+        }
+        walk_runs(bits, n, c, &run, out, 0);
+        c += (uint32_t)n;
+    }
+    if(run.length) close_run(out, &run);
+
+    out->used_clusters = (limit > 2 ? limit - 2 : 0) - out->free_clusters;
+    out->bad_clusters = counts.bad;
+    out->links = counts.links;
+    out->breaks = counts.breaks;
+}
+
+uint32_t fat_scan_free_run(const uint32_t *table, uint32_t from, uint32_t limit, uint32_t need)
+{
+    const ScanKernel *k = kernel();
+    uint64_t bits[FAT_SCAN_CHUNK / 64];
+    FatExtent run = { 0, 0 };
+    if(need == 0) need = 1;
+    if(from < 2) from = 2;
+
+    for(uint32_t c = from; c < limit; )
+    {
+        size_t n = limit - c < FAT_SCAN_CHUNK ? limit - c : FAT_SCAN_CHUNK;
+        k->pack(table + c, n, c, limit, bits, NULL);
+        uint32_t start = walk_runs(bits, n, c, &run, NULL, need);
+        if(start) return start;
+        c += (uint32_t)n;
+    }
+    return 0;
+}
+
+uint32_t fat_scan_free_bits(const uint32_t *table, uint32_t limit, uint64_t *bits)
+{
+    const ScanKernel *k = kernel();
+    uint32_t count = 0;
+
+    // chunks start at multiples of 64 so each lands on whole words of `bits`
+    for(uint32_t c = 0; c < limit; c += FAT_SCAN_CHUNK)
+    {
+        size_t n = limit - c < FAT_SCAN_CHUNK ? limit - c : FAT_SCAN_CHUNK;
+        uint64_t *words = bits + c / 64;
+        k->pack(table + c, n, c, limit, words, NULL);
+        if(c == 0) words[0] &= ~(uint64_t)3;   // clusters 0 and 1 are reserved
+        for(size_t w = 0; w < (n + 63) / 64; w++) count += (uint32_t)__builtin_popcountll(words[w]);
+    }
+    return count;
+}
+
+const char *fat_scan_kernel(void)
+{
+    return kernel()->name;
+}
+
+bool fat_scan_use(const char *name)
+{
+    for(size_t i = 0; i < KERNEL_COUNT; i++)
+    {
+        if(strcmp(kernels[i].name, name) == 0 && kernels[i].supported())
+        {
+            __atomic_store_n(&active, &kernels[i], __ATOMIC_RELEASE);
+            return true;
+        }
+    }
+    return false;
+}
@@ -4,4 +4,422 @@
 -write file data
 -update file size
 -cluster chain traversal for file offsets*/
-#include "file.h"
\ No newline at end of file
+#define _POSIX_C_SOURCE 200809L
+
+#include "file.h"
+#include "dir.h"
+#include <pthread.h>
+#include <string.h>
+
+static OpenFile table[MAX_NUM_FILES];
+
+/* `table_lock` guards which slots are in use and how many operations hold
+ * each; `file_locks[fd]` guards the contents of slot fd while an operation
+ * runs on it, so operations on different descriptors proceed in parallel.
+ * A waiter for a busy descriptor holds only that descriptor's lock, never
+ * `table_lock`. Order: table, then file. */
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t file_locks[MAX_NUM_FILES];
+static unsigned users[MAX_NUM_FILES];           // operations that acquired the slot
+static bool closing[MAX_NUM_FILES];             // file_close is waiting for users to drain
+static pthread_cond_t drained = PTHREAD_COND_INITIALIZER;
+static pthread_once_t file_locks_once = PTHREAD_ONCE_INIT;
+
+static void file_locks_init(void)
+{
+    for(int i = 0; i < MAX_NUM_FILES; i++) pthread_mutex_init(&file_locks[i], NULL);
+}
+
+int file_parse_mode(const char *flags)
+{
+    if(!flags) return 0;
+    if(strcmp(flags, "-r") == 0) return FILE_MODE_READ;
+    if(strcmp(flags, "-w") == 0) return FILE_MODE_WRITE;
+    if(strcmp(flags, "-rw") == 0 || strcmp(flags, "-wr") == 0) return FILE_MODE_READ | FILE_MODE_WRITE;
+    return 0;
+}
+
+static OpenFile *slot(int fd)
+{
+    if(fd < 0 || fd >= MAX_NUM_FILES || !table[fd].in_use) return NULL;
+    return &table[fd];
+}
+
+//Lock and return open descriptor `fd`, or NULL; release with `release`
+static OpenFile *acquire(int fd)
+{
+    pthread_once(&file_locks_once, file_locks_init);
+    pthread_mutex_lock(&table_lock);
+    OpenFile *f = slot(fd);
+    if(f && closing[fd]) f = NULL;
+    if(f) users[fd]++;      // keeps the slot from being closed and reused
+    pthread_mutex_unlock(&table_lock);
+
+    if(f) pthread_mutex_lock(&file_locks[fd]);
+    return f;
+}
+
+static void release(OpenFile *f)
+{
+    int fd = (int)(f - table);
+    pthread_mutex_unlock(&file_locks[fd]);
+
+    pthread_mutex_lock(&table_lock);
+    if(--users[fd] == 0 && closing[fd]) pthread_cond_broadcast(&drained);
+    pthread_mutex_unlock(&table_lock);
+}
+
+//Resolve `path` to its entry and the first cluster of the directory holding it
+static bool resolve_file(fat32_volume *vol, const DirSession *session, const char *path, DirEntry *entry,
+                         uint64_t *entry_offset, uint32_t *dir_cluster)
+{
+    uint32_t dir = session->cwd_cluster;
+    const char *base = path;
+
+    const char *slash = strrchr(path, '/');
+    if(slash)
+    {
+        char dir_path[256];
+        size_t len = (size_t)(slash - path);
+        if(len >= sizeof dir_path) return false;
+        memcpy(dir_path, path, len);
+        dir_path[len] = '\0';
+
+        DirEntry d;
+        if(!dir_resolve(vol, dir, len == 0 ? "/" : dir_path, &d, NULL) || !(d.DIR_Attr & 0x10)) return false;
+        dir = first_cluster_from_entry(&d);
+        base = slash + 1;
+    }
+    if(*base == '\0') base = ".";   // trailing slash names a directory
+
+    if(!dir_resolve(vol, dir, base, entry, entry_offset)) return false;
+    *dir_cluster = dir;
+    return true;
+}
+
+//Point the cursor at cluster `index` of the chain. Sequential access stays
+//in the current run or steps to the next; anything else is a binary search.
+static void cursor_seek(OpenFile *f, size_t index)
+{
+    const FatChain *c = &f->chain;
+    f->cur_index = index;
+    if(index >= c->cluster_count) return;
+
+    size_t r = f->cur_run;
+    if(r < c->run_count && index >= c->first_index[r] && index - c->first_index[r] < c->runs[r].length)
+        return;
+    if(r + 1 < c->run_count && index >= c->first_index[r + 1]
+       && index - c->first_index[r + 1] < c->runs[r + 1].length)
+    {
+        f->cur_run = r + 1;
+        return;
+    }
+    f->cur_run = fat_chain_find_run(c, index);
+}
+
+int file_open_at(fat32_volume *vol, const DirSession *session, const char *path, int mode)
+{
+    if(mode == 0 || (mode & ~(FILE_MODE_READ | FILE_MODE_WRITE))) return FILE_ERR_BAD_MODE;
+    if(!path || strlen(path) >= sizeof table[0].name) return FILE_ERR_NOT_FOUND;
+
+    DirEntry e;
+    uint64_t off;
+    uint32_t dir;
+    if(!resolve_file(vol, session, path, &e, &off, &dir)) return FILE_ERR_NOT_FOUND;
+    if(e.DIR_Attr & 0x10) return FILE_ERR_IS_DIR;
+
+    FatChain chain = {0};
+    uint32_t start = first_cluster_from_entry(&e);
+    if(start != 0 && !fat_get_chain_extents(vol, start, &chain)) return FILE_ERR_IO;
+
+    // the entry's location identifies the file, whatever path reached it
+    pthread_once(&file_locks_once, file_locks_init);
+    pthread_mutex_lock(&table_lock);
+    int fd = FILE_ERR_TABLE_FULL;
+    for(int i = 0; i < MAX_NUM_FILES; i++)
+    {
+        if(table[i].in_use && table[i].vol == vol && table[i].entry_offset == off)
+        {
+            fd = FILE_ERR_ALREADY_OPEN;
+            break;
+        }
+        if(!table[i].in_use && fd < 0) fd = i;
+    }
+    if(fd >= 0)
+    {
+        OpenFile *f = &table[fd];
+        memset(f, 0, sizeof *f);
+        f->in_use = true;
+        f->vol = vol;
+        strcpy(f->name, path);
+        snprintf(f->path, sizeof f->path, "%s", session->cwd_path);
+        f->mode = mode;
+        f->dir_cluster = dir;
+        f->entry_offset = off;
+        f->start_cluster = start;
+        f->size = e.DIR_FileSize;
+        f->chain = chain;
+    }
+    pthread_mutex_unlock(&table_lock);
+
+    if(fd < 0) fat_chain_free(&chain);
+    return fd;
+}
+
+int file_close(int fd)
+{
+    pthread_once(&file_locks_once, file_locks_init);
+    pthread_mutex_lock(&table_lock);
+    OpenFile *f = slot(fd);
+    if(f && closing[fd]) f = NULL;      // another close got there first
+    if(f)
+    {
+        // new operations are turned away; running ones finish without table_lock held
+        closing[fd] = true;
+        while(users[fd] > 0) pthread_cond_wait(&drained, &table_lock);
+        fat_chain_free(&f->chain);
+        memset(f, 0, sizeof *f);
+        closing[fd] = false;
+    }
+    pthread_mutex_unlock(&table_lock);
+    return f ? FILE_OK : FILE_ERR_NOT_OPEN;
+}
+
+void file_close_all(fat32_volume *vol)
+{
+    for(int i = 0; i < MAX_NUM_FILES; i++)
+    {
+        OpenFile *f = acquire(i);
+        if(!f) continue;
+        bool mine = f->vol == vol;
+        release(f);
+        if(mine) file_close(i);
+    }
+}
+
+int file_find(const char *name)
+{
+    if(!name) return FILE_ERR_NOT_OPEN;
+
+    int fd = FILE_ERR_NOT_OPEN;
+    pthread_mutex_lock(&table_lock);
+    for(int i = 0; i < MAX_NUM_FILES; i++)
+    {
+        if(table[i].in_use && strcmp(table[i].name, name) == 0)
+        {
+            fd = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&table_lock);
+    return fd;
+}
+
+const OpenFile *file_get(int fd)
+{
+    return slot(fd);
+}
+
+int file_lseek(int fd, uint64_t offset)
+{
+    OpenFile *f = acquire(fd);
+    if(!f) return FILE_ERR_NOT_OPEN;
+
+    int err = FILE_ERR_RANGE;
+    if(offset <= f->size)
+    {
+        f->offset = offset;
+        cursor_seek(f, (size_t)(offset / f->vol->cluster_size));
+        err = FILE_OK;
+    }
+    release(f);
+    return err;
+}
+
+static long read_locked(OpenFile *f, void *buf, size_t len)
+{
+    if(!(f->mode & FILE_MODE_READ)) return FILE_ERR_BAD_MODE;
+
+    // clamp to the file size and to what the chain actually holds
+    uint64_t end = f->size;
+    uint64_t chain_bytes = (uint64_t)f->chain.cluster_count * f->vol->cluster_size;
+    if(end > chain_bytes) end = chain_bytes;
+    if(f->offset >= end) return f->offset < f->size && len > 0 ? FILE_ERR_IO : 0;
+
+    size_t done = end - f->offset < len ? (size_t)(end - f->offset) : len;
+    if(!fat_chain_read(f->vol, &f->chain, f->offset, done, buf)) return FILE_ERR_IO;
+
+    // prefetch ahead of a sequential reader while it consumes this data
+    uint64_t first = f->offset / f->vol->cluster_size;
+    uint64_t last = (f->offset + done - 1) / f->vol->cluster_size;
+    uint64_t from;
+    size_t ahead = ra_access(&f->ra, first, (size_t)(last - first + 1), f->vol->cluster_size, &from);
+    if(ahead > 0) fat_chain_prefetch(f->vol, &f->chain, (size_t)from, ahead);
+
+    f->offset += done;
+    cursor_seek(f, (size_t)(f->offset / f->vol->cluster_size));
+    return (long)done;
+}
+
+long file_read(int fd, void *buf, size_t len)
+{
+    OpenFile *f = acquire(fd);
+    if(!f) return FILE_ERR_NOT_OPEN;
+
+    long n = read_locked(f, buf, len);
+    release(f);
+    return n;
+}
+
+//Give back clusters a failed write added after `old_tail` and reload the chain
+static void undo_extend(OpenFile *f, uint32_t old_tail, uint32_t first_new)
+{
+    if(old_tail) fat_set_entry(f->vol, old_tail, 0x0FFFFFFF);
+    fat_free_chain(f->vol, first_new);
+
+    fat_chain_free(&f->chain);
+    if(f->start_cluster != 0) fat_get_chain_extents(f->vol, f->start_cluster, &f->chain);
+}
+
+static long write_locked(OpenFile *f, const void *buf, size_t len)
+{
+    if(!(f->mode & FILE_MODE_WRITE)) return FILE_ERR_BAD_MODE;
+    if(len == 0) return 0;
+
+    uint64_t end = f->offset + len;
+    if(end > UINT32_MAX) return FILE_ERR_TOO_BIG;  // DIR_FileSize is 32 bits
+
+    // allocate everything the write needs up front, in as few runs as possible
+    size_t need = (size_t)((end + f->vol->cluster_size - 1) / f->vol->cluster_size);
+    uint32_t old_tail = 0;
+    uint32_t first_new = 0;
+    if(need > f->chain.cluster_count)
+    {
+        if(f->chain.run_count > 0)
+        {
+            const FatExtent *last = &f->chain.runs[f->chain.run_count - 1];
+            old_tail = last->start + last->length - 1;
+        }
+
+        // passing the tail rather than the start saves walking the chain
+        size_t count;
+        FatExtent *added = fat_extend_chain_extents(f->vol, old_tail, need - f->chain.cluster_count, &count);
+        if(!added) return FILE_ERR_NO_SPACE;
+        first_new = added[0].start;
+
+        bool ok = fat_chain_append(&f->chain, added, count);
+        free(added);
+        if(!ok)
+        {
+            undo_extend(f, old_tail, first_new);
+            return FILE_ERR_IO;
+        }
+    }
+
+    if(!fat_chain_write(f->vol, &f->chain, f->offset, len, buf))
+    {
+        if(first_new) undo_extend(f, old_tail, first_new);
+        return FILE_ERR_IO;
+    }
+
+    // one directory entry update per write, and only when something changed;
+    // `f` takes the new size and start only once the entry holds them
+    if(end > f->size || f->start_cluster == 0)
+    {
+        uint32_t start = f->start_cluster ? f->start_cluster : f->chain.runs[0].start;
+        uint32_t size = end > f->size ? (uint32_t)end : f->size;
+        DirEntry e;
+        bool ok = read_dir_entry(f->vol, f->dir_cluster, f->entry_offset, &e);
+        if(ok)
+        {
+            e.DIR_FstClusHigh = (uint16_t)(start >> 16);
+            e.DIR_FirstClusterLow = (uint16_t)(start & 0xFFFF);
+            e.DIR_FileSize = size;
+            ok = write_dir_entry(f->vol, f->dir_cluster, f->entry_offset, &e);
+        }
+        if(!ok)
+        {
+            if(first_new) undo_extend(f, old_tail, first_new);
+            return FILE_ERR_IO;
+        }
+        f->start_cluster = start;
+        f->size = size;
+    }
+
+    f->offset = end;
+    cursor_seek(f, (size_t)(f->offset / f->vol->cluster_size));
+    return (long)len;
+}
+
+long file_write(int fd, const void *buf, size_t len)
+{
+    OpenFile *f = acquire(fd);
+    if(!f) return FILE_ERR_NOT_OPEN;
+
+    fat_txn_begin(f->vol);      // allocation, data and entry update commit together
+    long n = write_locked(f, buf, len);
+    fat_txn_end(f->vol);
+    release(f);
+    return n;
+}
+
+long file_append(int fd, const void *buf, size_t len)
+{
+    OpenFile *f = acquire(fd);
+    if(!f) return FILE_ERR_NOT_OPEN;
+
+    f->offset = f->size;
+    cursor_seek(f, (size_t)(f->offset / f->vol->cluster_size));
+    fat_txn_begin(f->vol);
+    long n = write_locked(f, buf, len);
+    fat_txn_end(f->vol);
+    release(f);
+    return n;
+}
+
+static const char *mode_string(int mode)
+{
+    switch(mode)
+    {
+        case FILE_MODE_READ:                   return "-r";
+        case FILE_MODE_WRITE:                  return "-w";
+        case FILE_MODE_READ | FILE_MODE_WRITE: return "-rw";
+    }
+    return "?";
+}
+
+void file_lsof(void)
+{
+    bool any = false;
+    for(int i = 0; i < MAX_NUM_FILES; i++)
+    {
+        OpenFile *f = acquire(i);
+        if(!f) continue;
+        if(!any) printf("INDEX\tNAME\tMODE\tOFFSET\tPATH\n");
+        any = true;
+
+        printf("%d\t%s\t%s\t%llu\t%s\n", i, f->name, mode_string(f->mode),
+               (unsigned long long)f->offset, f->path);
+        release(f);
+    }
+    if(!any) printf("No files are currently open.\n");
+}
+
+const char *file_strerror(int err)
+{
+    switch(err)
+    {
+        case FILE_OK:               return "success";
+        case FILE_ERR_NOT_FOUND:    return "no such file";
+        case FILE_ERR_IS_DIR:       return "is a directory";
+        case FILE_ERR_ALREADY_OPEN: return "file is already open";
+        case FILE_ERR_TABLE_FULL:   return "too many open files";
+        case FILE_ERR_BAD_MODE:     return "invalid mode";
+        case FILE_ERR_NOT_OPEN:     return "file is not open";
+        case FILE_ERR_IO:           return "I/O error";
+        case FILE_ERR_RANGE:        return "offset is past the end of the file";
+        case FILE_ERR_NO_SPACE:     return "no space left on the volume";
+        case FILE_ERR_TOO_BIG:      return "file would exceed 4 GiB";
+    }
+    return "unknown error";
+}
@@ -0,0 +1,467 @@
+//Parallel consistency check: chains, cross-links, lost clusters, FAT mirrors
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "fsck.h"
+#include "cache.h"
+#include "dirscan.h"
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FSCK_MAX_THREADS 64
+#define FSCK_FAT_BATCH 65536            // FAT entries copied per lock hold
+#define FSCK_MIRROR_CHUNK (1u << 20)    // bytes of each FAT copy compared per read
+
+// Per-worker deque of directories still to scan. The owner pushes and
+// pops at the bottom (depth first, good locality); thieves take from the
+// top, which holds the oldest and usually largest subtrees.
+typedef struct
+{
+    pthread_mutex_t lock;
+    uint32_t *items;        // first clusters of directories
+    size_t top;
+    size_t bottom;
+    size_t capacity;
+} TaskDeque;
+
+typedef struct Scan Scan;
+
+typedef struct
+{
+    Scan *scan;
+    unsigned id;
+    TaskDeque deque;
+    FsckReport counts;      // this worker's share of the report
+} Worker;
+
+struct Scan
+{
+    fat32_volume *vol;
+    uint64_t *owned;        // bit per cluster: claimed by a reachable chain
+    uint64_t *crossed;      // bit per cluster: claimed more than once
+    Worker *workers;
+    unsigned nworkers;
+    size_t pending;         // directories queued or being scanned (atomic)
+    FsckVisit visit;
+    void *ctx;
+};
+
+static bool deque_push(TaskDeque *d, uint32_t dir)
+{
+    pthread_mutex_lock(&d->lock);
+    if(d->bottom == d->capacity)
+    {
+        if(d->top > 0)
+        {
+            // reuse the space freed by steals before growing
+            memmove(d->items, d->items + d->top, (d->bottom - d->top) * sizeof(uint32_t));
+            d->bottom -= d->top;
+            d->top = 0;
+        }
+        else
+        {
+            size_t cap = d->capacity ? d->capacity * 2 : 64;
+            uint32_t *grown = realloc(d->items, cap * sizeof(uint32_t));
+            if(!grown)
+            {
+                pthread_mutex_unlock(&d->lock);
+                return false;
+            }
+            d->items = grown;
+            d->capacity = cap;
+        }
+    }
+    d->items[d->bottom++] = dir;
+    pthread_mutex_unlock(&d->lock);
+    return true;
+}
+
+static bool deque_take(TaskDeque *d, bool from_top, uint32_t *dir)
+{
+    bool ok = false;
+    pthread_mutex_lock(&d->lock);
+    if(d->bottom > d->top)
+    {
+        *dir = from_top ? d->items[d->top++] : d->items[--d->bottom];
+        if(d->top == d->bottom) d->top = d->bottom = 0;
+        ok = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+//Set the ownership bit of `cluster`; false (and a cross-link) if it was set
+static bool claim(Worker *w, uint32_t cluster, bool count_cross)
+{
+    Scan *s = w->scan;
+    uint64_t bit = (uint64_t)1 << (cluster % 64);
+    if(!(__atomic_fetch_or(&s->owned[cluster / 64], bit, __ATOMIC_RELAXED) & bit))
+    {
+        w->counts.used_clusters++;
+        return true;
+    }
+    if(count_cross && !(__atomic_fetch_or(&s->crossed[cluster / 64], bit, __ATOMIC_RELAXED) & bit))
+    {
+        w->counts.cross_linked++;
+    }
+    return false;
+}
+
+/* Follow the chain at `start` and claim its clusters. Returns the number
+ * of clusters in a well-formed chain, or 0 if it is broken (it is still
+ * claimed up to the break). `*owner` is set if the first cluster was not
+ * claimed before, i.e. this reference is the one to descend through. */
+static size_t check_chain(Worker *w, uint32_t start, bool *owner)
+{
+    fat32_volume *vol = w->scan->vol;
+    *owner = false;
+    if(start < 2 || start >= vol->cluster_limit)
+    {
+        w->counts.bad_chains++;
+        return 0;
+    }
+
+    size_t count;
+    uint32_t *chain = fat_get_chain(vol, start, &count);
+    if(!chain)
+    {
+        w->counts.io_errors++;
+        return 0;
+    }
+
+    // the walk stops at the volume size, so a chain that long must loop
+    bool loops = count >= vol->cluster_limit - 2;
+    size_t valid = 0;
+    while(valid < count && chain[valid] < vol->cluster_limit) valid++;
+
+    bool ok = !loops && valid == count && count > 0
+              && fat_get_entry(vol, chain[count - 1]) >= 0x0FFFFFF8;   // not free, bad or reserved
+
+    for(size_t i = 0; i < valid; i++)
+    {
+        // a loop runs into its own clusters; that is not a cross-link
+        bool fresh = claim(w, chain[i], !loops);
+        if(i == 0) *owner = fresh;
+        if(!fresh && loops) break;
+    }
+    free(chain);
+
+    if(!ok)
+    {
+        w->counts.bad_chains++;
+        return 0;
+    }
+    return count;
+}
+
+static void queue_dir(Worker *w, uint32_t dir);
+
+//Check the chain of one entry found in `dir`
+static void check_entry(Worker *w, uint32_t dir, const DirEntry *e)
+{
+    Scan *s = w->scan;
+    fat32_volume *vol = s->vol;
+    if(e->DIR_Name[0] == '.') return;  // "." and ".." point at clusters owned elsewhere
+
+    if(s->visit) s->visit(vol, dir, e, s->ctx);
+
+    uint32_t start = first_cluster_from_entry(e);
+    bool owner;
+    if(e->DIR_Attr & 0x10)
+    {
+        w->counts.directories++;
+        // descend once per directory, however many entries point at it
+        if(check_chain(w, start, &owner) > 0 && owner) queue_dir(w, start);
+        return;
+    }
+
+    w->counts.files++;
+    if(start == 0)
+    {
+        if(e->DIR_FileSize != 0) w->counts.size_mismatches++;
+        return;
+    }
+    size_t have = check_chain(w, start, &owner);
+    size_t need = ((size_t)e->DIR_FileSize + vol->cluster_size - 1) / vol->cluster_size;
+    if(have > 0 && have != need) w->counts.size_mismatches++;
+}
+
+//Scan one directory: check every entry's chain, queue subdirectories
+static void scan_dir(Worker *w, uint32_t dir)
+{
+    fat32_volume *vol = w->scan->vol;
+    size_t per_cluster = vol->cluster_size / sizeof(DirEntry);
+
+    // the chain was checked and claimed by whoever queued the directory
+    size_t count;
+    uint32_t *chain = fat_get_chain(vol, dir, &count);
+    if(!chain)
+    {
+        w->counts.io_errors++;
+        return;
+    }
+
+    bool end = false;
+    for(size_t c = 0; c < count && !end; c++)
+    {
+        // scan the cached cluster in place (the mapping itself on a mapped image)
+        ClusterBuf *buf = cache_get(vol, chain[c]);
+        if(!buf)
+        {
+            w->counts.io_errors++;
+            break;
+        }
+        const DirEntry *entries = (const DirEntry *)buf->data;
+
+        // classify 64 entries at a time; deleted, LFN and label slots never reach check_entry
+        for(size_t block = 0; block < per_cluster && !end; block += 64)
+        {
+            size_t len = per_cluster - block < 64 ? per_cluster - block : 64;
+            DirScanMask m;
+            dir_scan_classify(entries + block, len, &m);
+            for(uint64_t named = m.named; named; named &= named - 1)
+            {
+                check_entry(w, dir, &entries[block + (size_t)__builtin_ctzll(named)]);
+            }
+            end = m.end < len;
+        }
+        cache_put(vol, buf);
+    }
+    free(chain);
+}
+
+static void queue_dir(Worker *w, uint32_t dir)
+{
+    Scan *s = w->scan;
+    __atomic_add_fetch(&s->pending, 1, __ATOMIC_RELAXED);
+    if(!deque_push(&w->deque, dir))
+    {
+        scan_dir(w, dir);   // out of memory: scan it here instead
+        __atomic_sub_fetch(&s->pending, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static bool steal(Worker *w, uint32_t *dir)
+{
+    Scan *s = w->scan;
+    for(unsigned k = 1; k < s->nworkers; k++)
+    {
+        Worker *victim = &s->workers[(w->id + k) % s->nworkers];
+        if(deque_take(&victim->deque, true, dir)) return true;
+    }
+    return false;
+}
+
+static void *walk_main(void *arg)
+{
+    Worker *w = arg;
+    Scan *s = w->scan;
+
+    while(1)
+    {
+        uint32_t dir;
+        if(!deque_take(&w->deque, false, &dir) && !steal(w, &dir))
+        {
+            // nothing queued anywhere; done once nobody can queue more
+            if(__atomic_load_n(&s->pending, __ATOMIC_ACQUIRE) == 0) break;
+            sched_yield();
+            continue;
+        }
+        scan_dir(w, dir);
+        __atomic_sub_fetch(&s->pending, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/* Second pass, split evenly between the workers: count free and lost
+ * clusters in this worker's slice of the FAT, and compare its slice of
+ * FAT sectors between the first FAT and every mirror. */
+static void *sweep_main(void *arg)
+{
+    Worker *w = arg;
+    Scan *s = w->scan;
+    fat32_volume *vol = s->vol;
+
+    uint32_t span = vol->cluster_limit - 2;
+    uint32_t lo = 2 + (uint32_t)((uint64_t)span * w->id / s->nworkers);
+    uint32_t hi = 2 + (uint32_t)((uint64_t)span * (w->id + 1) / s->nworkers);
+
+    uint32_t *fat = malloc(FSCK_FAT_BATCH * sizeof(uint32_t));
+    if(!fat)
+    {
+        w->counts.io_errors++;
+        return NULL;
+    }
+    for(uint32_t c = lo; c < hi; c += FSCK_FAT_BATCH)
+    {
+        size_t n = hi - c < FSCK_FAT_BATCH ? hi - c : FSCK_FAT_BATCH;
+        fat_get_entries(vol, c, n, fat);
+        for(size_t i = 0; i < n; i++)
+        {
+            uint32_t cl = c + (uint32_t)i;
+            if(fat[i] == 0) w->counts.free_clusters++;
+            else if(fat[i] != 0x0FFFFFF7 && !((s->owned[cl / 64] >> (cl % 64)) & 1))
+                w->counts.lost_clusters++;  // allocated, not bad, and unreachable
+        }
+    }
+    free(fat);
+
+    uint32_t bps = vol->bpb.bytes_per_sector;
+    uint32_t sec_lo = (uint32_t)((uint64_t)vol->bpb.fat_size * w->id / s->nworkers);
+    uint32_t sec_hi = (uint32_t)((uint64_t)vol->bpb.fat_size * (w->id + 1) / s->nworkers);
+    uint32_t batch = FSCK_MIRROR_CHUNK / bps ? FSCK_MIRROR_CHUNK / bps : 1;
+    uint8_t *primary = malloc((size_t)batch * bps);
+    uint8_t *mirror = malloc((size_t)batch * bps);
+    if(!primary || !mirror)
+    {
+        w->counts.io_errors++;
+        sec_hi = sec_lo;
+    }
+
+    for(uint32_t sec = sec_lo; sec < sec_hi; sec += batch)
+    {
+        uint32_t n = sec_hi - sec < batch ? sec_hi - sec : batch;
+        uint64_t off = ((uint64_t)vol->first_fat_sector + sec) * bps;
+        if(!bdev_read(vol->dev, off, primary, (size_t)n * bps))
+        {
+            w->counts.io_errors++;
+            continue;
+        }
+        for(int m = 1; m < vol->bpb.num_fats; m++)
+        {
+            uint64_t moff = off + (uint64_t)m * vol->bpb.fat_size * bps;
+            if(!bdev_read(vol->dev, moff, mirror, (size_t)n * bps))
+            {
+                w->counts.io_errors++;
+                continue;
+            }
+            for(uint32_t k = 0; k < n; k++)
+            {
+                if(memcmp(primary + (size_t)k * bps, mirror + (size_t)k * bps, bps) != 0)
+                    w->counts.mirror_mismatches++;
+            }
+        }
+    }
+    free(primary);
+    free(mirror);
+    return NULL;
+}
+
+//Run `fn` on every worker, the calling thread acting as worker 0
+static void run_workers(Scan *s, void *(*fn)(void *))
+{
+    pthread_t tids[FSCK_MAX_THREADS];
+    unsigned started = 1;
+    for(unsigned i = 1; i < s->nworkers; i++)
+    {
+        if(pthread_create(&tids[i], NULL, fn, &s->workers[i]) != 0) break;
+        started++;
+    }
+    if(started < s->nworkers)
+    {
+        // could not start them all: the sweep slices must still be covered
+        for(unsigned i = started; i < s->nworkers && fn == sweep_main; i++) fn(&s->workers[i]);
+    }
+    fn(&s->workers[0]);
+    for(unsigned i = 1; i < started; i++) pthread_join(tids[i], NULL);
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+bool fsck_run(fat32_volume *vol, unsigned threads, FsckVisit visit, void *ctx, FsckReport *report)
+{
+    memset(report, 0, sizeof *report);
+    double t0 = now_seconds();
+
+    if(threads == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (unsigned)cpus : 1;
+    }
+    if(threads > FSCK_MAX_THREADS) threads = FSCK_MAX_THREADS;
+
+    Scan s;
+    memset(&s, 0, sizeof s);
+    s.vol = vol;
+    s.visit = visit;
+    s.ctx = ctx;
+    s.nworkers = threads;
+
+    size_t words = (vol->cluster_limit + 63) / 64;
+    s.owned = calloc(words, sizeof(uint64_t));
+    s.crossed = calloc(words, sizeof(uint64_t));
+    s.workers = calloc(threads, sizeof(Worker));
+    bool ok = s.owned && s.crossed && s.workers;
+    for(unsigned i = 0; ok && i < threads; i++)
+    {
+        Worker *w = &s.workers[i];
+        w->scan = &s;
+        w->id = i;
+        pthread_mutex_init(&w->deque.lock, NULL);
+    }
+
+    if(ok)
+    {
+        // the root has no entry of its own; claim its chain and start there
+        report->free_reported = fat_free_count(vol);
+        bool owner;
+        if(check_chain(&s.workers[0], vol->bpb.root_cluster, &owner) > 0) queue_dir(&s.workers[0], vol->bpb.root_cluster);
+        run_workers(&s, walk_main);
+        run_workers(&s, sweep_main);
+    }
+    else
+    {
+        report->io_errors++;
+    }
+
+    for(unsigned i = 0; s.workers && i < threads; i++)
+    {
+        Worker *w = &s.workers[i];
+        report->directories += w->counts.directories;
+        report->files += w->counts.files;
+        report->used_clusters += w->counts.used_clusters;
+        report->bad_chains += w->counts.bad_chains;
+        report->cross_linked += w->counts.cross_linked;
+        report->size_mismatches += w->counts.size_mismatches;
+        report->lost_clusters += w->counts.lost_clusters;
+        report->free_clusters += w->counts.free_clusters;
+        report->mirror_mismatches += w->counts.mirror_mismatches;
+        report->io_errors += w->counts.io_errors;
+
+        if(w->scan) pthread_mutex_destroy(&w->deque.lock);
+        free(w->deque.items);
+    }
+    free(s.workers);
+    free(s.owned);
+    free(s.crossed);
+
+    report->threads = threads;
+    report->seconds = now_seconds() - t0;
+
+    return report->bad_chains == 0 && report->cross_linked == 0 && report->size_mismatches == 0
+           && report->lost_clusters == 0 && report->mirror_mismatches == 0 && report->io_errors == 0
+           && (report->free_reported == 0xFFFFFFFF || report->free_reported == report->free_clusters);
+}
+
+void fsck_print(const FsckReport *r)
+{
+    printf("%u directories, %u files, %llu clusters in use, %u free\n", r->directories, r->files,
+           (unsigned long long)r->used_clusters, r->free_clusters);
+    if(r->bad_chains) printf("%u broken cluster chains\n", r->bad_chains);
+    if(r->cross_linked) printf("%u cross-linked clusters\n", r->cross_linked);
+    if(r->size_mismatches) printf("%u files whose size does not match their chain\n", r->size_mismatches);
+    if(r->lost_clusters) printf("%u lost clusters\n", r->lost_clusters);
+    if(r->mirror_mismatches) printf("%u FAT mirror sectors differ from the first FAT\n", r->mirror_mismatches);
+    if(r->free_reported != 0xFFFFFFFF && r->free_reported != r->free_clusters)
+        printf("free count is %u, FSInfo says %u\n", r->free_clusters, r->free_reported);
+    if(r->io_errors) printf("%u I/O errors\n", r->io_errors);
+    printf("checked in %.3f s with %u threads\n", r->seconds, r->threads);
+}
@@ -0,0 +1,694 @@
+//Metadata write-ahead journal with group commit
+
+#define _GNU_SOURCE         // pread/pwrite/fdatasync with -std=c99
+
+#include "journal.h"
+#include "fat.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JOURNAL_MAGIC "FATJRNL1"
+#define JOURNAL_VERSION 1
+#define JOURNAL_HEADER_BYTES 64
+#define TXN_MAGIC 0x4E58544Au          // "JTXN"
+#define TXN_HEADER_BYTES 24
+
+// Record types. FAT_SET sets `count` entries from `first` to `value`;
+// FAT_LINK links `count` entries from `first` each to the next cluster.
+enum
+{
+    JREC_FAT_SET = 1,       // u32 first, u32 count, u32 value
+    JREC_FAT_LINK = 2,      // u32 first, u32 count
+    JREC_DATA = 3,          // u64 off, u32 len, len bytes
+    JREC_ZERO = 4           // u64 off, u32 len
+};
+
+/* On-disk layout. The file starts with a JOURNAL_HEADER_BYTES header:
+ *   0  magic[8]  8 version  12 bytes_per_sector  16 total_sectors
+ *   20 first_seq (u64)  28 crc of bytes 0..27
+ * followed by transactions, each a TXN_HEADER_BYTES header
+ *   0 magic  4 crc of the payload  8 seq (u64)  16 payload bytes  20 records
+ * and its payload of records. Replay takes transactions first_seq,
+ * first_seq + 1, ... and stops at the first one that is missing, torn
+ * (short or failing its checksum) or out of sequence. */
+
+typedef struct
+{
+    uint8_t *data;
+    size_t len;             // bytes used, TXN_HEADER_BYTES reserved at the front
+    size_t cap;
+} LogBuf;
+
+/* Per-volume journal state (fat32_volume.journal). */
+typedef struct Journal
+{
+    fat32_volume *vol;
+    int fd;
+    char *path;
+    uint64_t tail;          // file offset of the next transaction
+
+    /* `lock` guards everything below. Handles count themselves in
+     * `handles`; a commit raises `barrier` to hold off new handles until
+     * the ones in flight end, then swaps `running` for `spare` and drops
+     * the barrier before writing, so operations continue into the next
+     * transaction while the previous one is being synced. `committing`
+     * gives one thread at a time the file. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_key_t depth;    // handle nesting of the calling thread
+    size_t handles;
+    bool barrier;
+    bool committing;
+    LogBuf running;
+    LogBuf spare;
+    uint64_t seq;           // running transaction; read without the lock
+    uint64_t durable;       // newest transaction on disk; read without the lock
+    size_t blocks;          // clusters dirtied by the running transaction
+    size_t max_blocks;
+    size_t last_fat;        // offset in `running` of its last record if that is a FAT record, else 0
+    bool data_dirty;        // file data written since the last commit; atomic
+    bool failed;            // a journal write failed; read without the lock
+
+    // commit thread
+    pthread_t thread;
+    pthread_cond_t tick;
+    bool kick;
+    bool stop;
+} Journal;
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+//CRC-32C (Castagnoli) table
+static void crc_init(void)
+{
+    for(uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for(int k = 0; k < 8; k++) c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1)));
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32c(const void *data, size_t len)
+{
+    pthread_once(&crc_once, crc_init);
+    const uint8_t *p = data;
+    uint32_t c = 0xFFFFFFFFu;
+    while(len--) c = crc_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    return ~c;
+}
+
+//Sidecar path for an image, malloc'd
+static char *sidecar_path(const char *img_path)
+{
+    size_t n = strlen(img_path);
+    char *path = malloc(n + sizeof ".journal");
+    if(path)
+    {
+        memcpy(path, img_path, n);
+        memcpy(path + n, ".journal", sizeof ".journal");
+    }
+    return path;
+}
+
+static bool full_pread(int fd, uint64_t off, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    while(len > 0)
+    {
+        ssize_t n = pread(fd, p, len, (off_t)off);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return false;
+        p += n;
+        off += (uint64_t)n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool full_pwrite(int fd, uint64_t off, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    while(len > 0)
+    {
+        ssize_t n = pwrite(fd, p, len, (off_t)off);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return false;
+        p += n;
+        off += (uint64_t)n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+//Write a header naming `first_seq` as the first transaction to replay
+static bool write_header(int fd, const fat32_volume *vol, uint64_t first_seq)
+{
+    uint8_t h[JOURNAL_HEADER_BYTES];
+    memset(h, 0, sizeof h);
+    uint32_t version = JOURNAL_VERSION;
+    uint32_t bps = vol->bpb.bytes_per_sector;
+    memcpy(h, JOURNAL_MAGIC, 8);
+    memcpy(h + 8, &version, 4);
+    memcpy(h + 12, &bps, 4);
+    memcpy(h + 16, &vol->bpb.total_sectors, 4);
+    memcpy(h + 20, &first_seq, 8);
+    uint32_t crc = crc32c(h, 28);
+    memcpy(h + 28, &crc, 4);
+    return full_pwrite(fd, 0, h, sizeof h) && fdatasync(fd) == 0;
+}
+
+static bool log_reserve(LogBuf *b, size_t more)
+{
+    if(b->len + more <= b->cap) return true;
+    size_t cap = b->cap ? b->cap : 4096;
+    while(cap < b->len + more) cap *= 2;
+    uint8_t *grown = realloc(b->data, cap);
+    if(!grown) return false;
+    b->data = grown;
+    b->cap = cap;
+    return true;
+}
+
+//Empty a buffer, keeping room for the transaction header
+static bool log_reset(LogBuf *b)
+{
+    b->len = 0;
+    if(!log_reserve(b, TXN_HEADER_BYTES)) return false;
+    memset(b->data, 0, TXN_HEADER_BYTES);
+    b->len = TXN_HEADER_BYTES;
+    return true;
+}
+
+
+// ---- replay ----
+
+//Apply the records of one transaction
+static bool apply_records(fat32_volume *vol, const uint8_t *p, size_t len, uint32_t records, JournalFatFn fat_fn)
+{
+    const uint8_t *end = p + len;
+    for(uint32_t r = 0; r < records; r++)
+    {
+        if(p >= end) return false;
+        uint8_t type = *p++;
+        uint32_t first, count, value = 0, n;
+        uint64_t off;
+        switch(type)
+        {
+        case JREC_FAT_SET:
+        case JREC_FAT_LINK:
+            if(end - p < (type == JREC_FAT_SET ? 12 : 8)) return false;
+            memcpy(&first, p, 4);
+            memcpy(&count, p + 4, 4);
+            if(type == JREC_FAT_SET) memcpy(&value, p + 8, 4);
+            p += type == JREC_FAT_SET ? 12 : 8;
+            if(first >= vol->cluster_limit || count > vol->cluster_limit - first) return false;
+            for(uint32_t i = 0; i < count; i++)
+                fat_fn(vol, first + i, type == JREC_FAT_SET ? value : first + i + 1);
+            break;
+        case JREC_DATA:
+        case JREC_ZERO:
+            if(end - p < 12) return false;
+            memcpy(&off, p, 8);
+            memcpy(&n, p + 8, 4);
+            p += 12;
+            if(type == JREC_DATA)
+            {
+                if((size_t)(end - p) < n || !bdev_write(vol->dev, off, p, n)) return false;
+                p += n;
+            }
+            else if(!bdev_zero(vol->dev, off, n))
+            {
+                return false;
+            }
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+int journal_replay(fat32_volume *vol, const char *img_path, JournalFatFn fat_fn)
+{
+    char *path = sidecar_path(img_path);
+    if(!path) return -1;
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if(fd < 0) return errno == ENOENT ? 0 : -1;
+
+    // a missing or torn header means the journal was never used
+    uint8_t h[JOURNAL_HEADER_BYTES];
+    uint32_t crc, bps, total;
+    uint64_t seq;
+    if(!full_pread(fd, 0, h, sizeof h) || memcmp(h, JOURNAL_MAGIC, 8) != 0
+       || (memcpy(&crc, h + 28, 4), crc != crc32c(h, 28)))
+    {
+        close(fd);
+        return 0;
+    }
+    memcpy(&bps, h + 12, 4);
+    memcpy(&total, h + 16, 4);
+    memcpy(&seq, h + 20, 8);
+    if(bps != vol->bpb.bytes_per_sector || total != vol->bpb.total_sectors)
+    {
+        printf("Journal does not belong to this image\n");
+        close(fd);
+        return -1;
+    }
+
+    int applied = 0;
+    uint64_t off = JOURNAL_HEADER_BYTES;
+    uint8_t *payload = NULL;
+    for(;;)
+    {
+        uint8_t t[TXN_HEADER_BYTES];
+        uint32_t magic, len, records;
+        uint64_t tseq;
+        if(!full_pread(fd, off, t, sizeof t)) break;
+        memcpy(&magic, t, 4);
+        memcpy(&crc, t + 4, 4);
+        memcpy(&tseq, t + 8, 8);
+        memcpy(&len, t + 16, 4);
+        memcpy(&records, t + 20, 4);
+        if(magic != TXN_MAGIC || tseq != seq) break;
+
+        uint8_t *grown = realloc(payload, len ? len : 1);
+        if(!grown) break;
+        payload = grown;
+        if(!full_pread(fd, off + TXN_HEADER_BYTES, payload, len) || crc32c(payload, len) != crc) break;
+
+        if(!apply_records(vol, payload, len, records, fat_fn))
+        {
+            applied = -1;
+            break;
+        }
+        applied++;
+        seq++;
+        off += TXN_HEADER_BYTES + len;
+    }
+
+    free(payload);
+    close(fd);
+    return applied;
+}
+
+void journal_remove(const char *img_path)
+{
+    char *path = sidecar_path(img_path);
+    if(path) unlink(path);
+    free(path);
+}
+
+
+// ---- commit ----
+
+//Write a closed transaction at `at` and sync it
+static bool write_txn(Journal *j, LogBuf *b, uint64_t seq, uint64_t at)
+{
+    // ordered: file data the metadata points at reaches the image first
+    if(__atomic_exchange_n(&j->data_dirty, false, __ATOMIC_ACQ_REL) && !bdev_flush(j->vol->dev)) return false;
+
+    uint32_t magic = TXN_MAGIC;
+    uint32_t len = (uint32_t)(b->len - TXN_HEADER_BYTES);
+    uint32_t records = 0;
+    uint32_t crc = crc32c(b->data + TXN_HEADER_BYTES, len);
+    memcpy(&records, b->data + 20, 4);     // counted into the header slot by log_record
+    memcpy(b->data, &magic, 4);
+    memcpy(b->data + 4, &crc, 4);
+    memcpy(b->data + 8, &seq, 8);
+    memcpy(b->data + 16, &len, 4);
+
+    return full_pwrite(j->fd, at, b->data, b->len) && fdatasync(j->fd) == 0;
+}
+
+//Close the running transaction and write it. Called with the lock held,
+//the file owned (`committing`) and no handles in flight. The lock is
+//dropped while writing; unless `hold`, so is the barrier, and the next
+//transaction fills up meanwhile.
+static bool flush_running(Journal *j, bool hold)
+{
+    if(j->running.len == TXN_HEADER_BYTES) return !j->failed;
+
+    uint64_t seq = j->seq;
+    uint64_t at = j->tail;
+    LogBuf out = j->running;
+    j->running = j->spare;
+    j->spare = out;
+    bool ok = log_reset(&j->running);
+    j->blocks = 0;
+    j->last_fat = 0;
+    __atomic_store_n(&j->seq, seq + 1, __ATOMIC_RELEASE);
+
+    if(!hold)
+    {
+        j->barrier = false;
+        pthread_cond_broadcast(&j->cond);
+    }
+    pthread_mutex_unlock(&j->lock);
+    ok = ok && !j->failed && write_txn(j, &out, seq, at);
+    pthread_mutex_lock(&j->lock);
+
+    j->spare = out;     // keep the memory for the transaction after next
+    if(ok)
+    {
+        j->tail = at + out.len;
+        __atomic_store_n(&j->durable, seq, __ATOMIC_RELEASE);
+    }
+    else if(!j->failed)
+    {
+        // blocks are never held back for a journal that can't be written
+        printf("Journal write failed, continuing without crash safety\n");
+        __atomic_store_n(&j->failed, true, __ATOMIC_RELEASE);
+    }
+    return ok;
+}
+
+//Own the file with no handles in flight
+static void quiesce(Journal *j)
+{
+    while(j->committing) pthread_cond_wait(&j->cond, &j->lock);
+    j->committing = true;
+    j->barrier = true;
+    while(j->handles > 0) pthread_cond_wait(&j->cond, &j->lock);
+}
+
+static void release(Journal *j)
+{
+    j->committing = false;
+    j->barrier = false;
+    pthread_cond_broadcast(&j->cond);
+}
+
+bool journal_commit(fat32_volume *vol)
+{
+    Journal *j = vol->journal;
+    if(!j) return true;
+
+    pthread_mutex_lock(&j->lock);
+    uint64_t target = j->seq;
+    while(j->durable < target && !j->failed)
+    {
+        // a commit in progress may be writing `target` for us
+        if(j->committing)
+        {
+            pthread_cond_wait(&j->cond, &j->lock);
+            continue;
+        }
+        // nothing of ours is in the running transaction, or its write failed
+        if(j->seq != target || j->running.len == TXN_HEADER_BYTES) break;
+
+        quiesce(j);
+        flush_running(j, false);
+        release(j);
+    }
+    bool ok = !j->failed;
+    pthread_mutex_unlock(&j->lock);
+    return ok;
+}
+
+void journal_checkpoint_begin(fat32_volume *vol)
+{
+    Journal *j = vol->journal;
+    if(!j) return;
+
+    pthread_mutex_lock(&j->lock);
+    quiesce(j);
+    flush_running(j, true);
+    pthread_mutex_unlock(&j->lock);
+}
+
+void journal_checkpoint_end(fat32_volume *vol, bool ok)
+{
+    Journal *j = vol->journal;
+    if(!j) return;
+
+    pthread_mutex_lock(&j->lock);
+    // header first: once it names the next sequence number the old
+    // transactions can never be replayed, whatever the truncate leaves
+    if(ok && !j->failed && write_header(j->fd, vol, j->seq) && ftruncate(j->fd, JOURNAL_HEADER_BYTES) == 0)
+    {
+        j->tail = JOURNAL_HEADER_BYTES;
+    }
+    release(j);
+    pthread_mutex_unlock(&j->lock);
+}
+
+
+// ---- handles and records ----
+
+void journal_begin(fat32_volume *vol)
+{
+    Journal *j = vol->journal;
+    if(!j) return;
+
+    uintptr_t depth = (uintptr_t)pthread_getspecific(j->depth);
+    if(depth == 0)
+    {
+        pthread_mutex_lock(&j->lock);
+        while(j->barrier) pthread_cond_wait(&j->cond, &j->lock);
+        j->handles++;
+        pthread_mutex_unlock(&j->lock);
+    }
+    pthread_setspecific(j->depth, (void *)(depth + 1));
+}
+
+void journal_end(fat32_volume *vol)
+{
+    Journal *j = vol->journal;
+    if(!j) return;
+
+    uintptr_t depth = (uintptr_t)pthread_getspecific(j->depth);
+    pthread_setspecific(j->depth, (void *)(depth - 1));
+    if(depth != 1) return;
+
+    pthread_mutex_lock(&j->lock);
+    j->handles--;
+    if(j->handles == 0 && j->barrier) pthread_cond_broadcast(&j->cond);
+
+    size_t bytes = j->running.len - TXN_HEADER_BYTES;
+    bool full = bytes >= JOURNAL_COMMIT_BYTES || j->blocks >= j->max_blocks;
+    bool behind = j->blocks >= 2 * j->max_blocks;  // the commit thread is not keeping up
+    if(full || j->tail >= JOURNAL_CHECKPOINT_BYTES)
+    {
+        j->kick = true;
+        pthread_cond_signal(&j->tick);
+    }
+    pthread_mutex_unlock(&j->lock);
+
+    // never let uncommitted blocks fill the buffer cache
+    if(behind) journal_commit(vol);
+}
+
+//Append a record to the running transaction; `body` follows the type byte
+static size_t log_record(Journal *j, uint8_t type, const void *body, size_t body_len, const void *data, size_t data_len)
+{
+    if(!log_reserve(&j->running, 1 + body_len + data_len))
+    {
+        if(!j->failed) printf("Journal out of memory, continuing without crash safety\n");
+        __atomic_store_n(&j->failed, true, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    size_t at = j->running.len;
+    uint8_t *p = j->running.data + at;
+    *p = type;
+    memcpy(p + 1, body, body_len);
+    if(data_len) memcpy(p + 1 + body_len, data, data_len);
+    j->running.len += 1 + body_len + data_len;
+
+    uint32_t records;
+    memcpy(&records, j->running.data + 20, 4);
+    records++;
+    memcpy(j->running.data + 20, &records, 4);
+    return at;
+}
+
+void journal_log_fat(fat32_volume *vol, uint32_t cluster, uint32_t value)
+{
+    Journal *j = vol->journal;
+    if(!j || __atomic_load_n(&j->failed, __ATOMIC_ACQUIRE)) return;
+
+    uint8_t type = value == cluster + 1 ? JREC_FAT_LINK : JREC_FAT_SET;
+    pthread_mutex_lock(&j->lock);
+
+    // chains are linked and freed in order, so most changes extend the last record
+    if(j->last_fat)
+    {
+        uint8_t *r = j->running.data + j->last_fat;
+        uint32_t first, count, last_value = 0;
+        memcpy(&first, r + 1, 4);
+        memcpy(&count, r + 5, 4);
+        if(*r == JREC_FAT_SET) memcpy(&last_value, r + 9, 4);
+        if(*r == type && first + count == cluster && (type == JREC_FAT_LINK || last_value == value))
+        {
+            count++;
+            memcpy(r + 5, &count, 4);
+            pthread_mutex_unlock(&j->lock);
+            return;
+        }
+    }
+
+    uint32_t body[3] = { cluster, 1, value };
+    j->last_fat = log_record(j, type, body, type == JREC_FAT_SET ? 12 : 8, NULL, 0);
+    pthread_mutex_unlock(&j->lock);
+}
+
+void journal_log_data(fat32_volume *vol, uint64_t off, const void *data, size_t len)
+{
+    Journal *j = vol->journal;
+    if(!j || __atomic_load_n(&j->failed, __ATOMIC_ACQUIRE)) return;
+
+    uint8_t body[12];
+    uint32_t n = (uint32_t)len;
+    memcpy(body, &off, 8);
+    memcpy(body + 8, &n, 4);
+
+    pthread_mutex_lock(&j->lock);
+    log_record(j, JREC_DATA, body, sizeof body, data, len);
+    j->last_fat = 0;
+    j->blocks++;
+    pthread_mutex_unlock(&j->lock);
+}
+
+void journal_log_zero(fat32_volume *vol, uint64_t off, size_t len)
+{
+    Journal *j = vol->journal;
+    if(!j || __atomic_load_n(&j->failed, __ATOMIC_ACQUIRE)) return;
+
+    uint8_t body[12];
+    uint32_t n = (uint32_t)len;
+    memcpy(body, &off, 8);
+    memcpy(body + 8, &n, 4);
+
+    pthread_mutex_lock(&j->lock);
+    log_record(j, JREC_ZERO, body, sizeof body, NULL, 0);
+    j->last_fat = 0;
+    j->blocks++;
+    pthread_mutex_unlock(&j->lock);
+}
+
+void journal_note_data(fat32_volume *vol)
+{
+    Journal *j = vol->journal;
+    if(j) __atomic_store_n(&j->data_dirty, true, __ATOMIC_RELEASE);
+}
+
+uint64_t journal_running_seq(fat32_volume *vol)
+{
+    Journal *j = vol->journal;
+    return j ? __atomic_load_n(&j->seq, __ATOMIC_ACQUIRE) : 0;
+}
+
+bool journal_durable(fat32_volume *vol, uint64_t seq)
+{
+    Journal *j = vol->journal;
+    return !j || seq <= __atomic_load_n(&j->durable, __ATOMIC_ACQUIRE) || __atomic_load_n(&j->failed, __ATOMIC_ACQUIRE);
+}
+
+
+// ---- open/close ----
+
+//Commit thread: commits every JOURNAL_COMMIT_MS or when kicked, and
+//checkpoints once the journal file has grown past its limit
+static void *commit_main(void *arg)
+{
+    Journal *j = arg;
+    pthread_mutex_lock(&j->lock);
+    while(!j->stop)
+    {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += (long)JOURNAL_COMMIT_MS * 1000000L;
+        until.tv_sec += until.tv_nsec / 1000000000L;
+        until.tv_nsec %= 1000000000L;
+        while(!j->kick && !j->stop)
+        {
+            if(pthread_cond_timedwait(&j->tick, &j->lock, &until) == ETIMEDOUT) break;
+        }
+        j->kick = false;
+        if(j->stop) break;
+
+        bool checkpoint = j->tail >= JOURNAL_CHECKPOINT_BYTES;
+        pthread_mutex_unlock(&j->lock);
+        if(checkpoint) fat32_flush(j->vol);
+        else journal_commit(j->vol);
+        pthread_mutex_lock(&j->lock);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
+}
+
+static void journal_free(Journal *j)
+{
+    if(j->fd >= 0) close(j->fd);
+    free(j->running.data);
+    free(j->spare.data);
+    free(j->path);
+    free(j);
+}
+
+bool journal_open(fat32_volume *vol, const char *img_path, size_t max_blocks)
+{
+    Journal *j = calloc(1, sizeof *j);
+    if(!j) return false;
+    j->vol = vol;
+    j->path = sidecar_path(img_path);
+    j->fd = j->path ? open(j->path, O_RDWR | O_CREAT | O_TRUNC, 0644) : -1;
+    if(j->fd < 0 || !write_header(j->fd, vol, 1) || !log_reset(&j->running))
+    {
+        journal_free(j);
+        return false;
+    }
+
+    // make the new file's name durable, or a crash could lose the journal
+    char *slash = strrchr(j->path, '/');
+    char *dir = slash ? strndup(j->path, (size_t)(slash - j->path) + 1) : strdup(".");
+    int dfd = dir ? open(dir, O_RDONLY) : -1;
+    if(dfd >= 0)
+    {
+        fsync(dfd);
+        close(dfd);
+    }
+    free(dir);
+
+    j->tail = JOURNAL_HEADER_BYTES;
+    j->seq = 1;
+    j->max_blocks = max_blocks ? max_blocks : 1;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->cond, NULL);
+    pthread_cond_init(&j->tick, NULL);
+    if(pthread_key_create(&j->depth, NULL) != 0 || pthread_create(&j->thread, NULL, commit_main, j) != 0)
+    {
+        unlink(j->path);
+        journal_free(j);
+        return false;
+    }
+    vol->journal = j;
+    return true;
+}
+
+void journal_close(fat32_volume *vol, bool clean)
+{
+    Journal *j = vol->journal;
+    if(!j) return;
+
+    pthread_mutex_lock(&j->lock);
+    j->stop = true;
+    pthread_cond_signal(&j->tick);
+    pthread_mutex_unlock(&j->lock);
+    pthread_join(j->thread, NULL);
+
+    vol->journal = NULL;
+    if(clean && !j->failed) unlink(j->path);
+    pthread_key_delete(j->depth);
+    pthread_cond_destroy(&j->tick);
+    pthread_cond_destroy(&j->cond);
+    pthread_mutex_destroy(&j->lock);
+    journal_free(j);
+}
@@ -1,35 +1,371 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "lexer.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "fat.h"
 #include "dir.h"
+#include "file.h"
+#include "fsck.h"
+#include "fatscan.h"
+#include "cache.h"
+#include "perf.h"
+#include "server.h"
+#include "transfer.h"
 //Info command (for part 1)
 //Hello there
 
-#define MAX_NUM_FILES 10 //maximum number of files
 #define MAX_FILENAME_LENGTH 11 //maximum length of filename
+#define READ_BLOCK (256 * 1024)	//input is read this much at a time
+#define OUTPUT_BUFFER (256 * 1024)	//stdout buffer in batch mode
+#define ARENA_BLOCK 4096	//first block of the per-command arena
+#define CMD_SLOT_BITS 5	//command hash table has 1 << CMD_SLOT_BITS slots
 
 
-void info();
-char *get_input(void);
-tokenlist *new_tokenlist(void);
-void add_token(tokenlist *tokens, char *item);
-tokenlist *get_tokens(char *input);
-void free_tokens(tokenlist *tokens);
+void info(fat32_volume *vol);
+void read_command(const char *name, unsigned long long size);
+void write_command(const char *name, const char *text);
+void stats_print(void);
+void stats_reset(void);
+void stats_write_json(FILE *out, const CacheStats *cache);
 
 //initialize global variables
 int img_mounted = 0;
 char img_mounted_name[11];
+fat32_volume *vol = NULL;	//the mounted image
+DirSession shell;	//the shell's working directory on it
+bool quit = false;	//set by exit
+CacheStats cache_base;	//cache counters at the last stats reset
+Server *server = NULL;	//set while serving clients (-S)
+
+
+static void cmd_exit(tokenlist *tokens)	//wesley, just exits then closes img if open
+{
+	(void)tokens;
+	printf("Exiting...\n");
+	quit = true;
+}
+
+static void cmd_cd(tokenlist *tokens) //isa
+{
+	const char *target = tokens->size > 1 ? tokens->items[1] : "/";
+	if(!dir_session_cd(vol, &shell, target))
+	{
+		printf("cd: no such directory: %s\n", target);
+	}
+}
+
+static void cmd_ls(tokenlist *tokens) //isa
+{
+	(void)tokens;
+	printf("Listing directory:\n");
+	dir_ls(vol, &shell);
+}
+
+static void cmd_info(tokenlist *tokens)	//wesley
+{
+	(void)tokens;
+	printf("FAT32 Image Info:\n");
+	info(vol);
+}
+
+static void cmd_stats(tokenlist *tokens)
+{
+	if(tokens->size == 2 && strcmp(tokens->items[1], "reset") == 0)
+	{
+		stats_reset();
+	}
+	else if(tokens->size != 1)
+	{
+		printf("usage: stats [reset]\n");
+	}
+	else
+	{
+		printf("Performance stats:\n");
+		stats_print();
+	}
+}
+
+static void cmd_open(tokenlist *tokens)	//setting up open command,ivan
+{
+	if(tokens->size != 3)
+	{
+		printf("usage: open [FILENAME] [-r|-w|-rw|-wr]\n");
+	}
+	else
+	{
+		int fd = file_open_at(vol, &shell, tokens->items[1], file_parse_mode(tokens->items[2]));
+		if(fd < 0)
+			printf("open: %s: %s\n", tokens->items[1], file_strerror(fd));
+		else
+			printf("Opened %s (descriptor %d)\n", tokens->items[1], fd);
+	}
+}
+
+static void cmd_close(tokenlist *tokens)
+{
+	if(tokens->size != 2)
+		printf("usage: close [FILENAME]\n");
+	else if(file_close(file_find(tokens->items[1])) < 0)
+		printf("close: %s: %s\n", tokens->items[1], file_strerror(FILE_ERR_NOT_OPEN));
+}
+
+static void cmd_fsck(tokenlist *tokens)
+{
+	char *end = NULL;
+	unsigned long threads = tokens->size == 2 ? strtoul(tokens->items[1], &end, 10) : 0;
+	if(tokens->size > 2 || (end && (*end != '\0' || tokens->items[1][0] == '-')))
+	{
+		printf("usage: fsck [THREADS]\n");
+	}
+	else
+	{
+		FsckReport report;
+		bool clean = fsck_run(vol, (unsigned)threads, NULL, NULL, &report);
+		fsck_print(&report);
+		printf(clean ? "fsck: no problems found\n" : "fsck: problems found\n");
+	}
+}
+
+static void cmd_lsof(tokenlist *tokens)
+{
+	(void)tokens;
+	file_lsof();
+}
 
+static void cmd_lseek(tokenlist *tokens)
+{
+	char *end = NULL;
+	unsigned long long off = tokens->size == 3 ? strtoull(tokens->items[2], &end, 10) : 0;
+	if(tokens->size != 3 || *end != '\0' || tokens->items[2][0] == '-')
+	{
+		printf("usage: lseek [FILENAME] [OFFSET]\n");
+	}
+	else
+	{
+		int err = file_lseek(file_find(tokens->items[1]), off);
+		if(err < 0)
+			printf("lseek: %s: %s\n", tokens->items[1], file_strerror(err));
+	}
+}
+
+static void cmd_read(tokenlist *tokens)
+{
+	char *end = NULL;
+	unsigned long long size = tokens->size == 3 ? strtoull(tokens->items[2], &end, 10) : 0;
+	if(tokens->size != 3 || *end != '\0' || tokens->items[2][0] == '-')
+	{
+		printf("usage: read [FILENAME] [SIZE]\n");
+	}
+	else
+	{
+		read_command(tokens->items[1], size);
+	}
+}
+
+static void cmd_write(tokenlist *tokens)
+{
+	if(tokens->size < 3)
+		printf("usage: write [FILENAME] \"[STRING]\"\n");
+	else	//the string is the rest of the raw line, so its spacing survives tokenizing
+		write_command(tokens->items[1], token_rest(tokens, 2));
+}
+
+static void transfer_print(const char *cmd, const TransferStats *st)
+{
+	double mb = (double)st->bytes / (1024.0 * 1024.0);
+	printf("%s: %llu files, %llu directories, %.1f MiB in %.2f s (%.1f MiB/s)",
+		cmd, (unsigned long long)st->files, (unsigned long long)st->dirs, mb, st->seconds,
+		st->seconds > 0 ? mb / st->seconds : 0.0);
+	if(st->skipped || st->errors)
+		printf(", %llu skipped, %llu failed", (unsigned long long)st->skipped, (unsigned long long)st->errors);
+	printf("\n");
+}
+
+static void cmd_import(tokenlist *tokens)
+{
+	TransferStats st;
+	if(tokens->size != 3)
+		printf("usage: import [HOSTDIR] [DIRNAME]\n");
+	else if(!transfer_import(vol, &shell, tokens->items[1], tokens->items[2], &st))
+		printf("import: can't copy %s into %s\n", tokens->items[1], tokens->items[2]);
+	else
+		transfer_print("import", &st);
+}
+
+static void cmd_export(tokenlist *tokens)
+{
+	TransferStats st;
+	if(tokens->size != 3)
+		printf("usage: export [DIRNAME] [HOSTDIR]\n");
+	else if(!transfer_export(vol, &shell, tokens->items[1], tokens->items[2], &st))
+		printf("export: can't copy %s into %s\n", tokens->items[1], tokens->items[2]);
+	else
+		transfer_print("export", &st);
+}
+
+typedef struct {
+	const char *name;
+	void (*run)(tokenlist *tokens);
+	bool bare;	//takes no arguments
+} Command;
+
+static const Command commands[] = {
+	{ "exit", cmd_exit, true },
+	{ "cd", cmd_cd, false },
+	{ "ls", cmd_ls, true },
+	{ "info", cmd_info, true },
+	{ "stats", cmd_stats, false },
+	{ "open", cmd_open, false },
+	{ "close", cmd_close, false },
+	{ "fsck", cmd_fsck, false },
+	{ "lsof", cmd_lsof, true },
+	{ "lseek", cmd_lseek, false },
+	{ "read", cmd_read, false },
+	{ "write", cmd_write, false },
+	{ "import", cmd_import, false },
+	{ "export", cmd_export, false },
+};
+#define NUM_COMMANDS (sizeof commands / sizeof commands[0])
+
+#ifdef FAT_PERF
+static PerfHist command_time[NUM_COMMANDS];	//wall time of each command
+#endif
+
+//Perfect hash over the command names: a seeded FNV-1a whose seed
+//command_table_init picks so that no two commands share a slot. A lookup
+//is one hash and one strcmp.
+static uint8_t command_slots[1u << CMD_SLOT_BITS];	//index into commands + 1, 0 if empty
+static uint32_t command_seed;
+
+static unsigned command_hash(const char *name, uint32_t seed)
+{
+	uint32_t h = seed;
+	for(; *name; name++)
+		h = (h ^ (uint8_t)*name) * 16777619u;
+	return h >> (32 - CMD_SLOT_BITS);
+}
+
+static void command_table_init(void)
+{
+	for(command_seed = 2166136261u; ; command_seed++)
+	{
+		memset(command_slots, 0, sizeof command_slots);
+		size_t i;
+		for(i = 0; i < NUM_COMMANDS; i++)
+		{
+			unsigned h = command_hash(commands[i].name, command_seed);
+			if(command_slots[h])
+				break;		//collision, try the next seed
+			command_slots[h] = (uint8_t)(i + 1);
+		}
+		if(i == NUM_COMMANDS)
+			return;
+	}
+}
+
+static const Command *find_command(const char *name)
+{
+	unsigned slot = command_slots[command_hash(name, command_seed)];
+	if(slot == 0 || strcmp(commands[slot - 1].name, name) != 0)
+		return NULL;
+	return &commands[slot - 1];
+}
+
+
+static void stop_serving(int sig)
+{
+	(void)sig;
+	server_stop(server);
+}
+
+//Serve clients on `socket_path` until SIGINT or SIGTERM, then exit
+static void serve(const char *socket_path)
+{
+	server = server_open(vol, socket_path, 0);
+	if(server == NULL)
+	{
+		printf("Failed to serve on %s\n", socket_path);
+	}
+	else
+	{
+		struct sigaction sa;
+		memset(&sa, 0, sizeof sa);
+		sa.sa_handler = stop_serving;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+		printf("Serving on %s\n", socket_path);
+		fflush(stdout);
+		if(!server_run(server))
+			perror("server");
+		sa.sa_handler = SIG_DFL;	//nothing left to stop
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+		server_close(server);
+		server = NULL;
+	}
+	quit = true;	//no shell afterwards
+}
 
 int main(int argc, char *argv[])
 {
-	if(argc ==2)	//immediately checks for correct amount of arguments
+	unsigned mount_flags = 0;
+	BlockDevType io = BDEV_MMAP;
+	const char *script = NULL;
+	const char *stats_path = NULL;
+	int opt;
+	const char *socket_path = NULL;
+	while((opt = getopt(argc, argv, "ji:b:s:S:")) != -1)
+	{
+		if(opt == 'j')	//-j: journal metadata changes to IMAGE.journal
+			mount_flags = FAT_MOUNT_JOURNAL;
+		else if(opt == 'i')	//-i IO: image access through pread, mmap (default) or direct (O_DIRECT)
+		{
+			if(strcmp(optarg, "pread") == 0)
+				io = BDEV_PREAD;
+			else if(strcmp(optarg, "mmap") == 0)
+				io = BDEV_MMAP;
+			else if(strcmp(optarg, "direct") == 0)
+				io = BDEV_DIRECT;
+			else
+			{
+				printf("Unknown I/O backend: %s (pread, mmap or direct)\n", optarg);
+				return 1;
+			}
+		}
+		else if(opt == 'b')	//-b SCRIPT: run the commands in SCRIPT and exit
+			script = optarg;
+		else if(opt == 's')	//-s FILE: write the stats as JSON to FILE on exit
+			stats_path = optarg;
+		else if(opt == 'S')	//-S SOCKET: serve clients on a Unix socket instead (server.h)
+			socket_path = optarg;
+		else
+			return 1;
+	}
+
+	//batch mode: commands come from a script or a pipe, so no prompts and
+	//output goes out in large writes instead of a line at a time
+	int in_fd = STDIN_FILENO;
+	if(script != NULL && (in_fd = open(script, O_RDONLY)) < 0)
+	{
+		perror(script);
+		return 1;
+	}
+	bool batch = script != NULL || !isatty(in_fd);
+	if(batch)
+		setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER);
+
+	if(argc - optind == 1)	//immediately checks for correct amount of arguments
 	{
 		printf("Executable name: %s\n", argv[0]);
-		printf("Mounting image: %s\n", argv[1]);
+		printf("Mounting image: %s\n", argv[optind]);
 	}
 	else
 	{
@@ -38,7 +374,8 @@ int main(int argc, char *argv[])
 	}
 
 
-	if(fat32_init(argv[1])==1)	//check statement! DELETE LATER
+	vol = fat32_init(argv[optind], io, mount_flags);
+	if(vol != NULL)	//check statement! DELETE LATER
 	{
 		printf("Image mounted successfully\n");
 	}
@@ -48,81 +385,85 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 	img_mounted = 1;
-	strcpy(img_mounted_name, argv[1]);	//name of image is now stored
+	strcpy(img_mounted_name, argv[optind]);	//name of image is now stored
+	dir_session_init(vol, &shell);	//start at the root
+	command_table_init();
+	if(socket_path != NULL)
+		serve(socket_path);
 	
 	
 	DirEntry dir[16];    //initalize!
+	LineReader in;
+	reader_init(&in, in_fd);
+	Arena arena = { NULL };	//scratch for one command, reset after each
 	
-	while (1) {
+	while (!quit) {
 		
-		printf("%s> ", get_cwd_path());	//isa, shows current working directory in prompt
+		if(!batch)
+			printf("%s> ", shell.cwd_path);	//isa, shows current working directory in prompt
+		if(!reader_ready(&in))
+			fflush(stdout);		//about to wait for input: one flush per block read
 
 		/* input contains the whole command
-		 * tokens contains substrings from input split by spaces
+		 * tokens contains substrings from input split by spaces, in place
 		 */
 
-		char *input = get_input();	//given 
-		tokenlist *tokens = get_tokens(input);	//given below
-		
-		
-		
-	
-		// printf("Now printing out individual tokens:\n");
-		// for (int i = 0; i < tokens->size; i++){
-		// 	printf("token %d: (%s)\n", i, tokens->items[i]);
-		// }	
-		
-		// printf("Now do process here\n");
-
-		if(strcmp(input, "exit") == 0)	//wesley, just exits then closes img if open
+		size_t len;
+		char *input = reader_next(&in, &len);
+		if(input == NULL)
+			break;		//end of input
+		arena_reset(&arena);	//the previous line's tokens are done with
+		tokenlist *tokens = get_tokens(&arena, input, len);
+		if(tokens == NULL)
 		{
-			printf("Exiting...\n");
-			fat32_close();
-			return 0;
-		}
-		else if(strcmp(input, "cd") == 0) //isa
-		{
-			if(!dir_cd(tokens->items[1]))
-			{
-				printf("cd: no such directory: %s\n", tokens->items[1]);
-			}
-		}
-		else if(strcmp(input, "ls") == 0) //isa
-		{
-			printf("Listing directory:\n");
-			dir_ls(get_cwd_cluster());
-		}
-		else if(strcmp(input, "info") == 0)	//wesley
-		{
-			printf("FAT32 Image Info:\n");
-			info();
+			printf("Out of memory\n");
+			break;
 		}
-		else if(strlen(input) == 0)	//wesley
+
+		if(tokens->size == 0)	//wesley
 		{
 			continue;		//just means do nothing and reprompt
 		}
-		else if(strcmp(tokens->items[0], "open")==0)	//setting up open command,ivan
-		{
-			//do open implement. inside of dir.c please, call it in here
-			
 
+		const Command *cmd = find_command(tokens->items[0]);
+		if(cmd != NULL && !(cmd->bare && tokens->size > 1))
+		{
+#ifdef FAT_PERF
+			uint64_t start = perf_now_ns();
+			cmd->run(tokens);
+			perf_hist_add(&command_time[cmd - commands], perf_now_ns() - start);
+#else
+			cmd->run(tokens);
+#endif
 		}
-		
+		else
+			printf("Unknown command: %s\n", token_rest(tokens, 0));
+	}
+	file_close_all(vol);
+	CacheStats cache;
+	cache_get_stats(vol, &cache);	//the cache is gone after closing
+	fat32_close(vol);	//makes sure it closes properly
+	if(stats_path != NULL)	//after closing, so the final write-back is counted
+	{
+		FILE *out = fopen(stats_path, "w");
+		if(out == NULL)
+			perror(stats_path);
 		else
 		{
-			printf("Unknown command: %s\n", input);
+			stats_write_json(out, &cache);
+			fclose(out);
 		}
-
-		free(input);
-		free_tokens(tokens);
-		
 	}
-	fat32_close();	//makes sure it closes properly
+	reader_free(&in);
+	arena_free(&arena);
+	if(in_fd != STDIN_FILENO)
+		close(in_fd);
 	return 0;
 }
 
-void info()	//wesley
+void info(fat32_volume *vol)	//wesley
 {
+	const BootInfo bpb = vol->bpb;
 	uint32_t data_secs = bpb.total_sectors - (bpb.reserved_sectors + bpb.num_fats * bpb.fat_size);
 	uint32_t total_clusters = data_secs / bpb.sectors_per_cluster;
 
@@ -132,68 +473,330 @@ void info()	//wesley
 	printf("Total clusters: %u\n", total_clusters);
 	printf("FAT entries: %u\n", bpb.fat_size * (bpb.bytes_per_sector / 4));
 	printf("Image size: %u bytes\n", bpb.total_sectors * bpb.bytes_per_sector);
-	
+
+	FatStats st;
+	if(!fat_stats(vol, &st))
+		return;
+	unsigned long long cluster_bytes = vol->cluster_size;
+	printf("Free clusters: %llu (%llu bytes)\n", (unsigned long long)st.free_clusters, st.free_clusters * cluster_bytes);
+	printf("Used clusters: %llu (%llu bytes)\n", (unsigned long long)st.used_clusters, st.used_clusters * cluster_bytes);
+	if(st.bad_clusters)
+		printf("Bad clusters: %llu\n", (unsigned long long)st.bad_clusters);
+	if(st.first_free)
+		printf("First free cluster: %u\n", st.first_free);
+	printf("Largest free run: %u clusters at %u\n", st.largest_run.length, st.largest_run.start);
+	printf("Fragmentation: %llu of %llu chain links jump (%.1f%%)\n", (unsigned long long)st.breaks,
+	       (unsigned long long)st.links, st.links ? 100.0 * (double)st.breaks / (double)st.links : 0.0);
+	printf("Free runs: %llu\n", (unsigned long long)st.free_runs);
+	for(int k = 0; k < FAT_RUN_BUCKETS; k++)	//histogram by power-of-two length
+	{
+		if(st.run_histogram[k])
+			printf("  %10u+ clusters: %llu\n", 1u << k, (unsigned long long)st.run_histogram[k]);
+	}
+}
+
+//Cache counters since the last stats reset
+static void cache_since_reset(CacheStats *st)
+{
+	cache_get_stats(vol, st);
+	st->hits -= cache_base.hits;
+	st->misses -= cache_base.misses;
+	st->evictions -= cache_base.evictions;
+	st->writebacks -= cache_base.writebacks;
 }
 
-char *get_input(void) {
-	char *buffer = NULL;
-	int bufsize = 0;
-	char line[5];
-	while (fgets(line, 5, stdin) != NULL)
+void stats_print(void)
+{
+	CacheStats cache;
+	cache_since_reset(&cache);
+	uint64_t lookups = cache.hits + cache.misses;
+	printf("Cache: %llu hits, %llu misses (%.1f%% hit rate), %llu evictions, %llu writebacks\n",
+	       (unsigned long long)cache.hits, (unsigned long long)cache.misses,
+	       lookups ? 100.0 * (double)cache.hits / (double)lookups : 0.0,
+	       (unsigned long long)cache.evictions, (unsigned long long)cache.writebacks);
+	printf("Cache slots: %zu of %zu in use, %zu dirty\n", cache.in_use, cache.capacity, cache.dirty);
+
+#ifdef FAT_PERF
+	uint64_t count[PERF_COUNTERS];
+	perf_snapshot(count);
+	for(int c = 0; c < PERF_COUNTERS; c++)
+		printf("%-22s %llu\n", perf_counter_name((PerfCounter)c), (unsigned long long)count[c]);
+
+	printf("%-8s %10s %12s %10s %10s\n", "Command", "count", "total ms", "mean us", "max us");
+	for(size_t i = 0; i < NUM_COMMANDS; i++)
 	{
-		int addby = 0;
-		char *newln = strchr(line, '\n');
-		if (newln != NULL)
-			addby = newln - line;
-		else
-			addby = 5 - 1;
-		buffer = (char *)realloc(buffer, bufsize + addby);
-		memcpy(&buffer[bufsize], line, addby);
-		bufsize += addby;
-		if (newln != NULL)
-			break;
+		const PerfHist *h = &command_time[i];
+		if(h->count == 0)
+			continue;
+		printf("%-8s %10llu %12.3f %10.1f %10.1f\n", commands[i].name, (unsigned long long)h->count,
+		       (double)h->total_ns / 1e6, (double)h->total_ns / 1e3 / (double)h->count, (double)h->max_ns / 1e3);
+		for(int k = 0; k < PERF_HIST_BUCKETS; k++)	//histogram by power-of-two microseconds
+		{
+			if(h->buckets[k])
+				printf("  %10llu+ us: %llu\n", k ? 1ull << k : 0ull, (unsigned long long)h->buckets[k]);
+		}
 	}
-	buffer = (char *)realloc(buffer, bufsize + 1);
-	buffer[bufsize] = 0;
-	return buffer;
+#else
+	printf("Performance counters are not built in (build with PERF=1)\n");
+#endif
 }
 
-tokenlist *new_tokenlist(void) {
-	tokenlist *tokens = (tokenlist *)malloc(sizeof(tokenlist));
-	tokens->size = 0;
-	tokens->items = (char **)malloc(sizeof(char *));
-	tokens->items[0] = NULL; /* make NULL terminated */
-	return tokens;
+void stats_reset(void)
+{
+	cache_get_stats(vol, &cache_base);
+#ifdef FAT_PERF
+	perf_reset();
+	memset(command_time, 0, sizeof command_time);
+#endif
 }
 
-void add_token(tokenlist *tokens, char *item) {
-	int i = tokens->size;
+void stats_write_json(FILE *out, const CacheStats *cache)
+{
+	fprintf(out, "{\n  \"cache\": {\"hits\": %llu, \"misses\": %llu, \"evictions\": %llu, \"writebacks\": %llu}",
+	        (unsigned long long)(cache->hits - cache_base.hits), (unsigned long long)(cache->misses - cache_base.misses),
+	        (unsigned long long)(cache->evictions - cache_base.evictions),
+	        (unsigned long long)(cache->writebacks - cache_base.writebacks));
+#ifdef FAT_PERF
+	uint64_t count[PERF_COUNTERS];
+	perf_snapshot(count);
+	fprintf(out, ",\n  \"counters\": {");
+	for(int c = 0; c < PERF_COUNTERS; c++)
+		fprintf(out, "%s\"%s\": %llu", c ? ", " : "", perf_counter_name((PerfCounter)c), (unsigned long long)count[c]);
+	fprintf(out, "},\n  \"commands\": {");
 
-	tokens->items = (char **)realloc(tokens->items, (i + 2) * sizeof(char *));
-	tokens->items[i] = (char *)malloc(strlen(item) + 1);
-	tokens->items[i + 1] = NULL;
-	strcpy(tokens->items[i], item);
+	//histogram as [lower bound in us, count] pairs for the non-empty buckets
+	bool first = true;
+	for(size_t i = 0; i < NUM_COMMANDS; i++)
+	{
+		const PerfHist *h = &command_time[i];
+		if(h->count == 0)
+			continue;
+		fprintf(out, "%s\n    \"%s\": {\"count\": %llu, \"total_ns\": %llu, \"max_ns\": %llu, \"histogram_us\": [",
+		        first ? "" : ",", commands[i].name, (unsigned long long)h->count,
+		        (unsigned long long)h->total_ns, (unsigned long long)h->max_ns);
+		bool first_bucket = true;
+		for(int k = 0; k < PERF_HIST_BUCKETS; k++)
+		{
+			if(h->buckets[k] == 0)
+				continue;
+			fprintf(out, "%s[%llu, %llu]", first_bucket ? "" : ", ", k ? 1ull << k : 0ull, (unsigned long long)h->buckets[k]);
+			first_bucket = false;
+		}
+		fprintf(out, "]}");
+		first = false;
+	}
+	fprintf(out, "%s}", first ? "" : "\n  ");
+#endif
+	fprintf(out, "\n}\n");
+}
 
-	tokens->size += 1;
+void read_command(const char *name, unsigned long long size)
+{
+	int fd = file_find(name);
+	if(fd < 0)
+	{
+		printf("read: %s: %s\n", name, file_strerror(fd));
+		return;
+	}
+
+	//stream through a fixed buffer so large reads need no large allocation
+	char buf[65536];
+	while(size > 0)
+	{
+		size_t want = size < sizeof buf ? (size_t)size : sizeof buf;
+		long got = file_read(fd, buf, want);
+		if(got < 0)
+		{
+			printf("read: %s: %s\n", name, file_strerror((int)got));
+			return;
+		}
+		if(got == 0)
+			break;		//end of file
+		fwrite(buf, 1, (size_t)got, stdout);
+		size -= (unsigned long long)got;
+	}
+	printf("\n");
+}
+
+void write_command(const char *name, const char *text)
+{
+	int fd = file_find(name);
+	if(fd < 0)
+	{
+		printf("write: %s: %s\n", name, file_strerror(fd));
+		return;
+	}
+
+	const char *p = text;
+	size_t len = strlen(p);
+	if(len >= 2 && p[0] == '"' && p[len - 1] == '"')
+	{
+		p++;
+		len -= 2;
+	}
+
+	long n = file_write(fd, p, len);
+	if(n < 0)
+		printf("write: %s: %s\n", name, file_strerror((int)n));
+}
+
+void reader_init(LineReader *r, int fd) {
+	r->fd = fd;
+	r->buf = (char *)malloc(READ_BLOCK + 1);	//+1 for the NUL after a last line with no newline
+	r->cap = r->buf ? READ_BLOCK : 0;
+	r->start = 0;
+	r->end = 0;
+	r->eof = r->buf == NULL;
 }
 
-tokenlist *get_tokens(char *input) {
-	char *buf = (char *)malloc(strlen(input) + 1);
-	strcpy(buf, input);
-	tokenlist *tokens = new_tokenlist();
-	char *tok = strtok(buf, " ");
-	while (tok != NULL)
+//Move the unread tail to the front, growing the buffer for a line longer
+//than it, and read the next block after it
+static void reader_fill(LineReader *r) {
+	if(r->start > 0)
 	{
-		add_token(tokens, tok);
-		tok = strtok(NULL, " ");
+		memmove(r->buf, r->buf + r->start, r->end - r->start);
+		r->end -= r->start;
+		r->start = 0;
+	}
+	if(r->end == r->cap)
+	{
+		char *grown = (char *)realloc(r->buf, r->cap * 2 + 1);
+		if(grown == NULL)
+		{
+			r->eof = true;
+			return;
+		}
+		r->buf = grown;
+		r->cap *= 2;
 	}
-	free(buf);
+
+	ssize_t got;
+	do
+		got = read(r->fd, r->buf + r->end, r->cap - r->end);
+	while(got < 0 && errno == EINTR);
+	if(got < 0)
+		perror("read");
+	if(got <= 0)
+		r->eof = true;
+	else
+		r->end += (size_t)got;
+}
+
+bool reader_ready(const LineReader *r) {
+	return r->eof || (r->end > r->start && memchr(r->buf + r->start, '\n', r->end - r->start) != NULL);
+}
+
+char *reader_next(LineReader *r, size_t *len) {
+	while(1)
+	{
+		char *line = r->buf + r->start;
+		size_t avail = r->end - r->start;
+		char *newln = avail ? (char *)memchr(line, '\n', avail) : NULL;
+		if(newln != NULL || (r->eof && avail > 0))
+		{
+			size_t n = newln ? (size_t)(newln - line) : avail;
+			r->start += newln ? n + 1 : n;
+			if(n > 0 && line[n - 1] == '\r')
+				n--;
+			line[n] = 0;
+			if(len != NULL)
+				*len = n;
+			return line;
+		}
+		if(r->eof)
+			return NULL;
+		reader_fill(r);
+	}
+}
+
+void reader_free(LineReader *r) {
+	free(r->buf);
+	r->buf = NULL;
+	r->cap = r->start = r->end = 0;
+	r->eof = true;
+}
+
+struct ArenaBlock {
+	ArenaBlock *next;	//the older, smaller blocks
+	size_t cap;
+	size_t used;
+	char data[];
+};
+
+void *arena_alloc(Arena *a, size_t n) {
+	n = (n + sizeof(void *) - 1) & ~(sizeof(void *) - 1);	//keep pointers aligned
+	ArenaBlock *b = a->head;
+	if(b == NULL || b->cap - b->used < n)
+	{
+		size_t cap = b ? b->cap * 2 : ARENA_BLOCK;
+		while(cap < n)
+			cap *= 2;
+		ArenaBlock *grown = (ArenaBlock *)malloc(sizeof(ArenaBlock) + cap);
+		if(grown == NULL)
+			return NULL;
+		grown->next = b;
+		grown->cap = cap;
+		grown->used = 0;
+		a->head = b = grown;
+	}
+	void *p = b->data + b->used;
+	b->used += n;
+	return p;
+}
+
+void arena_reset(Arena *a) {
+	ArenaBlock *b = a->head;
+	if(b == NULL)
+		return;
+	while(b->next != NULL)	//only the newest, largest block is kept
+	{
+		ArenaBlock *old = b->next;
+		b->next = old->next;
+		free(old);
+	}
+	b->used = 0;
+}
+
+void arena_free(Arena *a) {
+	arena_reset(a);
+	free(a->head);
+	a->head = NULL;
+}
+
+tokenlist *get_tokens(Arena *arena, char *input, size_t len) {
+	tokenlist *tokens = (tokenlist *)arena_alloc(arena, sizeof(tokenlist));
+	char **items = (char **)arena_alloc(arena, (len / 2 + 2) * sizeof(char *));	//at most one item per two bytes
+	if(tokens == NULL || items == NULL)
+		return NULL;
+	tokens->items = items;
+	tokens->size = 0;
+	tokens->end = input + len;
+
+	char *p = input;
+	while(p < tokens->end)
+	{
+		if(*p == ' ')
+		{
+			p++;
+			continue;
+		}
+		items[tokens->size++] = p;
+		while(p < tokens->end && *p != ' ')
+			p++;
+		*p++ = 0;	//at the end of the line this is the line's own NUL
+	}
+	items[tokens->size] = NULL; /* make NULL terminated */
 	return tokens;
 }
 
-void free_tokens(tokenlist *tokens) {
-	for (int i = 0; i < tokens->size; i++)
-		free(tokens->items[i]);
-	free(tokens->items);
-	free(tokens);
+char *token_rest(tokenlist *tokens, size_t i) {
+	if(i >= tokens->size)
+		return tokens->end;
+	for(size_t j = i; j < tokens->size; j++)
+	{
+		char *e = tokens->items[j] + strlen(tokens->items[j]);
+		if(e != tokens->end)
+			*e = ' ';
+	}
+	return tokens->items[i];
 }
@@ -0,0 +1,121 @@
+//Per-thread performance counters and timing histograms
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "perf.h"
+
+#ifdef FAT_PERF
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+__thread PerfThread *perf_self;
+
+static pthread_mutex_t perf_lock = PTHREAD_MUTEX_INITIALIZER;
+static PerfThread *perf_threads;            // blocks of live threads
+static uint64_t perf_retired[PERF_COUNTERS]; // counts of threads that have exited
+static uint64_t perf_base[PERF_COUNTERS];   // totals at the last reset
+static pthread_key_t perf_key;
+static pthread_once_t perf_once = PTHREAD_ONCE_INIT;
+
+static const char *const counter_names[PERF_COUNTERS] = {
+    [PERF_FAT_GET] = "fat_get_entry",
+    [PERF_FAT_SET] = "fat_set_entry",
+    [PERF_READS] = "reads",
+    [PERF_READ_BYTES] = "bytes_read",
+    [PERF_WRITES] = "writes",
+    [PERF_WRITE_BYTES] = "bytes_written",
+    [PERF_SEEKS] = "seeks",
+    [PERF_DIR_SCANNED] = "dir_entries_scanned",
+    [PERF_FREE_PROBED] = "free_clusters_probed",
+};
+
+//Thread exit: fold the block into the retired totals
+static void thread_exit(void *arg)
+{
+    PerfThread *t = arg;
+    pthread_mutex_lock(&perf_lock);
+    for(int c = 0; c < PERF_COUNTERS; c++) perf_retired[c] += t->count[c];
+    if(t->prev) t->prev->next = t->next;
+    else perf_threads = t->next;
+    if(t->next) t->next->prev = t->prev;
+    pthread_mutex_unlock(&perf_lock);
+    perf_self = NULL;   // a later destructor that counts registers afresh
+    free(t);
+}
+
+static void make_key(void)
+{
+    pthread_key_create(&perf_key, thread_exit);
+}
+
+PerfThread *perf_thread_register(void)
+{
+    pthread_once(&perf_once, make_key);
+    PerfThread *t = calloc(1, sizeof *t);
+    if(!t) return NULL;
+
+    pthread_mutex_lock(&perf_lock);
+    t->next = perf_threads;
+    if(perf_threads) perf_threads->prev = t;
+    perf_threads = t;
+    pthread_mutex_unlock(&perf_lock);
+
+    pthread_setspecific(perf_key, t);
+    perf_self = t;
+    return t;
+}
+
+//Current totals, with perf_lock held
+static void sum_locked(uint64_t out[PERF_COUNTERS])
+{
+    memcpy(out, perf_retired, sizeof perf_retired);
+    for(PerfThread *t = perf_threads; t; t = t->next)
+    {
+        for(int c = 0; c < PERF_COUNTERS; c++) out[c] += __atomic_load_n(&t->count[c], __ATOMIC_RELAXED);
+    }
+}
+
+void perf_snapshot(uint64_t out[PERF_COUNTERS])
+{
+    pthread_mutex_lock(&perf_lock);
+    sum_locked(out);
+    for(int c = 0; c < PERF_COUNTERS; c++) out[c] -= perf_base[c];
+    pthread_mutex_unlock(&perf_lock);
+}
+
+void perf_reset(void)
+{
+    // counters only ever grow, so a reset just moves the baseline
+    pthread_mutex_lock(&perf_lock);
+    sum_locked(perf_base);
+    pthread_mutex_unlock(&perf_lock);
+}
+
+const char *perf_counter_name(PerfCounter c)
+{
+    return c < PERF_COUNTERS ? counter_names[c] : "?";
+}
+
+uint64_t perf_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void perf_hist_add(PerfHist *h, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int k = 0;
+    while(k < PERF_HIST_BUCKETS - 1 && (us >> (k + 1)) != 0) k++;
+
+    h->count++;
+    h->total_ns += ns;
+    if(ns > h->max_ns) h->max_ns = ns;
+    h->buckets[k]++;
+}
+
+#endif // FAT_PERF
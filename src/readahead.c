@@ -0,0 +1,60 @@
+//Sequential-access detection and adaptive read-ahead window
+
+#include "readahead.h"
+#include <stdbool.h>
+#include <string.h>
+
+#define RA_MIN_WINDOW 4                 // clusters
+#define RA_MAX_BYTES  (2u << 20)        // cap on one window
+
+static uint32_t max_window(uint32_t cluster_size)
+{
+    uint32_t max = cluster_size ? RA_MAX_BYTES / cluster_size : RA_MIN_WINDOW;
+    return max < RA_MIN_WINDOW ? RA_MIN_WINDOW : max;
+}
+
+void ra_reset(ReadAhead *ra)
+{
+    memset(ra, 0, sizeof *ra);
+}
+
+size_t ra_access(ReadAhead *ra, uint64_t first, size_t count, uint32_t cluster_size, uint64_t *from)
+{
+    if(count == 0) return 0;
+    uint64_t end = first + count;
+
+    // re-reading the cluster the last access ended in still counts as sequential
+    bool sequential = first == ra->next || first + 1 == ra->next;
+    if(sequential)
+    {
+        ra->hits++;
+        if(ra->window == 0) ra->window = RA_MIN_WINDOW;
+    }
+    else
+    {
+        ra->misses++;
+        ra->window /= 2;
+        if(ra->window < RA_MIN_WINDOW) ra->window = 0;
+        ra->issued = end;   // whatever was prefetched belongs to the old position
+    }
+    ra->next = end;
+
+    // a seek only shrinks the window; prefetch resumes once reads are sequential
+    if(!sequential || ra->window == 0) return 0;
+    if(ra->issued < end) ra->issued = end;
+    if(ra->issued - end >= ra->window / 2) return 0;
+
+    // running low: issue the next window, larger if the last one was all hits
+    if(ra->misses == 0 && ra->hits > 1)
+    {
+        uint32_t max = max_window(cluster_size);
+        ra->window = ra->window * 2 > max ? max : ra->window * 2;
+    }
+    ra->hits = 0;
+    ra->misses = 0;
+
+    *from = ra->issued;
+    size_t n = (size_t)(end + ra->window - ra->issued);
+    ra->issued = end + ra->window;
+    return n;
+}
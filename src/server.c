@@ -0,0 +1,566 @@
+//Unix-socket server: an epoll loop for the sockets and a worker pool for requests
+
+#define _GNU_SOURCE
+
+#include "server.h"
+#include "dir.h"
+#include "file.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+#define READ_CHUNK 65536        // bytes read from a client per readiness event
+#define MAX_PATH 256
+
+typedef struct Conn
+{
+    int fd;
+    DirSession session;         // this client's working directory
+    uint8_t *in;                // received bytes not handled yet
+    size_t in_len, in_cap;
+    uint8_t *out;               // responses not sent yet
+    size_t out_len, out_cap, out_sent;
+    bool busy;                  // with the workers; not in the epoll set meanwhile
+    bool hangup;                // no more requests will come
+    bool failed;                // a response could not be built; drop the client
+    struct Conn *next;          // work or done queue
+    struct Conn *prev_conn;     // every connection, for server_close
+    struct Conn *next_conn;
+} Conn;
+
+struct Server
+{
+    fat32_volume *vol;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd;                // eventfd: workers have finished connections
+    int stop_fd;                // eventfd: server_stop was called
+    Conn *conns;                // owned by the loop thread
+
+    pthread_t *threads;
+    unsigned workers;
+    pthread_mutex_t lock;       // guards the queues and `stopping`
+    pthread_cond_t work_cond;
+    Conn *work_head, *work_tail;
+    Conn *done;
+    bool stopping;
+};
+
+static uint16_t get_u16(const uint8_t *p) { return (uint16_t)(p[0] | p[1] << 8); }
+static uint32_t get_u32(const uint8_t *p) { return (uint32_t)get_u16(p) | (uint32_t)get_u16(p + 2) << 16; }
+static uint64_t get_u64(const uint8_t *p) { return (uint64_t)get_u32(p) | (uint64_t)get_u32(p + 4) << 32; }
+
+static void put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+    put_u16(p, (uint16_t)v);
+    put_u16(p + 2, (uint16_t)(v >> 16));
+}
+
+//Make room for `n` more bytes in a growing buffer
+static bool reserve(uint8_t **buf, size_t *cap, size_t len, size_t n)
+{
+    if(*cap - len >= n) return true;
+    size_t want = *cap ? *cap : 4096;
+    while(want - len < n) want *= 2;
+    uint8_t *grown = realloc(*buf, want);
+    if(!grown) return false;
+    *buf = grown;
+    *cap = want;
+    return true;
+}
+
+//Append `n` bytes to the output and return where they go, or NULL
+static uint8_t *out_append(Conn *c, size_t n)
+{
+    if(!reserve(&c->out, &c->out_cap, c->out_len, n))
+    {
+        c->failed = true;
+        return NULL;
+    }
+    uint8_t *p = c->out + c->out_len;
+    c->out_len += n;
+    return p;
+}
+
+//Copy a path out of a payload; it must fit and hold no NUL
+static bool get_path(const uint8_t *p, size_t len, char out[MAX_PATH])
+{
+    if(len >= MAX_PATH || memchr(p, '\0', len)) return false;
+    memcpy(out, p, len);
+    out[len] = '\0';
+    return true;
+}
+
+//First cluster of the directory at `path`, or an error status
+static int resolve_dir(Server *srv, Conn *c, const char *path, uint32_t *cluster)
+{
+    if(*path == '\0')
+    {
+        *cluster = c->session.cwd_cluster;
+        return SRV_OK;
+    }
+    DirEntry e;
+    if(!dir_resolve(srv->vol, c->session.cwd_cluster, path, &e, NULL)) return -FILE_ERR_NOT_FOUND;
+    if(!(e.DIR_Attr & 0x10)) return SRV_ERR_NOT_DIR;
+    *cluster = first_cluster_from_entry(&e);
+    if(*cluster < 2) *cluster = srv->vol->bpb.root_cluster;    // ".." up to the root
+    return SRV_OK;
+}
+
+static int op_ls(Server *srv, Conn *c, const char *path)
+{
+    uint32_t cluster;
+    int status = resolve_dir(srv, c, path, &cluster);
+    if(status != SRV_OK) return status;
+
+    DirIter it;
+    bool ok = dir_iter_open(srv->vol, &it, cluster);
+    while(ok && dir_iter_next(&it))
+    {
+        if(it.entry.DIR_Attr & 0x08) continue;     // volume label
+
+        char name[1024];
+        if(it.long_len > 0) format_long_name(it.long_name, it.long_len, name, sizeof name);
+        else format_short_name(it.entry.DIR_Name, name, sizeof name);
+
+        size_t len = strlen(name);
+        uint8_t *p = out_append(c, 8 + len);
+        if(!p) break;
+        put_u32(p, it.entry.DIR_FileSize);
+        p[4] = it.entry.DIR_Attr;
+        p[5] = 0;
+        put_u16(p + 6, (uint16_t)len);
+        memcpy(p + 8, name, len);
+    }
+    dir_iter_close(&it);
+    return ok ? SRV_OK : -FILE_ERR_IO;
+}
+
+static int op_cd(Server *srv, Conn *c, const char *path)
+{
+    if(*path == '\0') path = "/";     // like the shell's bare cd
+    uint32_t cluster;
+    int status = resolve_dir(srv, c, path, &cluster);
+    if(status != SRV_OK) return status;
+    if(!dir_session_cd(srv->vol, &c->session, path)) return -FILE_ERR_NOT_FOUND;
+
+    size_t len = strlen(c->session.cwd_path);
+    uint8_t *p = out_append(c, len);
+    if(p) memcpy(p, c->session.cwd_path, len);
+    return SRV_OK;
+}
+
+static int op_stat(Server *srv, Conn *c, const char *path)
+{
+    DirEntry e;
+    if(!dir_resolve(srv->vol, c->session.cwd_cluster, path, &e, NULL)) return -FILE_ERR_NOT_FOUND;
+
+    uint8_t *p = out_append(c, 16);
+    if(!p) return SRV_OK;
+    memset(p, 0, 16);
+    put_u32(p, e.DIR_FileSize);
+    put_u32(p + 4, first_cluster_from_entry(&e));
+    p[8] = e.DIR_Attr;
+    put_u16(p + 10, e.DIR_WrtDate);
+    put_u16(p + 12, e.DIR_WrtTime);
+    return SRV_OK;
+}
+
+/* Reads go straight to the cluster chain instead of through the open-file
+ * table, so any number of clients can read the same file at once. */
+static int op_read(Server *srv, Conn *c, uint64_t offset, uint32_t length, const char *path)
+{
+    fat32_volume *vol = srv->vol;
+    DirEntry e;
+    if(!dir_resolve(vol, c->session.cwd_cluster, path, &e, NULL)) return -FILE_ERR_NOT_FOUND;
+    if(e.DIR_Attr & 0x10) return -FILE_ERR_IS_DIR;
+    if(offset >= e.DIR_FileSize || length == 0) return SRV_OK;
+
+    uint64_t left = e.DIR_FileSize - offset;
+    size_t len = left < length ? (size_t)left : length;
+    uint32_t start = first_cluster_from_entry(&e);
+    FatChain chain = {0};
+    if(start == 0 || !fat_get_chain_extents(vol, start, &chain)) return -FILE_ERR_IO;
+
+    int status = -FILE_ERR_IO;
+    if(offset + len <= (uint64_t)chain.cluster_count * vol->cluster_size)
+    {
+        uint8_t *p = out_append(c, len);
+        if(!p) status = SRV_OK;     // the connection is dropped anyway
+        else if(fat_chain_read(vol, &chain, offset, len, p)) status = SRV_OK;
+    }
+    fat_chain_free(&chain);
+    return status;
+}
+
+static int op_write(Server *srv, Conn *c, uint64_t offset, const char *path, const uint8_t *data, size_t len)
+{
+    int fd = file_open_at(srv->vol, &c->session, path, FILE_MODE_WRITE);
+    if(fd < 0) return -fd;
+
+    int err = file_lseek(fd, offset);
+    long n = err < 0 ? err : file_write(fd, data, len);
+    file_close(fd);
+    if(n < 0) return (int)-n;
+
+    uint8_t *p = out_append(c, 4);
+    if(p) put_u32(p, (uint32_t)n);
+    return SRV_OK;
+}
+
+//Run one request and append its response
+static void handle(Server *srv, Conn *c, uint16_t op, uint32_t tag, const uint8_t *p, uint32_t len)
+{
+    size_t at = c->out_len;
+    uint8_t *h = out_append(c, SRV_HEADER_SIZE);
+    if(!h) return;
+
+    char path[MAX_PATH];
+    int status = SRV_ERR_BAD_REQUEST;
+    switch(op)
+    {
+        case SRV_OP_LS:
+        case SRV_OP_CD:
+        case SRV_OP_STAT:
+            if(!get_path(p, len, path)) break;
+            if(op == SRV_OP_LS) status = op_ls(srv, c, path);
+            else if(op == SRV_OP_CD) status = op_cd(srv, c, path);
+            else status = op_stat(srv, c, path);
+            break;
+        case SRV_OP_READ:
+            if(len < 12 || get_u32(p + 8) > SRV_MAX_PAYLOAD || !get_path(p + 12, len - 12, path)) break;
+            status = op_read(srv, c, get_u64(p), get_u32(p + 8), path);
+            break;
+        case SRV_OP_WRITE:
+        {
+            if(len < 12) break;
+            uint32_t path_len = get_u32(p + 8);
+            if(path_len > len - 12 || !get_path(p + 12, path_len, path)) break;
+            status = op_write(srv, c, get_u64(p), path, p + 12 + path_len, len - 12 - path_len);
+            break;
+        }
+    }
+    if(c->failed) return;
+
+    // the payload may have been reallocated; errors carry none
+    if(status != SRV_OK) c->out_len = at + SRV_HEADER_SIZE;
+    h = c->out + at;
+    put_u32(h, (uint32_t)(c->out_len - at - SRV_HEADER_SIZE));
+    put_u16(h + 4, op);
+    put_u16(h + 6, (uint16_t)status);
+    put_u32(h + 8, tag);
+}
+
+//Run every whole request buffered for `c`, in order
+static void handle_requests(Server *srv, Conn *c)
+{
+    size_t pos = 0;
+    while(!c->failed && c->in_len - pos >= SRV_HEADER_SIZE)
+    {
+        const uint8_t *h = c->in + pos;
+        uint32_t len = get_u32(h);
+        if(c->in_len - pos - SRV_HEADER_SIZE < len) break;
+        handle(srv, c, get_u16(h + 4), get_u32(h + 8), h + SRV_HEADER_SIZE, len);
+        pos += SRV_HEADER_SIZE + len;
+    }
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+}
+
+static void *worker_main(void *arg)
+{
+    Server *srv = arg;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&srv->lock);
+    while(1)
+    {
+        while(!srv->work_head && !srv->stopping) pthread_cond_wait(&srv->work_cond, &srv->lock);
+        if(srv->stopping) break;
+        Conn *c = srv->work_head;
+        srv->work_head = c->next;
+        if(!srv->work_head) srv->work_tail = NULL;
+        pthread_mutex_unlock(&srv->lock);
+
+        handle_requests(srv, c);
+
+        pthread_mutex_lock(&srv->lock);
+        c->next = srv->done;
+        srv->done = c;
+        pthread_mutex_unlock(&srv->lock);
+        if(write(srv->wake_fd, &one, sizeof one) < 0) { /* the counter is already nonzero */ }
+        pthread_mutex_lock(&srv->lock);
+    }
+    pthread_mutex_unlock(&srv->lock);
+    return NULL;
+}
+
+/* Everything below runs on the loop thread, apart from server_stop. */
+
+static bool watch(Server *srv, Conn *c, int ctl, uint32_t events)
+{
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    return epoll_ctl(srv->epoll_fd, ctl, c->fd, &ev) == 0;
+}
+
+static void close_conn(Server *srv, Conn *c)
+{
+    close(c->fd);   // also leaves the epoll set
+    if(c->prev_conn) c->prev_conn->next_conn = c->next_conn;
+    else srv->conns = c->next_conn;
+    if(c->next_conn) c->next_conn->prev_conn = c->prev_conn;
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+static void accept_clients(Server *srv)
+{
+    while(1)
+    {
+        int fd = accept4(srv->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) return;     // EAGAIN, or out of descriptors until a client leaves
+
+        Conn *c = calloc(1, sizeof *c);
+        if(!c)
+        {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        dir_session_init(srv->vol, &c->session);
+        c->next_conn = srv->conns;
+        if(srv->conns) srv->conns->prev_conn = c;
+        srv->conns = c;
+        if(!watch(srv, c, EPOLL_CTL_ADD, EPOLLIN)) close_conn(srv, c);
+    }
+}
+
+//True once a whole request is buffered; closes the client on a bad header
+static bool request_ready(const Conn *c, bool *bad)
+{
+    *bad = false;
+    if(c->in_len < SRV_HEADER_SIZE) return false;
+    uint32_t len = get_u32(c->in);
+    if(len > SRV_MAX_PAYLOAD)
+    {
+        *bad = true;
+        return false;
+    }
+    return c->in_len - SRV_HEADER_SIZE >= len;
+}
+
+//Hand `c` to the workers; it leaves the epoll set until they are done
+static void dispatch(Server *srv, Conn *c)
+{
+    epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    c->busy = true;
+    c->next = NULL;
+    pthread_mutex_lock(&srv->lock);
+    if(srv->work_tail) srv->work_tail->next = c;
+    else srv->work_head = c;
+    srv->work_tail = c;
+    pthread_cond_signal(&srv->work_cond);
+    pthread_mutex_unlock(&srv->lock);
+}
+
+//Send what we can; returns false if the client is gone
+static bool send_out(Conn *c)
+{
+    while(c->out_sent < c->out_len)
+    {
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if(n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        c->out_sent += (size_t)n;
+    }
+    c->out_len = c->out_sent = 0;
+    return true;
+}
+
+//Output is drained: close, or go back to reading requests
+static void resume(Server *srv, Conn *c)
+{
+    bool bad;
+    if(request_ready(c, &bad)) dispatch(srv, c);
+    else if(c->hangup || bad) close_conn(srv, c);
+}
+
+static void on_readable(Server *srv, Conn *c)
+{
+    if(!reserve(&c->in, &c->in_cap, c->in_len, READ_CHUNK))
+    {
+        close_conn(srv, c);
+        return;
+    }
+    ssize_t n = recv(c->fd, c->in + c->in_len, READ_CHUNK, 0);
+    if(n > 0) c->in_len += (size_t)n;
+    else if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) c->hangup = true;
+
+    bool bad;
+    if(request_ready(c, &bad)) dispatch(srv, c);
+    else if(c->hangup || bad) close_conn(srv, c);
+}
+
+static void on_writable(Server *srv, Conn *c)
+{
+    if(!send_out(c)) close_conn(srv, c);
+    else if(c->out_len > 0) return;     // still waiting for the client to read
+    else if(!watch(srv, c, EPOLL_CTL_MOD, EPOLLIN)) close_conn(srv, c);
+    else resume(srv, c);
+}
+
+//Take back the connections the workers have finished
+static void collect_done(Server *srv)
+{
+    uint64_t count;
+    if(read(srv->wake_fd, &count, sizeof count) < 0) { /* nothing was pending */ }
+
+    pthread_mutex_lock(&srv->lock);
+    Conn *c = srv->done;
+    srv->done = NULL;
+    pthread_mutex_unlock(&srv->lock);
+
+    while(c)
+    {
+        Conn *next = c->next;
+        c->busy = false;
+        if(c->failed || !send_out(c))
+            close_conn(srv, c);
+        else if(c->out_len > 0)
+        {
+            if(!watch(srv, c, EPOLL_CTL_ADD, EPOLLOUT)) close_conn(srv, c);   // client is slow to read
+        }
+        else if(c->hangup)
+            close_conn(srv, c);
+        else if(!watch(srv, c, EPOLL_CTL_ADD, EPOLLIN))
+            close_conn(srv, c);
+        c = next;
+    }
+}
+
+bool server_run(Server *srv)
+{
+    struct epoll_event ev[MAX_EVENTS];
+    while(1)
+    {
+        int n = epoll_wait(srv->epoll_fd, ev, MAX_EVENTS, -1);
+        if(n < 0)
+        {
+            if(errno == EINTR) continue;
+            return false;
+        }
+        for(int i = 0; i < n; i++)
+        {
+            void *p = ev[i].data.ptr;
+            if(p == &srv->stop_fd)
+            {
+                uint64_t count;
+                if(read(srv->stop_fd, &count, sizeof count) < 0) { /* raced with another reader */ }
+                return true;
+            }
+            else if(p == &srv->listen_fd) accept_clients(srv);
+            else if(p == &srv->wake_fd) collect_done(srv);
+            else if(((Conn *)p)->out_len > 0) on_writable(srv, p);  // errors show up in send
+            else on_readable(srv, p);   // data, or hangup/error which recv reports
+        }
+    }
+}
+
+void server_stop(Server *srv)
+{
+    uint64_t one = 1;
+    if(write(srv->stop_fd, &one, sizeof one) < 0) { /* already stopping */ }
+}
+
+static bool watch_fd(Server *srv, int *fd)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = fd };
+    return epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, *fd, &ev) == 0;
+}
+
+Server *server_open(fat32_volume *vol, const char *socket_path, unsigned workers)
+{
+    Server *srv = calloc(1, sizeof *srv);
+    if(!srv) return NULL;
+    srv->vol = vol;
+    srv->listen_fd = srv->epoll_fd = srv->wake_fd = srv->stop_fd = -1;
+    pthread_mutex_init(&srv->lock, NULL);
+    pthread_cond_init(&srv->work_cond, NULL);
+
+    if(workers == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? (unsigned)cpus : 1;
+    }
+    if(workers > MAX_NUM_FILES) workers = MAX_NUM_FILES;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    struct stat st;
+    bool ok = strlen(socket_path) < sizeof addr.sun_path;
+    if(ok)
+    {
+        strcpy(addr.sun_path, socket_path);
+        strcpy(srv->path, socket_path);
+        if(lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(socket_path);   // left by an earlier server
+        srv->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        ok = srv->listen_fd >= 0 && bind(srv->listen_fd, (struct sockaddr *)&addr, sizeof addr) == 0;
+        if(!ok) srv->path[0] = '\0';    // not ours to remove
+    }
+    ok = ok && listen(srv->listen_fd, SOMAXCONN) == 0;
+    ok = ok && (srv->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) >= 0;
+    ok = ok && (srv->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0;
+    ok = ok && (srv->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0;
+    ok = ok && watch_fd(srv, &srv->listen_fd) && watch_fd(srv, &srv->wake_fd) && watch_fd(srv, &srv->stop_fd);
+    ok = ok && (srv->threads = calloc(workers, sizeof(pthread_t))) != NULL;
+    for(; ok && srv->workers < workers; srv->workers++)
+    {
+        ok = pthread_create(&srv->threads[srv->workers], NULL, worker_main, srv) == 0;
+        if(!ok) break;
+    }
+
+    if(!ok)
+    {
+        server_close(srv);
+        return NULL;
+    }
+    return srv;
+}
+
+void server_close(Server *srv)
+{
+    if(!srv) return;
+
+    pthread_mutex_lock(&srv->lock);
+    srv->stopping = true;
+    pthread_cond_broadcast(&srv->work_cond);
+    pthread_mutex_unlock(&srv->lock);
+    for(unsigned i = 0; i < srv->workers; i++) pthread_join(srv->threads[i], NULL);
+
+    while(srv->conns) close_conn(srv, srv->conns);
+    if(srv->listen_fd >= 0) close(srv->listen_fd);
+    if(srv->epoll_fd >= 0) close(srv->epoll_fd);
+    if(srv->wake_fd >= 0) close(srv->wake_fd);
+    if(srv->stop_fd >= 0) close(srv->stop_fd);
+    if(srv->path[0]) unlink(srv->path);
+    pthread_mutex_destroy(&srv->lock);
+    pthread_cond_destroy(&srv->work_cond);
+    free(srv->threads);
+    free(srv);
+}
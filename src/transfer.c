@@ -0,0 +1,669 @@
+//Bulk import/export between a host tree and the image, as a threaded pipeline
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "transfer.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_DEPTH 64                // deeper trees are skipped (and image loops caught)
+#define MAX_FILE_BYTES 0xFFFFFFFFull
+#define FINISH_BATCH 512            // most entries created in one pass over a directory
+
+typedef struct Job
+{
+    char *path;                 // host path, for messages
+    int fd;                     // host file: source on import, destination on export
+    FatChain chain;             // its clusters in the image
+    uint64_t size;
+    uint32_t dir_cluster;       // import: image directory that gets the entry
+    char name[11];              // import: packed short name
+    bool failed;                // a chunk could not be copied; guarded by the pipeline lock
+    struct Job *next;           // finisher queue
+} Job;
+
+typedef struct
+{
+    Job *job;
+    uint64_t offset;
+    size_t len;
+    bool last;                  // the job's final chunk
+    bool ready;                 // filled, waiting for the writer
+    uint8_t *buf;
+    size_t cap;
+} Slot;
+
+typedef struct
+{
+    fat32_volume *vol;
+    bool import;
+    TransferStats *stats;       // guarded by `lock`
+
+    pthread_mutex_t lock;
+    pthread_cond_t space;       // walker: a slot came free
+    pthread_cond_t work;        // readers: a chunk was queued
+    pthread_cond_t filled;      // writer: a chunk is ready, or the walk ended
+    pthread_cond_t finish;      // finisher: a job is complete, or writing ended
+    Slot slots[TRANSFER_SLOTS]; // ring; chunk n lives in slot n % TRANSFER_SLOTS
+    uint64_t head;              // chunks queued by the walker
+    uint64_t next_read;         // chunks taken by readers
+    uint64_t tail;              // chunks written
+    bool walked;
+    bool written;
+    Job *finish_head, *finish_tail;
+} Pipeline;
+
+static void count(Pipeline *p, uint64_t *field, uint64_t n)
+{
+    pthread_mutex_lock(&p->lock);
+    *field += n;
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void skip(Pipeline *p, const char *path, const char *why)
+{
+    fprintf(stderr, "%s: %s: skipped, %s\n", p->import ? "import" : "export", path, why);
+    count(p, &p->stats->skipped, 1);
+}
+
+static void fail(Pipeline *p, const char *path, const char *why)
+{
+    fprintf(stderr, "%s: %s: %s\n", p->import ? "import" : "export", path, why);
+    count(p, &p->stats->errors, 1);
+}
+
+static void free_job(Job *job)
+{
+    if(job->fd >= 0) close(job->fd);
+    fat_chain_free(&job->chain);
+    free(job->path);
+    free(job);
+}
+
+//Walker: cut `job` into chunks and queue them, waiting for free slots
+static void queue_job(Pipeline *p, Job *job)
+{
+    uint64_t off = 0;
+    do
+    {
+        size_t len = job->size - off < TRANSFER_CHUNK ? (size_t)(job->size - off) : TRANSFER_CHUNK;
+        pthread_mutex_lock(&p->lock);
+        while(p->head - p->tail >= TRANSFER_SLOTS) pthread_cond_wait(&p->space, &p->lock);
+        Slot *s = &p->slots[p->head % TRANSFER_SLOTS];
+        s->job = job;
+        s->offset = off;
+        s->len = len;
+        s->last = off + len == job->size;
+        s->ready = false;
+        p->head++;
+        pthread_cond_signal(&p->work);
+        pthread_mutex_unlock(&p->lock);
+        off += len;
+    } while(off < job->size);
+}
+
+//Reader stage: source bytes of one chunk into its slot
+static bool fill(Pipeline *p, Slot *s)
+{
+    if(s->len == 0) return true;
+    if(s->cap < s->len)
+    {
+        uint8_t *grown = realloc(s->buf, s->len);
+        if(!grown) return false;
+        s->buf = grown;
+        s->cap = s->len;
+    }
+    if(!p->import) return fat_chain_read(p->vol, &s->job->chain, s->offset, s->len, s->buf);
+
+    for(size_t done = 0; done < s->len;)
+    {
+        ssize_t n = pread(s->job->fd, s->buf + done, s->len - done, (off_t)(s->offset + done));
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return false;    // error, or the file shrank
+        done += (size_t)n;
+    }
+    return true;
+}
+
+//Writer stage: one chunk to its destination
+static bool drain(Pipeline *p, Slot *s)
+{
+    if(s->len == 0) return true;
+    if(p->import) return fat_chain_write(p->vol, &s->job->chain, s->offset, s->len, s->buf);
+
+    for(size_t done = 0; done < s->len;)
+    {
+        ssize_t n = pwrite(s->job->fd, s->buf + done, s->len - done, (off_t)(s->offset + done));
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return false;
+        done += (size_t)n;
+    }
+    return true;
+}
+
+static void *reader_main(void *arg)
+{
+    Pipeline *p = arg;
+    pthread_mutex_lock(&p->lock);
+    while(1)
+    {
+        while(p->next_read == p->head && !p->walked) pthread_cond_wait(&p->work, &p->lock);
+        if(p->next_read == p->head) break;
+        Slot *s = &p->slots[p->next_read++ % TRANSFER_SLOTS];
+        bool skip_fill = s->job->failed;
+        pthread_mutex_unlock(&p->lock);
+
+        bool ok = skip_fill || fill(p, s);
+
+        pthread_mutex_lock(&p->lock);
+        if(!ok) s->job->failed = true;
+        s->ready = true;
+        pthread_cond_signal(&p->filled);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/* Chunks are written in the order they were queued, which for import is
+ * allocation order: the device sees one sweep over the new clusters. */
+static void *writer_main(void *arg)
+{
+    Pipeline *p = arg;
+    pthread_mutex_lock(&p->lock);
+    while(1)
+    {
+        while(!(p->tail < p->head && p->slots[p->tail % TRANSFER_SLOTS].ready) && !(p->walked && p->tail == p->head))
+            pthread_cond_wait(&p->filled, &p->lock);
+        if(p->tail == p->head) break;
+        Slot *s = &p->slots[p->tail % TRANSFER_SLOTS];
+        Job *job = s->job;
+        bool failed = job->failed;
+        pthread_mutex_unlock(&p->lock);
+
+        bool ok = failed || drain(p, s);
+        if(s->last)
+        {
+            // the host file is done with; closing here bounds the descriptors in flight
+            if(close(job->fd) != 0 && !p->import) ok = false;
+            job->fd = -1;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        if(!ok) job->failed = true;
+        if(s->last)
+        {
+            job->next = NULL;
+            if(p->finish_tail) p->finish_tail->next = job;
+            else p->finish_head = job;
+            p->finish_tail = job;
+            pthread_cond_signal(&p->finish);
+        }
+        p->tail++;
+        pthread_cond_signal(&p->space);
+    }
+    p->written = true;
+    pthread_cond_signal(&p->finish);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static DirEntry file_entry(const Job *job)
+{
+    uint32_t first = job->chain.run_count ? job->chain.runs[0].start : 0;
+    DirEntry e;
+    memset(&e, 0, sizeof e);
+    memcpy(e.DIR_Name, job->name, 11);
+    e.DIR_Attr = 0x20;
+    e.DIR_FstClusHigh = (uint16_t)(first >> 16);
+    e.DIR_FirstClusterLow = (uint16_t)(first & 0xFFFF);
+    e.DIR_FileSize = (uint32_t)job->size;
+    return e;
+}
+
+/* Finisher stage: the directory entries of imported files and the tally.
+ * Consecutive files of one directory get their entries in one pass over
+ * it, so the cost of finding free slots does not grow with every file. */
+static void complete(Pipeline *p, Job *jobs)
+{
+    while(jobs)
+    {
+        Job *run[FINISH_BATCH];
+        DirEntry entries[FINISH_BATCH];
+        size_t n = 0, wanted = 0;
+        uint32_t dir = jobs->dir_cluster;
+        for(; jobs && n < FINISH_BATCH && jobs->dir_cluster == dir; jobs = jobs->next)
+        {
+            run[n++] = jobs;
+            if(p->import && !jobs->failed) entries[wanted++] = file_entry(jobs);
+        }
+        // entries are created in order, so a short count fails the last ones
+        size_t created = wanted ? create_dir_entries(p->vol, dir, entries, wanted) : 0;
+
+        for(size_t i = 0; i < n; i++)
+        {
+            Job *job = run[i];
+            bool ok = !job->failed;
+            if(p->import && ok)
+            {
+                ok = created > 0;
+                if(ok) created--;
+            }
+            if(p->import && !ok && job->chain.run_count)
+                fat_free_chain(p->vol, job->chain.runs[0].start);   // give back what no entry will own
+
+            if(!ok)
+            {
+                fail(p, job->path, p->import ? "copy into the image failed" : "copy out of the image failed");
+            }
+            else
+            {
+                pthread_mutex_lock(&p->lock);
+                p->stats->files++;
+                p->stats->bytes += job->size;
+                pthread_mutex_unlock(&p->lock);
+            }
+            free_job(job);
+        }
+    }
+}
+
+static void *finisher_main(void *arg)
+{
+    Pipeline *p = arg;
+    pthread_mutex_lock(&p->lock);
+    while(1)
+    {
+        while(!p->finish_head && !p->written) pthread_cond_wait(&p->finish, &p->lock);
+        Job *jobs = p->finish_head;     // take everything that is complete
+        if(!jobs) break;
+        p->finish_head = p->finish_tail = NULL;
+        pthread_mutex_unlock(&p->lock);
+
+        complete(p, jobs);
+
+        pthread_mutex_lock(&p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+//Host `dir` + "/" + `name` into `out`; false if it does not fit
+static bool join_path(char *out, size_t out_size, const char *dir, const char *name)
+{
+    size_t len = strlen(dir);
+    bool slash = len > 0 && dir[len - 1] == '/';
+    return (size_t)snprintf(out, out_size, "%s%s%s", dir, slash ? "" : "/", name) < out_size;
+}
+
+/* Import */
+
+typedef struct
+{
+    char *name;
+    char key[11];
+    bool ok;                    // packs into a valid 8.3 name
+} HostName;
+
+//Only names that are already valid 8.3 names are imported
+static bool short_name_ok(const char *name, char key[11])
+{
+    const char *dot = strchr(name, '.');
+    if(dot && strchr(dot + 1, '.')) return false;
+    for(const char *c = name; *c; c++)
+    {
+        if((unsigned char)*c < 0x20 || strchr(" \"*+,/:;<=>?[\\]|", *c)) return false;
+    }
+    return format_name_83(name, key) && (unsigned char)key[0] != 0xE5;
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    return memcmp(((const HostName *)a)->key, ((const HostName *)b)->key, 11);
+}
+
+static void import_file(Pipeline *p, const char *path, uint32_t dir_cluster, const char key[11])
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0)
+    {
+        fail(p, path, strerror(errno));
+        if(fd >= 0) close(fd);
+        return;
+    }
+    if((uint64_t)st.st_size > MAX_FILE_BYTES)
+    {
+        close(fd);
+        skip(p, path, "too large for FAT32");
+        return;
+    }
+
+    Job *job = calloc(1, sizeof *job);
+    if(job) job->path = strdup(path);
+    if(!job || !job->path)
+    {
+        free(job);
+        close(fd);
+        fail(p, path, "out of memory");
+        return;
+    }
+    job->fd = fd;
+    job->size = (uint64_t)st.st_size;
+    job->dir_cluster = dir_cluster;
+    memcpy(job->name, key, 11);
+
+    // every cluster of the file in one allocation, as few extents as free space allows
+    size_t clusters = (size_t)((job->size + p->vol->cluster_size - 1) / p->vol->cluster_size);
+    if(clusters > 0)
+    {
+        size_t n;
+        FatExtent *ext = fat_extend_chain_extents(p->vol, 0, clusters, &n);
+        bool ok = ext && fat_chain_append(&job->chain, ext, n);
+        if(ext && !ok) fat_free_chain(p->vol, ext[0].start);
+        free(ext);
+        if(!ok)
+        {
+            fail(p, path, "no space left in the image");
+            free_job(job);
+            return;
+        }
+    }
+    queue_job(p, job);
+}
+
+static void import_dir(Pipeline *p, const char *host, uint32_t cluster, int depth)
+{
+    if(depth > MAX_DEPTH)
+    {
+        skip(p, host, "nested too deep");
+        return;
+    }
+    DIR *d = opendir(host);
+    if(!d)
+    {
+        fail(p, host, strerror(errno));
+        return;
+    }
+
+    // read the whole listing first, so same-named entries can be found
+    HostName *names = NULL;
+    size_t n = 0, cap = 0;
+    struct dirent *de;
+    while((de = readdir(d)) != NULL)
+    {
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if(n == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            HostName *grown = realloc(names, cap * sizeof *names);
+            if(!grown) break;
+            names = grown;
+        }
+        names[n].name = strdup(de->d_name);
+        if(!names[n].name) break;
+        names[n].ok = short_name_ok(de->d_name, names[n].key);
+        n++;
+    }
+    closedir(d);
+    qsort(names, n, sizeof *names, compare_keys);
+
+    char path[4096];
+    for(size_t i = 0; i < n; i++)
+    {
+        HostName *h = &names[i];
+        struct stat st;
+        if(!join_path(path, sizeof path, host, h->name))
+            skip(p, h->name, "path too long");
+        else if(lstat(path, &st) != 0)
+            fail(p, path, strerror(errno));
+        else if(!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+            skip(p, path, "not a regular file or directory");
+        else if(!h->ok)
+            skip(p, path, "name does not fit 8.3");
+        else if(i > 0 && names[i - 1].ok && memcmp(names[i - 1].key, h->key, 11) == 0)
+            skip(p, path, "same 8.3 name as another entry");
+        else
+        {
+            uint32_t sub;
+            uint8_t attr;
+            bool exists = find_dir_child(p->vol, cluster, h->name, &sub, &attr);
+            if(S_ISREG(st.st_mode) && exists)
+                skip(p, path, "already in the image");
+            else if(S_ISREG(st.st_mode))
+                import_file(p, path, cluster, h->key);
+            else if(exists && !(attr & 0x10))
+                skip(p, path, "a file of that name is in the image");
+            else if(exists)
+                import_dir(p, path, sub, depth + 1);     // merge
+            else if(!create_directory(p->vol, cluster, h->key, &sub))
+                fail(p, path, "can't create the directory in the image");
+            else
+            {
+                count(p, &p->stats->dirs, 1);
+                import_dir(p, path, sub, depth + 1);
+            }
+        }
+    }
+    for(size_t i = 0; i < n; i++) free(names[i].name);
+    free(names);
+}
+
+/* Export */
+
+typedef struct
+{
+    char name[256];
+    DirEntry entry;
+    bool has_nul;       // the stored name holds a NUL, cut off in `name`
+} ImageName;
+
+//Stored names hold a NUL only in a crafted or corrupt image
+static bool stored_name_has_nul(const DirIter *it)
+{
+    if(it->long_len > 0)
+    {
+        for(size_t i = 0; i < it->long_len; i++)
+            if(it->long_name[i] == 0) return true;
+        return false;
+    }
+    return memchr(it->entry.DIR_Name, '\0', 11) != NULL;
+}
+
+//A name from the image must stay one component inside the export directory
+static bool host_name_ok(const ImageName *n)
+{
+    return !n->has_nul && n->name[0] != '\0' && strcmp(n->name, ".") != 0 && strcmp(n->name, "..") != 0
+           && strchr(n->name, '/') == NULL;
+}
+
+static void export_file(Pipeline *p, const DirEntry *e, const char *path)
+{
+    Job *job = calloc(1, sizeof *job);
+    if(job) job->path = strdup(path);
+    if(!job || !job->path)
+    {
+        free(job);
+        fail(p, path, "out of memory");
+        return;
+    }
+    job->size = e->DIR_FileSize;
+    job->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(job->fd < 0)
+    {
+        fail(p, path, strerror(errno));
+        free_job(job);
+        return;
+    }
+
+    uint32_t first = first_cluster_from_entry(e);
+    if(job->size > 0)
+    {
+        const char *why = NULL;
+        if(first < 2 || !fat_get_chain_extents(p->vol, first, &job->chain))
+            why = "bad cluster chain in the image";
+        else if((uint64_t)job->chain.cluster_count * p->vol->cluster_size < job->size)
+            why = "cluster chain shorter than the file";
+        else if(posix_fallocate(job->fd, 0, (off_t)job->size) == ENOSPC)
+            why = "no space left on the host";     // other failures: no preallocation, still copied
+        if(why)
+        {
+            fail(p, path, why);
+            free_job(job);
+            return;
+        }
+    }
+    queue_job(p, job);
+}
+
+static void export_dir(Pipeline *p, uint32_t cluster, const char *host, int depth)
+{
+    if(depth > MAX_DEPTH)
+    {
+        skip(p, host, "nested too deep");
+        return;
+    }
+    if(mkdir(host, 0777) == 0)
+        count(p, &p->stats->dirs, 1);
+    else if(errno != EEXIST)
+    {
+        fail(p, host, strerror(errno));
+        return;
+    }
+
+    // collect the listing, so no directory lock is held while copying
+    ImageName *names = NULL;
+    size_t n = 0, cap = 0;
+    DirIter it;
+    if(dir_iter_open(p->vol, &it, cluster))
+    {
+        while(dir_iter_next(&it))
+        {
+            if(it.entry.DIR_Attr & 0x08) continue;     // volume label
+            if(it.entry.DIR_Name[0] == '.') continue;  // "." and ".."
+            if(n == cap)
+            {
+                cap = cap ? cap * 2 : 64;
+                ImageName *grown = realloc(names, cap * sizeof *names);
+                if(!grown) break;
+                names = grown;
+            }
+            if(it.long_len > 0) format_long_name(it.long_name, it.long_len, names[n].name, sizeof names[n].name);
+            else format_short_name(it.entry.DIR_Name, names[n].name, sizeof names[n].name);
+            names[n].entry = it.entry;
+            names[n].has_nul = stored_name_has_nul(&it);
+            n++;
+        }
+    }
+    dir_iter_close(&it);
+
+    char path[4096];
+    for(size_t i = 0; i < n; i++)
+    {
+        const DirEntry *e = &names[i].entry;
+        if(!host_name_ok(&names[i]))
+            skip(p, names[i].name, "name is not a safe host file name");
+        else if(!join_path(path, sizeof path, host, names[i].name))
+            skip(p, names[i].name, "path too long");
+        else if(!(e->DIR_Attr & 0x10))
+            export_file(p, e, path);
+        else if(first_cluster_from_entry(e) < 2)
+            fail(p, path, "bad directory entry");
+        else
+            export_dir(p, first_cluster_from_entry(e), path, depth + 1);
+    }
+    free(names);
+}
+
+/* Driver */
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+//Run the walk on this thread with the other stages around it
+static bool run_pipeline(fat32_volume *vol, bool import, const char *host, uint32_t cluster, TransferStats *stats)
+{
+    memset(stats, 0, sizeof *stats);
+    Pipeline *p = calloc(1, sizeof *p);
+    if(!p) return false;
+    p->vol = vol;
+    p->import = import;
+    p->stats = stats;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->space, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->filled, NULL);
+    pthread_cond_init(&p->finish, NULL);
+
+    double t0 = now();
+    pthread_t readers[TRANSFER_READERS], writer, finisher;
+    bool have_writer = pthread_create(&writer, NULL, writer_main, p) == 0;
+    bool have_finisher = have_writer && pthread_create(&finisher, NULL, finisher_main, p) == 0;
+    int started = 0;
+    while(have_finisher && started < TRANSFER_READERS && pthread_create(&readers[started], NULL, reader_main, p) == 0)
+        started++;
+    bool ok = started > 0;
+
+    if(ok)
+    {
+        if(import) import_dir(p, host, cluster, 0);
+        else export_dir(p, cluster, host, 0);
+    }
+
+    // each stage stops once everything before it has drained
+    pthread_mutex_lock(&p->lock);
+    p->walked = true;
+    pthread_cond_broadcast(&p->work);
+    pthread_cond_signal(&p->filled);
+    pthread_mutex_unlock(&p->lock);
+    for(int i = 0; i < started; i++) pthread_join(readers[i], NULL);
+    if(have_writer) pthread_join(writer, NULL);
+    if(have_finisher) pthread_join(finisher, NULL);
+    stats->seconds = now() - t0;
+
+    for(int i = 0; i < TRANSFER_SLOTS; i++) free(p->slots[i].buf);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->space);
+    pthread_cond_destroy(&p->work);
+    pthread_cond_destroy(&p->filled);
+    pthread_cond_destroy(&p->finish);
+    free(p);
+    return ok;
+}
+
+//First cluster of the image directory `path`, or 0
+static uint32_t image_dir(fat32_volume *vol, const DirSession *session, const char *path)
+{
+    DirEntry e;
+    if(!dir_resolve(vol, session->cwd_cluster, path, &e, NULL) || !(e.DIR_Attr & 0x10)) return 0;
+    uint32_t cluster = first_cluster_from_entry(&e);
+    return cluster < 2 ? vol->bpb.root_cluster : cluster;
+}
+
+bool transfer_import(fat32_volume *vol, const DirSession *session, const char *host_dir, const char *img_dir,
+                     TransferStats *stats)
+{
+    struct stat st;
+    uint32_t cluster = image_dir(vol, session, img_dir);
+    if(!cluster || stat(host_dir, &st) != 0 || !S_ISDIR(st.st_mode)) return false;
+    return run_pipeline(vol, true, host_dir, cluster, stats);
+}
+
+bool transfer_export(fat32_volume *vol, const DirSession *session, const char *img_dir, const char *host_dir,
+                     TransferStats *stats)
+{
+    uint32_t cluster = image_dir(vol, session, img_dir);
+    if(!cluster) return false;
+    return run_pipeline(vol, false, host_dir, cluster, stats);
+}